@@ -2715,7 +2715,8 @@ enum MBG_XFEATURE_BITS
   "Database",               \
   "GNSS Messages",          \
   "PTP Next Gen.",          \
-  "System Reference"        \
+  "System Reference",       \
+  "FCU API"                 \
 }
 
 
@@ -38,7 +38,21 @@
 #endif
 
 
-#if DEBUG_SEM
+#if !defined( USE_DEBUG_SEM )
+  // If static keys are used then semaphore operations on a device
+  // can be reported if enabled at runtime, see ::PCPS_DBG_SEM.
+  #define USE_DEBUG_SEM  ( DEBUG_SEM || _PCPS_USE_DBG_KEYS )
+#endif
+
+#if _PCPS_USE_DBG_KEYS
+  #define _pcps_ddev_dbg_sem( _pddev ) \
+    ( (_pddev) && _pcps_ddev_dbg( _pddev, PCPS_DBG_SEM ) )
+#else
+  #define _pcps_ddev_dbg_sem( _pddev )  DEBUG_SEM
+#endif
+
+
+#if USE_DEBUG_SEM
 
 static __mbg_inline
 void snprintf_pddev( char *s, size_t max_len, const PCPS_DDEV *pddev )
@@ -62,10 +76,12 @@ void _sema_init_pddev( struct semaphore *ps, int n, const char *sem_name,
 {
   char ws[40];
 
-  snprintf_pddev( ws, sizeof( ws ), pddev );
-
-  _mbgddmsg_3( DEBUG_SEM, MBG_LOG_INFO, "%s initializing %s%s",
-                fnc_name, sem_name, ws );
+  if ( _pcps_ddev_dbg_sem( pddev ) )
+  {
+    snprintf_pddev( ws, sizeof( ws ), pddev );
+    _mbg_kdd_msg_3( MBG_LOG_INFO, "%s initializing %s%s",
+                    fnc_name, sem_name, ws );
+  }
 
   sema_init( ps, n );
 
@@ -79,20 +95,26 @@ int _down_interruptible_pddev( struct semaphore *ps, const char *sem_name,
 {
   int retval;
   char ws[40];
+  bool dbg = _pcps_ddev_dbg_sem( pddev );
 
-  snprintf_pddev( ws, sizeof( ws ), pddev );
-
-  _mbgddmsg_3( DEBUG_SEM, MBG_LOG_INFO, "%s: going to get %s%s",
-                fnc_name, sem_name, ws );
+  if ( dbg )
+  {
+    snprintf_pddev( ws, sizeof( ws ), pddev );
+    _mbg_kdd_msg_3( MBG_LOG_INFO, "%s: going to get %s%s",
+                    fnc_name, sem_name, ws );
+  }
 
   retval = down_interruptible( ps );
 
-  if ( retval < 0 )
-    _mbgddmsg_3( DEBUG_SEM, MBG_LOG_INFO, "%s: interrupted waiting for %s%s",
-                  fnc_name, sem_name, ws );
-  else
-    _mbgddmsg_3( DEBUG_SEM, MBG_LOG_INFO, "%s: got %s%s",
-                  fnc_name, sem_name, ws );
+  if ( dbg )
+  {
+    if ( retval < 0 )
+      _mbg_kdd_msg_3( MBG_LOG_INFO, "%s: interrupted waiting for %s%s",
+                      fnc_name, sem_name, ws );
+    else
+      _mbg_kdd_msg_3( MBG_LOG_INFO, "%s: got %s%s",
+                      fnc_name, sem_name, ws );
+  }
 
   return retval;
 
@@ -106,10 +128,12 @@ void _up_pddev( struct semaphore *ps, const char *sem_name,
 {
   char ws[40];
 
-  snprintf_pddev( ws, sizeof( ws ), pddev );
-
-  _mbgddmsg_3( DEBUG_SEM, MBG_LOG_INFO, "%s: releasing %s%s",
-                fnc_name, sem_name, ws );
+  if ( _pcps_ddev_dbg_sem( pddev ) )
+  {
+    snprintf_pddev( ws, sizeof( ws ), pddev );
+    _mbg_kdd_msg_3( MBG_LOG_INFO, "%s: releasing %s%s",
+                    fnc_name, sem_name, ws );
+  }
 
   up( ps );
 
@@ -256,13 +256,19 @@
   #endif
 
 
-  #define _iob_to_pout( _piob, _pout, _size )                       \
-  do                                                                \
-  {                                                                 \
-    _debug_iob_ptr( _pout, _size, "outp" );                         \
-                                                                    \
-    if ( copy_to_user( (void *) (uintptr_t) _pout, _piob, _size ) ) \
-      rc = MBG_ERR_COPY_TO_USER;                                    \
+  // While an IOCTL batch is being executed the output buffer is
+  // a kernel buffer, which is only copied to user space after the
+  // device mutex has been released, see ::mbgdrvr_ioctl_batch.
+  #define _iob_to_pout( _piob, _pout, _size )                         \
+  do                                                                  \
+  {                                                                   \
+    _debug_iob_ptr( _pout, _size, "outp" );                           \
+                                                                      \
+    if ( _pcps_is_batch_owner( pddev ) )                              \
+      memcpy( (void *) (uintptr_t) _pout, _piob, _size );             \
+    else                                                              \
+      if ( copy_to_user( (void *) (uintptr_t) _pout, _piob, _size ) ) \
+        rc = MBG_ERR_COPY_TO_USER;                                    \
   } while (  0 )
 
 
@@ -355,6 +361,14 @@
   #define _frc_iob_from_pin  _iob_from_pin
 #endif
 
+// By default the buffers for the generic IOCTL calls are allocated
+// from the kernel heap for each call. The OS-specific driver code
+// may provide a different allocator, e.g. one based on a mempool.
+#if !defined( _ioctl_buf_alloc )
+  #define _ioctl_buf_alloc( _sz )      _pcps_kmalloc( _sz )
+  #define _ioctl_buf_free( _p, _sz )   _pcps_kfree( _p, _sz )
+#endif
+
 
 #define _iob_to_pout_var( _iob, _pout ) \
   _iob_to_pout( &(_iob), _pout, sizeof( _iob ) )
@@ -406,6 +420,27 @@
                                               \
   } while ( 0 )
 
+#elif USE_PCPS_PRIO_LANES
+
+  // Latency-class callers are counted while they are waiting for
+  // the device mutex, so a bulk transfer in progress can release
+  // the mutex between 2 blocks. See ::lane_sem_inc.
+  // ioctl_switch() passes the class of the IOCTL code, all other
+  // callers are bulk class.
+  #define _pcps_sem_inc_safe_lat( _pddev, _lat )  \
+  do                                              \
+  {                                               \
+    if ( _pcps_access_is_unsafe( _pddev ) )       \
+      goto err_busy_irq_unsafe;                   \
+                                                  \
+    if ( lane_sem_inc( _pddev, _lat ) < 0 )       \
+      return -ERESTARTSYS;                        \
+                                                  \
+  } while ( 0 )
+
+  #define _pcps_sem_inc_safe( _pddev ) \
+    _pcps_sem_inc_safe_lat( _pddev, 0 )
+
 #else
 
   // Other OSs don't use an IRP, so no IRP pointer
@@ -422,6 +457,13 @@
 
 #endif
 
+#if !defined( _pcps_sem_inc_safe_lat )
+  // The class of a command is only evaluated if USE_PCPS_PRIO_LANES
+  // is enabled, so the class parameter is ignored, and needn't exist.
+  #define _pcps_sem_inc_safe_lat( _pddev, _lat ) \
+    _pcps_sem_inc_safe( _pddev )
+#endif
+
 
 
 /**
@@ -438,6 +480,12 @@
  * between processes the code which copies the data from or to user space has to be
  * protected by the device semaphore in the same way as the actual device access.
  *
+ * If ::USE_IO_BUFFER_POOL is enabled then the read functions use a private
+ * DMA-capable buffer from a per-device pool instead, so the data can be copied
+ * up to user space after the device semaphore has been released. This avoids
+ * that a process which has to wait for a page fault when writing to user space
+ * blocks other processes accessing the same device.
+ *
  * @{ */
 
 /**
@@ -455,26 +503,128 @@ do                             \
 
 
 
+#if USE_IO_BUFFER_POOL
+
+/**
+ * @brief Get a private I/O buffer for a read operation.
+ *
+ * Must be called after the device semaphore has been acquired,
+ * so the buffer can't be leaked if acquiring the semaphore fails.
+ * Sets up @a p_dev_iob to point to the buffer.
+ *
+ * If no buffer is available, release the semaphore and goto an error label.
+ */
+#define _io_get_iob( _pddev )                   \
+do                                              \
+{                                               \
+  p_dev_iob = iob_pool_get( _pddev );           \
+                                                \
+  if ( p_dev_iob == NULL )                      \
+  {                                             \
+    _pcps_sem_dec( _pddev );                    \
+    goto err_no_mem;                            \
+  }                                             \
+                                                \
+} while ( 0 )
+
+
+/**
+ * @brief Release the device semaphore, then copy the data to user space.
+ *
+ * The data is only copied if @a rc indicates success.
+ * Eventually the private I/O buffer is returned to the pool.
+ */
+#define _io_sem_dec_iob_to_pout( _pddev, _piob, _pout, _size )  \
+do                                                              \
+{                                                               \
+  _pcps_sem_dec( _pddev );                                      \
+                                                                \
+  if ( mbg_rc_is_success( rc ) )                                \
+    _iob_to_pout( _piob, _pout, _size );                        \
+                                                                \
+  iob_pool_put( _pddev, p_dev_iob );                            \
+                                                                \
+} while ( 0 )
+
+#else
+
+// The shared I/O buffer is used, which has already been set up.
+#define _io_get_iob( _pddev )  _nop_macro_fnc()
+
+// The shared I/O buffer has to be copied to user space
+// before the device semaphore is released.
+#define _io_sem_dec_iob_to_pout( _pddev, _piob, _pout, _size )  \
+do                                                              \
+{                                                               \
+  if ( mbg_rc_is_success( rc ) )                                \
+    _iob_to_pout( _piob, _pout, _size );                        \
+                                                                \
+  _pcps_sem_dec( _pddev );                                      \
+                                                                \
+} while ( 0 )
+
+#endif
+
+#define _io_sem_dec_iob_to_pout_var( _pddev, _iob, _pout ) \
+  _io_sem_dec_iob_to_pout( _pddev, &(_iob), _pout, sizeof( _iob ) )
+
+
+
+/**
+ * @brief Indicate that the event log read position of a device is changed.
+ *
+ * Used with the IOCTL calls which read the first or next event log entry,
+ * or clear the event log. Must be used with the device mutex held, after
+ * the device has been accessed, so the driver's event log mirror, which
+ * checks the generation with the device mutex held, either sees the
+ * new generation, or has read its entry before the position was changed.
+ */
+#if USE_PCPS_EVT_LOG_MIRROR
+  #define _io_evt_log_cursor_moved( _pddev )  atomic_inc( &(_pddev)->evt_log_cursor_gen )
+#else
+  #define _io_evt_log_cursor_moved( _pddev )  _nop_macro_fnc()
+#endif
+
+/**
+ * @brief Check if a generic IOCTL call changes the event log read position of a device.
+ *
+ * Used by the macros reading or writing standard data structures,
+ * and by the generic IOCTL calls, which can send any command to a device,
+ * including the commands which read the first or next event log entry,
+ * or clear the event log. Must be used with the device mutex held, after
+ * the device has been accessed, see _io_evt_log_cursor_moved().
+ */
+#define _io_evt_log_chk_cmd( _pddev, _cmd )       \
+do                                                \
+{                                                 \
+  if ( ( (_cmd) == PCPS_FIRST_EVT_LOG_ENTRY ) ||  \
+       ( (_cmd) == PCPS_NEXT_EVT_LOG_ENTRY ) ||   \
+       ( (_cmd) == PCPS_CLR_EVT_LOG ) )           \
+    _io_evt_log_cursor_moved( _pddev );           \
+                                                  \
+} while ( 0 )
+
+
+
 /**
  * @brief Read a standard data structure from a device.
  *
  * If access fails goto an error label.
  */
-#define _io_read_var( _pddev, _cmd, _fld, _pout )        \
-do                                                       \
-{                                                        \
-  _pcps_sem_inc_safe( _pddev );                          \
-                                                         \
-  rc = _pcps_read_var( _pddev, _cmd, p_dev_iob->_fld );  \
-                                                         \
-  if ( mbg_rc_is_success( rc ) )                         \
-    _iob_to_pout_var( p_dev_iob->_fld, _pout );          \
-                                                         \
-  _pcps_sem_dec( _pddev );                               \
-                                                         \
-  if ( mbg_rc_is_error( rc ) )                           \
-    goto err_dev_access;                                 \
-                                                         \
+#define _io_read_var( _pddev, _cmd, _fld, _pout )                 \
+do                                                                \
+{                                                                 \
+  _pcps_sem_inc_safe_lat( _pddev, lat_class );                    \
+  _io_get_iob( _pddev );                                          \
+                                                                  \
+  rc = _pcps_read_var( _pddev, _cmd, p_dev_iob->_fld );           \
+  _io_evt_log_chk_cmd( _pddev, _cmd );                            \
+                                                                  \
+  _io_sem_dec_iob_to_pout_var( _pddev, p_dev_iob->_fld, _pout );  \
+                                                                  \
+  if ( mbg_rc_is_error( rc ) )                                    \
+    goto err_dev_access;                                          \
+                                                                  \
 } while ( 0 )
 
 
@@ -487,7 +637,7 @@ do                                                       \
 #define _io_write_var( _pddev, _cmd, _fld, _pin )         \
 do                                                        \
 {                                                         \
-  _pcps_sem_inc_safe( _pddev );                           \
+  _pcps_sem_inc_safe_lat( _pddev, lat_class );            \
   _iob_from_pin_var( p_dev_iob->_fld, _pin );             \
   rc = _pcps_write_var( _pddev, _cmd, p_dev_iob->_fld );  \
   _pcps_sem_dec( _pddev );                                \
@@ -506,16 +656,17 @@ do                                                        \
  *
  * We don't have a buffer here that needs to be protected.
  */
-#define _io_write_cmd( _pddev, _cmd )     \
-do                                        \
-{                                         \
-  _pcps_sem_inc_safe( _pddev );           \
-  rc = _pcps_write_byte( _pddev, _cmd );  \
-  _pcps_sem_dec( _pddev );                \
-                                          \
-  if ( mbg_rc_is_error( rc ) )            \
-    goto err_dev_access;                  \
-                                          \
+#define _io_write_cmd( _pddev, _cmd )          \
+do                                             \
+{                                              \
+  _pcps_sem_inc_safe_lat( _pddev, lat_class ); \
+  rc = _pcps_write_byte( _pddev, _cmd );       \
+  _io_evt_log_chk_cmd( _pddev, _cmd );         \
+  _pcps_sem_dec( _pddev );                     \
+                                               \
+  if ( mbg_rc_is_error( rc ) )                 \
+    goto err_dev_access;                       \
+                                               \
 } while ( 0 )
 
 
@@ -532,14 +683,12 @@ do                                                                            \
 {                                                                             \
   _io_chk_cond( _pcps_ddev_has_gps_data( _pddev ) );                          \
                                                                               \
-  _pcps_sem_inc_safe( _pddev );                                               \
+  _pcps_sem_inc_safe_lat( _pddev, lat_class );                                \
+  _io_get_iob( _pddev );                                                      \
                                                                               \
   rc = pcps_read_gps( _pddev, _cmd, (uchar FAR *) &p_dev_iob->_fld, _size );  \
                                                                               \
-  if ( mbg_rc_is_success( rc ) )                                              \
-    _iob_to_pout( &p_dev_iob->_fld, _pout, _size );                           \
-                                                                              \
-  _pcps_sem_dec( _pddev );                                                    \
+  _io_sem_dec_iob_to_pout( _pddev, &p_dev_iob->_fld, _pout, _size );          \
                                                                               \
   if ( mbg_rc_is_error( rc ) )                                                \
     goto err_dev_access;                                                      \
@@ -555,23 +704,21 @@ do                                                                            \
  *
  * If access fails goto an error label.
  */
-#define _io_read_gps_var( _pddev, _cmd, _fld, _pout )        \
-do                                                           \
-{                                                            \
-  _io_chk_cond( _pcps_ddev_has_gps_data( _pddev ) );         \
-                                                             \
-  _pcps_sem_inc_safe( _pddev );                              \
-                                                             \
-  rc = _pcps_read_gps_var( _pddev, _cmd, p_dev_iob->_fld );  \
-                                                             \
-  if ( mbg_rc_is_success( rc ) )                             \
-    _iob_to_pout_var( p_dev_iob->_fld, _pout );              \
-                                                             \
-  _pcps_sem_dec( _pddev );                                   \
-                                                             \
-  if ( mbg_rc_is_error( rc ) )                               \
-    goto err_dev_access;                                     \
-                                                             \
+#define _io_read_gps_var( _pddev, _cmd, _fld, _pout )             \
+do                                                                \
+{                                                                 \
+  _io_chk_cond( _pcps_ddev_has_gps_data( _pddev ) );              \
+                                                                  \
+  _pcps_sem_inc_safe_lat( _pddev, lat_class );                    \
+  _io_get_iob( _pddev );                                          \
+                                                                  \
+  rc = _pcps_read_gps_var( _pddev, _cmd, p_dev_iob->_fld );       \
+                                                                  \
+  _io_sem_dec_iob_to_pout_var( _pddev, p_dev_iob->_fld, _pout );  \
+                                                                  \
+  if ( mbg_rc_is_error( rc ) )                                    \
+    goto err_dev_access;                                          \
+                                                                  \
 } while ( 0 )
 
 
@@ -588,7 +735,7 @@ do                                                            \
 {                                                             \
   _io_chk_cond( _pcps_ddev_has_gps_data( _pddev ) );          \
                                                               \
-  _pcps_sem_inc_safe( _pddev );                               \
+  _pcps_sem_inc_safe_lat( _pddev, lat_class );                \
   _iob_from_pin_var( p_dev_iob->_fld, _pin );                 \
   rc = _pcps_write_gps_var( _pddev, _cmd, p_dev_iob->_fld );  \
   _pcps_sem_dec( _pddev );                                    \
@@ -679,6 +826,32 @@ do                                      \
                                         \
 } while ( 0 )
 
+
+/**
+ * @brief Report a device capability that has been evaluated at probe time.
+ *
+ * @see ::MBG_DEV_CAP_BITS
+ */
+#define _report_dev_cap( _pddev, _n, _pout ) \
+  _report_cond( _mbg_dev_cap_is_set( &(_pddev)->dev_caps, _n ), _pout )
+
+
+/**
+ * @brief Try to serve a status structure from the device's status snapshot.
+ *
+ * Evaluates to true if the data has been copied to user space
+ * from the current snapshot, so the device doesn't need to be accessed.
+ * Otherwise the caller should fall back to reading from the device.
+ */
+#if _PCPS_USE_STATUS_SNAPSHOT
+  #define _io_read_snapshot( _pddev, _item, _pout, _size )  \
+    mbg_rc_is_success( read_status_snapshot( _pddev, _item, (void *) (uintptr_t) (_pout), _size ) )
+#else
+  #define _io_read_snapshot( _pddev, _item, _pout, _size )  false
+#endif
+
+
+
 /** @} defgroup group_ioctl_ext_macros */
 
 
@@ -867,6 +1040,497 @@ void do_get_fast_hr_timestamp_cycles_safe( PCPS_DDEV *pddev, PCPS_TIME_STAMP_CYC
 
 
 
+#if _PCPS_USE_STATUS_SNAPSHOT
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+void *status_snapshot_item( const PCPS_DDEV *pddev, PCPS_STATUS_SNAPSHOT *p, int item, size_t *p_size );
+#endif
+
+/**
+ * @brief Determine address and size of an item in a status snapshot buffer
+ *
+ * @param[in]   pddev   Pointer to the device structure
+ * @param[in]   p       The snapshot buffer
+ * @param[in]   item    One of the ::MBG_STATUS_SNAPSHOT_ITEMS
+ * @param[out]  p_size  Size of the item, depending on the device for variable size items
+ *
+ * @return The address of the item in the buffer, or NULL if item is unknown
+ */
+static __mbg_inline
+void *status_snapshot_item( const PCPS_DDEV *pddev, PCPS_STATUS_SNAPSHOT *p, int item, size_t *p_size )
+{
+  switch ( item )
+  {
+    case MBG_SNAPSHOT_BVAR_STAT:
+      *p_size = sizeof( p->bvar_stat );
+      return &p->bvar_stat;
+
+    case MBG_SNAPSHOT_PTP_STATE:
+      *p_size = sizeof( p->ptp_state );
+      return &p->ptp_state;
+
+    case MBG_SNAPSHOT_IRIG_CTRL_BITS:
+      *p_size = sizeof( p->irig_ctrl_bits );
+      return &p->irig_ctrl_bits;
+
+    case MBG_SNAPSHOT_ALL_XMR_STATUS:
+      *p_size = pddev->snapshot_n_xmr * sizeof( p->all_xmulti_ref_status_idx[0] );
+      return p->all_xmulti_ref_status_idx;
+
+    case MBG_SNAPSHOT_ALL_GNSS_SAT_INFO:
+      *p_size = pddev->snapshot_n_gnss * sizeof( p->all_gnss_sat_info_idx[0] );
+      return p->all_gnss_sat_info_idx;
+
+  }  // switch
+
+  *p_size = 0;
+  return NULL;
+
+}  // status_snapshot_item
+
+
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+int status_snapshot_item_from_gps_cmd( uint32_t gps_cmd );
+#endif
+
+/**
+ * @brief Map a GPS command code to a status snapshot item
+ *
+ * @param[in]  gps_cmd  One of the @ref PC_GPS_CMD_CODES
+ *
+ * @return One of the ::MBG_STATUS_SNAPSHOT_ITEMS, or -1 if there is no associated item
+ */
+static __mbg_inline
+int status_snapshot_item_from_gps_cmd( uint32_t gps_cmd )
+{
+  switch ( gps_cmd )
+  {
+    case PC_GPS_BVAR_STAT:          return MBG_SNAPSHOT_BVAR_STAT;
+    case PC_GPS_PTP_STATE:          return MBG_SNAPSHOT_PTP_STATE;
+    case PC_GPS_ALL_XMR_STATUS:     return MBG_SNAPSHOT_ALL_XMR_STATUS;
+    case PC_GPS_ALL_GNSS_SAT_INFO:  return MBG_SNAPSHOT_ALL_GNSS_SAT_INFO;
+  }
+
+  return -1;
+
+}  // status_snapshot_item_from_gps_cmd
+
+
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+int read_status_snapshot( PCPS_DDEV *pddev, int item, void *pout, size_t size );
+#endif
+
+/**
+ * @brief Copy an item from the current status snapshot to user space
+ *
+ * The item is only copied if the snapshotter is running for the device,
+ * the item is valid in the current snapshot, the snapshot is not outdated,
+ * and the requested size matches the size of the item exactly.
+ * In any other case the caller should read the data from the device instead.
+ *
+ * @param[in]   pddev  Pointer to the device structure
+ * @param[in]   item   One of the ::MBG_STATUS_SNAPSHOT_ITEMS
+ * @param[out]  pout   The user space output buffer
+ * @param[in]   size   Size of the output buffer
+ *
+ * @return ::MBG_SUCCESS if the data has been copied, ::MBG_ERR_NOT_READY if the data
+ *         is not available from the snapshot, or ::MBG_ERR_COPY_TO_USER
+ */
+static __mbg_inline
+int read_status_snapshot( PCPS_DDEV *pddev, int item, void *pout, size_t size )
+{
+  PCPS_STATUS_SNAPSHOT *p;
+  void *p_item;
+  size_t item_size;
+  int rc = MBG_ERR_NOT_READY;
+
+  if ( pddev->snapshot == NULL || item < 0 )
+    return rc;
+
+  if ( _mbg_mutex_acquire( &pddev->snapshot_mutex ) < 0 )
+    return rc;
+
+  p = &pddev->snapshot[pddev->snapshot_idx];
+
+  // If the worker has stalled for some reason we don't want
+  // to return outdated data.
+  if ( ( p->valid_items & ( 1UL << item ) ) &&
+       time_before_eq( jiffies, p->jiffies_updated + 2 * pddev->snapshot_intv + HZ ) )
+  {
+    p_item = status_snapshot_item( pddev, p, item, &item_size );
+
+    if ( p_item && ( item_size == size ) )
+    {
+      rc = MBG_SUCCESS;
+      _iob_to_pout( p_item, pout, size );
+    }
+  }
+
+  _mbg_mutex_release( &pddev->snapshot_mutex );
+
+  if ( mbg_rc_is_success( rc ) )
+    _pcps_stats_inc( pddev, snapshot_hits );
+  else
+    _pcps_stats_inc( pddev, snapshot_misses );
+
+  return rc;
+
+}  // read_status_snapshot
+
+#endif  // _PCPS_USE_STATUS_SNAPSHOT
+
+
+
+#if _PCPS_USE_UCAP_RING
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+unsigned int ucap_ring_pop( PCPS_DDEV *pddev, PCPS_HR_TIME *p, unsigned int n );
+#endif
+
+/**
+ * @brief Remove capture events from the user capture ring buffer
+ *
+ * The ring buffer may be shared with user space, so the indexes are
+ * accessed without locking, and only the local mask is used to
+ * address the entries. Callers inside the driver have to hold
+ * pddev->ucap_ring_mutex to serialize among each other.
+ *
+ * @param[in]   pddev  Pointer to the device structure
+ * @param[out]  p      Buffer for the events
+ * @param[in]   n      Max. number of events to be returned
+ *
+ * @return The number of events returned
+ */
+static __mbg_inline
+unsigned int ucap_ring_pop( PCPS_DDEV *pddev, PCPS_HR_TIME *p, unsigned int n )
+{
+  MBG_UCAP_RING_HDR *p_hdr = pddev->ucap_ring;
+  uint32_t head = READ_ONCE( p_hdr->head );
+  uint32_t tail = READ_ONCE( p_hdr->tail );
+  uint32_t avail = head - tail;
+  unsigned int i;
+
+  // Make sure the entries are read after head.
+  smp_rmb();
+
+  if ( avail > pddev->ucap_ring_mask + 1 )  // tail is messed up
+    avail = 0;
+
+  if ( n > avail )
+    n = avail;
+
+  for ( i = 0; i < n; i++ )
+    p[i] = pddev->ucap_ring_entries[( tail + i ) & pddev->ucap_ring_mask];
+
+  // Make sure the entries have been read before they can be overwritten.
+  smp_mb();
+  WRITE_ONCE( p_hdr->tail, tail + n );
+
+  return n;
+
+}  // ucap_ring_pop
+
+
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+void ucap_ring_get_entries( PCPS_DDEV *pddev, PCPS_UCAP_ENTRIES *p );
+#endif
+
+/**
+ * @brief Get the number of capture events in the user capture ring buffer
+ *
+ * While the drainer is running the on-board FIFO is usually empty, so
+ * this is returned instead of the ::PCPS_UCAP_ENTRIES read from the device.
+ *
+ * @param[in]   pddev  Pointer to the device structure
+ * @param[out]  p      Buffer for the number of events and the size of the ring buffer, in host byte order
+ */
+static __mbg_inline
+void ucap_ring_get_entries( PCPS_DDEV *pddev, PCPS_UCAP_ENTRIES *p )
+{
+  MBG_UCAP_RING_HDR *p_hdr = pddev->ucap_ring;
+  uint32_t avail = READ_ONCE( p_hdr->head ) - READ_ONCE( p_hdr->tail );
+
+  p->max = pddev->ucap_ring_mask + 1;
+  p->used = ( avail > p->max ) ? 0 : avail;  // 0 if tail is messed up, as in ucap_ring_pop()
+
+}  // ucap_ring_get_entries
+
+
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+int read_ucap_ring( PCPS_DDEV *pddev, void *pout );
+#endif
+
+/**
+ * @brief Copy the oldest capture event from the ring buffer to user space
+ *
+ * Does the same as ::PCPS_GIVE_UCAP_EVENT, i.e. if no event is available
+ * then both the seconds and the fractions of the returned time stamp are 0.
+ *
+ * @param[in]   pddev  Pointer to the device structure
+ * @param[out]  pout   The user space output buffer
+ *
+ * @return ::MBG_SUCCESS if an event or an empty time stamp has been copied,
+ *         ::MBG_ERR_NOT_READY if the drainer is not running for the device,
+ *         or ::MBG_ERR_COPY_TO_USER
+ */
+static __mbg_inline
+int read_ucap_ring( PCPS_DDEV *pddev, void *pout )
+{
+  PCPS_HR_TIME hr_time;
+  int rc = MBG_SUCCESS;
+
+  if ( pddev->ucap_ring == NULL )
+    return MBG_ERR_NOT_READY;
+
+  if ( _mbg_mutex_acquire( &pddev->ucap_ring_mutex ) < 0 )
+    return MBG_ERR_NOT_READY;
+
+  if ( ucap_ring_pop( pddev, &hr_time, 1 ) == 0 )
+    memset( &hr_time, 0, sizeof( hr_time ) );
+
+  _mbg_mutex_release( &pddev->ucap_ring_mutex );
+
+  _iob_to_pout_var( hr_time, pout );
+
+  return rc;
+
+}  // read_ucap_ring
+
+
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+void ucap_ring_clear( PCPS_DDEV *pddev );
+#endif
+
+/**
+ * @brief Discard all capture events from the user capture ring buffer
+ *
+ * Used when the on-board FIFO is cleared, so the ring buffer
+ * doesn't return events captured before.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ */
+static __mbg_inline
+void ucap_ring_clear( PCPS_DDEV *pddev )
+{
+  MBG_UCAP_RING_HDR *p_hdr = pddev->ucap_ring;
+
+  if ( p_hdr == NULL )
+    return;
+
+  if ( _mbg_mutex_acquire( &pddev->ucap_ring_mutex ) < 0 )
+    return;
+
+  WRITE_ONCE( p_hdr->tail, READ_ONCE( p_hdr->head ) );
+
+  _mbg_mutex_release( &pddev->ucap_ring_mutex );
+
+}  // ucap_ring_clear
+
+#endif  // _PCPS_USE_UCAP_RING
+
+
+
+#if USE_IO_BUFFER_POOL
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+PCPS_IO_BUFFER *iob_pool_get( PCPS_DDEV *pddev );
+#endif
+
+/**
+ * @brief Get a private I/O buffer from the device's buffer pool
+ *
+ * Never blocks. If all buffers of the pool are currently in use
+ * then a temporary buffer is allocated, which is DMA-capable, too.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ *
+ * @return Pointer to the I/O buffer, or NULL if no buffer could be allocated
+ *
+ * @see ::iob_pool_put
+ */
+static __mbg_inline
+PCPS_IO_BUFFER *iob_pool_get( PCPS_DDEV *pddev )
+{
+  PCPS_IO_BUFFER *p = NULL;
+
+  _mbg_spin_lock_acquire( &pddev->iob_pool_lock );
+
+  if ( pddev->iob_pool_free )
+  {
+    int i = __ffs( pddev->iob_pool_free );
+
+    pddev->iob_pool_free &= ~( 1UL << i );
+    p = pddev->iob_pool[i];
+  }
+
+  _mbg_spin_lock_release( &pddev->iob_pool_lock );
+
+  if ( p == NULL )
+  {
+    p = _pcps_kmalloc( sizeof( *p ) );
+
+    _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_DEBUG, "I/O buffer pool exhausted, temp. buffer %s",
+                 p ? "allocated" : "not available" );
+  }
+
+  return p;
+
+}  // iob_pool_get
+
+
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+void iob_pool_put( PCPS_DDEV *pddev, PCPS_IO_BUFFER *p );
+#endif
+
+/**
+ * @brief Return an I/O buffer to the device's buffer pool
+ *
+ * If the buffer is not a member of the pool, i.e. it has been
+ * allocated temporarily by ::iob_pool_get, it is freed.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  p      The I/O buffer returned by ::iob_pool_get
+ *
+ * @see ::iob_pool_get
+ */
+static __mbg_inline
+void iob_pool_put( PCPS_DDEV *pddev, PCPS_IO_BUFFER *p )
+{
+  int i;
+
+  for ( i = 0; i < PCPS_IOB_POOL_SIZE; i++ )
+  {
+    if ( pddev->iob_pool[i] == p )
+    {
+      _mbg_spin_lock_acquire( &pddev->iob_pool_lock );
+      pddev->iob_pool_free |= 1UL << i;
+      _mbg_spin_lock_release( &pddev->iob_pool_lock );
+      return;
+    }
+  }
+
+  _pcps_kfree( p, sizeof( *p ) );
+
+}  // iob_pool_put
+
+#endif  // USE_IO_BUFFER_POOL
+
+
+
+#if USE_PCPS_PRIO_LANES
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+int lane_sem_inc( PCPS_DDEV *pddev, int lat_class );
+#endif
+
+/**
+ * @brief Acquire the device mutex for a latency-class or bulk-class command
+ *
+ * Does the same as _pcps_sem_inc(), but a latency-class caller is
+ * counted while waiting for the mutex, and a bulk-class caller allows
+ * ::pcps_read_gps to release the mutex temporarily between 2 blocks
+ * if a latency-class caller is waiting. So a latency-class caller only
+ * needs to wait until the current block has been transferred, while
+ * the delay of a bulk transfer is limited by ::PCPS_LANE_MAX_YIELDS.
+ *
+ * @param[in]  pddev      Pointer to the device structure
+ * @param[in]  lat_class  Flag indicating a latency-class command, see ::ioctl_is_latency_class
+ *
+ * @return 0 on success, or a negative number if waiting has been interrupted
+ */
+static __mbg_inline
+int lane_sem_inc( PCPS_DDEV *pddev, int lat_class )
+{
+  ulong flags;
+  int rc;
+
+  if ( _pcps_is_batch_owner( pddev ) )
+  {
+    // The mutex is already held for an IOCTL batch, and must
+    // not be released before the whole batch has been executed.
+    spin_lock_irqsave( &pddev->irq_lock, flags );
+    atomic_inc( &pddev->access_in_progress );
+    spin_unlock_irqrestore( &pddev->irq_lock, flags );
+    return 0;
+  }
+
+  if ( lat_class )
+  {
+    atomic_inc( &pddev->n_lat_waiters );
+    rc = _mbg_mutex_acquire( &pddev->dev_mutex );
+    atomic_dec( &pddev->n_lat_waiters );
+
+    if ( rc < 0 )
+      return rc;
+  }
+  else
+  {
+    int n_defers = 0;
+
+    rc = _mbg_mutex_acquire( &pddev->dev_mutex );
+
+    if ( rc < 0 )
+      return rc;
+
+    // If a bulk transfer has released the mutex in ::pcps_lane_yield
+    // then the mutex may have been passed to us rather than to the
+    // latency-class caller, so we pass it on while a latency-class
+    // caller is still waiting. The waiters are queued in FIFO order,
+    // so we are queued behind the latency-class caller.
+    while ( atomic_read( &pddev->n_lat_waiters ) &&
+            ( n_defers++ < PCPS_LANE_MAX_YIELDS ) )
+    {
+      _mbg_mutex_release( &pddev->dev_mutex );
+
+      rc = _mbg_mutex_acquire( &pddev->dev_mutex );
+
+      if ( rc < 0 )
+        return rc;
+    }
+  }
+
+  _pcps_lane_set_owner( pddev );
+
+  spin_lock_irqsave( &pddev->irq_lock, flags );
+  atomic_inc( &pddev->access_in_progress );
+  spin_unlock_irqrestore( &pddev->irq_lock, flags );
+
+  pddev->lane_may_yield = !lat_class;
+
+  return 0;
+
+}  // lane_sem_inc
+
+#endif  // USE_PCPS_PRIO_LANES
+
+
+
 #if defined( __GNUC__ )
 // Avoid "no previous prototype" with some gcc versions.
 static __mbg_inline
@@ -929,6 +1593,9 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
     // that access the same device, so not only the real device access
     // itself needs to be protected by the device semaphore, but copying
     // data in from and out to user space, too.
+    // If USE_IO_BUFFER_POOL is enabled then the read functions replace
+    // this pointer by a private buffer from the device's buffer pool,
+    // so only the write functions use the shared buffer.
     PCPS_IO_BUFFER *p_dev_iob = &pddev->io_buffer;
   #endif
 
@@ -939,6 +1606,11 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
   IOCTL_BUFFER ioctl_buffer;
   IOCTL_BUFFER *p_tmp = &ioctl_buffer;
 
+  #if USE_PCPS_PRIO_LANES
+    // Latency-class commands get priority over large data transfers.
+    int lat_class = ioctl_is_latency_class( ioctl_code );
+  #endif
+
   #if USE_IOCTL_GENERIC_REQ
     void *p_buff_in;
     void *p_buff_out;
@@ -1000,16 +1672,14 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_PCPS_HR_TIME_CYCLES:
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
+      _io_get_iob( pddev );
 
       rc = _pcps_read_var( pddev, PCPS_GIVE_HR_TIME, p_dev_iob->pcps_hr_time_cycles.t );
 
       p_dev_iob->pcps_hr_time_cycles.cycles = pddev->acc_cycles;
 
-      if ( mbg_rc_is_success( rc ) )
-        _iob_to_pout_var( p_dev_iob->pcps_hr_time_cycles, pout );
-
-      _pcps_sem_dec( pddev );
+      _io_sem_dec_iob_to_pout_var( pddev, p_dev_iob->pcps_hr_time_cycles, pout );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -1018,6 +1688,20 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_PCPS_UCAP_EVENT:
+    #if _PCPS_USE_UCAP_RING
+      // If the user capture drainer is running for the device
+      // then the on-board FIFO must not be read directly.
+      rc = read_ucap_ring( pddev, pout );
+
+      if ( rc != MBG_ERR_NOT_READY )
+      {
+        if ( mbg_rc_is_error( rc ) )
+          goto err_dev_access;
+
+        break;
+      }
+    #endif
+
       _io_read_var_chk( pddev, PCPS_GIVE_UCAP_EVENT, pcps_hr_time,
                         pout, _pcps_ddev_has_ucap( pddev ) );
       break;
@@ -1031,16 +1715,14 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_PCPS_TIME_CYCLES:
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
+      _io_get_iob( pddev );
 
       rc = _pcps_read_var( pddev, PCPS_GIVE_TIME_NOCLEAR, p_dev_iob->pcps_time_cycles.t );
 
       p_dev_iob->pcps_time_cycles.cycles = pddev->acc_cycles;
 
-      if ( mbg_rc_is_success( rc ) )
-        _iob_to_pout_var( p_dev_iob->pcps_time_cycles, pout );
-
-      _pcps_sem_dec( pddev );
+      _io_sem_dec_iob_to_pout_var( pddev, p_dev_iob->pcps_time_cycles, pout );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -1080,12 +1762,15 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       _io_chk_cond( _pcps_ddev_has_hr_time( pddev ) );
 
       // This API call is also supported for USB devices, so we have to
-      // use the DMA-capable common buffer provided by the device data,
-      // and as a consequence also the code that reads the current
+      // use a DMA-capable I/O buffer. The code that reads the current
       // system time and cycles needs to be inside the critical section
-      // protected by the semaphore, as well as the code that copies the
-      // structure up to user space.
-      _pcps_sem_inc_safe( pddev );
+      // protected by the semaphore anyway, so the system time is read
+      // as close as possible to the device time. If the common buffer
+      // provided by the device data is used then the code that copies
+      // the structure up to user space needs to be inside the critical
+      // section, too.
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
+      _io_get_iob( pddev );
 
       mbg_get_pc_cycles( &p_dev_iob->mbg_time_info_hrt.sys_time_cycles.cyc_before );
       mbg_get_sys_time( &p_dev_iob->mbg_time_info_hrt.sys_time_cycles.sys_time );
@@ -1094,10 +1779,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       rc = _pcps_read_var( pddev, PCPS_GIVE_HR_TIME, p_dev_iob->mbg_time_info_hrt.ref_hr_time_cycles.t );
       p_dev_iob->mbg_time_info_hrt.ref_hr_time_cycles.cycles = pddev->acc_cycles;
 
-      if ( mbg_rc_is_success( rc ) )
-        _iob_to_pout_var( p_dev_iob->mbg_time_info_hrt, pout );
-
-      _pcps_sem_dec( pddev );
+      _io_sem_dec_iob_to_pout_var( pddev, p_dev_iob->mbg_time_info_hrt, pout );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -1152,6 +1834,9 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_GPS_BVAR_STAT:
+      if ( _io_read_snapshot( pddev, MBG_SNAPSHOT_BVAR_STAT, pout, sizeof( p_dev_iob->bvar_stat ) ) )
+        break;
+
       _io_read_gps_var( pddev, PC_GPS_BVAR_STAT, bvar_stat, pout );
       break;
 
@@ -1196,6 +1881,25 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_PCPS_UCAP_ENTRIES:
+    #if _PCPS_USE_UCAP_RING
+      // If the user capture drainer is running for the device
+      // then the events are in the ring buffer.
+      if ( pddev->ucap_ring )
+      {
+        PCPS_UCAP_ENTRIES ucap_entries;
+
+        ucap_ring_get_entries( pddev, &ucap_entries );
+        _mbg_swab_pcps_ucap_entries( &ucap_entries );  // same byte order as read from the device
+        rc = MBG_SUCCESS;
+        _iob_to_pout_var( ucap_entries, pout );
+
+        if ( mbg_rc_is_error( rc ) )
+          goto err_dev_access;
+
+        break;
+      }
+    #endif
+
       _io_read_var_chk( pddev, PCPS_GIVE_UCAP_ENTRIES, pcps_ucap_entries,
                         pout, _pcps_ddev_has_ucap( pddev ) );
       break;
@@ -1226,6 +1930,9 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_IRIG_CTRL_BITS:
+      if ( _io_read_snapshot( pddev, MBG_SNAPSHOT_IRIG_CTRL_BITS, pout, sizeof( p_dev_iob->mbg_irig_ctrl_bits ) ) )
+        break;
+
       _io_read_var_chk( pddev, PCPS_GET_IRIG_CTRL_BITS, mbg_irig_ctrl_bits,
                         pout, _pcps_ddev_has_irig_ctrl_bits( pddev ) );
       break;
@@ -1238,6 +1945,9 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
 
     case IOCTL_GET_PTP_STATE:
+      if ( _io_read_snapshot( pddev, MBG_SNAPSHOT_PTP_STATE, pout, sizeof( p_dev_iob->ptp_state ) ) )
+        break;
+
       _io_read_gps_var_chk( pddev, PC_GPS_PTP_STATE, ptp_state,
                             pout, _pcps_ddev_has_ptp( pddev ) );
       break;
@@ -1281,241 +1991,288 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
     #endif
 
 
+  #if _PCPS_USE_STATUS_SNAPSHOT
+    case IOCTL_GET_STATUS_SNAPSHOT_INFO:
+    {
+      // The snapshot data is not DMA-capable, nor does it have to be,
+      // so we can use a local variable as buffer for the data to be returned.
+      MBG_STATUS_SNAPSHOT_INFO snapshot_info;
+      PCPS_STATUS_SNAPSHOT *p;
+
+      _io_chk_cond( pddev->snapshot );
+
+      memset( &snapshot_info, 0, sizeof( snapshot_info ) );
+
+      if ( _mbg_mutex_acquire( &pddev->snapshot_mutex ) < 0 )
+        return -ERESTARTSYS;
+
+      p = &pddev->snapshot[pddev->snapshot_idx];
+      snapshot_info.supp_items = pddev->snapshot_supp_items;
+      snapshot_info.valid_items = p->valid_items;
+      snapshot_info.intv_ms = jiffies_to_msecs( pddev->snapshot_intv );
+      snapshot_info.age_ms = jiffies_to_msecs( jiffies - p->jiffies_updated );
+      snapshot_info.seq = pddev->snapshot_seq;
+      snapshot_info.n_errors = pddev->snapshot_n_errors;
+
+      _mbg_mutex_release( &pddev->snapshot_mutex );
+
+      _iob_to_pout_var( snapshot_info, pout );
+      break;
+    }
+  #endif
+
+
 
     // Commands returning device capabilities and features
 
+    case IOCTL_GET_DEV_CAPS:
+      // Set up when the device was probed, and never changed afterwards.
+      _iob_to_pout_var( pddev->dev_caps, pout );
+      break;
+
+
     case IOCTL_DEV_IS_GPS:
-      _report_cond( _pcps_ddev_is_gps( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_GPS, pout );
       break;
 
 
     case IOCTL_DEV_IS_DCF:
-      _report_cond( _pcps_ddev_is_dcf( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_DCF, pout );
       break;
 
 
     case IOCTL_DEV_IS_MSF:
-      _report_cond( _pcps_ddev_is_msf( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_MSF, pout );
       break;
 
 
     case IOCTL_DEV_IS_WWVB:
-      _report_cond( _pcps_ddev_is_wwvb( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_WWVB, pout );
       break;
 
 
     case IOCTL_DEV_IS_LWR:
-      _report_cond( _pcps_ddev_is_lwr( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_LWR, pout );
       break;
 
 
     case IOCTL_DEV_IS_GNSS:
-      _report_cond( _pcps_ddev_is_gnss( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_GNSS, pout );
       break;
 
 
     case IOCTL_DEV_IS_IRIG_RX:
-      _report_cond( _pcps_ddev_is_irig_rx( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_IRIG_RX, pout );
       break;
 
 
     case IOCTL_DEV_HAS_HR_TIME:
-      _report_cond( _pcps_ddev_has_hr_time( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_HR_TIME, pout );
       break;
 
 
     case IOCTL_DEV_HAS_CAB_LEN:
-      _report_cond( _pcps_ddev_has_cab_len( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_CAB_LEN, pout );
       break;
 
 
     case IOCTL_DEV_HAS_TZDL:
-      _report_cond( _pcps_ddev_has_tzdl( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_TZDL, pout );
       break;
 
 
     case IOCTL_DEV_HAS_PCPS_TZDL:
-      _report_cond( _pcps_ddev_has_pcps_tzdl( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_PCPS_TZDL, pout );
       break;
 
 
     case IOCTL_DEV_HAS_TZCODE:
-      _report_cond( _pcps_ddev_has_tzcode( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_TZCODE, pout );
       break;
 
 
     case IOCTL_DEV_HAS_TZ:
-      _report_cond( _pcps_ddev_has_tz( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_TZ, pout );
       break;
 
 
     case IOCTL_DEV_HAS_EVENT_TIME:
-      _report_cond( _pcps_ddev_has_event_time( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_EVENT_TIME, pout );
       break;
 
 
     case IOCTL_DEV_HAS_RECEIVER_INFO:
-      _report_cond( _pcps_ddev_has_receiver_info( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_RECEIVER_INFO, pout );
       break;
 
 
     case IOCTL_DEV_CAN_CLR_UCAP_BUFF:
-      _report_cond( _pcps_ddev_can_clr_ucap_buff( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_CAN_CLR_UCAP_BUFF, pout );
       break;
 
 
     case IOCTL_DEV_HAS_UCAP:
-      _report_cond( _pcps_ddev_has_ucap( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_UCAP, pout );
       break;
 
 
     case IOCTL_DEV_HAS_IRIG_TX:
-      _report_cond( _pcps_ddev_has_irig_tx( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_IRIG_TX, pout );
       break;
 
 
     case IOCTL_DEV_HAS_SERIAL_HS:
-      _report_cond( _pcps_ddev_has_serial_hs( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_SERIAL_HS, pout );
       break;
 
 
     case IOCTL_DEV_HAS_SIGNAL:
-      _report_cond( _pcps_ddev_has_signal( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_SIGNAL, pout );
       break;
 
 
     case IOCTL_DEV_HAS_MOD:
-      _report_cond( _pcps_ddev_has_mod( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_MOD, pout );
       break;
 
 
     case IOCTL_DEV_HAS_IRIG:
-      _report_cond( _pcps_ddev_has_irig( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_IRIG, pout );
       break;
 
 
     case IOCTL_DEV_HAS_REF_OFFS:
-      _report_cond( _pcps_ddev_has_ref_offs( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_REF_OFFS, pout );
       break;
 
 
     case IOCTL_DEV_HAS_OPT_FLAGS:
-      _report_cond( _pcps_ddev_has_opt_flags( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_OPT_FLAGS, pout );
       break;
 
 
     case IOCTL_DEV_HAS_GPS_DATA:
-      _report_cond( _pcps_ddev_has_gps_data( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_GPS_DATA, pout );
       break;
 
 
     case IOCTL_DEV_HAS_SYNTH:
-      _report_cond( _pcps_ddev_has_synth( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_SYNTH, pout );
       break;
 
 
     case IOCTL_DEV_HAS_GENERIC_IO:
-      _report_cond( _pcps_ddev_has_generic_io( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_GENERIC_IO, pout );
       break;
 
 
     case IOCTL_DEV_HAS_PCI_ASIC_FEATURES:
-      _report_cond( _pcps_ddev_has_asic_features( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_PCI_ASIC_FEATURES, pout );
       break;
 
 
     case IOCTL_DEV_HAS_PCI_ASIC_VERSION:
-      _report_cond( _pcps_ddev_has_asic_version( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_PCI_ASIC_VERSION, pout );
       break;
 
 
     case IOCTL_DEV_HAS_FAST_HR_TIMESTAMP:
-      _report_cond( _pcps_ddev_has_fast_hr_timestamp( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_FAST_HR_TIMESTAMP, pout );
       break;
 
 
     case IOCTL_DEV_HAS_GPS_TIME_SCALE:
-      _report_cond( _pcps_ddev_has_time_scale( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_GPS_TIME_SCALE, pout );
       break;
 
 
     case IOCTL_DEV_HAS_GPS_UTC_PARM:
-      _report_cond( _pcps_ddev_has_utc_parm( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_GPS_UTC_PARM, pout );
       break;
 
 
     case IOCTL_DEV_HAS_IRIG_CTRL_BITS:
-      _report_cond( _pcps_ddev_has_irig_ctrl_bits( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_IRIG_CTRL_BITS, pout );
       break;
 
 
     case IOCTL_DEV_HAS_LAN_INTF:
-      _report_cond( _pcps_ddev_has_lan_intf( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_LAN_INTF, pout );
       break;
 
 
     case IOCTL_DEV_IS_PTP:
-      _report_cond( _pcps_ddev_is_ptp( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_IS_PTP, pout );
       break;
 
 
     case IOCTL_DEV_HAS_PTP:
-      _report_cond( _pcps_ddev_has_ptp( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_PTP, pout );
       break;
 
 
     case IOCTL_DEV_HAS_IRIG_TIME:
-      _report_cond( _pcps_ddev_has_irig_time( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_IRIG_TIME, pout );
       break;
 
 
     case IOCTL_DEV_HAS_RAW_IRIG_DATA:
-      _report_cond( _pcps_ddev_has_raw_irig_data( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_RAW_IRIG_DATA, pout );
       break;
 
 
     case IOCTL_DEV_HAS_PTP_UNICAST:
-      _report_cond( _pcps_ddev_has_ptp_unicast( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_PTP_UNICAST, pout );
       break;
 
 
     case IOCTL_DEV_HAS_PZF:
-      _report_cond( _pcps_ddev_has_pzf( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_PZF, pout );
       break;
 
 
     case IOCTL_DEV_HAS_CORR_INFO:
-      _report_cond( _pcps_ddev_has_corr_info( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_CORR_INFO, pout );
       break;
 
 
     case IOCTL_DEV_HAS_TR_DISTANCE:
-      _report_cond( _pcps_ddev_has_tr_distance( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_TR_DISTANCE, pout );
       break;
 
 
     case IOCTL_DEV_HAS_DEBUG_STATUS:
-      _report_cond( _pcps_ddev_has_debug_status( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_DEBUG_STATUS, pout );
       break;
 
 
     case IOCTL_DEV_HAS_EVT_LOG:
-      _report_cond( _pcps_ddev_has_evt_log( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_EVT_LOG, pout );
       break;
 
 
     case IOCTL_DEV_HAS_GPIO:
-      _report_cond( _pcps_ddev_has_gpio( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_GPIO, pout );
       break;
 
 
     case IOCTL_DEV_HAS_XMR:
-      _report_cond( _pcps_ddev_has_xmr( pddev ), pout );
+      _report_dev_cap( pddev, MBG_DEV_CAP_HAS_XMR, pout );
       break;
 
 
     case IOCTL_CHK_DEV_FEAT:
       _iob_from_pin_var( p_tmp->dev_feat_req, pin );
+      #if _PCPS_USE_LAZY_EXT_FEAT
+        if ( ( p_tmp->dev_feat_req.feat_type == DEV_FEAT_TYPE_XFEAT ) ||
+             ( p_tmp->dev_feat_req.feat_type == DEV_FEAT_TYPE_TLV_FEAT ) )
+        {
+          // Read the extended features if not yet done.
+          _pcps_sem_inc_safe_lat( pddev, lat_class );
+          pcps_chk_ext_features( pddev );
+          _pcps_sem_dec( pddev );
+        }
+      #endif
       rc = pcps_chk_dev_feat( pddev, p_tmp->dev_feat_req.feat_type, p_tmp->dev_feat_req.feat_num );
       #if DEBUG_IOCTL
         _mbgddmsg_3( DEBUG_IOCTL, MBG_LOG_INFO, "chk_dev_feat %lu:%lu returned %i",
@@ -1537,6 +2294,9 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
     case IOCTL_PCPS_CLR_UCAP_BUFF:
       _io_write_cmd_chk( pddev, PCPS_CLR_UCAP_BUFF,
                          _pcps_ddev_can_clr_ucap_buff( pddev ) );
+    #if _PCPS_USE_UCAP_RING
+      ucap_ring_clear( pddev );
+    #endif
       break;
 
 
@@ -1699,7 +2459,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
     #if USE_IOCTL_GENERIC_REQ
       _iob_from_pin_var( p_tmp->req, pin );
 
-      p_buff_out = _pcps_kmalloc( p_tmp->req.out_sz );
+      p_buff_out = _ioctl_buf_alloc( p_tmp->req.out_sz );
 
       if ( p_buff_out == NULL )
       {
@@ -1712,15 +2472,16 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = _pcps_read( pddev, (uint8_t) p_tmp->req.info, p_buff_out,
                        (uint8_t) p_tmp->req.out_sz );
+      _io_evt_log_chk_cmd( pddev, (uint8_t) p_tmp->req.info );
       _pcps_sem_dec( pddev );
 
       if ( mbg_rc_is_success( rc ) )
         _frc_iob_to_pout( p_buff_out, p_tmp->req.out_p, p_tmp->req.out_sz );
 
-      _pcps_kfree( p_buff_out, p_tmp->req.out_sz );
+      _ioctl_buf_free( p_buff_out, p_tmp->req.out_sz );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -1731,7 +2492,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       buffer_size = sizeof( p_tmp->ctl ) + p_tmp->ctl.data_size_out;
 
-      p_buff = _pcps_kmalloc( buffer_size );
+      p_buff = _ioctl_buf_alloc( buffer_size );
 
       if ( p_buff == NULL )
         goto err_no_mem;
@@ -1739,9 +2500,10 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = _pcps_read( pddev, (uint8_t) p_tmp->ctl.info, p_buff->data,
                        (uint8_t) p_tmp->ctl.data_size_out );
+      _io_evt_log_chk_cmd( pddev, (uint8_t) p_tmp->ctl.info );
       _pcps_sem_dec( pddev );
 
       if ( mbg_rc_is_success( rc ) )
@@ -1750,7 +2512,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
         _iob_to_pout( p_buff, pout, buffer_size );    // TODO need to check if correct size is used
       }
 
-      _pcps_kfree( p_buff, buffer_size );
+      _ioctl_buf_free( p_buff, buffer_size );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -1763,7 +2525,13 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
     #if USE_IOCTL_GENERIC_REQ
       _iob_from_pin_var( p_tmp->req, pin );
 
-      p_buff_out = _pcps_kmalloc( p_tmp->req.out_sz );
+      // Status structures like PC_GPS_ALL_XMR_STATUS are read
+      // via this call, so they may be available from the snapshot.
+      if ( _io_read_snapshot( pddev, status_snapshot_item_from_gps_cmd( p_tmp->req.info ),
+                              p_tmp->req.out_p, p_tmp->req.out_sz ) )
+        break;
+
+      p_buff_out = _ioctl_buf_alloc( p_tmp->req.out_sz );
 
       if ( p_buff_out == NULL )
       {
@@ -1776,7 +2544,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_read_gps( pddev, (uint8_t) p_tmp->req.info, p_buff_out,
                           (uint16_t) p_tmp->req.out_sz );
       _pcps_sem_dec( pddev );
@@ -1784,7 +2552,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       if ( mbg_rc_is_success( rc ) )
         _frc_iob_to_pout( p_buff_out, p_tmp->req.out_p, p_tmp->req.out_sz );
 
-      _pcps_kfree( p_buff_out, p_tmp->req.out_sz );
+      _ioctl_buf_free( p_buff_out, p_tmp->req.out_sz );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -1795,7 +2563,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       buffer_size = sizeof( p_tmp->ctl ) + p_tmp->ctl.data_size_out;
 
-      p_buff = _pcps_kmalloc( buffer_size );
+      p_buff = _ioctl_buf_alloc( buffer_size );
 
       if ( p_buff == NULL )
         goto err_no_mem;
@@ -1803,7 +2571,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_read_gps( pddev, (uint8_t) p_tmp->ctl.info, p_buff->data,
                           (uint16_t) p_tmp->ctl.data_size_out );
       _pcps_sem_dec( pddev );
@@ -1814,7 +2582,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
         _iob_to_pout( p_buff, pout, buffer_size );  // TODO need to check if correct size is used
       }
 
-      _pcps_kfree( p_buff, buffer_size );
+      _ioctl_buf_free( p_buff, buffer_size );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -2085,7 +2853,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       _iob_from_pin_var( p_tmp->req, pin );
 
-      p_buff_in = _pcps_kmalloc( p_tmp->req.in_sz );
+      p_buff_in = _ioctl_buf_alloc( p_tmp->req.in_sz );
 
       if ( p_buff_in == NULL )
       {
@@ -2100,12 +2868,13 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_write( pddev, (uint8_t) p_tmp->req.info, p_buff_in,
                        (uint8_t) p_tmp->req.in_sz );
+      _io_evt_log_chk_cmd( pddev, (uint8_t) p_tmp->req.info );
       _pcps_sem_dec( pddev );
 
-      _pcps_kfree( p_buff_in, p_tmp->req.in_sz );
+      _ioctl_buf_free( p_buff_in, p_tmp->req.in_sz );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -2116,7 +2885,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       buffer_size = sizeof( p_tmp->ctl ) + p_tmp->ctl.data_size_in;
 
-      p_buff = _pcps_kmalloc( buffer_size );
+      p_buff = _ioctl_buf_alloc( buffer_size );
 
       if ( p_buff == NULL )
         goto err_no_mem;
@@ -2126,12 +2895,13 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_write( pddev, (uint8_t) p_tmp->ctl.info, p_buff->data,
                        (uint8_t) p_tmp->ctl.data_size_in );
+      _io_evt_log_chk_cmd( pddev, (uint8_t) p_tmp->ctl.info );
       _pcps_sem_dec( pddev );
 
-      _pcps_kfree( p_buff, buffer_size );
+      _ioctl_buf_free( p_buff, buffer_size );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -2145,7 +2915,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       _iob_from_pin_var( p_tmp->req, pin );
 
-      p_buff_in = _pcps_kmalloc( p_tmp->req.in_sz );
+      p_buff_in = _ioctl_buf_alloc( p_tmp->req.in_sz );
 
       if ( p_buff_in == NULL )
       {
@@ -2160,12 +2930,12 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_write_gps( pddev, (uint8_t) p_tmp->req.info, p_buff_in,
                            (uint16_t) p_tmp->req.in_sz );
       _pcps_sem_dec( pddev );
 
-      _pcps_kfree( p_buff_in, p_tmp->req.in_sz );
+      _ioctl_buf_free( p_buff_in, p_tmp->req.in_sz );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -2176,7 +2946,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       buffer_size = sizeof( p_tmp->ctl ) + p_tmp->ctl.data_size_in;
 
-      p_buff = _pcps_kmalloc( buffer_size );
+      p_buff = _ioctl_buf_alloc( buffer_size );
 
       if ( p_buff == NULL )
         goto err_no_mem;
@@ -2186,12 +2956,12 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_write_gps( pddev, (uint8_t) p_tmp->ctl.info, p_buff->data,
                            (uint8_t) p_tmp->ctl.data_size_in );
       _pcps_sem_dec( pddev );
 
-      _pcps_kfree( p_buff, buffer_size );
+      _ioctl_buf_free( p_buff, buffer_size );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -2208,7 +2978,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       if ( p_tmp->req.in_p && p_tmp->req.in_sz )
       {
-        p_buff_in = _pcps_kmalloc( p_tmp->req.in_sz );
+        p_buff_in = _ioctl_buf_alloc( p_tmp->req.in_sz );
 
         if ( p_buff_in == NULL )
         {
@@ -2228,7 +2998,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
       if ( p_tmp->req.out_p && p_tmp->req.out_sz )
       {
-        p_buff_out = _pcps_kmalloc( p_tmp->req.out_sz );
+        p_buff_out = _ioctl_buf_alloc( p_tmp->req.out_sz );
 
         if ( p_buff_out == NULL )
         {
@@ -2238,7 +3008,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
 
           // We can't continue this API call, but before we leave we have to free
           // the input buffer we already have allocated before.
-          _pcps_kfree( p_buff_in, p_tmp->req.in_sz );
+          _ioctl_buf_free( p_buff_in, p_tmp->req.in_sz );
           goto err_no_mem;
         }
       }
@@ -2251,20 +3021,22 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_generic_io( pddev, (uint8_t) p_tmp->req.info,
                             p_buff_in, (uint8_t) p_tmp->req.in_sz,
                             p_buff_out, (uint8_t) p_tmp->req.out_sz );
+      // We can't tell what the device does with a generic I/O request.
+      _io_evt_log_cursor_moved( pddev );
       _pcps_sem_dec( pddev );
 
       if ( mbg_rc_is_success( rc ) )
         _frc_iob_to_pout( p_buff_out, p_tmp->req.out_p, p_tmp->req.out_sz );
 
       if ( p_buff_in )
-        _pcps_kfree( p_buff_in, p_tmp->req.in_sz );
+        _ioctl_buf_free( p_buff_in, p_tmp->req.in_sz );
 
       if ( p_buff_out )
-        _pcps_kfree( p_buff_out, p_tmp->req.out_sz );
+        _ioctl_buf_free( p_buff_out, p_tmp->req.out_sz );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -2279,7 +3051,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
                 ( ( p_tmp->ctl.data_size_in > p_tmp->ctl.data_size_out ) ?
                     p_tmp->ctl.data_size_in : p_tmp->ctl.data_size_out );
 
-      p_buff = _pcps_kmalloc( buffer_size );
+      p_buff = _ioctl_buf_alloc( buffer_size );
 
       if ( p_buff == NULL )
         goto err_no_mem;
@@ -2289,10 +3061,12 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
       // We only use local buffers here, and the allocated buffer used
       // for device access is anyway DMA-capable, so only the direct access
       // to the device needs to be protected by the device semaphore.
-      _pcps_sem_inc_safe( pddev );
+      _pcps_sem_inc_safe_lat( pddev, lat_class );
       rc = pcps_generic_io( pddev, (uint8_t) p_tmp->ctl.info,
                             p_buff->data, (uint8_t) p_tmp->ctl.data_size_in,
                             p_buff->data, (uint8_t) p_tmp->ctl.data_size_out );
+      // We can't tell what the device does with a generic I/O request.
+      _io_evt_log_cursor_moved( pddev );
       _pcps_sem_dec( pddev );
 
       if ( mbg_rc_is_success( rc ) )
@@ -2301,7 +3075,7 @@ int ioctl_switch( PCPS_DDEV *pddev, unsigned int ioctl_code,
         _iob_to_pout( p_buff, pout, sizeof( p_buff->ctl ) + p_tmp->ctl.data_size_out );  // TODO need to check if correct size is used
       }
 
-      _pcps_kfree( p_buff, buffer_size );
+      _ioctl_buf_free( p_buff, buffer_size );
 
       if ( mbg_rc_is_error( rc ) )
         goto err_dev_access;
@@ -184,15 +184,202 @@ extern unsigned long volatile jiffies;
     ( LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 11 ) )
 #endif
 
+// Pre-allocated URBs are used to submit a command and the read of the
+// response at the same time. This requires usb_alloc_coherent() which
+// is available since 2.6.35, and reinit_completion() which has been
+// introduced in 3.13.
+#if !defined( _PCPS_USE_USB_URB )
+  #define _PCPS_USE_USB_URB \
+    ( _PCPS_USE_USB && ( LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 13, 0 ) ) )
+#endif
+
+// The latency of time stamps read via USB is compensated based on
+// the frame numbers provided by usb_get_current_frame_number().
+#if !defined( _PCPS_USE_USB_LATENCY_COMP )
+  #define _PCPS_USE_USB_LATENCY_COMP  _PCPS_USE_USB
+#endif
+
 #include <linux/cdev.h>   // Requires kernel 2.6.0 or newer
 
-#if !defined( _PCPS_USE_LINUX_KTHREAD )
-  #define _PCPS_USE_LINUX_KTHREAD \
-  ( LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 10 ) )  //##++++
+#if !defined( _PCPS_USE_STATUS_SNAPSHOT )
+  // The background status snapshotter is implemented as a self-rearming
+  // delayed work item. cancel_delayed_work_sync() which is required to
+  // stop such a work item safely has been introduced in kernel 2.6.23.
+  #define _PCPS_USE_STATUS_SNAPSHOT \
+    ( LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 23 ) )
+#endif
+
+#if _PCPS_USE_STATUS_SNAPSHOT
+  #include <linux/workqueue.h>
+  #include <linux/jiffies.h>
+#endif
+
+#if !defined( _PCPS_USE_IOCTL_MEMPOOL )
+  // The buffers for the generic IOCTL calls are taken from a mempool
+  // backed by a slab cache per size class. kmem_cache_create() has its
+  // current signature since kernel 2.6.23.
+  #define _PCPS_USE_IOCTL_MEMPOOL \
+    ( LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 23 ) )
+#endif
+
+#if _PCPS_USE_IOCTL_MEMPOOL
+  #include <linux/slab.h>
+  #include <linux/mempool.h>
+#endif
+
+#if !defined( _PCPS_USE_ASYNC_REQ )
+  // Asynchronous requests are executed by a work item which has to be
+  // stopped safely by cancel_work_sync(), which has been introduced
+  // in kernel 2.6.22.
+  #define _PCPS_USE_ASYNC_REQ \
+    ( LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 22 ) )
+#endif
+
+#if _PCPS_USE_ASYNC_REQ
+  #include <linux/workqueue.h>
+#endif
+
+#if !defined( _PCPS_USE_UCAP_RING )
+  // The user capture ring buffer is shared with user space without
+  // locking, which requires READ_ONCE() and WRITE_ONCE(). These have
+  // been introduced in kernel 3.19.
+  #define _PCPS_USE_UCAP_RING \
+    ( LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 19, 0 ) )
+#endif
+
+#if _PCPS_USE_UCAP_RING
+  #include <linux/workqueue.h>
+  #include <linux/vmalloc.h>
+  #include <linux/log2.h>
+#endif
+
+#if !defined( _PCPS_USE_PTP_CLOCK )
+  // User capture events can be passed to a PTP hardware clock (PHC)
+  // as external time stamps, which requires the user capture drainer.
+  // The gettime64() and adjfine() callbacks of a PHC are available
+  // since kernel 4.10.
+  #if defined( CONFIG_PTP_1588_CLOCK ) || defined( CONFIG_PTP_1588_CLOCK_MODULE )
+    #define _PCPS_USE_PTP_CLOCK \
+      ( _PCPS_USE_UCAP_RING && ( LINUX_VERSION_CODE >= KERNEL_VERSION( 4, 10, 0 ) ) )
+  #else
+    #define _PCPS_USE_PTP_CLOCK  0
+  #endif
+#endif
+
+#if _PCPS_USE_PTP_CLOCK
+  #include <linux/ptp_clock_kernel.h>
+#endif
+
+#if !defined( _PCPS_USE_URING_CMD )
+  // The uring_cmd member of struct file_operations has been
+  // introduced in kernel 5.19, so IOCTL codes can also be
+  // submitted via io_uring.
+  #if defined( CONFIG_IO_URING )
+    #define _PCPS_USE_URING_CMD \
+      ( LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 19, 0 ) )
+  #else
+    #define _PCPS_USE_URING_CMD  0
+  #endif
+#endif
+
+#if _PCPS_USE_URING_CMD
+  #if ( LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 7, 0 ) )
+    #include <linux/io_uring/cmd.h>
+  #else
+    #include <linux/io_uring.h>
+  #endif
+
+  // Since kernel 6.6 the command payload has to be retrieved
+  // from the SQE by a helper function.
+  #if ( LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 6, 0 ) )
+    #define _mbg_uring_cmd_payload( _c )  io_uring_sqe_cmd( (_c)->sqe )
+  #else
+    #define _mbg_uring_cmd_payload( _c )  ( (_c)->cmd )
+  #endif
+#endif
+
+#if !defined( _PCPS_USE_ASYNC_PROBE )
+  // PCI devices are probed asynchronously in parallel if the driver core
+  // supports PROBE_PREFER_ASYNCHRONOUS, which has been introduced in
+  // kernel 4.2. A PTP270PEX card which is still booting is probed later
+  // by a delayed work item instead of blocking the probe routine.
+  #define _PCPS_USE_ASYNC_PROBE \
+    ( _PCPS_USE_PCI_PNP && ( LINUX_VERSION_CODE >= KERNEL_VERSION( 4, 2, 0 ) ) )
+#endif
+
+#if _PCPS_USE_ASYNC_PROBE
+  #include <linux/workqueue.h>
+#endif
+
+#if !defined( _PCPS_USE_LAZY_EXT_FEAT )
+  // The extended features of a device are not read at probe time,
+  // but by the IOCTL handler when they are needed for the first time.
+  #define _PCPS_USE_LAZY_EXT_FEAT  1
+#endif
+
+#if !defined( _PCPS_USE_AGG_DEV )
+  // An additional misc device /dev/mbgclock-agg reads the time
+  // from the healthiest of the devices supported by the driver.
+  #define _PCPS_USE_AGG_DEV  1
+#endif
+
+#if _PCPS_USE_AGG_DEV
+  #include <linux/miscdevice.h>
+#endif
+
+#if !defined( _PCPS_USE_SYSFS_ATTR )
+  // Cached state of a device is published as read-only attributes
+  // of its class device. The dev_groups member of struct class
+  // and the ATTRIBUTE_GROUPS() macro have been introduced in kernel 3.11.
+  #define _PCPS_USE_SYSFS_ATTR \
+    ( LINUX_VERSION_CODE >= KERNEL_VERSION( 3, 11, 0 ) )
+#endif
+
+#if _PCPS_USE_SYSFS_ATTR
+  #include <linux/sysfs.h>
+#endif
+
+#if !defined( _PCPS_USE_DEV_STATS )
+  // Statistics are counted per device and CPU, and can be read
+  // in OpenMetrics text format from a debugfs file per device.
+  // The this_cpu_*() operations have been introduced in kernel 2.6.33.
+  #if defined( CONFIG_DEBUG_FS )
+    #define _PCPS_USE_DEV_STATS \
+      ( LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 33 ) )
+  #else
+    #define _PCPS_USE_DEV_STATS  0
+  #endif
+#endif
+
+#if _PCPS_USE_DEV_STATS
+  #include <linux/debugfs.h>
+  #include <linux/seq_file.h>
+  #include <linux/percpu.h>
+  #include <linux/ktime.h>
+#endif
+
+#if !defined( _PCPS_USE_TRACEPOINTS )
+  // Tracepoints for ftrace, perf and BPF, see mbg_trace_lx.h,
+  // which is included by pcpsdrvr.h. The events are defined using
+  // DECLARE_EVENT_CLASS(), which has been introduced in kernel 2.6.33.
+  #if defined( CONFIG_TRACEPOINTS )
+    #define _PCPS_USE_TRACEPOINTS \
+      ( LINUX_VERSION_CODE >= KERNEL_VERSION( 2, 6, 33 ) )
+  #else
+    #define _PCPS_USE_TRACEPOINTS  0
+  #endif
+#endif
+
+#if !defined( _PCPS_USE_DBG_KEYS )
+  // Debug code which can be enabled at runtime per device,
+  // and is otherwise skipped by a patched-out branch. The
+  // static_branch_...() API has been introduced in kernel 4.3.
+  #define _PCPS_USE_DBG_KEYS \
+    ( LINUX_VERSION_CODE >= KERNEL_VERSION( 4, 3, 0 ) )
 #endif
 
-#if _PCPS_USE_LINUX_KTHREAD
-  #include <linux/kthread.h>
+#if _PCPS_USE_DBG_KEYS
+  #include <linux/jump_label.h>
 #endif
 
 
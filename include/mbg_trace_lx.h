@@ -0,0 +1,270 @@
+
+/**************************************************************************
+ *
+ *  $Id: mbg_trace_lx.h $
+ *
+ *  Copyright (c) Meinberg Funkuhren, Bad Pyrmont, Germany
+ *
+ *  Description:
+ *    Tracepoints of the Linux kernel driver, to be used with
+ *    ftrace, perf, or BPF. A disabled tracepoint costs only
+ *    a not-taken branch.
+ *
+ *    Exactly one module source file has to define CREATE_TRACE_POINTS
+ *    before this file is included, to create the tracepoints.
+ *
+ *    Each event carries the device number of the device, which is 0:0
+ *    while a device hasn't been registered yet, and a cycles count
+ *    taken when the event was recorded, see ::mbg_get_pc_cycles.
+ *
+ **************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mbgclock
+
+#if !defined( _MBG_TRACE_LX_H ) || defined( TRACE_HEADER_MULTI_READ )
+#define _MBG_TRACE_LX_H
+
+
+/* Other headers to be included */
+
+#include <mbgpccyc.h>
+
+#include <linux/kdev_t.h>
+#include <linux/tracepoint.h>
+
+
+/* Start of header body */
+
+// Start of a device command, or of a write command via pcps_write().
+DECLARE_EVENT_CLASS( mbgclock_cmd_start_class,
+
+  TP_PROTO( dev_t dev, uint8_t cmd, uint16_t count ),
+
+  TP_ARGS( dev, cmd, count ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( uint8_t, cmd )
+    __field( uint16_t, count )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->cmd = cmd;
+    __entry->count = count;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d cmd=0x%02X count=%u cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->cmd, __entry->count, (long long) __entry->cycles )
+);
+
+
+// Completion of a device command, or of a write command via pcps_write().
+DECLARE_EVENT_CLASS( mbgclock_cmd_end_class,
+
+  TP_PROTO( dev_t dev, uint8_t cmd, uint16_t count, int rc ),
+
+  TP_ARGS( dev, cmd, count, rc ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( uint8_t, cmd )
+    __field( uint16_t, count )
+    __field( int, rc )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->cmd = cmd;
+    __entry->count = count;
+    __entry->rc = rc;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d cmd=0x%02X count=%u rc=%d cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->cmd, __entry->count, __entry->rc,
+             (long long) __entry->cycles )
+);
+
+
+DEFINE_EVENT( mbgclock_cmd_start_class, mbgclock_cmd_start,
+  TP_PROTO( dev_t dev, uint8_t cmd, uint16_t count ),
+  TP_ARGS( dev, cmd, count )
+);
+
+DEFINE_EVENT( mbgclock_cmd_end_class, mbgclock_cmd_end,
+  TP_PROTO( dev_t dev, uint8_t cmd, uint16_t count, int rc ),
+  TP_ARGS( dev, cmd, count, rc )
+);
+
+DEFINE_EVENT( mbgclock_cmd_start_class, mbgclock_write_start,
+  TP_PROTO( dev_t dev, uint8_t cmd, uint16_t count ),
+  TP_ARGS( dev, cmd, count )
+);
+
+DEFINE_EVENT( mbgclock_cmd_end_class, mbgclock_write_end,
+  TP_PROTO( dev_t dev, uint8_t cmd, uint16_t count, int rc ),
+  TP_ARGS( dev, cmd, count, rc )
+);
+
+
+
+// Entry to the IRQ handler.
+TRACE_EVENT( mbgclock_irq_entry,
+
+  TP_PROTO( dev_t dev, int hw_irq ),
+
+  TP_ARGS( dev, hw_irq ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( int, hw_irq )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->hw_irq = hw_irq;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d irq=%d cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->hw_irq, (long long) __entry->cycles )
+);
+
+
+// Exit from the IRQ handler. If the device was busy, the time
+// has not been read, and rc is meaningless.
+TRACE_EVENT( mbgclock_irq_exit,
+
+  TP_PROTO( dev_t dev, int busy, int rc ),
+
+  TP_ARGS( dev, busy, rc ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( int, busy )
+    __field( int, rc )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->busy = busy;
+    __entry->rc = rc;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d busy=%d rc=%d cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->busy, __entry->rc, (long long) __entry->cycles )
+);
+
+
+
+// Dispatch of an IOCTL call, after the privilege check.
+TRACE_EVENT( mbgclock_ioctl,
+
+  TP_PROTO( dev_t dev, unsigned int ioctl_code ),
+
+  TP_ARGS( dev, ioctl_code ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( unsigned int, ioctl_code )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->ioctl_code = ioctl_code;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d code=0x%08X nr=0x%02X cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->ioctl_code, _IOC_NR( __entry->ioctl_code ),
+             (long long) __entry->cycles )
+);
+
+
+
+// Start of a USB bulk transfer to or from the endpoint with address ep.
+TRACE_EVENT( mbgclock_usb_xfer_start,
+
+  TP_PROTO( dev_t dev, unsigned int ep, int len, int timeout ),
+
+  TP_ARGS( dev, ep, len, timeout ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( unsigned int, ep )
+    __field( int, len )
+    __field( int, timeout )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->ep = ep;
+    __entry->len = len;
+    __entry->timeout = timeout;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d ep=0x%02X len=%d timeout=%d cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->ep, __entry->len, __entry->timeout,
+             (long long) __entry->cycles )
+);
+
+
+// Completion of a USB bulk transfer. rc is the number of bytes
+// which have actually been transferred, or one of the MBG_ERROR_CODES.
+TRACE_EVENT( mbgclock_usb_xfer_end,
+
+  TP_PROTO( dev_t dev, unsigned int ep, int rc ),
+
+  TP_ARGS( dev, ep, rc ),
+
+  TP_STRUCT__entry(
+    __field( dev_t, dev )
+    __field( unsigned int, ep )
+    __field( int, rc )
+    __field( MBG_PC_CYCLES, cycles )
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->ep = ep;
+    __entry->rc = rc;
+    mbg_get_pc_cycles( &__entry->cycles );
+  ),
+
+  TP_printk( "dev=%d:%d ep=0x%02X rc=%d cycles=%lld",
+             MAJOR( __entry->dev ), MINOR( __entry->dev ),
+             __entry->ep, __entry->rc, (long long) __entry->cycles )
+);
+
+
+/* End of header body */
+
+#endif  /* _MBG_TRACE_LX_H */
+
+
+// This part must be outside the include guard. The header is
+// located in the driver's include directory, which is in the
+// compiler's include path.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mbg_trace_lx
+
+#include <trace/define_trace.h>
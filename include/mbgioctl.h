@@ -479,6 +479,383 @@ typedef struct
 
 
 
+/**
+ * @brief Status structures which can be served from a status snapshot
+ *
+ * If the kernel driver supports it, the structures listed here can be read
+ * periodically by a background worker in the driver, and the associated
+ * IOCTL calls are then served from memory instead of accessing the device.
+ *
+ * @see ::MBG_STATUS_SNAPSHOT_ITEM_MASKS
+ * @see ::MBG_STATUS_SNAPSHOT_INFO
+ */
+enum MBG_STATUS_SNAPSHOT_ITEMS
+{
+  MBG_SNAPSHOT_BVAR_STAT,          ///< ::BVAR_STAT, see ::IOCTL_GET_GPS_BVAR_STAT
+  MBG_SNAPSHOT_PTP_STATE,          ///< ::PTP_STATE, see ::IOCTL_GET_PTP_STATE
+  MBG_SNAPSHOT_IRIG_CTRL_BITS,     ///< ::MBG_IRIG_CTRL_BITS, see ::IOCTL_GET_IRIG_CTRL_BITS
+  MBG_SNAPSHOT_ALL_XMR_STATUS,     ///< n * ::XMULTI_REF_STATUS_IDX, see ::PC_GPS_ALL_XMR_STATUS
+  MBG_SNAPSHOT_ALL_GNSS_SAT_INFO,  ///< n * ::GNSS_SAT_INFO_IDX, see ::PC_GPS_ALL_GNSS_SAT_INFO
+  N_MBG_SNAPSHOT_ITEMS             ///< The number of known items
+};
+
+
+/**
+ * @brief Bit masks associated with ::MBG_STATUS_SNAPSHOT_ITEMS
+ *
+ * @see ::MBG_STATUS_SNAPSHOT_ITEMS
+ */
+enum MBG_STATUS_SNAPSHOT_ITEM_MASKS
+{
+  MBG_SNAPSHOT_MSK_BVAR_STAT         = ( 1UL << MBG_SNAPSHOT_BVAR_STAT ),          ///< See ::MBG_SNAPSHOT_BVAR_STAT
+  MBG_SNAPSHOT_MSK_PTP_STATE         = ( 1UL << MBG_SNAPSHOT_PTP_STATE ),          ///< See ::MBG_SNAPSHOT_PTP_STATE
+  MBG_SNAPSHOT_MSK_IRIG_CTRL_BITS    = ( 1UL << MBG_SNAPSHOT_IRIG_CTRL_BITS ),     ///< See ::MBG_SNAPSHOT_IRIG_CTRL_BITS
+  MBG_SNAPSHOT_MSK_ALL_XMR_STATUS    = ( 1UL << MBG_SNAPSHOT_ALL_XMR_STATUS ),     ///< See ::MBG_SNAPSHOT_ALL_XMR_STATUS
+  MBG_SNAPSHOT_MSK_ALL_GNSS_SAT_INFO = ( 1UL << MBG_SNAPSHOT_ALL_GNSS_SAT_INFO )   ///< See ::MBG_SNAPSHOT_ALL_GNSS_SAT_INFO
+};
+
+#define MBG_SNAPSHOT_MSK_ALL  ( ( 1UL << N_MBG_SNAPSHOT_ITEMS ) - 1 )
+
+
+/**
+ * @brief Information on the status snapshot of a device
+ *
+ * The data returned by an IOCTL call which is served from a snapshot
+ * is as old as reported in ::MBG_STATUS_SNAPSHOT_INFO::age_ms.
+ * If ::MBG_STATUS_SNAPSHOT_INFO::seq is the same before and after such call
+ * then the data has been taken from the snapshot described here.
+ *
+ * @see ::IOCTL_GET_STATUS_SNAPSHOT_INFO
+ */
+typedef struct
+{
+  uint32_t supp_items;   ///< Items refreshed for the device, see ::MBG_STATUS_SNAPSHOT_ITEM_MASKS
+  uint32_t valid_items;  ///< Items valid in the current snapshot, see ::MBG_STATUS_SNAPSHOT_ITEM_MASKS
+  uint32_t intv_ms;      ///< Refresh interval [ms]
+  uint32_t age_ms;       ///< Age of the current snapshot [ms]
+  uint32_t seq;          ///< Incremented whenever a new snapshot has become current
+  uint32_t n_errors;     ///< Number of item reads that failed since the snapshotter has been started
+  uint32_t reserved_0;   ///< Reserved, currently always 0
+  uint32_t reserved_1;   ///< Reserved, currently always 0
+
+} MBG_STATUS_SNAPSHOT_INFO;
+
+
+#if !defined( MBG_IOCTL_BATCH_MAX_ENTRIES )
+  /// The max. number of entries of an ::IOCTL_PCPS_BATCH request
+  #define MBG_IOCTL_BATCH_MAX_ENTRIES  32
+#endif
+
+#if !defined( MBG_IOCTL_BATCH_MAX_OUT_SIZE )
+  /// The max. total size of the output buffers of an ::IOCTL_PCPS_BATCH request
+  #define MBG_IOCTL_BATCH_MAX_OUT_SIZE  0x10000UL
+#endif
+
+
+/**
+ * @brief An entry of an ::IOCTL_PCPS_BATCH request
+ *
+ * Only IOCTL codes that just return a data structure of fixed size
+ * can be used, and ::MBG_IOCTL_BATCH_ENTRY::out_sz has to match the size
+ * of the data structure. The address of the output buffer is passed as
+ * 64 bit number, as in ::IOCTL_GENERIC_REQ.
+ *
+ * @see ::MBG_IOCTL_BATCH_REQ
+ */
+typedef struct
+{
+  uint32_t ioctl_code;  ///< The IOCTL code to be executed.
+  int32_t rc;           ///< Set by the driver to the return code of the IOCTL call.
+  uint64_t out_p;       ///< Address of the output buffer.
+  uint32_t out_sz;      ///< Size of the output buffer.
+  uint32_t reserved;    ///< Reserved, yet not used.
+
+} MBG_IOCTL_BATCH_ENTRY;
+
+
+/**
+ * @brief A request to execute several IOCTL calls at once
+ *
+ * The driver executes the entries in the order given, while the
+ * device mutex is held continuously, so the data returned by the
+ * entries is consistent, and IOCTL calls from other processes can't
+ * interfere. The return code of each entry is stored in
+ * ::MBG_IOCTL_BATCH_ENTRY::rc, and the return code of the batch
+ * request itself only indicates whether the request could be handled.
+ *
+ * The results are collected in a kernel buffer and only copied to
+ * the output buffers after the device mutex has been released, so the
+ * total size of the output buffers is limited to ::MBG_IOCTL_BATCH_MAX_OUT_SIZE.
+ *
+ * A batch is handled like a bulk-class command, but it never yields
+ * the device mutex to latency-class callers, because this would break
+ * the consistency of the results. So a latency-class caller may have
+ * to wait until all entries of a batch have been executed, and time
+ * critical applications should keep the number of entries small.
+ *
+ * @see ::IOCTL_PCPS_BATCH
+ * @see ::MBG_IOCTL_BATCH_ENTRY
+ */
+typedef struct
+{
+  uint64_t entries_p;   ///< Address of an array of ::MBG_IOCTL_BATCH_ENTRY.
+  uint32_t n_entries;   ///< Number of entries, at most ::MBG_IOCTL_BATCH_MAX_ENTRIES.
+  uint32_t flags;       ///< Reserved, currently always 0.
+
+} MBG_IOCTL_BATCH_REQ;
+
+
+
+/**
+ * @brief Payload of an io_uring command submitted to a device
+ *
+ * On Linux the IOCTL codes supported by the driver can also be submitted
+ * via io_uring as IORING_OP_URING_CMD, with the IOCTL code in the cmd_op
+ * field of the SQE, and this structure in the cmd field of the SQE.
+ * The result of the command is the return code of the equivalent
+ * ioctl() call.
+ */
+typedef struct
+{
+  uint64_t arg;       ///< Address of the IOCTL argument, as passed to ioctl().
+  uint64_t reserved;  ///< Reserved, currently always 0.
+
+} MBG_URING_CMD;
+
+
+
+/**
+ * @brief Flags used with ::MBG_ASYNC_REQ::flags
+ */
+enum MBG_ASYNC_REQ_FLAG_MASKS
+{
+  MBG_ASYNC_REQ_FLAG_WRITE = 0x0001  ///< Write data to the device, else read data from the device
+};
+
+
+/**
+ * @brief A GPS request to be executed asynchronously
+ *
+ * Submitted via ::IOCTL_ASYNC_SUBMIT. If a write request is submitted
+ * then the data is copied from ::MBG_ASYNC_REQ::in_p before the IOCTL
+ * call returns. The driver returns a ticket which has to be passed to
+ * ::IOCTL_ASYNC_FETCH to retrieve the result. poll() reports POLLPRI
+ * when a result is available. The number of requests a driver can hold
+ * for a device is limited, so the IOCTL call fails with EBUSY if too
+ * many results have not yet been fetched.
+ *
+ * @see ::IOCTL_ASYNC_SUBMIT
+ * @see ::MBG_ASYNC_RESULT
+ */
+typedef struct
+{
+  uint64_t in_p;      ///< Address of the data to be written, ignored for read requests.
+  uint32_t info;      ///< The GPS command code, see @ref PC_GPS_CMD_CODES.
+  uint32_t flags;     ///< See ::MBG_ASYNC_REQ_FLAG_MASKS.
+  uint32_t size;      ///< Number of bytes to be written or read.
+  uint32_t ticket;    ///< Set by the driver to identify the request.
+
+} MBG_ASYNC_REQ;
+
+
+/**
+ * @brief The result of an asynchronous GPS request
+ *
+ * Used with ::IOCTL_ASYNC_FETCH. If the request identified by
+ * ::MBG_ASYNC_RESULT::ticket has not yet been completed, the IOCTL call
+ * fails with EAGAIN. Otherwise ::MBG_ASYNC_RESULT::rc is set, the data
+ * of a read request is copied to ::MBG_ASYNC_RESULT::out_p, and the
+ * request is discarded.
+ *
+ * @see ::IOCTL_ASYNC_FETCH
+ * @see ::MBG_ASYNC_REQ
+ */
+typedef struct
+{
+  uint64_t out_p;     ///< Address of the output buffer for a read request.
+  uint32_t out_sz;    ///< Size of the output buffer, must not be less than ::MBG_ASYNC_REQ::size.
+  uint32_t ticket;    ///< The ticket returned by ::IOCTL_ASYNC_SUBMIT.
+  int32_t rc;         ///< Set by the driver, one of the @ref MBG_RETURN_CODES.
+  uint32_t reserved;  ///< Reserved, currently always 0.
+
+} MBG_ASYNC_RESULT;
+
+
+
+/**
+ * @brief A request to read a range of event log entries
+ *
+ * Used with ::IOCTL_GET_EVT_LOG_ENTRIES. The driver keeps a copy of the
+ * event log of a device, and only reads entries from the device which
+ * have been added since the log has been read before. Entries are
+ * indexed from the oldest entry, which has index 0.
+ *
+ * A caller which only wants to retrieve new entries can pass the value
+ * of ::MBG_EVT_LOG_BULK_REQ::n_total returned by a previous call
+ * as ::MBG_EVT_LOG_BULK_REQ::first_idx, provided the value of
+ * ::MBG_EVT_LOG_BULK_REQ::log_seq has not changed. Otherwise the log
+ * has been cleared or has wrapped around, and the entries have to be
+ * read again starting at index 0.
+ *
+ * @see ::IOCTL_GET_EVT_LOG_ENTRIES
+ * @see ::MBG_EVT_LOG_ENTRY
+ */
+typedef struct
+{
+  uint64_t out_p;        ///< Address of an array of ::MBG_EVT_LOG_ENTRY.
+  uint32_t max_entries;  ///< Number of entries the array can take.
+  uint32_t first_idx;    ///< Index of the first entry to be returned.
+  uint32_t n_entries;    ///< Set by the driver to the number of entries returned.
+  uint32_t n_total;      ///< Set by the driver to the number of entries in the log.
+  uint32_t log_seq;      ///< Set by the driver, changes if the log has been cleared or has wrapped around.
+  uint32_t reserved;     ///< Reserved, currently always 0.
+
+} MBG_EVT_LOG_BULK_REQ;
+
+
+
+/**
+ * @brief The offset to be passed to mmap() to map the user capture ring buffer
+ *
+ * @see ::MBG_UCAP_RING_HDR
+ */
+#define MBG_UCAP_RING_MMAP_OFFS   0x100000UL
+
+
+/**
+ * @brief Header of the user capture ring buffer of a device
+ *
+ * If the user capture drainer is enabled in the driver, capture events
+ * are moved periodically from the device's on-board FIFO to a large
+ * ring buffer of ::PCPS_HR_TIME structures. The status field of each
+ * entry is preserved as read from the device, so the ::PCPS_UCAP_BUFFER_FULL
+ * flag indicates that events have been lost on the device.
+ *
+ * The ring buffer can be mapped into user space via mmap() with offset
+ * ::MBG_UCAP_RING_MMAP_OFFS. The mapping has to be shared and writable,
+ * i.e. MAP_SHARED with PROT_READ | PROT_WRITE, since the consumer has to
+ * update the tail index. The ring starts with this header,
+ * and the entries start at ::MBG_UCAP_RING_HDR::entries_offs.
+ * The driver only writes ::MBG_UCAP_RING_HDR::head and the counters,
+ * and a single consumer reads the entries and then updates
+ * ::MBG_UCAP_RING_HDR::tail. Both indexes are free-running,
+ * and have to be masked with ::MBG_UCAP_RING_HDR::n_entries - 1.
+ *
+ * Alternatively the events can be read via ::IOCTL_GET_UCAP_EVENTS,
+ * and ::IOCTL_GET_PCPS_UCAP_EVENT is also served from the ring buffer
+ * if the drainer is enabled. Both methods must not be used concurrently
+ * with a consumer reading from the mapped ring buffer.
+ *
+ * @see ::MBG_UCAP_RING_MMAP_OFFS
+ * @see ::IOCTL_GET_UCAP_EVENTS
+ */
+typedef struct MBG_UCAP_RING_HDR_s
+{
+  uint32_t n_entries;     ///< Number of entries of the ring buffer, always a power of 2.
+  uint32_t entries_offs;  ///< Offset of the first entry from the start of the header.
+  uint32_t head;          ///< Index of the next entry to be written by the driver.
+  uint32_t tail;          ///< Index of the next entry to be read by the consumer.
+  uint32_t n_overruns;    ///< Number of events dropped because the ring buffer was full.
+  uint32_t n_fifo_full;   ///< Number of events read with ::PCPS_UCAP_BUFFER_FULL set.
+  uint32_t n_drained;     ///< Number of events moved from the device to the ring buffer.
+  uint32_t n_errors;      ///< Number of failed attempts to read from the device.
+
+} MBG_UCAP_RING_HDR;
+
+
+/**
+ * @brief A request to read several user capture events at once
+ *
+ * Used with ::IOCTL_GET_UCAP_EVENTS, which is only supported
+ * if the user capture drainer is enabled in the driver.
+ *
+ * @see ::MBG_UCAP_RING_HDR
+ */
+typedef struct
+{
+  uint64_t out_p;        ///< Address of an array of ::PCPS_HR_TIME.
+  uint32_t max_entries;  ///< Number of entries the array can take.
+  uint32_t n_entries;    ///< Set by the driver to the number of events returned.
+  uint32_t n_overruns;   ///< Set by the driver, see ::MBG_UCAP_RING_HDR::n_overruns.
+  uint32_t n_fifo_full;  ///< Set by the driver, see ::MBG_UCAP_RING_HDR::n_fifo_full.
+
+} MBG_UCAP_EVENTS_REQ;
+
+
+
+/**
+ * @brief Information on the device which has served a sample of the aggregate device
+ *
+ * The aggregate device /dev/mbgclock-agg reads the time from the
+ * healthiest device currently supported by the driver, and switches to
+ * a different device if the status of the selected one degrades.
+ *
+ * @see ::MBG_AGG_SAMPLE_FLAG_MASKS
+ * @see ::IOCTL_GET_AGG_TIME
+ * @see ::IOCTL_GET_AGG_HR_TIME
+ * @see ::IOCTL_GET_AGG_FAST_HR_TIMESTAMP
+ */
+typedef struct
+{
+  uint32_t dev_minor;       ///< Minor number N of the device /dev/mbgclockN which has served the sample.
+  uint32_t flags;           ///< See ::MBG_AGG_SAMPLE_FLAG_MASKS.
+  uint32_t n_switches;      ///< Number of times the serving device has changed since the driver has been loaded.
+  int32_t switch_offs_ns;   ///< Approx. offset [ns] of the serving device to the previous one, determined at the last switch.
+
+} MBG_AGG_SAMPLE_INFO;
+
+
+/**
+ * @brief Flag bits used with ::MBG_AGG_SAMPLE_INFO::flags
+ */
+enum MBG_AGG_SAMPLE_FLAG_MASKS
+{
+  MBG_AGG_SAMPLE_FLAG_SWITCHED   = 0x0001,  ///< The serving device has changed with this sample.
+  MBG_AGG_SAMPLE_FLAG_DEGRADED   = 0x0002,  ///< No synchronized device available, the sample is from the best one left.
+  MBG_AGG_SAMPLE_FLAG_OFFS_VALID = 0x0004   ///< ::MBG_AGG_SAMPLE_INFO::switch_offs_ns is valid.
+};
+
+
+/**
+ * @brief A ::PCPS_TIME read via the aggregate device
+ *
+ * @see ::IOCTL_GET_AGG_TIME
+ */
+typedef struct
+{
+  MBG_AGG_SAMPLE_INFO info;
+  PCPS_TIME t;
+
+} MBG_AGG_TIME;
+
+
+/**
+ * @brief A ::PCPS_HR_TIME read via the aggregate device
+ *
+ * @see ::IOCTL_GET_AGG_HR_TIME
+ */
+typedef struct
+{
+  MBG_AGG_SAMPLE_INFO info;
+  PCPS_HR_TIME t;
+
+} MBG_AGG_HR_TIME;
+
+
+/**
+ * @brief A fast ::PCPS_TIME_STAMP read via the aggregate device
+ *
+ * @see ::IOCTL_GET_AGG_FAST_HR_TIMESTAMP
+ */
+typedef struct
+{
+  MBG_AGG_SAMPLE_INFO info;
+  PCPS_TIME_STAMP tstamp;
+
+} MBG_AGG_FAST_HR_TIMESTAMP;
+
+
+
 typedef union
 {
   IOCTL_DEV_FEAT_REQ dev_feat_req;
@@ -729,6 +1106,19 @@ typedef union
 #define IOCTL_GET_ALL_GPIO_STATUS        _MBG_IOG( IOTYPE, 0xA3, IOCTL_GENERIC_REQ )  // variable size
 #define IOCTL_CHK_DEV_FEAT               _MBG_IOW( IOTYPE, 0xA4, IOCTL_DEV_FEAT_REQ )
 
+#define IOCTL_GET_STATUS_SNAPSHOT_INFO   _MBG_IOR( IOTYPE, 0xA5, MBG_STATUS_SNAPSHOT_INFO )
+#define IOCTL_PCPS_BATCH                 _MBG_IOW( IOTYPE, 0xA6, MBG_IOCTL_BATCH_REQ )
+#define IOCTL_ASYNC_SUBMIT               _MBG_IOW( IOTYPE, 0xA7, MBG_ASYNC_REQ )
+#define IOCTL_ASYNC_FETCH                _MBG_IOW( IOTYPE, 0xA8, MBG_ASYNC_RESULT )
+#define IOCTL_GET_EVT_LOG_ENTRIES        _MBG_IOW( IOTYPE, 0xA9, MBG_EVT_LOG_BULK_REQ )
+#define IOCTL_GET_UCAP_EVENTS            _MBG_IOW( IOTYPE, 0xAA, MBG_UCAP_EVENTS_REQ )
+#define IOCTL_GET_DEV_CAPS               _MBG_IOR( IOTYPE, 0xAB, MBG_DEV_CAPS )
+
+// The following codes are only supported by the aggregate device.
+#define IOCTL_GET_AGG_TIME               _MBG_IOR( IOTYPE, 0xAC, MBG_AGG_TIME )
+#define IOCTL_GET_AGG_HR_TIME            _MBG_IOR( IOTYPE, 0xAD, MBG_AGG_HR_TIME )
+#define IOCTL_GET_AGG_FAST_HR_TIMESTAMP  _MBG_IOR( IOTYPE, 0xAE, MBG_AGG_FAST_HR_TIMESTAMP )
+
 // The codes below are subject to changes without notice. They may be supported
 // by some kernel drivers, but usage is restricted to Meinberg software development.
 // Unrestricted usage may cause system malfunction !!
@@ -908,6 +1298,16 @@ typedef union
   _mbg_cn_table_entry( IOCTL_GET_XMR_HOLDOVER_STATUS ),        \
   _mbg_cn_table_entry( IOCTL_GET_ALL_GPIO_STATUS ),            \
   _mbg_cn_table_entry( IOCTL_CHK_DEV_FEAT ),                   \
+  _mbg_cn_table_entry( IOCTL_GET_STATUS_SNAPSHOT_INFO ),       \
+  _mbg_cn_table_entry( IOCTL_PCPS_BATCH ),                     \
+  _mbg_cn_table_entry( IOCTL_ASYNC_SUBMIT ),                   \
+  _mbg_cn_table_entry( IOCTL_ASYNC_FETCH ),                    \
+  _mbg_cn_table_entry( IOCTL_GET_EVT_LOG_ENTRIES ),            \
+  _mbg_cn_table_entry( IOCTL_GET_UCAP_EVENTS ),                \
+  _mbg_cn_table_entry( IOCTL_GET_DEV_CAPS ),                   \
+  _mbg_cn_table_entry( IOCTL_GET_AGG_TIME ),                   \
+  _mbg_cn_table_entry( IOCTL_GET_AGG_HR_TIME ),                \
+  _mbg_cn_table_entry( IOCTL_GET_AGG_FAST_HR_TIMESTAMP ),      \
                                                                \
   _mbg_cn_table_entry( IOCTL_MBG_DBG_GET_PORT_ADDR ),          \
   _mbg_cn_table_entry( IOCTL_MBG_DBG_SET_PORT_ADDR ),          \
@@ -958,24 +1358,26 @@ enum MBG_REQ_PRIVL
 #if defined( __GNUC__ )
 // Avoid "no previous prototype" with some gcc versions.
 static __mbg_inline
-int ioctl_get_required_privilege( ulong ioctl_code ) __attribute__((always_inline));
+int ioctl_is_latency_class( ulong ioctl_code ) __attribute__((always_inline));
 #endif
 
 /**
- * @brief Determine the privilege level required to execute a specific IOCTL command.
+ * @brief Check if an IOCTL command belongs to the latency class.
  *
- * @param ioctl_code The IOCTL code for which to return the privilege level
+ * Commands of the latency class read the current time from a device,
+ * and thus need to be executed with lowest latency. A driver may
+ * give such commands priority over other commands, e.g. over large
+ * data transfers which are split into several blocks.
  *
- * @return One of the enumerated privilege levels
- * @return -1 for unknown IOCTL codes
+ * @param ioctl_code The IOCTL code to be checked
+ *
+ * @return 1 if the command belongs to the latency class, else 0
+ *
+ * @see ::ioctl_get_required_privilege
  */
 static __mbg_inline
-int ioctl_get_required_privilege( ulong ioctl_code )
+int ioctl_is_latency_class( ulong ioctl_code )
 {
-  // To provide best maintainability the sequence of cases in ioctl_switch()
-  // should match the sequence of the cases here, which also makes sure
-  // commands requiring lowest latency are handled first.
-
   switch ( ioctl_code )
   {
     // Commands requiring lowest latency:
@@ -993,8 +1395,47 @@ int ioctl_get_required_privilege( ulong ioctl_code )
     case IOCTL_GET_GPS_UCAP:
     case IOCTL_GET_TIME_INFO_HRT:
     case IOCTL_GET_TIME_INFO_TSTAMP:
-      return MBG_REQ_PRIVL_NONE;
+    // Commands of the aggregate device:
+    case IOCTL_GET_AGG_TIME:
+    case IOCTL_GET_AGG_HR_TIME:
+    case IOCTL_GET_AGG_FAST_HR_TIMESTAMP:
+      return 1;
+
+  }  // switch
+
+  return 0;
+
+}  // ioctl_is_latency_class
+
 
+
+#if defined( __GNUC__ )
+// Avoid "no previous prototype" with some gcc versions.
+static __mbg_inline
+int ioctl_get_required_privilege( ulong ioctl_code ) __attribute__((always_inline));
+#endif
+
+/**
+ * @brief Determine the privilege level required to execute a specific IOCTL command.
+ *
+ * @param ioctl_code The IOCTL code for which to return the privilege level
+ *
+ * @return One of the enumerated privilege levels
+ * @return -1 for unknown IOCTL codes
+ */
+static __mbg_inline
+int ioctl_get_required_privilege( ulong ioctl_code )
+{
+  // To provide best maintainability the sequence of cases in ioctl_switch()
+  // should match the sequence of the cases here, which also makes sure
+  // commands requiring lowest latency are handled first.
+
+  // Commands requiring lowest latency, see ::ioctl_is_latency_class.
+  if ( ioctl_is_latency_class( ioctl_code ) )
+    return MBG_REQ_PRIVL_NONE;
+
+  switch ( ioctl_code )
+  {
     // Commands returning public status information:
     case IOCTL_GET_PCPS_DRVR_INFO:
     case IOCTL_GET_PCPS_DEV:
@@ -1008,6 +1449,7 @@ int ioctl_get_required_privilege( ulong ioctl_code )
     case IOCTL_GET_PCI_ASIC_VERSION:
     case IOCTL_GET_SYNTH_STATE:
     case IOCTL_GET_PCPS_UCAP_ENTRIES:
+    case IOCTL_GET_UCAP_EVENTS:
     case IOCTL_GET_PCI_ASIC_FEATURES:
     case IOCTL_GET_IRQ_STAT_INFO:
     case IOCTL_GET_CYCLES_FREQUENCY:
@@ -1019,12 +1461,18 @@ int ioctl_get_required_privilege( ulong ioctl_code )
     case IOCTL_GET_NUM_EVT_LOG_ENTRIES:
     case IOCTL_GET_FIRST_EVT_LOG_ENTRY:
     case IOCTL_GET_NEXT_EVT_LOG_ENTRY:
+    case IOCTL_GET_EVT_LOG_ENTRIES:
   #if _MBG_SUPP_VAR_ACC_SIZE
     case IOCTL_GET_ALL_GNSS_SAT_INFO:
   #endif
+    case IOCTL_GET_STATUS_SNAPSHOT_INFO:
+    case IOCTL_PCPS_BATCH:       // each entry is checked separately
+    case IOCTL_ASYNC_SUBMIT:     // write requests are checked separately
+    case IOCTL_ASYNC_FETCH:
       return MBG_REQ_PRIVL_NONE;
 
     // Commands returning device capabilities and features:
+    case IOCTL_GET_DEV_CAPS:
     case IOCTL_DEV_IS_GPS:
     case IOCTL_DEV_IS_DCF:
     case IOCTL_DEV_IS_MSF:
@@ -1344,6 +1344,94 @@ enum DEV_FEAT_TYPES
 
 
 
+/**
+ * @brief Device capabilities which can be retrieved at once
+ *
+ * Each capability corresponds to one of the IOCTL_DEV_IS_... or
+ * IOCTL_DEV_HAS_... codes, each of which only returns a single one.
+ * The capabilities are evaluated once when a device is probed.
+ *
+ * @see ::MBG_DEV_CAPS
+ */
+enum MBG_DEV_CAP_BITS
+{
+  MBG_DEV_CAP_IS_GPS,                ///< See ::IOCTL_DEV_IS_GPS
+  MBG_DEV_CAP_IS_DCF,                ///< See ::IOCTL_DEV_IS_DCF
+  MBG_DEV_CAP_IS_MSF,                ///< See ::IOCTL_DEV_IS_MSF
+  MBG_DEV_CAP_IS_WWVB,               ///< See ::IOCTL_DEV_IS_WWVB
+  MBG_DEV_CAP_IS_LWR,                ///< See ::IOCTL_DEV_IS_LWR
+  MBG_DEV_CAP_IS_GNSS,               ///< See ::IOCTL_DEV_IS_GNSS
+  MBG_DEV_CAP_IS_IRIG_RX,            ///< See ::IOCTL_DEV_IS_IRIG_RX
+  MBG_DEV_CAP_HAS_HR_TIME,           ///< See ::IOCTL_DEV_HAS_HR_TIME
+  MBG_DEV_CAP_HAS_CAB_LEN,           ///< See ::IOCTL_DEV_HAS_CAB_LEN
+  MBG_DEV_CAP_HAS_TZDL,              ///< See ::IOCTL_DEV_HAS_TZDL
+  MBG_DEV_CAP_HAS_PCPS_TZDL,         ///< See ::IOCTL_DEV_HAS_PCPS_TZDL
+  MBG_DEV_CAP_HAS_TZCODE,            ///< See ::IOCTL_DEV_HAS_TZCODE
+  MBG_DEV_CAP_HAS_TZ,                ///< See ::IOCTL_DEV_HAS_TZ
+  MBG_DEV_CAP_HAS_EVENT_TIME,        ///< See ::IOCTL_DEV_HAS_EVENT_TIME
+  MBG_DEV_CAP_HAS_RECEIVER_INFO,     ///< See ::IOCTL_DEV_HAS_RECEIVER_INFO
+  MBG_DEV_CAP_CAN_CLR_UCAP_BUFF,     ///< See ::IOCTL_DEV_CAN_CLR_UCAP_BUFF
+  MBG_DEV_CAP_HAS_UCAP,              ///< See ::IOCTL_DEV_HAS_UCAP
+  MBG_DEV_CAP_HAS_IRIG_TX,           ///< See ::IOCTL_DEV_HAS_IRIG_TX
+  MBG_DEV_CAP_HAS_SERIAL_HS,         ///< See ::IOCTL_DEV_HAS_SERIAL_HS
+  MBG_DEV_CAP_HAS_SIGNAL,            ///< See ::IOCTL_DEV_HAS_SIGNAL
+  MBG_DEV_CAP_HAS_MOD,               ///< See ::IOCTL_DEV_HAS_MOD
+  MBG_DEV_CAP_HAS_IRIG,              ///< See ::IOCTL_DEV_HAS_IRIG
+  MBG_DEV_CAP_HAS_REF_OFFS,          ///< See ::IOCTL_DEV_HAS_REF_OFFS
+  MBG_DEV_CAP_HAS_OPT_FLAGS,         ///< See ::IOCTL_DEV_HAS_OPT_FLAGS
+  MBG_DEV_CAP_HAS_GPS_DATA,          ///< See ::IOCTL_DEV_HAS_GPS_DATA
+  MBG_DEV_CAP_HAS_SYNTH,             ///< See ::IOCTL_DEV_HAS_SYNTH
+  MBG_DEV_CAP_HAS_GENERIC_IO,        ///< See ::IOCTL_DEV_HAS_GENERIC_IO
+  MBG_DEV_CAP_HAS_PCI_ASIC_FEATURES, ///< See ::IOCTL_DEV_HAS_PCI_ASIC_FEATURES
+  MBG_DEV_CAP_HAS_PCI_ASIC_VERSION,  ///< See ::IOCTL_DEV_HAS_PCI_ASIC_VERSION
+  MBG_DEV_CAP_HAS_FAST_HR_TIMESTAMP, ///< See ::IOCTL_DEV_HAS_FAST_HR_TIMESTAMP
+  MBG_DEV_CAP_HAS_GPS_TIME_SCALE,    ///< See ::IOCTL_DEV_HAS_GPS_TIME_SCALE
+  MBG_DEV_CAP_HAS_GPS_UTC_PARM,      ///< See ::IOCTL_DEV_HAS_GPS_UTC_PARM
+  MBG_DEV_CAP_HAS_IRIG_CTRL_BITS,    ///< See ::IOCTL_DEV_HAS_IRIG_CTRL_BITS
+  MBG_DEV_CAP_HAS_LAN_INTF,          ///< See ::IOCTL_DEV_HAS_LAN_INTF
+  MBG_DEV_CAP_IS_PTP,                ///< See ::IOCTL_DEV_IS_PTP
+  MBG_DEV_CAP_HAS_PTP,               ///< See ::IOCTL_DEV_HAS_PTP
+  MBG_DEV_CAP_HAS_IRIG_TIME,         ///< See ::IOCTL_DEV_HAS_IRIG_TIME
+  MBG_DEV_CAP_HAS_RAW_IRIG_DATA,     ///< See ::IOCTL_DEV_HAS_RAW_IRIG_DATA
+  MBG_DEV_CAP_HAS_PTP_UNICAST,       ///< See ::IOCTL_DEV_HAS_PTP_UNICAST
+  MBG_DEV_CAP_HAS_PZF,               ///< See ::IOCTL_DEV_HAS_PZF
+  MBG_DEV_CAP_HAS_CORR_INFO,         ///< See ::IOCTL_DEV_HAS_CORR_INFO
+  MBG_DEV_CAP_HAS_TR_DISTANCE,       ///< See ::IOCTL_DEV_HAS_TR_DISTANCE
+  MBG_DEV_CAP_HAS_DEBUG_STATUS,      ///< See ::IOCTL_DEV_HAS_DEBUG_STATUS
+  MBG_DEV_CAP_HAS_EVT_LOG,           ///< See ::IOCTL_DEV_HAS_EVT_LOG
+  MBG_DEV_CAP_HAS_GPIO,              ///< See ::IOCTL_DEV_HAS_GPIO
+  MBG_DEV_CAP_HAS_XMR,               ///< See ::IOCTL_DEV_HAS_XMR
+  N_MBG_DEV_CAP_BITS
+};
+
+
+/// The number of 32 bit words of ::MBG_DEV_CAPS::bits, leaving room for new capabilities.
+#define MBG_DEV_CAPS_N_WORDS  4
+
+
+/**
+ * @brief A bit mask of the capabilities of a device
+ *
+ * Returned by ::IOCTL_GET_DEV_CAPS.
+ *
+ * @see ::MBG_DEV_CAP_BITS
+ */
+typedef struct
+{
+  uint32_t n_bits;                        ///< Number of capabilities known by the driver, i.e. ::N_MBG_DEV_CAP_BITS
+  uint32_t reserved;                      ///< Reserved, currently always 0
+  uint32_t bits[MBG_DEV_CAPS_N_WORDS];    ///< Bit n is set if capability n is supported, see ::MBG_DEV_CAP_BITS
+
+} MBG_DEV_CAPS;
+
+#define _mbg_dev_cap_set( _p, _n ) \
+  (_p)->bits[(_n) / 32] |= ( 1UL << ( (_n) % 32 ) )
+
+#define _mbg_dev_cap_is_set( _p, _n ) \
+  ( ( (_p)->bits[(_n) / 32] & ( 1UL << ( (_n) % 32 ) ) ) != 0 )
+
+
+
 /**
  * @brief Device driver information
  *
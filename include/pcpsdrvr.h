@@ -290,6 +290,70 @@
   #define USE_LOCAL_IO_BUFFER  0
 #endif
 
+#if !defined( USE_IO_BUFFER_POOL )
+  // On Linux the IOCTL read functions use DMA-capable I/O buffers
+  // from a small per-device pool rather than the shared buffer in the
+  // device structure, so the data can be copied to user space after
+  // the device mutex has been released.
+  #if defined( MBG_TGT_LINUX ) && !USE_LOCAL_IO_BUFFER
+    #define USE_IO_BUFFER_POOL  1
+  #else
+    #define USE_IO_BUFFER_POOL  0
+  #endif
+#endif
+
+#if !defined( PCPS_IOB_POOL_SIZE )
+  #define PCPS_IOB_POOL_SIZE  4
+#endif
+
+#if !defined( USE_PCPS_PRIO_LANES )
+  // On Linux a large data transfer which is split into several blocks
+  // temporarily releases the device mutex between 2 blocks if a caller
+  // requiring low latency is waiting to access the device.
+  #if defined( MBG_TGT_LINUX )
+    #define USE_PCPS_PRIO_LANES  1
+  #else
+    #define USE_PCPS_PRIO_LANES  0
+  #endif
+#endif
+
+#if !defined( PCPS_LANE_MAX_YIELDS )
+  // The max. number of times a single bulk transfer releases the
+  // device mutex, which limits the delay of the bulk transfer.
+  #define PCPS_LANE_MAX_YIELDS  8
+#endif
+
+#if !defined( PCPS_ASYNC_MAX_PENDING )
+  // The max. number of asynchronous requests held for a device.
+  #define PCPS_ASYNC_MAX_PENDING  8
+#endif
+
+#if !defined( USE_PCPS_EVT_LOG_MIRROR )
+  // On Linux the driver keeps a copy of the entries of a device's
+  // on-board event log, so only new entries have to be read from
+  // the device, see ::IOCTL_GET_EVT_LOG_ENTRIES.
+  #if defined( MBG_TGT_LINUX )
+    #define USE_PCPS_EVT_LOG_MIRROR  1
+  #else
+    #define USE_PCPS_EVT_LOG_MIRROR  0
+  #endif
+#endif
+
+#if !defined( PCPS_EVT_LOG_MIRROR_MAX_ENTRIES )
+  // The max. number of event log entries kept by the driver.
+  #define PCPS_EVT_LOG_MIRROR_MAX_ENTRIES  16384
+#endif
+
+#if !defined( USE_PCPS_IOCTL_BATCH )
+  // On Linux a batch of IOCTL read requests can be executed while
+  // the device mutex is held continuously, see ::IOCTL_PCPS_BATCH.
+  #if defined( MBG_TGT_LINUX )
+    #define USE_PCPS_IOCTL_BATCH  1
+  #else
+    #define USE_PCPS_IOCTL_BATCH  0
+  #endif
+#endif
+
 #if defined( MBG_TGT_NETWARE )
   #define _DEFAULT_PCPS_USE_CLOCK_TICK  1
   #define _DEFAULT_PCPS_USE_ISA         1
@@ -404,6 +468,81 @@
 
 #define _PCPS_USE_PNP           ( _PCPS_USE_PCI_PNP || _PCPS_USE_ISA_PNP || _PCPS_USE_USB )
 
+#ifndef _PCPS_USE_STATUS_SNAPSHOT
+  // The background status snapshotter is only implemented for Linux.
+  #define _PCPS_USE_STATUS_SNAPSHOT  0
+#endif
+
+#ifndef _PCPS_USE_IOCTL_MEMPOOL
+  // Mempools for generic IOCTL buffers are only implemented for Linux.
+  #define _PCPS_USE_IOCTL_MEMPOOL  0
+#endif
+
+#ifndef _PCPS_USE_URING_CMD
+  // io_uring command passthrough is only implemented for Linux.
+  #define _PCPS_USE_URING_CMD  0
+#endif
+
+#ifndef _PCPS_USE_ASYNC_REQ
+  // Asynchronous GPS requests are only implemented for Linux.
+  #define _PCPS_USE_ASYNC_REQ  0
+#endif
+
+#ifndef _PCPS_USE_UCAP_RING
+  // The user capture drainer is only implemented for Linux.
+  #define _PCPS_USE_UCAP_RING  0
+#endif
+
+#ifndef _PCPS_USE_PTP_CLOCK
+  // PTP hardware clock support is only implemented for Linux.
+  #define _PCPS_USE_PTP_CLOCK  0
+#endif
+
+#ifndef _PCPS_USE_USB_URB
+  // Pipelined USB transfers are only implemented for Linux.
+  #define _PCPS_USE_USB_URB  0
+#endif
+
+#ifndef _PCPS_USE_USB_LATENCY_COMP
+  // USB latency compensation is implemented separately for Windows.
+  #define _PCPS_USE_USB_LATENCY_COMP  0
+#endif
+
+#ifndef _PCPS_USE_ASYNC_PROBE
+  // Deferred probing is only implemented for Linux.
+  #define _PCPS_USE_ASYNC_PROBE  0
+#endif
+
+#ifndef _PCPS_USE_LAZY_EXT_FEAT
+  // Other targets read the extended features when the device is probed.
+  #define _PCPS_USE_LAZY_EXT_FEAT  0
+#endif
+
+#ifndef _PCPS_USE_AGG_DEV
+  // The aggregate device is only implemented for Linux.
+  #define _PCPS_USE_AGG_DEV  0
+#endif
+
+#ifndef _PCPS_USE_SYSFS_ATTR
+  // Sysfs attributes are only implemented for Linux.
+  #define _PCPS_USE_SYSFS_ATTR  0
+#endif
+
+#ifndef _PCPS_USE_DEV_STATS
+  // Device statistics are only implemented for Linux.
+  #define _PCPS_USE_DEV_STATS  0
+#endif
+
+#ifndef _PCPS_USE_TRACEPOINTS
+  // Tracepoints are only implemented for Linux.
+  #define _PCPS_USE_TRACEPOINTS  0
+#endif
+
+#ifndef _PCPS_USE_DBG_KEYS
+  // Runtime debug switches are only implemented for Linux.
+  #define _PCPS_USE_DBG_KEYS  0
+#endif
+
 #if _PCPS_USE_PCI_PNP && _PCPS_USE_PCI_BIOS
   #error "PCI PNP and non-PNP can't be used at the same time"
 #endif
@@ -426,6 +565,12 @@
   #define DEBUG_USB_IO  0
 #endif
 
+#if !defined( USE_DEBUG_USB_IO )
+  // Include code to report details of USB transfers,
+  // see ::pcps_direct_usb_transfer.
+  #define USE_DEBUG_USB_IO  ( ( DEBUG_USB_IO > 2 ) || _PCPS_USE_DBG_KEYS )
+#endif
+
 #if !defined( DEBUG_IOCTL )
   #define DEBUG_IOCTL  0
 #endif
@@ -469,6 +614,14 @@
   #if _PCPS_USE_USB
     #include <linux/usb.h>
   #endif
+
+  #if _PCPS_USE_USB_URB
+    #include <linux/completion.h>
+  #endif
+
+  #if _PCPS_USE_TRACEPOINTS
+    #include <mbg_trace_lx.h>
+  #endif
 #endif
 
 #if defined( MBG_TGT_QNX )
@@ -566,21 +719,61 @@ _ext const char driver_name[]
   // are only required to prevent interference with the IRQ handler
   // under Linux which implements the serial port emulation for the
   // NTP parse driver.
-  #define _pcps_sem_inc( _pddev )                          \
-  {                                                        \
-    ulong flags;                                           \
-                                                           \
-    if ( _mbg_mutex_acquire( &(_pddev)->dev_mutex ) < 0 )  \
-      return -ERESTARTSYS;                                 \
-                                                           \
-    spin_lock_irqsave( &(_pddev)->irq_lock, flags );       \
-    atomic_inc( &(_pddev)->access_in_progress );           \
-    spin_unlock_irqrestore( &(_pddev)->irq_lock, flags );  \
+  // While an IOCTL batch is being executed the device mutex
+  // is held by the task executing the batch, so the mutex must
+  // not be acquired or released again for the single entries.
+  #if USE_PCPS_IOCTL_BATCH
+    #define _pcps_is_batch_owner( _pddev )  ( (_pddev)->batch_owner == current )
+  #else
+    #define _pcps_is_batch_owner( _pddev )  0
+  #endif
+
+  // A task which has released the device mutex temporarily in
+  // ::pcps_lane_yield may be interrupted while waiting to get the
+  // mutex back, so the task holding the mutex is saved, and
+  // _pcps_sem_dec() only releases the mutex if the current task
+  // still holds it.
+  #if USE_PCPS_PRIO_LANES
+    #define _pcps_lane_set_owner( _pddev )  (_pddev)->lane_owner = current
+    #define _pcps_lane_is_owner( _pddev )   ( (_pddev)->lane_owner == current )
+    #define _pcps_lane_clr_yield( _pddev )  \
+      (_pddev)->lane_may_yield = 0;         \
+      (_pddev)->lane_owner = NULL
+  #else
+    #define _pcps_lane_set_owner( _pddev )  _nop_macro_fnc()
+    #define _pcps_lane_is_owner( _pddev )   1
+    #define _pcps_lane_clr_yield( _pddev )  _nop_macro_fnc()
+  #endif
+
+  #define _pcps_sem_inc( _pddev )                              \
+  {                                                            \
+    ulong flags;                                               \
+                                                               \
+    if ( !_pcps_is_batch_owner( _pddev ) )                     \
+    {                                                          \
+      if ( _mbg_mutex_acquire( &(_pddev)->dev_mutex ) < 0 )    \
+        return -ERESTARTSYS;                                   \
+                                                               \
+      _pcps_lane_set_owner( _pddev );                          \
+    }                                                          \
+                                                               \
+    spin_lock_irqsave( &(_pddev)->irq_lock, flags );           \
+    atomic_inc( &(_pddev)->access_in_progress );               \
+    spin_unlock_irqrestore( &(_pddev)->irq_lock, flags );      \
   }
 
-  #define _pcps_sem_dec( _pddev )                 \
-    atomic_dec( &(_pddev)->access_in_progress );  \
-    _mbg_mutex_release( &(_pddev)->dev_mutex )
+  #define _pcps_sem_dec( _pddev )                     \
+  do                                                  \
+  {                                                   \
+    if ( _pcps_is_batch_owner( _pddev ) )             \
+      atomic_dec( &(_pddev)->access_in_progress );    \
+    else if ( _pcps_lane_is_owner( _pddev ) )         \
+    {                                                 \
+      _pcps_lane_clr_yield( _pddev );                 \
+      atomic_dec( &(_pddev)->access_in_progress );    \
+      _mbg_mutex_release( &(_pddev)->dev_mutex );     \
+    }                                                 \
+  } while ( 0 )
 
 #elif defined( MBG_TGT_FREEBSD )
 
@@ -718,30 +911,6 @@ bool is_ep_rcv( uint8_t ep )
 
 
 
-#if defined( MBG_TGT_LINUX )
-
-  // definitions used to control the cyclic USB read thread
-
-  #if _PCPS_USE_LINUX_KTHREAD
-
-    // Used by kthread_run() / kthread_stop()
-    typedef struct task_struct *PCPS_THREAD_INFO;
-
-  #else
-
-    // Used by kernel_thread() / daemonize() / kill_proc()
-    typedef struct
-    {
-      pid_t pid;
-      char name[17];   // 16 chars as supported by the kernel, plus trailing 0
-      struct completion exit;
-
-    } PCPS_THREAD_INFO;
-
-  #endif  // _PCPS_USE_LINUX_KTHREAD
-
-#endif  // defined( MBG_TGT_LINUX )
-
 #endif  // _PCPS_USE_USB
 
 
@@ -769,6 +938,223 @@ typedef union
 
 
 
+#if _PCPS_USE_STATUS_SNAPSHOT
+
+/**
+ * @brief A set of status structures read periodically by a background worker
+ *
+ * Two of these buffers are kept for each device where the snapshotter is
+ * enabled. The worker refills the inactive buffer and then makes it the
+ * current one, so readers can be served from memory without accessing
+ * the device.
+ *
+ * @see ::MBG_STATUS_SNAPSHOT_ITEMS
+ */
+typedef struct
+{
+  unsigned long jiffies_updated;  ///< Time when the snapshot was completed.
+  uint32_t valid_items;           ///< Items read successfully, see ::MBG_STATUS_SNAPSHOT_ITEM_MASKS.
+
+  BVAR_STAT bvar_stat;
+  PTP_STATE ptp_state;
+  MBG_IRIG_CTRL_BITS irig_ctrl_bits;
+  ALL_XMULTI_REF_STATUS_IDX all_xmulti_ref_status_idx;
+  ALL_GNSS_SAT_INFO_IDX all_gnss_sat_info_idx;
+
+} PCPS_STATUS_SNAPSHOT;
+
+#endif  // _PCPS_USE_STATUS_SNAPSHOT
+
+
+
+#if _PCPS_USE_ASYNC_REQ
+
+/**
+ * @brief States of a ::PCPS_ASYNC_REQ slot
+ */
+enum PCPS_ASYNC_REQ_STATES
+{
+  PCPS_ASYNC_REQ_FREE,    ///< The slot is not in use.
+  PCPS_ASYNC_REQ_QUEUED,  ///< The request is waiting to be executed.
+  PCPS_ASYNC_REQ_BUSY,    ///< The request is being executed.
+  PCPS_ASYNC_REQ_DONE     ///< The request has been executed, the result can be fetched.
+};
+
+
+/**
+ * @brief An asynchronous GPS request queued for a device
+ *
+ * The request is executed by a per-device work item, and the
+ * result is kept until the process which submitted the request
+ * fetches it, or closes the device.
+ *
+ * @see ::MBG_ASYNC_REQ
+ * @see ::MBG_ASYNC_RESULT
+ */
+typedef struct
+{
+  struct file *filp;  ///< The file the request has been submitted with, NULL if the submitter has gone.
+  void *buf;          ///< Buffer with the data to be written or read.
+  uint32_t ticket;    ///< Ticket returned to the submitter, see ::MBG_ASYNC_REQ::ticket.
+  int state;          ///< See ::PCPS_ASYNC_REQ_STATES.
+  int rc;             ///< The result, one of the @ref MBG_RETURN_CODES.
+  uint16_t size;      ///< Number of bytes to be written or read.
+  uint8_t cmd;        ///< One of the @ref PC_GPS_CMD_CODES.
+  uint8_t is_write;   ///< Flag indicating a write request.
+
+} PCPS_ASYNC_REQ;
+
+#endif  // _PCPS_USE_ASYNC_REQ
+
+
+
+#if _PCPS_USE_DEV_STATS
+
+/**
+ * @brief Number of IOCTL codes which are counted separately
+ *
+ * IOCTL codes are counted by their _IOC_NR() number.
+ */
+#define PCPS_STATS_N_IOCTL_NR     256
+
+/**
+ * @brief Number of buckets of the device command latency histogram
+ *
+ * Bucket 0 counts commands which took less than 1 us, and bucket n
+ * commands which took less than 2^n us. The last bucket counts all
+ * commands which took even longer.
+ */
+#define PCPS_STATS_N_LAT_BUCKETS  18
+
+/**
+ * @brief Statistics counters of a device
+ *
+ * An instance of this structure exists for each CPU, and the counters
+ * are only incremented on the local CPU, so no lock is required.
+ * The counters of all CPUs are summed up when the statistics are read.
+ *
+ * @see ::_pcps_stats_inc
+ */
+typedef struct
+{
+  unsigned long ioctl_cnt[PCPS_STATS_N_IOCTL_NR];        ///< Number of IOCTL calls, indexed by _IOC_NR() of the code
+  unsigned long cmd_lat_hist[PCPS_STATS_N_LAT_BUCKETS];  ///< Histogram of device command latencies, see ::PCPS_STATS_N_LAT_BUCKETS and ::PCPS_DBG_CMD_LAT
+  u64 cmd_lat_sum_ns;                                    ///< Sum of all device command latencies [ns], see ::PCPS_DBG_CMD_LAT
+  unsigned long cmd_timeouts;                            ///< Device commands which failed with ::MBG_ERR_TIMEOUT
+  unsigned long cmd_errors;                              ///< Device commands which failed with a different error
+  unsigned long usb_xfer_errors;                         ///< Failed USB transfers, including cyclic USB messages
+  unsigned long snapshot_hits;                           ///< Status requests served from the status snapshot
+  unsigned long snapshot_misses;                         ///< Status requests not served from an existing status snapshot
+
+} PCPS_DDEV_STATS;
+
+// Increment a statistics counter on the local CPU.
+#define _pcps_stats_inc( _pddev, _fld )        \
+do                                             \
+{                                              \
+  if ( (_pddev)->stats )                       \
+    this_cpu_inc( (_pddev)->stats->_fld );     \
+                                               \
+} while ( 0 )
+
+#else
+
+#define _pcps_stats_inc( _pddev, _fld )  _nop_macro_fnc()
+
+#endif  // _PCPS_USE_DEV_STATS
+
+
+
+// Record events at the tracepoints defined in mbg_trace_lx.h.
+// The device is identified by its device number.
+#if _PCPS_USE_TRACEPOINTS
+
+  #define _pcps_trace_cmd_start( _pddev, _cmd, _cnt ) \
+    trace_mbgclock_cmd_start( (_pddev)->lx_dev, (_cmd), (_cnt) )
+
+  #define _pcps_trace_cmd_end( _pddev, _cmd, _cnt, _rc ) \
+    trace_mbgclock_cmd_end( (_pddev)->lx_dev, (_cmd), (_cnt), (_rc) )
+
+  #define _pcps_trace_write_start( _pddev, _cmd, _cnt ) \
+    trace_mbgclock_write_start( (_pddev)->lx_dev, (_cmd), (_cnt) )
+
+  #define _pcps_trace_write_end( _pddev, _cmd, _cnt, _rc ) \
+    trace_mbgclock_write_end( (_pddev)->lx_dev, (_cmd), (_cnt), (_rc) )
+
+  #define _pcps_trace_irq_entry( _pddev, _irq ) \
+    trace_mbgclock_irq_entry( (_pddev)->lx_dev, (_irq) )
+
+  #define _pcps_trace_irq_exit( _pddev, _busy, _rc ) \
+    trace_mbgclock_irq_exit( (_pddev)->lx_dev, (_busy), (_rc) )
+
+  #define _pcps_trace_ioctl( _pddev, _code ) \
+    trace_mbgclock_ioctl( (_pddev)->lx_dev, (_code) )
+
+  #define _pcps_trace_usb_xfer_start( _pddev, _ep, _len, _timeout ) \
+    trace_mbgclock_usb_xfer_start( (_pddev)->lx_dev, (_ep), (_len), (_timeout) )
+
+  #define _pcps_trace_usb_xfer_end( _pddev, _ep, _rc ) \
+    trace_mbgclock_usb_xfer_end( (_pddev)->lx_dev, (_ep), (_rc) )
+
+#else
+
+  #define _pcps_trace_cmd_start( _pddev, _cmd, _cnt )                 _nop_macro_fnc()
+  #define _pcps_trace_cmd_end( _pddev, _cmd, _cnt, _rc )              _nop_macro_fnc()
+  #define _pcps_trace_write_start( _pddev, _cmd, _cnt )               _nop_macro_fnc()
+  #define _pcps_trace_write_end( _pddev, _cmd, _cnt, _rc )            _nop_macro_fnc()
+  #define _pcps_trace_irq_entry( _pddev, _irq )                       _nop_macro_fnc()
+  #define _pcps_trace_irq_exit( _pddev, _busy, _rc )                  _nop_macro_fnc()
+  #define _pcps_trace_ioctl( _pddev, _code )                          _nop_macro_fnc()
+  #define _pcps_trace_usb_xfer_start( _pddev, _ep, _len, _timeout )   _nop_macro_fnc()
+  #define _pcps_trace_usb_xfer_end( _pddev, _ep, _rc )                _nop_macro_fnc()
+
+#endif  // _PCPS_USE_TRACEPOINTS
+
+
+
+/**
+ * @brief Bit masks of debug code which can be enabled per device
+ *
+ * If ::_PCPS_USE_DBG_KEYS is set then the debug code is always
+ * compiled in, but is only executed for a device if the associated
+ * bit has been set, see ::pcps_set_dbg_flags. Otherwise the debug
+ * code is only compiled in if the associated DEBUG_... switch
+ * has been set at compile time.
+ *
+ * @see ::_pcps_ddev_dbg
+ */
+enum PCPS_DBG_FLAG_MASKS
+{
+  PCPS_DBG_IO            = 0x0001,  ///< Report commands and data, see DEBUG_IO
+  PCPS_DBG_IO_TIMING     = 0x0002,  ///< Report execution times of commands, see DEBUG_IO_TIMING
+  PCPS_DBG_ACCESS_TIMING = 0x0004,  ///< Report register access times, see DEBUG_ACCESS_TIMING
+  PCPS_DBG_SEM           = 0x0008,  ///< Report semaphore operations, see DEBUG_SEM
+  PCPS_DBG_USB_IO        = 0x0010,  ///< Report details of USB transfers, see DEBUG_USB_IO
+  PCPS_DBG_CMD_LAT       = 0x0020   ///< Measure the latencies of device commands for the statistics, see ::pcps_read_timed
+};
+
+#if _PCPS_USE_DBG_KEYS
+
+  // Enabled while the debug flags of at least one device are not 0,
+  // so debug code is skipped without even reading the flags otherwise.
+  DECLARE_STATIC_KEY_FALSE( pcps_dbg_key );
+
+  // Check if debug code selected by a combination of
+  // ::PCPS_DBG_FLAG_MASKS has been enabled for a device.
+  #define _pcps_ddev_dbg( _pddev, _msk )            \
+    ( static_branch_unlikely( &pcps_dbg_key ) &&    \
+      ( READ_ONCE( (_pddev)->dbg_flags ) & (_msk) ) )
+
+#else
+
+  // The debug code is only compiled in if it has been
+  // enabled at compile time, so always execute it.
+  #define _pcps_ddev_dbg( _pddev, _msk )  1
+
+#endif  // _PCPS_USE_DBG_KEYS
+
+
+
 struct PCPS_DDEV_s;
 typedef struct PCPS_DDEV_s PCPS_DDEV;
 
@@ -785,6 +1171,8 @@ struct PCPS_DDEV_s
   PCPS_DEV dev;             ///< Device info data that can be passed to user space.
 
   PCPS_READ_FNC *read;      ///< Pointer to the read function depending on the access mode.
+  bool ext_feat_read;       ///< The extended features have been read, see ::pcps_chk_ext_features.
+  MBG_DEV_CAPS dev_caps;    ///< Capabilities evaluated when the device has been probed, see ::MBG_DEV_CAP_BITS.
   uint access_mode;         ///< Access mode used for the device, depending on interface type. See ::PCPS_ACCESS_MODES.
   bool access_mode_forced;  ///< Flag indicating that the access mode was forced.
   MBG_IOPORT_ADDR_MAPPED status_port_offs;
@@ -875,8 +1263,52 @@ struct PCPS_DDEV_s
   #if defined( MBG_TGT_LINUX )
     atomic_t connected;               ///< Flag indicating if the device is "connected"
     atomic_t access_in_progress;      ///< Flag indicating if device access is currently in progress
+
+    #if USE_PCPS_PRIO_LANES
+      atomic_t n_lat_waiters;         ///< Number of latency-class callers waiting for the device mutex
+      int lane_may_yield;             ///< The mutex holder may release the mutex between blocks of a bulk transfer
+      struct task_struct *lane_owner; ///< Task holding the device mutex, see ::_pcps_sem_inc
+    #endif
+
+    #if USE_PCPS_IOCTL_BATCH
+      struct task_struct *batch_owner;  ///< Task executing an IOCTL batch, which holds the device mutex
+    #endif
+
+    #if USE_PCPS_EVT_LOG_MIRROR
+      MBG_EVT_LOG_ENTRY *evt_log_mirror;  ///< Copy of the device's event log, NULL if not yet read
+      uint32_t evt_log_mirror_size;       ///< Number of entries allocated for evt_log_mirror
+      uint32_t evt_log_n_mirrored;        ///< Number of entries in evt_log_mirror
+      uint32_t evt_log_seq;               ///< Incremented whenever entries in evt_log_mirror have been changed or dropped
+      uint32_t evt_log_n_dev;             ///< Number of entries of the device's log at the last update, 0 if unknown
+      MBG_EVT_LOG_ENTRY evt_log_first;    ///< Oldest entry of the device's log at the last update
+      atomic_t evt_log_cursor_gen;        ///< Incremented whenever the log read position may be changed by another caller
+      int evt_log_cursor_synced;          ///< Value of evt_log_cursor_gen while the read position was after the last mirrored entry
+      int evt_log_cursor_valid;           ///< Flag indicating evt_log_cursor_synced is valid
+      MBG_MUTEX evt_log_mutex;            ///< Serializes access to evt_log_mirror
+    #endif
+
+    #if _PCPS_USE_UCAP_RING
+      struct delayed_work ucap_drain_work;       ///< Work item moving capture events from the device to the ring
+      struct MBG_UCAP_RING_HDR_s *ucap_ring;     ///< Capture event ring buffer, NULL if the drainer is not running
+      PCPS_HR_TIME *ucap_ring_entries;           ///< The entries of the ring buffer
+      uint32_t ucap_ring_mask;                   ///< Number of entries of the ring buffer - 1
+      size_t ucap_ring_alloc_size;               ///< Size of the ring buffer including the header
+      unsigned long ucap_drain_intv;             ///< Drain interval [jiffies]
+      PCPS_IO_BUFFER *ucap_drain_iob;            ///< DMA-capable buffer, only used with the device mutex held
+      MBG_MUTEX ucap_ring_mutex;                 ///< Serializes consumers inside the driver
+    #endif
+
+    #if _PCPS_USE_PTP_CLOCK
+      struct ptp_clock *ptp_clock;               ///< PTP hardware clock, NULL if not registered
+      struct ptp_clock_info ptp_info;            ///< Capabilities and callbacks of the PTP hardware clock
+      unsigned long ptp_extts_mask;              ///< Bit mask of capture inputs enabled as extts channels
+    #endif
+
     atomic_t data_avail;              ///< Flag indicating if data has been made available by IRQ handler
     unsigned long jiffies_at_irq;     ///< Set by IRQ handler, used to check if cyclic IRQs still occur
+    uint32_t irq_cnt;                 ///< Number of cyclic IRQs or USB messages received, protected by irq_lock
+    uint32_t irq_err_cnt;             ///< Number of cyclic IRQs for which the time could not be read
+    uint32_t irq_busy_cnt;            ///< Number of cyclic IRQs which occurred while the device was accessed
     struct fasync_struct *fasyncptr;  ///< Used for asynchronous signalling when data is available
     PCPS_TIME t;                      ///< Date and time read by IRQ handler
 
@@ -894,9 +1326,70 @@ struct PCPS_DDEV_s
     #if _PCPS_USE_USB
       struct usb_device *udev;           ///< Linux USB device associated with this device
       struct usb_interface *intf;        ///< Linux USB interface associated with this device
-      PCPS_THREAD_INFO usb_read_thread;  ///< Kernel thread to receive cyclic USB messages
-      struct semaphore sem_usb_cyclic;   ///< Semaphore used for cyclic USB messages
-      PCPS_TIME t_cyc;                   ///< Buffer for the time read in cyclic USB messages
+      struct urb *cyc_urb;               ///< Continuously resubmitted URB to receive cyclic USB messages
+      PCPS_TIME *cyc_urb_buf;            ///< DMA-capable buffer for the time received by cyc_urb
+      atomic_t cyc_urb_active;           ///< Flag indicating cyc_urb has been submitted
+      atomic_t cyc_urb_halted;           ///< Flag indicating cyc_urb has been stopped by a stalled endpoint
+      int cyc_urb_n_errors;              ///< Number of consecutive failed transfers of cyc_urb
+    #endif
+
+    #if _PCPS_USE_USB_URB
+      struct urb *urb_out;               ///< Pre-allocated URB to send a command, NULL if not available
+      struct urb *urb_in;                ///< Pre-allocated URB to receive the response
+      uint8_t *urb_out_buf;              ///< Coherent transfer buffer of urb_out
+      uint8_t *urb_in_buf;               ///< Coherent transfer buffer of urb_in
+      struct usb_anchor urb_anchor;      ///< Anchor of the submitted URBs
+      struct completion urb_done;        ///< Completed when a pipelined transfer has finished
+    #endif
+
+    #if USE_IO_BUFFER_POOL
+      PCPS_IO_BUFFER *iob_pool[PCPS_IOB_POOL_SIZE];  ///< DMA-capable I/O buffers used by IOCTL read calls
+      unsigned long iob_pool_free;                   ///< Bit mask of pool buffers currently not in use
+      MBG_SPINLOCK iob_pool_lock;                    ///< Spinlock protecting iob_pool_free
+    #endif
+
+    #if _PCPS_USE_STATUS_SNAPSHOT
+      struct delayed_work snapshot_work;  ///< Work item refreshing the status snapshot
+      PCPS_STATUS_SNAPSHOT *snapshot;     ///< Array of 2 snapshot buffers, NULL if the snapshotter is not running
+      int snapshot_idx;                   ///< Index of the current snapshot buffer, protected by snapshot_mutex
+      MBG_MUTEX snapshot_mutex;           ///< Serializes readers of the current buffer and buffer switches
+      unsigned long snapshot_intv;        ///< Refresh interval [jiffies]
+      uint32_t snapshot_supp_items;       ///< Items refreshed for this device, see ::MBG_STATUS_SNAPSHOT_ITEM_MASKS
+      uint32_t snapshot_seq;              ///< Incremented whenever a new snapshot has become current
+      uint32_t snapshot_n_errors;         ///< Number of item reads that failed
+      uint16_t snapshot_n_xmr;            ///< Number of ::XMULTI_REF_STATUS_IDX in a snapshot
+      uint16_t snapshot_n_gnss;           ///< Number of ::GNSS_SAT_INFO_IDX in a snapshot
+    #endif
+
+    #if _PCPS_USE_ASYNC_REQ
+      struct work_struct async_work;                      ///< Work item executing asynchronous requests
+      PCPS_ASYNC_REQ async_req[PCPS_ASYNC_MAX_PENDING];   ///< Asynchronous requests, protected by async_lock
+      MBG_SPINLOCK async_lock;                            ///< Spinlock protecting async_req and async_ticket
+      uint32_t async_ticket;                              ///< The last ticket number which has been assigned
+    #endif
+
+    #if _PCPS_USE_ASYNC_PROBE
+      struct delayed_work probe_work;    ///< Work item probing a device which was not ready when detected
+      struct pci_dev *probe_pci_dev;     ///< The PCI device to be probed by probe_work
+      int probe_state;                   ///< See ::PCPS_PROBE_STATES
+      int probe_tries;                   ///< Number of deferred probe attempts
+    #endif
+
+    #if _PCPS_USE_SYSFS_ATTR
+      int numa_node;                     ///< NUMA node of the PCI or USB device, or NUMA_NO_NODE
+    #endif
+
+    #if _PCPS_USE_DEV_STATS
+      PCPS_DDEV_STATS __percpu *stats;   ///< Per-CPU statistics, NULL if not available
+      struct dentry *stats_dentry;       ///< debugfs directory of the device, NULL if not created
+    #endif
+
+    #if _PCPS_USE_DBG_KEYS
+      uint32_t dbg_flags;                ///< Enabled debug code, see ::PCPS_DBG_FLAG_MASKS and ::pcps_set_dbg_flags
+    #endif
+
+    #if _PCPS_USE_AGG_DEV
+      atomic_t agg_refs;                 ///< Number of references held by the aggregate device, see ::agg_forget_device
     #endif
   #endif
 
@@ -915,6 +1408,29 @@ struct PCPS_DDEV_s
 
 
 
+#if _PCPS_USE_ASYNC_PROBE
+
+/**
+ * @brief Codes used with ::PCPS_DDEV::probe_state
+ *
+ * A device which is not yet ready to be accessed when it is detected,
+ * e.g. a PTP270PEX card which is still booting, isn't waited for by
+ * the probe routine but is probed later by a delayed work item.
+ */
+enum PCPS_PROBE_STATES
+{
+  PCPS_PROBE_NOW,          ///< Probe the device and wait until it is ready, if required
+  PCPS_PROBE_MAY_DEFER,    ///< Return ::MBG_ERR_NOT_READY if the device is not yet ready
+  PCPS_PROBE_DEFERRED,     ///< The device is going to be probed later by a work item
+  PCPS_PROBE_DONE,         ///< The device has been probed and set up successfully
+  PCPS_PROBE_FAILED,       ///< Deferred probing has failed
+  N_PCPS_PROBE_STATES
+};
+
+#endif  // _PCPS_USE_ASYNC_PROBE
+
+
+
 /**
  * @brief Codes used with ::PCPS_DDEV::access_mode
  *
@@ -1359,6 +1875,12 @@ _ext const char *fw_id_ref[]
 
 // Call the device's read function to write the command byte _cmd
 // and read _n bytes to buffer _s.
+#if _PCPS_USE_DEV_STATS && !defined( _pcps_read )
+  // The latency and the result are recorded in the statistics.
+  #define _pcps_read( _pddev, _cmd, _p, _n )  \
+    pcps_read_timed( (_pddev), (_cmd), (uchar FAR *)(_p), (_n) )
+#endif
+
 #if !defined( _pcps_read )
   #define _pcps_read( _pddev, _cmd, _p, _n )  \
     ( (_pddev)->read( _pddev, (_cmd), (uchar FAR *)(_p), (_n) ) )
@@ -1512,6 +2034,12 @@ uint8_t _pcps_ddev_read_status_port( const PCPS_DDEV *pddev )
     #define _pcps_ms_to_usb_timeout( _ms )     (_ms)
   #endif
 
+  #if !defined( MBGUSB_URB_BUF_SIZE )
+    // Size of the coherent buffers of the pre-allocated URBs.
+    // Larger transfers are done in the conventional way.
+    #define MBGUSB_URB_BUF_SIZE                1024
+  #endif
+
 
   #if !defined( MBGUSB_TIMEOUT_SEND )
     #define MBGUSB_TIMEOUT_SEND            _pcps_ms_to_usb_timeout( MBGUSB_TIMEOUT_SEND_MS )
@@ -1551,6 +2079,8 @@ int pcps_direct_usb_transfer( PCPS_DDEV *pddev, void *buffer, int len, int ep_id
       _mbgddmsg_fnc_entry();
     #endif
 
+    _pcps_trace_usb_xfer_start( pddev, ep, len, timeout );
+
     #if _PCPS_CHK_BUFFER_DMA_CAPABLE
       if ( !_pcps_buffer_is_dma_capable( buffer ) )
       {
@@ -1579,31 +2109,35 @@ int pcps_direct_usb_transfer( PCPS_DDEV *pddev, void *buffer, int len, int ep_id
         usb_rc = usb_bulk_msg( pddev->udev, pipe, buffer, len, &actual_len, timeout );
 
 
-    #if DEBUG_USB_IO > 2
-    {
-      char ptr_str[40];
+    #if USE_DEBUG_USB_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_USB_IO ) )
+      {
+        char ptr_str[40];
 
-      if ( p )
-        mbg_kdd_snprintf( ptr_str, sizeof( ptr_str ), "%p", p );
-      else
-        mbg_kdd_snprintf( ptr_str, sizeof( ptr_str ), "NULL" );
+        if ( p )
+          mbg_kdd_snprintf( ptr_str, sizeof( ptr_str ), "%p", p );
+        else
+          mbg_kdd_snprintf( ptr_str, sizeof( ptr_str ), "NULL" );
 
-      _mbgddmsg_8( DEBUG_USB_IO, MBG_LOG_INFO, "%s: ep %02X, pipe %02X, malloc %s, len %i, actual_len %i, timeout %i, usb_rc: %i",
-                   fnc_name, ep, pipe, ptr_str, len, actual_len, timeout, usb_rc );
-    }
+        _mbg_kdd_msg_8( MBG_LOG_INFO, "%s: ep %02X, pipe %02X, malloc %s, len %i, actual_len %i, timeout %i, usb_rc: %i",
+                        fnc_name, ep, pipe, ptr_str, len, actual_len, timeout, usb_rc );
+      }
     #endif
 
     if ( usb_rc < 0 )
     {
       rc = mbg_posix_errno_to_mbg( -usb_rc, NULL );
 
-      #if DEBUG_USB_IO > 2
-        _mbgddmsg_3( DEBUG_USB_IO, MBG_LOG_INFO, "%s: USB rc %i -> %i", fnc_name, usb_rc, rc );
+      #if USE_DEBUG_USB_IO
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_USB_IO ) )
+          _mbg_kdd_msg_3( MBG_LOG_INFO, "%s: USB rc %i -> %i", fnc_name, usb_rc, rc );
       #endif
     }
     else
       rc = actual_len;
 
+    _pcps_trace_usb_xfer_end( pddev, ep, rc );
+
   #else
 
     #error Needs to be implemented for this target.
@@ -1701,6 +2235,46 @@ int pcps_direct_usb_read_cyclic( PCPS_DDEV *pddev, void *buffer, int len )
 /* by MAKEHDR, do not remove the comments. */
 
  void pcps_dump_data( const void *buffer, size_t count, const char *info ) ;
+ /**
+ * @brief Release the pre-allocated URBs of a USB device
+ *
+ * Must not be called while a transfer is in progress,
+ * i.e. the caller has to hold the device mutex.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure
+ *
+ * @see ::pcps_usb_alloc_urbs
+ */
+ void pcps_usb_free_urbs( PCPS_DDEV *pddev ) ;
+
+ /**
+ * @brief Set the debug flags of a device
+ *
+ * Enables or disables debug code for a specific device at runtime.
+ * The debug code is skipped by a patched-out branch while the
+ * flags of all devices are 0. Must be called with flags 0
+ * before a device is removed. May sleep.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  flags  Bit mask of ::PCPS_DBG_FLAG_MASKS
+ */
+ void pcps_set_dbg_flags( PCPS_DDEV *pddev, uint32_t flags ) ;
+
+ /**
+ * @brief Call the read function of a device, and update the statistics
+ *
+ * Used by the ::_pcps_read macro if ::_PCPS_USE_DEV_STATS is set.
+ * May also be called from interrupt context.
+ *
+ * @param[in]  pddev   Pointer to the device structure
+ * @param[in]  cmd     The command code for the board, see @ref PCPS_CMD_CODES
+ * @param[out] buffer  A buffer for the data to be read, or NULL
+ * @param[in]  count   The number of bytes to be read
+ *
+ * @return The return code of the read function, see @ref MBG_RETURN_CODES
+ */
+ int pcps_read_timed( PCPS_DDEV *pddev, uint8_t cmd, void FAR *buffer, uint16_t count ) ;
+
  /**
  * @brief Write data to a device
  *
@@ -1809,6 +2383,24 @@ int pcps_direct_usb_read_cyclic( PCPS_DDEV *pddev, void *buffer, int len )
  */
  void check_receiver_info_and_features( PCPS_DDEV *pddev ) ;
 
+ /**
+ * @brief Read the extended features of a device, if not yet done
+ *
+ * The ::MBG_XFEATURE_BUFFER and ::MBG_TLV_INFO of a device are only
+ * needed to check for extended features, so if ::_PCPS_USE_LAZY_EXT_FEAT
+ * is set they are not read by ::pcps_probe_device, but when they are
+ * needed for the first time. They are read at most once, even if
+ * reading fails.
+ *
+ * The caller must hold the device mutex, which isn't released
+ * temporarily while the buffers are read, see ::pcps_lane_yield.
+ *
+ * @param[in,out] pddev  Pointer to a device structure
+ *
+ * @see ::check_receiver_info_and_features
+ */
+ void pcps_chk_ext_features( PCPS_DDEV *pddev ) ;
+
  /**
  * @brief Release I/O port and memory resource that have been claimed before
  *
@@ -1940,6 +2532,30 @@ int pcps_direct_usb_read_cyclic( PCPS_DDEV *pddev, void *buffer, int len )
  */
  int pcps_probe_device( PCPS_DDEV *pddev, PCPS_BUS_NUM bus_num, PCPS_SLOT_NUM dev_fnc_num ) ;
 
+ /**
+ * @brief Quickly re-attach a USB device that has been probed before
+ *
+ * If a USB device is unplugged and plugged in again, the kernel driver
+ * can find the device structure that has been set up when the device
+ * was probed before, by product ID and serial number. In this case
+ * it is sufficient to re-initialize the USB interface and read the
+ * firmware ID to check if the information determined by the previous
+ * ::pcps_probe_device call is still valid, so the time-consuming
+ * readout of ::RECEIVER_INFO, extended features, etc. can be skipped.
+ *
+ * The udev and intf fields of the device structure have to be set
+ * up for the new USB device before this function is called.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure which has been recycled
+ *
+ * @return ::MBG_SUCCESS if the device could be re-attached, ::MBG_ERR_FW_ID
+ *         if the firmware ID has changed, or one of the other @ref MBG_ERROR_CODES.
+ *         In case of error ::pcps_probe_device has to be called to do a full probe.
+ *
+ * @see ::pcps_probe_device
+ */
+ int pcps_reattach_usb_device( PCPS_DDEV *pddev ) ;
+
  /**
  * @brief Clean up function called by ::pcps_probe_device on error
  *
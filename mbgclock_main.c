@@ -183,12 +183,20 @@
 #include <stddef.h>
 
 #include <linux/termios.h>
+#include <linux/vmalloc.h>
 #include <linux/pci.h>
 
 #if _USE_LINUX_DEVFS
   #include <linux/devfs_fs_kernel.h>
 #endif
 
+#if _PCPS_USE_TRACEPOINTS
+  // The tracepoints declared in mbg_trace_lx.h, which has already
+  // been included via pcpsdrvr.h, are instantiated in this module.
+  #define CREATE_TRACE_POINTS
+  #include <mbg_trace_lx.h>
+#endif
+
 #define MBG_COPYRIGHT    "(c) Meinberg 2001-" MBG_CURRENT_COPYRIGHT_YEAR_STR
 
 #define MBG_DRVR_NAME    "mbgclock"
@@ -245,6 +253,174 @@ static PCPS_DDEV *default_ucap_pddev;
   static MBG_DBG_PORT mbg_dbg_port = 0x378 + 0;  //##++
 #endif  // USE_DEBUG_PORT
 
+
+#if _PCPS_USE_IOCTL_MEMPOOL
+
+#if !defined( MBG_IOCTL_MEMPOOL_MIN_NR )
+  #define MBG_IOCTL_MEMPOOL_MIN_NR  2  // number of buffers reserved per size class
+#endif
+
+/**
+ * @brief Size classes of the buffers for generic IOCTL calls
+ *
+ * Each size class has its own slab cache and a mempool with a few
+ * reserved buffers, so the generic read and write calls don't need to
+ * allocate memory in steady state, and still work if memory is tight.
+ * Larger buffers are allocated from the kernel heap for each call.
+ */
+static const size_t ioctl_buf_sizes[] = { 256, 1024, 4096, 16384 };
+
+#define N_IOCTL_BUF_SIZES  ( (int) ( sizeof( ioctl_buf_sizes ) / sizeof( ioctl_buf_sizes[0] ) ) )
+
+static char ioctl_buf_cache_names[N_IOCTL_BUF_SIZES][32];
+static struct kmem_cache *ioctl_buf_caches[N_IOCTL_BUF_SIZES];
+static mempool_t *ioctl_buf_pools[N_IOCTL_BUF_SIZES];
+
+
+
+static /*HDR*/
+/**
+ * @brief Determine the mempool to be used for a generic IOCTL buffer
+ *
+ * @param[in]  size  The required buffer size
+ *
+ * @return Index of the size class, or -1 if the buffer has to be
+ *         allocated from the kernel heap
+ */
+int ioctl_buf_size_class( size_t size )
+{
+  int i;
+
+  for ( i = 0; i < N_IOCTL_BUF_SIZES; i++ )
+    if ( size <= ioctl_buf_sizes[i] )
+      return ioctl_buf_pools[i] ? i : -1;
+
+  return -1;
+
+}  // ioctl_buf_size_class
+
+
+
+static /*HDR*/
+/**
+ * @brief Allocate a buffer for a generic IOCTL call
+ *
+ * If the buffer is taken from a mempool then the call may sleep
+ * until a buffer is returned to the pool, but doesn't fail.
+ *
+ * @param[in]  size  The required buffer size
+ *
+ * @return Pointer to the buffer, or NULL if no buffer could be allocated
+ *
+ * @see ::mbgdrvr_ioctl_buf_free
+ */
+void *mbgdrvr_ioctl_buf_alloc( size_t size )
+{
+  int i = ioctl_buf_size_class( size );
+
+  if ( i < 0 )
+    return _pcps_kmalloc( size );
+
+  return mempool_alloc( ioctl_buf_pools[i], GFP_KERNEL );
+
+}  // mbgdrvr_ioctl_buf_alloc
+
+
+
+static /*HDR*/
+/**
+ * @brief Free a buffer allocated by ::mbgdrvr_ioctl_buf_alloc
+ *
+ * @param[in]  p     Pointer to the buffer, may be NULL
+ * @param[in]  size  The size that was passed to ::mbgdrvr_ioctl_buf_alloc
+ */
+void mbgdrvr_ioctl_buf_free( void *p, size_t size )
+{
+  int i;
+
+  if ( p == NULL )
+    return;
+
+  i = ioctl_buf_size_class( size );
+
+  if ( i < 0 )
+    _pcps_kfree( p, size );
+  else
+    mempool_free( p, ioctl_buf_pools[i] );
+
+}  // mbgdrvr_ioctl_buf_free
+
+
+
+static /*HDR*/
+void mbgdrvr_destroy_ioctl_buf_pools( void )
+{
+  int i;
+
+  for ( i = 0; i < N_IOCTL_BUF_SIZES; i++ )
+  {
+    if ( ioctl_buf_pools[i] )
+    {
+      mempool_destroy( ioctl_buf_pools[i] );
+      ioctl_buf_pools[i] = NULL;
+    }
+
+    if ( ioctl_buf_caches[i] )
+    {
+      kmem_cache_destroy( ioctl_buf_caches[i] );
+      ioctl_buf_caches[i] = NULL;
+    }
+  }
+
+}  // mbgdrvr_destroy_ioctl_buf_pools
+
+
+
+static /*HDR*/
+/**
+ * @brief Set up the slab caches and mempools for generic IOCTL buffers
+ *
+ * Failure is not fatal. Buffers of a size class for which no
+ * mempool could be set up are allocated from the kernel heap.
+ */
+void mbgdrvr_create_ioctl_buf_pools( void )
+{
+  int i;
+
+  for ( i = 0; i < N_IOCTL_BUF_SIZES; i++ )
+  {
+    // The cache name must persist as long as the cache exists.
+    snprintf( ioctl_buf_cache_names[i], sizeof( ioctl_buf_cache_names[i] ),
+              MBG_DRVR_NAME "_iobuf_%lu", (ulong) ioctl_buf_sizes[i] );
+
+    ioctl_buf_caches[i] = kmem_cache_create( ioctl_buf_cache_names[i], ioctl_buf_sizes[i],
+                                             0, SLAB_HWCACHE_ALIGN, NULL );
+
+    if ( ioctl_buf_caches[i] )
+      ioctl_buf_pools[i] = mempool_create_slab_pool( MBG_IOCTL_MEMPOOL_MIN_NR, ioctl_buf_caches[i] );
+
+    if ( ioctl_buf_pools[i] == NULL )
+    {
+      mbg_kdd_msg( MBG_LOG_WARN, "Failed to set up mempool for %lu byte IOCTL buffers",
+                   (ulong) ioctl_buf_sizes[i] );
+
+      if ( ioctl_buf_caches[i] )
+      {
+        kmem_cache_destroy( ioctl_buf_caches[i] );
+        ioctl_buf_caches[i] = NULL;
+      }
+    }
+  }
+
+}  // mbgdrvr_create_ioctl_buf_pools
+
+
+#define _ioctl_buf_alloc( _sz )     mbgdrvr_ioctl_buf_alloc( _sz )
+#define _ioctl_buf_free( _p, _sz )  mbgdrvr_ioctl_buf_free( _p, _sz )
+
+#endif  // _PCPS_USE_IOCTL_MEMPOOL
+
+
 #include <macioctl.h>
 
 
@@ -258,6 +434,35 @@ static int minor = 0;
 static int max_devs = MBGCLOCK_MAX_DEVS;
 static int ddev_list_alloc_size;
 
+#if _PCPS_USE_STATUS_SNAPSHOT
+  static int status_snapshot_intv;  // [ms], 0 disables the status snapshotter
+  static int status_snapshot_items = MBG_SNAPSHOT_MSK_ALL;
+#endif
+
+#if _PCPS_USE_UCAP_RING
+  static int ucap_drain_intv;       // [ms], 0 disables the user capture drainer
+  static int ucap_ring_size = 4096; // number of events, rounded up to a power of 2
+
+  #if !defined( MBG_UCAP_RING_MAX_ENTRIES )
+    // The max. number of events of a ring buffer, if a larger size
+    // has been passed via the module parameter.
+    #define MBG_UCAP_RING_MAX_ENTRIES  ( 1UL << 20 )
+  #endif
+#endif
+
+#if _PCPS_USE_PTP_CLOCK
+  static int ptp_clock;             // != 0 to register a PTP hardware clock for each ucap device
+#endif
+
+#if _PCPS_USE_AGG_DEV
+  static int agg_check_intv = 1000; // [ms], 0 disables the aggregate device
+  static int agg_max_offs = 1000;   // [us], max. offset of a device to the majority of the others, 0 disables the check
+#endif
+
+#if _PCPS_USE_DBG_KEYS
+  static uint dbg_flags;            // initial debug flags of each device, see PCPS_DBG_FLAG_MASKS
+#endif
+
 
 #ifdef MODULE
 
@@ -316,6 +521,60 @@ MODULE_PARM_DESC( max_devs, "max number of supported devices" );
 #endif
 MODULE_PARM_DESC( pretend_sync, "pretend to NTP to be always sync'ed" );
 
+#if _PCPS_USE_STATUS_SNAPSHOT
+  #if defined( module_param )
+    module_param( status_snapshot_intv, int, 0444 );
+    module_param( status_snapshot_items, int, 0444 );
+  #elif defined( MODULE_PARM )
+    MODULE_PARM( status_snapshot_intv, "i" );
+    MODULE_PARM( status_snapshot_items, "i" );
+  #endif
+  MODULE_PARM_DESC( status_snapshot_intv, "interval [ms] to refresh status snapshots in the background, 0 (default) to disable." );
+  MODULE_PARM_DESC( status_snapshot_items, "bit mask of status structures to be kept in the snapshots, all by default." );
+#endif
+
+#if _PCPS_USE_UCAP_RING
+  #if defined( module_param )
+    module_param( ucap_drain_intv, int, 0444 );
+    module_param( ucap_ring_size, int, 0444 );
+  #elif defined( MODULE_PARM )
+    MODULE_PARM( ucap_drain_intv, "i" );
+    MODULE_PARM( ucap_ring_size, "i" );
+  #endif
+  MODULE_PARM_DESC( ucap_drain_intv, "interval [ms] to move user capture events to a ring buffer, 0 (default) to disable." );
+  MODULE_PARM_DESC( ucap_ring_size, "number of user capture events the ring buffer can take, 4096 by default, max. 1048576." );
+#endif
+
+#if _PCPS_USE_PTP_CLOCK
+  #if defined( module_param )
+    module_param( ptp_clock, int, 0444 );
+  #elif defined( MODULE_PARM )
+    MODULE_PARM( ptp_clock, "i" );
+  #endif
+  MODULE_PARM_DESC( ptp_clock, "if != 0, register a PTP clock providing user captures as external time stamps, 0 by default." );
+#endif
+
+#if _PCPS_USE_AGG_DEV
+  #if defined( module_param )
+    module_param( agg_check_intv, int, 0444 );
+  #elif defined( MODULE_PARM )
+    MODULE_PARM( agg_check_intv, "i" );
+  #endif
+  MODULE_PARM_DESC( agg_check_intv, "interval [ms] to check the health of all devices for the aggregate device, 1000 by default, 0 disables the aggregate device." );
+
+  #if defined( module_param )
+    module_param( agg_max_offs, int, 0444 );
+  #elif defined( MODULE_PARM )
+    MODULE_PARM( agg_max_offs, "i" );
+  #endif
+  MODULE_PARM_DESC( agg_max_offs, "max. offset [us] of a device to the majority of the others before the aggregate device demotes it, 1000 by default, 0 disables the check." );
+#endif
+
+#if _PCPS_USE_DBG_KEYS
+  module_param( dbg_flags, uint, 0444 );
+  MODULE_PARM_DESC( dbg_flags, "initial debug flags of each device: 0x01 I/O, 0x02 I/O timing, 0x04 access timing, 0x08 semaphores, 0x10 USB I/O, 0x20 command latency statistics, 0 by default." );
+#endif
+
 #if _PCPS_USE_MM_IO
   #if defined( module_param )
     module_param( force_io_access, int, 0444 );
@@ -369,6 +628,11 @@ EXPORT_SYMBOL( access_in_progress );
 
 #define CYCLIC_TIMEOUT ( (ulong) 2 * HZ )  // 2 seconds
 
+// Max. number of consecutive failed transfers after which the
+// cyclic USB URB is not resubmitted anymore, see
+// mbgdrvr_usb_cyclic_complete().
+#define MBG_USB_CYC_MAX_ERRORS  8
+
 #if NEW_FASYNC2
   #define _kill_fasync( _fa, _sig, _band ) \
     kill_fasync( _fa, _sig, _band )
@@ -480,68 +744,6 @@ void list_system_irqs( void )
 #endif
 
 
-#if _PCPS_USE_LINUX_KTHREAD
-
-  #define _usb_read_thread_should_stop() \
-     kthread_should_stop()
-
-  #define _usb_read_thread_exit( _pddev, _v ) \
-    return (_v);
-
-  #define _usb_read_thread_started( _pddev ) \
-    ( (_pddev)->usb_read_thread != NULL )
-
-  #define _usb_read_thread_start( _fnc, _pddev )               \
-    (_pddev)->usb_read_thread = kthread_run( (_fnc), (_pddev), \
-       "%s%d", driver_name, MINOR( (_pddev)->lx_dev ) )
-
-  #define _usb_read_thread_failed_to_start( _pddev ) \
-    ( IS_ERR( (_pddev)->usb_read_thread ) )
-
-  #define _usb_read_thread_set_unused( _pddev ) \
-    (_pddev)->usb_read_thread = NULL;
-
-  #define _usb_read_thread_stop( _pddev ) \
-    kthread_stop( (_pddev)->usb_read_thread )
-
-  // This is not required if the kthread API is being used.
-  #define _usb_read_thread_daemonize( _pddev ) \
-    _nop_macro_fnc()
-
-#else
-
-  #define _usb_read_thread_should_stop() \
-    signal_pending( current )
-
-  #define _usb_read_thread_exit( _pddev, _v ) \
-    complete_and_exit( &pddev->usb_read_thread.exit, (_v) )
-
-  #define _usb_read_thread_started( _pddev ) \
-    ( (_pddev)->usb_read_thread.pid != 0 )
-
-  #define _usb_read_thread_start( _fnc, _pddev )         \
-    init_completion( &(_pddev)->usb_read_thread.exit );  \
-    (_pddev)->usb_read_thread.pid = kernel_thread( (_fnc), (_pddev), CLONE_KERNEL );
-
-  #define _usb_read_thread_failed_to_start( _pddev ) \
-    ( (_pddev)->usb_read_thread.pid == 0 )
-
-  #define _usb_read_thread_set_unused( _pddev ) \
-    (_pddev)->usb_read_thread.pid = 0;
-
-  #define _usb_read_thread_stop( _pddev )                   \
-    kill_proc( (_pddev)->usb_read_thread.pid, SIGKILL, 1 ); \
-    wait_for_completion( &(_pddev)->usb_read_thread.exit )
-
-  #define _usb_read_thread_daemonize( _pddev )                                          \
-    snprintf( (_pddev)->usb_read_thread.name, sizeof( (_pddev)->usb_read_thread.name ), \
-              "%s%d", driver_name, MINOR( (_pddev)->lx_dev ) );                       \
-    daemonize( (_pddev)->usb_read_thread.name );                                        \
-    allow_signal( SIGKILL )
-
-#endif
-
-
 static void mbgdrvr_delete_device( PCPS_DDEV *pddev );
 
 
@@ -585,21 +787,23 @@ int ddev_list_alloc( void )
 
 
 static /*HDR*/
-PCPS_DDEV **ddev_list_locate_minor( unsigned int minor )
+PCPS_DDEV **ddev_list_locate_minor( unsigned int dev_minor )
 {
-  int i;
+  // The index of a device list entry is the offset of the
+  // minor number which has been assigned to the device, so the
+  // entry can be addressed directly.
+  unsigned int idx = dev_minor - minor;
 
-  for ( i = 0; i < max_devs; i++ )
+  if ( ( dev_minor >= (unsigned int) minor ) && ( idx < (unsigned int) max_devs ) )
   {
-    PCPS_DDEV **ppddev = &ddev_list[i];
+    PCPS_DDEV **ppddev = &ddev_list[idx];
 
     if ( *ppddev )
-      if ( minor == MINOR( (*ppddev)->lx_dev ) )
-        return ppddev;
+      return ppddev;
   }
 
-  mbg_kdd_msg( MBG_LOG_WARN, "Unable to locate minor %i in device list",
-               minor );
+  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "No device with minor %i in device list",
+               dev_minor );
 
   return NULL;
 
@@ -646,19 +850,24 @@ PCPS_DDEV **ddev_list_locate_device( PCPS_BUS_FLAGS bus_flags, PCPS_DEV_ID dev_i
 
 
 static /*HDR*/
+/**
+ * @brief Remove a device from the device list
+ *
+ * Must be called with sem_fops held, and before the device
+ * structure is freed.
+ *
+ * @param[in]  pddev  The device to be removed
+ *
+ * @return 0 on success, or -1 if the device was not in the list
+ */
 int ddev_list_remove_entry( PCPS_DDEV *pddev )
 {
-  int i;
+  unsigned int idx = MINOR( pddev->lx_dev ) - minor;
 
-  for ( i = 0; i < max_devs; i++ )
+  if ( ( idx < (unsigned int) max_devs ) && ( ddev_list[idx] == pddev ) )
   {
-    PCPS_DDEV **ppddev = &ddev_list[i];
-
-    if ( *ppddev == pddev )
-    {
-      *ppddev = NULL;
-      return 0;
-    }
+    ddev_list[idx] = NULL;
+    return 0;
   }
 
   mbg_kdd_msg( MBG_LOG_WARN, "Failed to remove device minor %i from device list",
@@ -682,6 +891,11 @@ int ddev_list_add_entry( PCPS_DDEV *pddev )
     if ( *ppddev == NULL )
     {
       *ppddev = pddev;
+
+      // The minor number of the device determines the
+      // list index, see ::ddev_list_remove_entry.
+      pddev->lx_dev = MKDEV( major, minor + i );
+
       return i;
     }
   }
@@ -756,6 +970,7 @@ static /*HDR*/
   if ( !_pcps_ddev_has_gen_irq( pddev ) )
     goto out;
 
+  _pcps_trace_irq_entry( pddev, hw_irq );
 
   _mbg_dbg_hw_lpt_set_bit( MBG_BIT_IRQ );
 
@@ -773,8 +988,12 @@ static /*HDR*/
     rdtscll( tsc_irq_1 );
   #endif
 
+  pddev->irq_cnt++;
+
   if ( !curr_access_in_progress )
     rc = _pcps_read_var( pddev, PCPS_GIVE_TIME, pddev->t );
+  else
+    pddev->irq_busy_cnt++;
 
   #if DEBUG_IRQ_LATENCY
     rdtscll( tsc_irq_2 );
@@ -785,7 +1004,9 @@ static /*HDR*/
 
   if ( !curr_access_in_progress )
   {
-    if ( mbg_rc_is_success( rc ) )
+    if ( mbg_rc_is_error( rc ) )
+      pddev->irq_err_cnt++;
+    else
     {
       atomic_set( &pddev->data_avail, 1 );
 
@@ -798,6 +1019,7 @@ static /*HDR*/
 
   spin_unlock_irqrestore( &pddev->irq_lock, flags );
 
+  _pcps_trace_irq_exit( pddev, curr_access_in_progress, rc );
 
   #if DEBUG_IRQ_TIMING
   {
@@ -842,15 +1064,9 @@ out:
 __mbg_inline
 int get_cyclic_lock( PCPS_DDEV *pddev, unsigned long *p_flags, const char *fnc_name )
 {
-  #if _PCPS_USE_USB
-  if ( _pcps_ddev_is_usb( pddev ) )
-  {
-    if ( _down_interruptible_pddev( &pddev->sem_usb_cyclic, "sem_usb_cyclic", fnc_name, pddev ) < 0 )
-      return -ERESTARTSYS;
-  }
-  else
-  #endif
-    spin_lock_irqsave( &pddev->irq_lock, *p_flags );
+  // The cyclic data of USB devices is updated by an URB completion
+  // handler, so the same lock is used as for the IRQ handler.
+  spin_lock_irqsave( &pddev->irq_lock, *p_flags );
 
   return 0;
 
@@ -861,12 +1077,7 @@ int get_cyclic_lock( PCPS_DDEV *pddev, unsigned long *p_flags, const char *fnc_n
 __mbg_inline
 void release_cyclic_lock( PCPS_DDEV *pddev, unsigned long *p_flags, const char *fnc_name )
 {
-  #if _PCPS_USE_USB
-  if ( _pcps_ddev_is_usb( pddev ) )
-    _up_pddev( &pddev->sem_usb_cyclic, "sem_usb_cyclic", fnc_name, pddev );
-  else
-  #endif
-    spin_unlock_irqrestore( &pddev->irq_lock, *p_flags );
+  spin_unlock_irqrestore( &pddev->irq_lock, *p_flags );
 
 }  // release_cyclic_lock
 
@@ -874,142 +1085,259 @@ void release_cyclic_lock( PCPS_DDEV *pddev, unsigned long *p_flags, const char *
 
 #if _PCPS_USE_USB
 
-// The function below is started as a new kernel thread in order to
-// receive periodic messages from an USB device.
-// This is used to emulate the hardware IRQ generated by
-// plug-in cards.
+// USB devices don't generate IRQs, but can send a message once per
+// second. An URB is kept submitted to receive these messages, and its
+// completion handler emulates the IRQ handler of plug-in cards.
+// The URB has no timeout, so it doesn't have to be polled.
+//
+// The completion handler runs in atomic context, so the URB is not
+// resubmitted if the endpoint has stalled, if the USB host controller
+// reports an error which usually persists, or if too many transfers
+// have failed in a row. Instead, the URB is stopped, and the cyclic
+// timeout check in process context calls mbgdrvr_enable_cyclic()
+// which clears a halt condition, or resets the device, and
+// restarts the URB.
 
 static /*HDR*/
-int mbgdrvr_read_usb_cyclic( void *p )
+void mbgdrvr_usb_cyclic_complete( struct urb *urb )
 {
-  PCPS_DDEV *pddev = p;
-
-  _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "USB xmt tmo: %u, rcv tmo: %u, cycl tmo: %u, HZ: %u",
-               MBGUSB_TIMEOUT_SEND, MBGUSB_TIMEOUT_RECEIVE,
-               MBGUSB_TIMEOUT_RECEIVE_CYCLIC, HZ );
+  PCPS_DDEV *pddev = (PCPS_DDEV *) urb->context;
+  unsigned long flags;
+  int rc;
 
-  _usb_read_thread_daemonize( pddev );
+  #if DEBUG_IRQ_LATENCY
+    rdtscll( tsc_usb_1 );
+  #endif
 
-  // The device sends a cyclic message in intervals of 1 s,
-  // so we have to wait more than 1 s totally to detect a
-  // timeout.
-  // Unfortunatly the USB read function does not return if
-  // we receive a signal (e.g. to terminate), so in order
-  // to be able to react on a signal in a timely manner
-  // we call the read function with a fraction of the total
-  // timeout and simply retry unless we have received a signal,
-  // or the total timeout interval has expired.
-  for (;;)
+  switch ( urb->status )
   {
-    int rc;
+    case 0:
+      break;
 
-    if ( _usb_read_thread_should_stop() )  // we have been signalled to abort
-    {
-      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read " MBG_DEV_NAME_FMT " received signal to stop",
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+    case -ENODEV:
+      // The URB has been killed, or the device has been disconnected.
+      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB URB for " MBG_DEV_NAME_FMT " terminated, status %i",
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), urb->status );
+      goto out_stopped;
+
+    case -EPIPE:
+      // The endpoint has stalled. The halt condition can only
+      // be cleared in process context.
+      mbg_kdd_msg( MBG_LOG_WARN, "Cyclic USB endpoint of " MBG_DEV_NAME_FMT " has stalled, URB stopped",
                    _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      break;
-    }
+      _pcps_stats_inc( pddev, usb_xfer_errors );
+      atomic_set( &pddev->cyc_urb_halted, 1 );
+      goto out_stopped;
+
+    case -EPROTO:
+    case -EILSEQ:
+    case -ETIME:
+    case -EOVERFLOW:
+      // Low level protocol errors which are usually not transient,
+      // e.g. if the device is being unplugged.
+      mbg_kdd_msg( MBG_LOG_WARN, "Cyclic USB URB for " MBG_DEV_NAME_FMT " returned status %i, URB stopped",
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), urb->status );
+      _pcps_stats_inc( pddev, usb_xfer_errors );
+      goto out_stopped;
 
-    // read with fractional timeout interval
-    rc = _pcps_direct_usb_read_var_cyclic( pddev, &pddev->t_cyc );
+    default:
+      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "Cyclic USB URB for " MBG_DEV_NAME_FMT " returned status %i",
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), urb->status );
+      goto out_error;
+  }
 
-    if ( mbg_rc_is_error( rc ) )
-    {
-      if ( rc == MBG_ERR_TIMEOUT )
-      {
-        #if ( 1 && defined( DEBUG ) )  // TODO DEBUG_CYCLIC
-          _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "Cyclic USB read " MBG_DEV_NAME_FMT " timed out",
-                       _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-        #endif
-        continue;    // this may be a normal case
-      }
+  if ( urb->actual_length != sizeof( pddev->t ) )
+  {
+    _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_WARN, "Cyclic USB URB for " MBG_DEV_NAME_FMT " received %i of %i bytes",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+                 urb->actual_length, (int) sizeof( pddev->t ) );
+    goto out_error;
+  }
 
-      // Read has been terminated due to some other error.
-      // Eventually the device has been disconnected, in which case
-      // the USB stack may return -ETIME (-62), which is converted
-      // to MBG_ERR_TIMER.
-      _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_WARN, "Cyclic USB read " MBG_DEV_NAME_FMT " returned %i: %s",
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc, mbg_strerror( rc ) );
-      break;
-    }
+  pddev->cyc_urb_n_errors = 0;
 
-    // success, so rc holds the number of bytes read
-    if ( rc != sizeof( pddev->t_cyc ) )
-    {
-      _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_WARN, "Cyclic USB read " MBG_DEV_NAME_FMT " returned %i of %i bytes",
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc, (int) sizeof( pddev->t_cyc ) );
-      continue;
-    }
+  spin_lock_irqsave( &pddev->irq_lock, flags );
 
-    // received a message from the device
-    #if DEBUG_IRQ_LATENCY
-      rdtscll( tsc_usb_1 );
-    #endif
+  #if DEBUG_IRQ_LATENCY
+    rdtscll( tsc_usb_2 );
+  #endif
 
-    if ( _down_interruptible_pddev( &pddev->sem_usb_cyclic, "sem_usb_cyclic", __func__, pddev ) < 0 )
-      break;
+  pddev->jiffies_at_irq = jiffies;
+  pddev->irq_cnt++;
+  pddev->t = *pddev->cyc_urb_buf;
+  atomic_set( &pddev->data_avail, 1 );
 
-    #if DEBUG_IRQ_LATENCY
-      rdtscll( tsc_usb_2 );
-    #endif
+  spin_unlock_irqrestore( &pddev->irq_lock, flags );
 
-    pddev->jiffies_at_irq = jiffies;
-    pddev->t = pddev->t_cyc;
-    atomic_set( &pddev->data_avail, 1 );
+  _mbgddmsg_6( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read " MBG_DEV_NAME_FMT " success: %02d:%02d:%02d.%02d",
+               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+               pddev->t.hour, pddev->t.min, pddev->t.sec, pddev->t.sec100 );
 
-    _up_pddev( &pddev->sem_usb_cyclic, "sem_usb_cyclic", __func__, pddev );
+  wake_up_interruptible( &pddev->wait_queue );
 
-    _mbgddmsg_6( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read " MBG_DEV_NAME_FMT " success: %02d:%02d:%02d.%02d",
-                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
-                 pddev->t.hour, pddev->t.min, pddev->t.sec, pddev->t.sec100 );
+  if ( pddev->fasyncptr )
+    _kill_fasync( &pddev->fasyncptr, SIGIO, POLL_IN );
+
+  goto resubmit;
 
-    wake_up_interruptible( &pddev->wait_queue );
 
-    if ( pddev->fasyncptr )
-      _kill_fasync( &pddev->fasyncptr, SIGIO, POLL_IN );
+out_error:
+  _pcps_stats_inc( pddev, usb_xfer_errors );
+
+  if ( ++pddev->cyc_urb_n_errors >= MBG_USB_CYC_MAX_ERRORS )
+  {
+    mbg_kdd_msg( MBG_LOG_WARN, "Cyclic USB URB for " MBG_DEV_NAME_FMT " failed %i times in a row, URB stopped",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), pddev->cyc_urb_n_errors );
+    goto out_stopped;
   }
 
-  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read thread for " MBG_DEV_NAME_FMT " exits",
-               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+resubmit:
+  rc = usb_submit_urb( urb, GFP_ATOMIC );
+
+  if ( rc == 0 )
+    return;
 
-  _usb_read_thread_set_unused( pddev );
-  _usb_read_thread_exit( pddev, 0 );
+  // -EPERM is returned if the URB is just being killed.
+  if ( rc != -EPERM )
+    mbg_kdd_msg( MBG_LOG_WARN, "Failed to resubmit cyclic USB URB for " MBG_DEV_NAME_FMT ", errno: %i",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
 
-}  // mbgdrvr_read_usb_cyclic
+out_stopped:
+  // Enables mbgdrvr_enable_cyclic() to restart the URB.
+  // The halt flag has to be visible before the URB is
+  // seen as stopped.
+  smp_wmb();
+  atomic_set( &pddev->cyc_urb_active, 0 );
+
+}  // mbgdrvr_usb_cyclic_complete
 
 
 
 static /*HDR*/
-int mbgdrvr_ctrl_usb_cyclic( PCPS_DDEV *pddev, uint8_t cmd )
+int mbgdrvr_start_usb_cyclic( PCPS_DDEV *pddev )
 {
   int rc;
 
-  if ( _down_interruptible( &pddev->dev_mutex, "dev_mutex", __func__, pddev ) < 0 )
-    return -ERESTARTSYS;
+  if ( pddev->cyc_urb == NULL )
+  {
+    pddev->cyc_urb = usb_alloc_urb( 0, GFP_KERNEL );
 
-  pddev->cmd_info.cmd = cmd;
-  rc = _pcps_direct_usb_write_var( pddev, &pddev->cmd_info.cmd );
+    if ( pddev->cyc_urb == NULL )
+      return -ENOMEM;
 
-  _up( &pddev->dev_mutex, "dev_mutex", "ctrl_usb_cyclic", pddev );
+    // The buffer must be DMA-capable, so it can't be part of the
+    // device structure, where it might share a cache line with
+    // other fields.
+    pddev->cyc_urb_buf = kmalloc( sizeof( *pddev->cyc_urb_buf ), GFP_KERNEL );
 
-  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Control USB cyclic cmd 0x%02X, rc: %d",
-               cmd, rc );
+    if ( pddev->cyc_urb_buf == NULL )
+    {
+      usb_free_urb( pddev->cyc_urb );
+      pddev->cyc_urb = NULL;
+      return -ENOMEM;
+    }
+  }
 
-  return rc;
+  // The URB is set up each time it is submitted since the USB
+  // device may have changed if the device has been re-attached.
+  usb_fill_bulk_urb( pddev->cyc_urb, pddev->udev,
+                     usb_rcvbulkpipe( pddev->udev, pddev->ep[MBGUSB_EP_IDX_HOST_IN_CYCLIC].addr ),
+                     pddev->cyc_urb_buf, sizeof( *pddev->cyc_urb_buf ),
+                     mbgdrvr_usb_cyclic_complete, pddev );
 
-}  // mbgdrvr_ctrl_usb_cyclic
+  // The URB is not active, so its completion handler
+  // doesn't access the fields below concurrently.
+  if ( atomic_xchg( &pddev->cyc_urb_halted, 0 ) )
+  {
+    rc = usb_clear_halt( pddev->udev, pddev->cyc_urb->pipe );
 
-#endif  // _PCPS_USE_USB
+    _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "Cleared halt of cyclic USB endpoint of " MBG_DEV_NAME_FMT ", rc: %i",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
+  }
 
+  pddev->cyc_urb_n_errors = 0;
+  atomic_set( &pddev->cyc_urb_active, 1 );
 
+  rc = usb_submit_urb( pddev->cyc_urb, GFP_KERNEL );
 
-static /*HDR*/
-int mbgdrvr_disable_cyclic( PCPS_DDEV *pddev )
-{
-  _mbg_dbg_hw_lpt_vars
+  if ( rc < 0 )
+    atomic_set( &pddev->cyc_urb_active, 0 );
 
-  if ( !( pddev->irq_stat_info & PCPS_IRQ_STAT_ENABLED ) )
-    goto done;
+  return rc;
+
+}  // mbgdrvr_start_usb_cyclic
+
+
+
+static /*HDR*/
+void mbgdrvr_stop_usb_cyclic( PCPS_DDEV *pddev )
+{
+  // usb_kill_urb() waits until the completion handler has
+  // finished, and prevents the URB from being resubmitted.
+  if ( pddev->cyc_urb )
+    usb_kill_urb( pddev->cyc_urb );
+
+  atomic_set( &pddev->cyc_urb_active, 0 );
+
+}  // mbgdrvr_stop_usb_cyclic
+
+
+
+static /*HDR*/
+void mbgdrvr_free_usb_cyclic( PCPS_DDEV *pddev )
+{
+  mbgdrvr_stop_usb_cyclic( pddev );
+
+  if ( pddev->cyc_urb )
+  {
+    usb_free_urb( pddev->cyc_urb );
+    pddev->cyc_urb = NULL;
+  }
+
+  if ( pddev->cyc_urb_buf )
+  {
+    kfree( pddev->cyc_urb_buf );
+    pddev->cyc_urb_buf = NULL;
+  }
+
+}  // mbgdrvr_free_usb_cyclic
+
+
+
+static /*HDR*/
+int mbgdrvr_ctrl_usb_cyclic( PCPS_DDEV *pddev, uint8_t cmd )
+{
+  int rc;
+
+  if ( _down_interruptible( &pddev->dev_mutex, "dev_mutex", __func__, pddev ) < 0 )
+    return -ERESTARTSYS;
+
+  pddev->cmd_info.cmd = cmd;
+  rc = _pcps_direct_usb_write_var( pddev, &pddev->cmd_info.cmd );
+
+  _up( &pddev->dev_mutex, "dev_mutex", "ctrl_usb_cyclic", pddev );
+
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Control USB cyclic cmd 0x%02X, rc: %d",
+               cmd, rc );
+
+  return rc;
+
+}  // mbgdrvr_ctrl_usb_cyclic
+
+#endif  // _PCPS_USE_USB
+
+
+
+static /*HDR*/
+int mbgdrvr_disable_cyclic( PCPS_DDEV *pddev )
+{
+  _mbg_dbg_hw_lpt_vars
+
+  if ( !( pddev->irq_stat_info & PCPS_IRQ_STAT_ENABLED ) )
+    goto done;
 
   #if _PCPS_USE_USB
   if ( _pcps_ddev_is_usb( pddev ) )
@@ -1020,16 +1348,10 @@ int mbgdrvr_disable_cyclic( PCPS_DDEV *pddev )
 
     _mbgddmsg_0( DEBUG_DRVR, MBG_LOG_INFO, "Disabled cyclic USB msgs" );
 
-    if ( _usb_read_thread_started( pddev ) )
-    {
-      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read thread for " MBG_DEV_NAME_FMT " going to be stopped",
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-
-      _usb_read_thread_stop( pddev );
+    mbgdrvr_stop_usb_cyclic( pddev );
 
-      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read thread for " MBG_DEV_NAME_FMT " has been stopped",
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-    }
+    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB URB for " MBG_DEV_NAME_FMT " has been stopped",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
   }
   else
   #endif
@@ -1075,27 +1397,30 @@ int mbgdrvr_enable_cyclic( PCPS_DDEV *pddev, unsigned int force )
   if ( _pcps_ddev_is_usb( pddev ) )
   {
     if ( force > 1 )
+    {
+      mbgdrvr_stop_usb_cyclic( pddev );
       usb_reset_device( pddev->udev );
 
-    if ( !_usb_read_thread_started( pddev ) )
+      // Resetting the device also clears a halt condition.
+      atomic_set( &pddev->cyc_urb_halted, 0 );
+    }
+
+    if ( !atomic_read( &pddev->cyc_urb_active ) )
     {
-      _usb_read_thread_start( mbgdrvr_read_usb_cyclic, pddev );
+      int rc = mbgdrvr_start_usb_cyclic( pddev );
 
-      if ( _usb_read_thread_failed_to_start( pddev ) )
-      {
-        mbg_kdd_msg( MBG_LOG_WARN, "Failed to start cyclic USB read thread for " MBG_DEV_NAME_FMT,
-                     _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-        _usb_read_thread_set_unused( pddev );
-      }
+      if ( rc < 0 )
+        mbg_kdd_msg( MBG_LOG_WARN, "Failed to submit cyclic USB URB for " MBG_DEV_NAME_FMT ", errno: %i",
+                     _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
       else
-        _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read thread for " MBG_DEV_NAME_FMT " started successfully",
+        _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB URB for " MBG_DEV_NAME_FMT " submitted successfully",
                      _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
     }
     else
-      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB read thread for " MBG_DEV_NAME_FMT " already started",
+      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Cyclic USB URB for " MBG_DEV_NAME_FMT " already submitted",
                    _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
 
-    if ( _usb_read_thread_started( pddev ) )
+    if ( atomic_read( &pddev->cyc_urb_active ) )
     {
       pddev->irq_stat_info |= PCPS_IRQ_STAT_ENABLED;
       mbgdrvr_ctrl_usb_cyclic( pddev, PCPS_IRQ_1_SEC );
@@ -1170,775 +1495,3946 @@ int mbgdrvr_enable_cyclic( PCPS_DDEV *pddev, unsigned int force )
 
 
 
-#if DEBUG_IRQ_TIMING
+#if _PCPS_USE_STATUS_SNAPSHOT
 
 static /*HDR*/
-void report_irq_timing( int lvl, const PCPS_DDEV *pddev,
-                        unsigned long jiffies_now,
-                        unsigned long jiffies_at_irq,
-                        long delta_jiffies )
+int snapshot_read_item( PCPS_DDEV *pddev, int item, void *p, size_t size )
 {
+  int rc;
 
-}  // report_irq_timing
+  if ( _pcps_access_is_unsafe( pddev ) )
+    return MBG_ERR_IRQ_UNSAFE;
 
-#endif  // DEBUG_IRQ_TIMING
+  _pcps_sem_inc( pddev );
 
+  #if USE_PCPS_PRIO_LANES
+    // Reading the status is less urgent than reading the time.
+    pddev->lane_may_yield = 1;
+  #endif
 
+  switch ( item )
+  {
+    case MBG_SNAPSHOT_BVAR_STAT:
+      rc = _pcps_read_gps( pddev, PC_GPS_BVAR_STAT, p, (uint16_t) size );
+      break;
 
-static /*HDR*/
-unsigned int mbgclock_poll( struct file *filp, poll_table *pt )
-{
-  unsigned int poll_retval = 0;
-  PCPS_DDEV *pddev = NULL;
-  int sys_rc = mbgdrvr_get_pddev( &pddev, filp, "poll" );
+    case MBG_SNAPSHOT_PTP_STATE:
+      rc = _pcps_read_gps( pddev, PC_GPS_PTP_STATE, p, (uint16_t) size );
+      break;
 
-  if ( sys_rc < 0 )
-  {
-    poll_retval = POLLERR | POLLHUP;
-    goto out;
-  }
+    case MBG_SNAPSHOT_IRIG_CTRL_BITS:
+      rc = _pcps_read( pddev, PCPS_GET_IRIG_CTRL_BITS, p, (uint16_t) size );
+      break;
 
-  mbgdrvr_enable_cyclic( pddev, 0 );
+    case MBG_SNAPSHOT_ALL_XMR_STATUS:
+      rc = _pcps_read_gps( pddev, PC_GPS_ALL_XMR_STATUS, p, (uint16_t) size );
+      break;
 
-  poll_wait( filp, &pddev->wait_queue, pt );
+    case MBG_SNAPSHOT_ALL_GNSS_SAT_INFO:
+      rc = _pcps_read_gps( pddev, PC_GPS_ALL_GNSS_SAT_INFO, p, (uint16_t) size );
+      break;
 
-  if ( atomic_read( &pddev->data_avail ) )
-    poll_retval = POLLIN | POLLRDNORM;
-  else
-  {
-    unsigned long flags = 0;
-    unsigned long jiffies_now = jiffies;
-    unsigned long jiffies_at_irq;
-    long delta_jiffies;
+    default:
+      rc = MBG_ERR_INV_PARM;
 
-    if ( get_cyclic_lock( pddev, &flags, __func__ ) < 0 )
-      return -ERESTARTSYS;
+  }  // switch
 
-    jiffies_at_irq = pddev->jiffies_at_irq;
+  _pcps_sem_dec( pddev );
 
-    release_cyclic_lock( pddev, &flags, __func__ );
+  return rc;
 
-    delta_jiffies = (long) jiffies_now - (long) jiffies_at_irq;
+}  // snapshot_read_item
 
 
-    if ( delta_jiffies > CYCLIC_TIMEOUT )
+
+static /*HDR*/
+void mbgdrvr_status_snapshot_work( struct work_struct *work )
+{
+  PCPS_DDEV *pddev = container_of( work, PCPS_DDEV, snapshot_work.work );
+  int nxt_idx = pddev->snapshot_idx ^ 1;
+  PCPS_STATUS_SNAPSHOT *p = &pddev->snapshot[nxt_idx];
+  uint32_t valid_items = 0;
+  int item;
+
+  // Readers only ever access the current buffer, so the other one can be
+  // refilled without holding the snapshot mutex. The snapshot buffers have
+  // been kmalloc'ed, so they are DMA-capable and can be passed directly
+  // to the read functions.
+  if ( get_dev_connected( pddev ) )
+  {
+    for ( item = 0; item < N_MBG_SNAPSHOT_ITEMS; item++ )
     {
-      mbg_kdd_msg( MBG_LOG_WARN, "** Cyclic timeout polling " MBG_DEV_NAME_FMT ": 0x%08lX - 0x%08lX = %li, exceeds %li",
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
-                   jiffies_now, jiffies_at_irq,
-                   delta_jiffies, CYCLIC_TIMEOUT );
+      size_t size;
+      void *p_item;
+      int rc;
 
-      #if DEBUG_IRQ_TIMING
-        report_irq_timing( MBG_LOG_DEBUG, pddev, jiffies_now, jiffies_at_irq, delta_jiffies );
-      #endif
+      if ( !( pddev->snapshot_supp_items & ( 1UL << item ) ) )
+        continue;
 
-      mbgdrvr_enable_cyclic( pddev, 2 );
+      p_item = status_snapshot_item( pddev, p, item, &size );
+      rc = snapshot_read_item( pddev, item, p_item, size );
+
+      if ( mbg_rc_is_success( rc ) )
+        valid_items |= ( 1UL << item );
+      else
+      {
+        pddev->snapshot_n_errors++;
+        _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_WARN, "Failed to read snapshot item %i from " MBG_DEV_NAME_FMT ", rc: %i",
+                     item, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
+      }
     }
-    else
+
+    p->valid_items = valid_items;
+    p->jiffies_updated = jiffies;
+
+    // Workqueue threads don't receive signals, so this can't be interrupted.
+    if ( _mbg_mutex_acquire( &pddev->snapshot_mutex ) == 0 )
     {
-      #if DEBUG_IRQ_TIMING
-        mbg_kdd_msg( MBG_LOG_DEBUG, "Poll chk cyclic timeout " MBG_DEV_NAME_FMT ": 0x%08lX - 0x%08lX = %li, timeout: %li",
-                     _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
-                     jiffies_now, jiffies_at_irq,
-                     delta_jiffies, CYCLIC_TIMEOUT );
-      #endif
+      pddev->snapshot_idx = nxt_idx;
+      pddev->snapshot_seq++;
+      _mbg_mutex_release( &pddev->snapshot_mutex );
     }
   }
 
-out:
-  return poll_retval;
+  schedule_delayed_work( &pddev->snapshot_work, pddev->snapshot_intv );
 
-}  // mbgclock_poll
+}  // mbgdrvr_status_snapshot_work
 
 
 
-/*
- * The function below is called whenever fcntl( .., F_SETFL, ..) is called
- * to change the device's FASYNC flag.
- *
- */
 static /*HDR*/
-int mbgclock_fasync( int fd, struct file *filp, int on )
+int snapshot_read_counts( PCPS_DDEV *pddev )
 {
-  PCPS_DDEV *pddev = NULL;
-  int sys_rc = mbgdrvr_get_pddev( &pddev, filp, "fasync" );
+  union
+  {
+    XMULTI_REF_INSTANCES xmulti_ref_instances;
+    MBG_GNSS_MODE_INFO gnss_mode_info;
+  } *p_tmp;
+  int rc = MBG_SUCCESS;
 
-  if ( sys_rc < 0 )
+  // Acquire the device before the buffer is allocated since
+  // _pcps_sem_inc() returns immediately if interrupted.
+  _pcps_sem_inc( pddev );
+
+  // This buffer needs to be DMA-capable for USB devices.
+  p_tmp = _pcps_kmalloc( sizeof( *p_tmp ) );
+
+  if ( p_tmp == NULL )
+  {
+    rc = MBG_ERR_NO_MEM;
     goto out;
+  }
 
-  // mbgdrvr_enable_cyclic( pddev, 0 );    //##++ conditionally / always enable IRQ here?
+  if ( pddev->snapshot_supp_items & MBG_SNAPSHOT_MSK_ALL_XMR_STATUS )
+  {
+    rc = _pcps_read_gps_var( pddev, PC_GPS_XMR_INSTANCES, p_tmp->xmulti_ref_instances );
 
-  sys_rc = fasync_helper( fd, filp, on, &pddev->fasyncptr );
+    if ( mbg_rc_is_success( rc ) )
+    {
+      _mbg_swab_xmulti_ref_instances( &p_tmp->xmulti_ref_instances );
 
-out:
-  return sys_rc;
+      // If there are more instances than we can store then the item is not supported.
+      if ( p_tmp->xmulti_ref_instances.n_xmr_settings <= MAX_PARM_XMR )
+        pddev->snapshot_n_xmr = p_tmp->xmulti_ref_instances.n_xmr_settings;
+    }
 
-}  // mbgclock_fasync
+    if ( pddev->snapshot_n_xmr == 0 )
+      pddev->snapshot_supp_items &= ~MBG_SNAPSHOT_MSK_ALL_XMR_STATUS;
+  }
 
+  if ( pddev->snapshot_supp_items & MBG_SNAPSHOT_MSK_ALL_GNSS_SAT_INFO )
+  {
+    rc = _pcps_read_gps_var( pddev, PC_GPS_GNSS_MODE, p_tmp->gnss_mode_info );
 
+    if ( mbg_rc_is_success( rc ) )
+    {
+      int n;
 
-static /*HDR*/
-#if FLUSH_WITH_LOCK_OWNER_ID
-int mbgclock_flush( struct file *filp, fl_owner_t id )
-#else
-int mbgclock_flush( struct file *filp )
-#endif
-{
-  PCPS_DDEV *pddev = NULL;
-  int sys_rc = mbgdrvr_get_pddev( &pddev, filp, "flush" );
+      _mbg_swab_mbg_gnss_mode_info( &p_tmp->gnss_mode_info );
+      n = num_bits_set( p_tmp->gnss_mode_info.supp_gnss_types );
 
-  if ( sys_rc < 0 )
-    goto out;
+      if ( n <= MAX_PARM_GNSS_SAT )
+        pddev->snapshot_n_gnss = (uint16_t) n;
+    }
 
-  atomic_set( &pddev->data_avail, 0 );
+    if ( pddev->snapshot_n_gnss == 0 )
+      pddev->snapshot_supp_items &= ~MBG_SNAPSHOT_MSK_ALL_GNSS_SAT_INFO;
+  }
+
+  _pcps_kfree( p_tmp, sizeof( *p_tmp ) );
 
 out:
-  return sys_rc;
+  _pcps_sem_dec( pddev );
 
-}  // mbgclock_flush
+  return rc;
+
+}  // snapshot_read_counts
 
 
 
 static /*HDR*/
-int mbgclock_open( struct inode *inode, struct file *filp )
+void mbgdrvr_start_status_snapshot( PCPS_DDEV *pddev )
 {
-  PCPS_DDEV **ppddev;
-  PCPS_DDEV *pddev;
-  int minor = iminor( inode );
-  int retval = 0;
-  _mbg_dbg_hw_lpt_vars
+  uint32_t supp_items = 0;
 
-  _mbg_dbg_hw_lpt_set_bit( MBG_BIT_OPEN );
+  if ( status_snapshot_intv <= 0 )
+    return;
 
-  if ( filp == NULL )
+  if ( _pcps_ddev_has_gps_data( pddev ) )
   {
-    mbg_kdd_msg( MBG_LOG_WARN, "Open minor %i called with file pointer NULL", minor );
-    retval = -EBADF;
-    goto out;
+    if ( _pcps_ddev_is_gps( pddev ) )
+      supp_items |= MBG_SNAPSHOT_MSK_BVAR_STAT;
+
+    if ( _pcps_ddev_has_ptp( pddev ) )
+      supp_items |= MBG_SNAPSHOT_MSK_PTP_STATE;
+
+    if ( _pcps_ddev_has_xmr( pddev ) )
+      supp_items |= MBG_SNAPSHOT_MSK_ALL_XMR_STATUS;
+
+    if ( _pcps_ddev_is_gnss( pddev ) )
+      supp_items |= MBG_SNAPSHOT_MSK_ALL_GNSS_SAT_INFO;
   }
 
-  if ( _down_interruptible( &sem_fops, "sem_fops", __func__, filp ) < 0 )
+  if ( _pcps_ddev_has_irig_ctrl_bits( pddev ) )
+    supp_items |= MBG_SNAPSHOT_MSK_IRIG_CTRL_BITS;
+
+  pddev->snapshot_supp_items = supp_items & status_snapshot_items;
+
+  // The number of XMR and GNSS status structures depends on the device,
+  // but doesn't change at runtime, so we determine it only once.
+  snapshot_read_counts( pddev );
+
+  if ( pddev->snapshot_supp_items == 0 )
   {
-    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p open minor %i: interrupted wait for sem_fops",
-                 filp, minor );
-    retval = -ERESTARTSYS;
-    goto out;
+    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "No status snapshot items supported by " MBG_DEV_NAME_FMT,
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+    return;
   }
 
-  ppddev = ddev_list_locate_minor( minor );
+  pddev->snapshot = _pcps_kmalloc( 2 * sizeof( *pddev->snapshot ) );
 
-  if ( ppddev == NULL )
-    goto out_enodev;
+  if ( pddev->snapshot == NULL )
+  {
+    mbg_kdd_msg( MBG_LOG_WARN, "Failed to allocate status snapshot buffers for " MBG_DEV_NAME_FMT,
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+    return;
+  }
 
-  pddev = *ppddev;
+  memset( pddev->snapshot, 0, 2 * sizeof( *pddev->snapshot ) );
+  pddev->snapshot_idx = 0;
+  pddev->snapshot_intv = msecs_to_jiffies( status_snapshot_intv );
 
-  if ( pddev == NULL )
-    goto out_enodev;
+  if ( pddev->snapshot_intv == 0 )
+    pddev->snapshot_intv = 1;
 
+  _mbg_mutex_init( &pddev->snapshot_mutex, "snapshot_mutex" );
+  INIT_DELAYED_WORK( &pddev->snapshot_work, mbgdrvr_status_snapshot_work );
 
-  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p open minor %i",
-               filp, minor );
+  // The device is not yet flagged as connected, so the first
+  // snapshot is taken after the first interval.
+  schedule_delayed_work( &pddev->snapshot_work, pddev->snapshot_intv );
 
-  filp->private_data = ppddev;
+  mbg_kdd_msg( MBG_LOG_INFO, "Status snapshots of " MBG_DEV_NAME_FMT " every %i ms, items %02lX",
+               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+               status_snapshot_intv, (ulong) pddev->snapshot_supp_items );
 
-  atomic_inc( &pddev->open_count );
+}  // mbgdrvr_start_status_snapshot
 
-  _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "%p open: new open count: %i, dev: %p",
-               filp, atomic_read( &pddev->open_count ), pddev );
 
-  #if _PCPS_MUST_UPDATE_USE_COUNT
-    MOD_INC_USE_COUNT;
-  #endif
 
-  goto out_up_sem_fops;
+static /*HDR*/
+void mbgdrvr_stop_status_snapshot( PCPS_DDEV *pddev )
+{
+  PCPS_STATUS_SNAPSHOT *p = pddev->snapshot;
 
+  if ( p == NULL )
+    return;
 
-out_enodev:
-   retval = -ENODEV;
-  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "%p open failed for minor %i: ENODEV",
-               filp, minor );
+  // The work item re-arms itself, which is handled properly by
+  // cancel_delayed_work_sync().
+  cancel_delayed_work_sync( &pddev->snapshot_work );
 
-out_up_sem_fops:
-  _up( &sem_fops, "sem_fops", "open", filp );
+  pddev->snapshot = NULL;
+  _pcps_kfree( p, 2 * sizeof( *p ) );
 
-out:
-  _mbg_dbg_hw_lpt_clr_bit( MBG_BIT_OPEN );
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Stopped status snapshots of " MBG_DEV_NAME_FMT,
+               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
 
-  return retval;
+}  // mbgdrvr_stop_status_snapshot
+
+#endif  // _PCPS_USE_STATUS_SNAPSHOT
 
-}  // mbgclock_open
 
 
+#if _PCPS_USE_ASYNC_REQ
 
 static /*HDR*/
-int mbgclock_release( struct inode *inode, struct file *filp )
+int async_req_exec( PCPS_DDEV *pddev, PCPS_ASYNC_REQ *p )
 {
-  PCPS_DDEV *pddev;
-  int retval = 0;
-  _mbg_dbg_hw_lpt_vars
+  int rc;
 
+  if ( _pcps_access_is_unsafe( pddev ) )
+    return MBG_ERR_IRQ_UNSAFE;
 
-  _mbg_dbg_hw_lpt_set_bit( MBG_BIT_RELEASE );
+  _pcps_sem_inc( pddev );
 
-  if ( _down_interruptible( &sem_fops, "sem_fops", __func__, filp ) < 0 )
-  {
-    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: interrupted wait for sem_fops",
-                 filp, minor );
-    retval = -ERESTARTSYS;
-    goto out;  // don't return directly
-  }
+  #if USE_PCPS_PRIO_LANES
+    // Asynchronous requests are by definition not urgent.
+    pddev->lane_may_yield = 1;
+  #endif
 
-  // sem_fops must not be released before we're through with pddev !
+  if ( p->is_write )
+    rc = _pcps_write_gps( pddev, p->cmd, p->buf, p->size );
+  else
+    rc = _pcps_read_gps( pddev, p->cmd, p->buf, p->size );
 
-  pddev = *( (PCPS_DDEV **) filp->private_data );
+  _pcps_sem_dec( pddev );
 
-  if ( pddev == NULL )
+  return rc;
+
+}  // async_req_exec
+
+
+
+static /*HDR*/
+/**
+ * @brief Find the queued asynchronous request which has been submitted first
+ *
+ * Must be called with the async_lock held.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ *
+ * @return Pointer to the request, or NULL if no request is queued
+ */
+PCPS_ASYNC_REQ *async_req_next_queued( PCPS_DDEV *pddev )
+{
+  PCPS_ASYNC_REQ *p_next = NULL;
+  int i;
+
+  for ( i = 0; i < PCPS_ASYNC_MAX_PENDING; i++ )
   {
-    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "%p release %i: closing with dev NULL",
-                 filp, iminor( inode ) );
-    retval = -ENODEV;
-    goto out_up_sem_fops;
+    PCPS_ASYNC_REQ *p = &pddev->async_req[i];
+
+    if ( p->state != PCPS_ASYNC_REQ_QUEUED )
+      continue;
+
+    // Ticket numbers may wrap around.
+    if ( p_next == NULL || (int32_t) ( p->ticket - p_next->ticket ) < 0 )
+      p_next = p;
   }
 
-  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: closing",
-                filp, iminor( inode ) );
+  return p_next;
 
-  if ( atomic_dec_and_test( &pddev->open_count ) )
+}  // async_req_next_queued
+
+
+
+static /*HDR*/
+void mbgdrvr_async_work( struct work_struct *work )
+{
+  PCPS_DDEV *pddev = container_of( work, PCPS_DDEV, async_work );
+
+  for (;;)
   {
-    if ( get_dev_connected( pddev ) )
+    PCPS_ASYNC_REQ *p;
+    int rc;
+
+    _mbg_spin_lock_acquire( &pddev->async_lock );
+    p = async_req_next_queued( pddev );
+
+    if ( p )
+      p->state = PCPS_ASYNC_REQ_BUSY;
+
+    _mbg_spin_lock_release( &pddev->async_lock );
+
+    if ( p == NULL )
+      break;
+
+    rc = async_req_exec( pddev, p );
+
+    _mbgddmsg_5( DEBUG_DRVR, MBG_LOG_INFO, "Async request %u, GPS cmd %02X done on " MBG_DEV_NAME_FMT ", rc: %i",
+                 p->ticket, p->cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
+
+    _mbg_spin_lock_acquire( &pddev->async_lock );
+
+    p->rc = rc;
+
+    if ( p->filp == NULL )
     {
-      _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: closing with connected dev " MBG_DEV_NAME_FMT,
-                   filp, iminor( inode ),
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      mbgdrvr_disable_cyclic( pddev );
+      // The device has been closed by the submitter
+      // while the request was being executed.
+      _ioctl_buf_free( p->buf, p->size );
+      p->buf = NULL;
+      p->state = PCPS_ASYNC_REQ_FREE;
     }
     else
-    {
-      _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: closing with disconnected dev " MBG_DEV_NAME_FMT,
-                   filp, iminor( inode ),
-                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      mbgdrvr_delete_device( pddev );
-      pddev = NULL;
-      retval = -ENODEV;
-    }
-  }
-  else
-    _mbgddmsg_5( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: new open count: %i, dev " MBG_DEV_NAME_FMT,
-                 filp, iminor( inode ), atomic_read( &pddev->open_count ),
-                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      p->state = PCPS_ASYNC_REQ_DONE;
 
-  #if _PCPS_MUST_UPDATE_USE_COUNT
-    MOD_DEC_USE_COUNT;
-  #endif
+    _mbg_spin_lock_release( &pddev->async_lock );
 
-  if ( pddev )  // has not been deleted above
-  {
-    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i calling fasync_helper",
-                 filp, iminor( inode ));
-    fasync_helper( -1, filp, 0, &pddev->fasyncptr );
+    wake_up_interruptible( &pddev->wait_queue );
   }
 
+}  // mbgdrvr_async_work
 
-out_up_sem_fops:
-  _up( &sem_fops, "sem_fops", "release", filp );
-
-out:
-  _mbg_dbg_hw_lpt_clr_bit( MBG_BIT_RELEASE );
 
-  return retval;
 
-}  // mbgclock_release
+static /*HDR*/
+void mbgdrvr_init_async_req( PCPS_DDEV *pddev )
+{
+  memset( pddev->async_req, 0, sizeof( pddev->async_req ) );
+  pddev->async_ticket = 0;
+  _mbg_spin_lock_init( &pddev->async_lock, "async_lock" );
+  INIT_WORK( &pddev->async_work, mbgdrvr_async_work );
 
+}  // mbgdrvr_init_async_req
 
 
-#if DEBUG_IRQ_LATENCY
 
 static /*HDR*/
-long dt( int64_t delta_cyc )
+void mbgdrvr_exit_async_req( PCPS_DDEV *pddev )
 {
-  return (long) ( delta_cyc / cpu_khz / 1000 );
+  int i;
 
-}  // dt
+  cancel_work_sync( &pddev->async_work );
 
-#endif
+  for ( i = 0; i < PCPS_ASYNC_MAX_PENDING; i++ )
+  {
+    PCPS_ASYNC_REQ *p = &pddev->async_req[i];
+
+    if ( p->buf )
+    {
+      _ioctl_buf_free( p->buf, p->size );
+      p->buf = NULL;
+    }
+
+    p->state = PCPS_ASYNC_REQ_FREE;
+  }
+
+}  // mbgdrvr_exit_async_req
 
 
 
 static /*HDR*/
-ssize_t mbgclock_read( struct file *filp, char *buffer,
-                       size_t count, loff_t *ppos )
+/**
+ * @brief Discard the asynchronous requests submitted via a file
+ *
+ * Called when the file is closed. A request which is just being
+ * executed is discarded by the worker when it has been completed.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  filp   The file which is being closed
+ */
+void mbgdrvr_async_release( PCPS_DDEV *pddev, struct file *filp )
 {
-  PCPS_DDEV *pddev;
-  unsigned long flags = 0;
-  PCPS_TIME t;
-  char timestr[MBG_SIZE_TLG];
-  int bytes_to_copy;
-  ssize_t sys_rc = mbgdrvr_get_pddev( &pddev, filp, ( filp->f_flags & O_NONBLOCK ) ?
-                                      "read (non-blocking)" : "read (blocking)" );
-
-  if ( sys_rc < 0 )
-    goto out;
+  int i;
 
-  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "%p read starts", filp );
+  _mbg_spin_lock_acquire( &pddev->async_lock );
 
-  if ( atomic_read( &pddev->open_count ) == 0 )  //##++
+  for ( i = 0; i < PCPS_ASYNC_MAX_PENDING; i++ )
   {
-    _mbgddmsg_3( DEBUG, MBG_LOG_ERR, "%p read: dev " MBG_DEV_NAME_FMT " not opened",
-                 filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-    sys_rc = -EIO;
-    goto out;
-  }
+    PCPS_ASYNC_REQ *p = &pddev->async_req[i];
 
-  #if !ESPIPE_BY_VFS
-    if ( ppos != &filp->f_pos )
+    if ( p->state == PCPS_ASYNC_REQ_FREE || p->filp != filp )
+      continue;
+
+    p->filp = NULL;
+
+    if ( p->state != PCPS_ASYNC_REQ_BUSY )
     {
-      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "%p read: dev " MBG_DEV_NAME_FMT " past end",
-                   filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      sys_rc = -ESPIPE;
-      goto out;
+      _ioctl_buf_free( p->buf, p->size );
+      p->buf = NULL;
+      p->state = PCPS_ASYNC_REQ_FREE;
     }
-  #endif
-
-  if ( buffer == NULL )
-  {
-    _mbgddmsg_1( DEBUG, MBG_LOG_ERR, "%p read: no buffer specified", filp );
-    sys_rc = -EINVAL;
-    goto out;
   }
 
-  mbgdrvr_enable_cyclic( pddev, 0 );
+  _mbg_spin_lock_release( &pddev->async_lock );
 
-  if ( count < sizeof( timestr ) )
-    _mbgddmsg_3( DEBUG, MBG_LOG_WARN, "%p read: buffer size (%i) less than required (%i)",
-                 filp, (int) count, (int) sizeof( timestr ) );
+}  // mbgdrvr_async_release
 
-  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "%p read: wait for data_avail", filp );
 
-  while ( !atomic_read( &pddev->data_avail ) )
+
+static /*HDR*/
+bool mbgdrvr_async_result_avail( PCPS_DDEV *pddev, struct file *filp )
+{
+  bool avail = false;
+  int i;
+
+  _mbg_spin_lock_acquire( &pddev->async_lock );
+
+  for ( i = 0; i < PCPS_ASYNC_MAX_PENDING; i++ )
   {
-    if ( filp->f_flags & O_NONBLOCK )
+    PCPS_ASYNC_REQ *p = &pddev->async_req[i];
+
+    if ( p->state == PCPS_ASYNC_REQ_DONE && p->filp == filp )
     {
-      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "%p read non-blocking returns with no data available, dev: " MBG_DEV_NAME_FMT,
-                   filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      sys_rc = -EAGAIN;
-      goto out;
+      avail = true;
+      break;
     }
+  }
 
-    #if USE_WAIT_EVENT
-      for (;;)
-      {
-        int dev_connected = 0;
-        int this_rc = wait_event_interruptible_timeout( pddev->wait_queue,
-           atomic_read( &pddev->data_avail ) || !(dev_connected = get_dev_connected( pddev ) ), CYCLIC_TIMEOUT );
-
-        if ( this_rc < 0 )  // interrupted
-          goto out_interrupted_wait;
+  _mbg_spin_lock_release( &pddev->async_lock );
 
-        if ( !dev_connected )  // device has been removed
-        {
-          _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "%p read dev " MBG_DEV_NAME_FMT ": device removed while waiting",
-                       filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-          sys_rc = -ERESTARTSYS;
-          goto out;
-        }
+  return avail;
 
-        if ( this_rc )  // data available, the normal case
-          break;
+}  // mbgdrvr_async_result_avail
 
-        // timeout, cyclic reads may have been disabled, try to re-enable
-        _mbgddmsg_3( DEBUG, MBG_LOG_WARN, "%p read: IRQ timeout, dev " MBG_DEV_NAME_FMT,
-                     filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
 
-        mbgdrvr_enable_cyclic( pddev, 2 );
-      }
-    #else
-      // There may be a race condition if data has become available
-      // after the while() check but before we go to sleep below.
-      // However, this doesn't really matter for our application.
-      interruptible_sleep_on_timeout( &pddev->wait_queue );   // used with 2.4.x and needs to be fixed
 
-      if ( signal_pending( current ) )
-        goto out_interrupted_wait;
-    #endif
-  }
+static /*HDR*/
+/**
+ * @brief Queue an asynchronous GPS request, see ::IOCTL_ASYNC_SUBMIT
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  filp   The file the request is submitted with
+ * @param[in]  arg    The user space address of the ::MBG_ASYNC_REQ
+ *
+ * @return 0 if the request has been queued, else a negative errno
+ */
+long mbgdrvr_async_submit( PCPS_DDEV *pddev, struct file *filp, unsigned long arg )
+{
+  MBG_ASYNC_REQ req;
+  PCPS_ASYNC_REQ *p = NULL;
+  bool is_write;
+  void *buf;
+  uint32_t ticket = 0;
+  int i;
 
+  if ( copy_from_user( &req, (void *) arg, sizeof( req ) ) )
+    return IOCTL_RC_ERR_COPY_FROM_USER;
 
-  if ( get_cyclic_lock( pddev, &flags, __func__ ) < 0 )
-    return -ERESTARTSYS;
+  if ( req.size == 0 || req.size > 0xFFFF || req.info > 0xFF ||
+       ( req.flags & ~MBG_ASYNC_REQ_FLAG_WRITE ) )
+    return IOCTL_RC_ERR_INVAL_PARAM;
 
-  t = pddev->t;
-  atomic_set( &pddev->data_avail, 0 );
+  is_write = ( req.flags & MBG_ASYNC_REQ_FLAG_WRITE ) != 0;
 
-  release_cyclic_lock( pddev, &flags, __func__ );
+  #if !OMIT_PRIV_CHECKING
+    // Same as for IOCTL_PCPS_GENERIC_WRITE_GPS.
+    if ( is_write && !capable( CAP_SYS_ADMIN ) )
+      return IOCTL_RC_ERR_PERM;
+  #endif
 
+  buf = _ioctl_buf_alloc( req.size );
 
-  pcps_time_to_time_str( &t, timestr, sizeof( timestr ) );
+  if ( buf == NULL )
+    return IOCTL_RC_ERR_NO_MEM;
 
-  #if DEBUG_IRQ_LATENCY
-    if ( debug > 1 )
+  if ( is_write )
+    if ( copy_from_user( buf, (void *) (uintptr_t) req.in_p, req.size ) )
     {
-      unsigned long long tsc;
+      _ioctl_buf_free( buf, req.size );
+      return IOCTL_RC_ERR_COPY_FROM_USER;
+    }
 
-      rdtscll( tsc );
+  _mbg_spin_lock_acquire( &pddev->async_lock );
 
-      if ( _pcps_ddev_is_usb( pddev ) )
-        mbg_kdd_msg( MBG_LOG_INFO, "%s %Lu %lu %lu, %lu", _pcps_ddev_type_name( pddev ),
-                     tsc, dt( tsc - tsc_usb_2 ), dt( tsc_usb_2 - tsc_usb_1 ),
-                     dt( tsc_usb_1 - tsc_irq_1 ) );
-      else
-        mbg_kdd_msg( MBG_LOG_INFO, "%s %Lu %lu %lu", _pcps_ddev_type_name( pddev ),
-                     tsc, dt( tsc - tsc_irq_2 ), dt( tsc_irq_2 - tsc_irq_1 ) );
+  for ( i = 0; i < PCPS_ASYNC_MAX_PENDING; i++ )
+  {
+    if ( pddev->async_req[i].state == PCPS_ASYNC_REQ_FREE )
+    {
+      p = &pddev->async_req[i];
+
+      // Ticket 0 is never assigned.
+      if ( ++pddev->async_ticket == 0 )
+        pddev->async_ticket++;
+
+      ticket = pddev->async_ticket;
+
+      p->filp = filp;
+      p->buf = buf;
+      p->ticket = ticket;
+      p->rc = MBG_SUCCESS;
+      p->size = (uint16_t) req.size;
+      p->cmd = (uint8_t) req.info;
+      p->is_write = is_write;
+      p->state = PCPS_ASYNC_REQ_QUEUED;
+      break;
     }
-  #endif
+  }
 
-  bytes_to_copy = _min( count, sizeof( timestr ) - 1 );
+  _mbg_spin_lock_release( &pddev->async_lock );
 
-  if ( copy_to_user( buffer, timestr, bytes_to_copy ) )
+  if ( p == NULL )
   {
-    _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_ERR, "%p read: unable to copy to user space, dev " MBG_DEV_NAME_FMT,
-                  filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-    sys_rc = -EFAULT;
-    goto out;
+    _ioctl_buf_free( buf, req.size );
+    return -EBUSY;
   }
 
-  sys_rc = bytes_to_copy;
-  _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "%p read dev " MBG_DEV_NAME_FMT ": \"%s\"",
-               filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), timestr );
-  goto out;
+  schedule_work( &pddev->async_work );
 
+  if ( put_user( ticket, &( (MBG_ASYNC_REQ __user *) arg )->ticket ) )
+    return IOCTL_RC_ERR_COPY_TO_USER;  // the request is discarded when the file is closed
 
-out_interrupted_wait:
-  _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "%p read dev " MBG_DEV_NAME_FMT ": blocking interrupted",
-               filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-  sys_rc = -ERESTARTSYS;
+  return 0;
 
-out:
-  return sys_rc;
+}  // mbgdrvr_async_submit
 
-}  // mbgclock_read
 
 
+static /*HDR*/
+/**
+ * @brief Fetch the result of an asynchronous GPS request, see ::IOCTL_ASYNC_FETCH
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  filp   The file the request has been submitted with
+ * @param[in]  arg    The user space address of the ::MBG_ASYNC_RESULT
+ *
+ * @return 0 if the result has been fetched, -EAGAIN if the request has
+ *         not yet been completed, else another negative errno
+ */
+long mbgdrvr_async_fetch( PCPS_DDEV *pddev, struct file *filp, unsigned long arg )
+{
+  MBG_ASYNC_RESULT res;
+  MBG_ASYNC_RESULT __user *p_usr = (MBG_ASYNC_RESULT __user *) arg;
+  PCPS_ASYNC_REQ req;
+  long sys_rc = 0;
+  int i;
+
+  if ( copy_from_user( &res, p_usr, sizeof( res ) ) )
+    return IOCTL_RC_ERR_COPY_FROM_USER;
+
+  if ( res.ticket == 0 )
+    return IOCTL_RC_ERR_INVAL_PARAM;
+
+  _mbg_spin_lock_acquire( &pddev->async_lock );
+
+  for ( i = 0; i < PCPS_ASYNC_MAX_PENDING; i++ )
+  {
+    PCPS_ASYNC_REQ *p = &pddev->async_req[i];
+
+    if ( p->state == PCPS_ASYNC_REQ_FREE || p->filp != filp || p->ticket != res.ticket )
+      continue;
+
+    if ( p->state != PCPS_ASYNC_REQ_DONE )
+      sys_rc = -EAGAIN;
+    else
+      if ( !p->is_write && res.out_sz < p->size )
+        sys_rc = IOCTL_RC_ERR_INVAL_PARAM;
+      else
+      {
+        // Detach the result from the slot.
+        req = *p;
+        p->buf = NULL;
+        p->state = PCPS_ASYNC_REQ_FREE;
+      }
+
+    goto out_found;
+  }
+
+  sys_rc = IOCTL_RC_ERR_INVAL_PARAM;  // unknown ticket
+
+out_found:
+  _mbg_spin_lock_release( &pddev->async_lock );
+
+  if ( sys_rc < 0 )
+    return sys_rc;
+
+  if ( !req.is_write && mbg_rc_is_success( req.rc ) )
+    if ( copy_to_user( (void *) (uintptr_t) res.out_p, req.buf, req.size ) )
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+
+  if ( sys_rc == 0 )
+    if ( put_user( (int32_t) req.rc, &p_usr->rc ) )
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+
+  _ioctl_buf_free( req.buf, req.size );
+
+  return sys_rc;
+
+}  // mbgdrvr_async_fetch
+
+#endif  // _PCPS_USE_ASYNC_REQ
+
+
+
+#if USE_PCPS_EVT_LOG_MIRROR
+
+#if !defined( MBG_EVT_LOG_SYNC_MAX_TRIES )
+  // The number of attempts to read the event log if the read
+  // position is changed concurrently by another caller.
+  #define MBG_EVT_LOG_SYNC_MAX_TRIES  3
+#endif
+
+
+static /*HDR*/
+/**
+ * @brief Read the number of entries or a single entry of a device's event log
+ *
+ * The device mutex is only held while a single entry is read, so other
+ * callers aren't blocked while the whole log is read. If the read position
+ * has been changed by another caller since the previous entry has been read,
+ * the next entry isn't read, and ::MBG_ERR_BUSY is returned instead.
+ *
+ * @param[in]     pddev   Pointer to the device structure
+ * @param[in]     cmd     ::PCPS_NUM_EVT_LOG_ENTRIES, ::PCPS_FIRST_EVT_LOG_ENTRY, or ::PCPS_NEXT_EVT_LOG_ENTRY
+ * @param[out]    p_iob   A DMA-capable buffer for the data
+ * @param[in,out] p_gen   The value of pddev->evt_log_cursor_gen when the previous entry has been read
+ *
+ * @return ::MBG_SUCCESS on success, -ERESTARTSYS if interrupted while waiting
+ *         for the device mutex, else one of the @ref MBG_ERROR_CODES
+ */
+int evt_log_read( PCPS_DDEV *pddev, uint8_t cmd, PCPS_IO_BUFFER *p_iob, int *p_gen )
+{
+  int rc;
+
+  if ( _pcps_access_is_unsafe( pddev ) )
+    return MBG_ERR_IRQ_UNSAFE;
+
+  _pcps_sem_inc( pddev );
+
+  switch ( cmd )
+  {
+    case PCPS_NUM_EVT_LOG_ENTRIES:
+      rc = _pcps_read_var( pddev, cmd, p_iob->num_evt_log_entries );
+      break;
+
+    case PCPS_NEXT_EVT_LOG_ENTRY:
+      if ( atomic_read( &pddev->evt_log_cursor_gen ) != *p_gen )
+      {
+        rc = MBG_ERR_BUSY;
+        break;
+      }
+      // fall through
+
+    default:
+      rc = _pcps_read_var( pddev, cmd, p_iob->evt_log_entry );
+      *p_gen = atomic_read( &pddev->evt_log_cursor_gen );
+
+  }  // switch
+
+  _pcps_sem_dec( pddev );
+
+  return rc;
+
+}  // evt_log_read
+
+
+
+static /*HDR*/
+/**
+ * @brief Update the event log mirror of a device
+ *
+ * If the log is not full, and the read position of the device is still
+ * after the last mirrored entry, only the new entries are read.
+ *
+ * If the log is full then each new entry replaces the oldest one, so
+ * the number of entries doesn't tell if entries have been added.
+ * In this case only the oldest entry is read and compared to the oldest
+ * entry saved at the previous update. The whole log only has to be
+ * read again if it has changed.
+ *
+ * If the log has more entries than can be mirrored then the newest
+ * entries are kept.
+ *
+ * pddev->evt_log_seq is incremented unless only new entries have been
+ * appended to the mirror.
+ *
+ * If a wait for the device mutex is interrupted by a signal, -ERESTARTSYS
+ * is returned, and the mirror is only truncated if entries which had
+ * already been read differed from the mirrored ones.
+ *
+ * Must be called with pddev->evt_log_mutex held.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ *
+ * @return ::MBG_SUCCESS on success, -ERESTARTSYS if interrupted,
+ *         else one of the @ref MBG_ERROR_CODES
+ */
+int mbgdrvr_evt_log_sync( PCPS_DDEV *pddev )
+{
+  PCPS_IO_BUFFER *p_iob;
+  MBG_NUM_EVT_LOG_ENTRIES num;
+  MBG_EVT_LOG_ENTRY first;
+  uint32_t n_old = pddev->evt_log_n_mirrored;
+  uint32_t n_dev_old = pddev->evt_log_n_dev;
+  uint32_t n_skip;
+  uint32_t n;
+  uint32_t i;
+  int gen = 0;
+  int n_tries;
+  int rc;
+
+  // The device may need a DMA-capable buffer.
+  p_iob = _pcps_kmalloc( sizeof( *p_iob ) );
+
+  if ( p_iob == NULL )
+    return MBG_ERR_NO_MEM;
+
+  rc = evt_log_read( pddev, PCPS_NUM_EVT_LOG_ENTRIES, p_iob, &gen );
+
+  if ( mbg_rc_is_error( rc ) )
+    goto out;
+
+  num = p_iob->num_evt_log_entries;
+
+  if ( pddev->evt_log_mirror == NULL || pddev->evt_log_mirror_size < num.max )
+  {
+    uint32_t size = min_t( uint32_t, num.max, PCPS_EVT_LOG_MIRROR_MAX_ENTRIES );
+
+    if ( size > pddev->evt_log_mirror_size )
+    {
+      MBG_EVT_LOG_ENTRY *p = vmalloc( size * sizeof( *p ) );
+
+      if ( p == NULL )
+      {
+        rc = MBG_ERR_NO_MEM;
+        goto out;
+      }
+
+      if ( pddev->evt_log_mirror )
+      {
+        memcpy( p, pddev->evt_log_mirror, n_old * sizeof( *p ) );
+        vfree( pddev->evt_log_mirror );
+      }
+
+      pddev->evt_log_mirror = p;
+      pddev->evt_log_mirror_size = size;
+    }
+  }
+
+  // If the log is not full then new entries are appended, and if the read
+  // position is still after the last mirrored entry, the new entries can
+  // be read without reading all the old entries again.
+  if ( pddev->evt_log_cursor_valid && ( n_old > 0 ) && ( num.used < num.max ) &&
+       ( num.used >= n_dev_old ) && ( atomic_read( &pddev->evt_log_cursor_gen ) == pddev->evt_log_cursor_synced ) )
+  {
+    uint32_t size = pddev->evt_log_mirror_size;
+    uint32_t n_new = num.used - n_dev_old;
+    uint32_t last_time = pddev->evt_log_mirror[n_old - 1].time;
+
+    // If there are more new entries than can be mirrored,
+    // skip the oldest new entries.
+    n_skip = ( n_new > size ) ? ( n_new - size ) : 0;
+
+    // If the mirror would overflow, drop the oldest entries.
+    if ( n_old + n_new - n_skip > size )
+    {
+      uint32_t n_drop = n_old + n_new - n_skip - size;
+
+      memmove( pddev->evt_log_mirror, &pddev->evt_log_mirror[n_drop],
+               ( n_old - n_drop ) * sizeof( *pddev->evt_log_mirror ) );
+      n_old -= n_drop;
+      pddev->evt_log_n_mirrored = n_old;
+      pddev->evt_log_seq++;
+    }
+
+    gen = pddev->evt_log_cursor_synced;
+
+    for ( i = 0; i < n_new; i++ )
+    {
+      rc = evt_log_read( pddev, PCPS_NEXT_EVT_LOG_ENTRY, p_iob, &gen );
+
+      if ( mbg_rc_is_error( rc ) )
+        break;
+
+      // Entries are appended in chronological order. If not, the log
+      // has been changed in a way we haven't noticed.
+      if ( p_iob->evt_log_entry.time < last_time )
+      {
+        rc = MBG_ERR_BUSY;
+        break;
+      }
+
+      last_time = p_iob->evt_log_entry.time;
+
+      if ( i >= n_skip )
+        pddev->evt_log_mirror[n_old++] = p_iob->evt_log_entry;
+    }
+
+    // The entries read so far are valid in any case.
+    pddev->evt_log_n_mirrored = n_old;
+
+    if ( mbg_rc_is_success( rc ) )
+    {
+      pddev->evt_log_n_dev = num.used;
+      pddev->evt_log_cursor_synced = gen;
+      goto out;
+    }
+
+    if ( rc == -ERESTARTSYS )
+    {
+      // Interrupted while waiting for the device mutex, so the
+      // read position is still after the last entry read.
+      pddev->evt_log_n_dev = n_dev_old + i;
+      pddev->evt_log_cursor_synced = gen;
+      goto out;
+    }
+
+    if ( rc != MBG_ERR_BUSY )
+    {
+      pddev->evt_log_cursor_valid = 0;
+      pddev->evt_log_n_dev = 0;
+      goto out;
+    }
+
+    // Fall back to reading the whole log.
+    n_old = pddev->evt_log_n_mirrored;
+  }
+  else
+    if ( ( n_old > 0 ) && ( num.used == num.max ) && ( n_dev_old == num.used ) )
+    {
+      // The log was full at the previous update, and is still full.
+      // If the oldest entry is unchanged then no entry has been added.
+      // Reading the oldest entry moves the read position, though.
+      pddev->evt_log_cursor_valid = 0;
+
+      rc = evt_log_read( pddev, PCPS_FIRST_EVT_LOG_ENTRY, p_iob, &gen );
+
+      if ( mbg_rc_is_error( rc ) )
+        goto out;
+
+      if ( memcmp( &p_iob->evt_log_entry, &pddev->evt_log_first,
+                   sizeof( p_iob->evt_log_entry ) ) == 0 )
+        goto out;
+    }
+
+  pddev->evt_log_cursor_valid = 0;
+  pddev->evt_log_n_dev = 0;
+
+  // If the log has more entries than can be mirrored,
+  // skip the oldest entries.
+  n_skip = ( num.used > pddev->evt_log_mirror_size ) ? ( num.used - pddev->evt_log_mirror_size ) : 0;
+
+  for ( n_tries = 0; n_tries < MBG_EVT_LOG_SYNC_MAX_TRIES; n_tries++ )
+  {
+    bool appended = true;
+
+    rc = MBG_SUCCESS;
+    n = num.used - n_skip;
+    memset( &first, 0, sizeof( first ) );
+
+    for ( i = 0; i < num.used; i++ )
+    {
+      uint32_t j;
+
+      rc = evt_log_read( pddev, ( i == 0 ) ? PCPS_FIRST_EVT_LOG_ENTRY : PCPS_NEXT_EVT_LOG_ENTRY,
+                         p_iob, &gen );
+
+      if ( mbg_rc_is_error( rc ) )
+        break;
+
+      if ( i == 0 )
+        first = p_iob->evt_log_entry;
+
+      if ( i < n_skip )
+        continue;
+
+      j = i - n_skip;
+
+      if ( j < n_old && memcmp( &pddev->evt_log_mirror[j], &p_iob->evt_log_entry,
+                                sizeof( p_iob->evt_log_entry ) ) )
+        appended = false;
+
+      pddev->evt_log_mirror[j] = p_iob->evt_log_entry;
+    }
+
+    if ( rc == MBG_ERR_BUSY )
+    {
+      appended = false;
+      continue;  // try again
+    }
+
+    if ( ( rc == -ERESTARTSYS ) && appended )
+    {
+      // Interrupted while waiting for the device mutex. The entries
+      // read so far match the mirror, or have been appended, so the
+      // mirror is kept, and only grows by the appended entries.
+      if ( i > n_skip + n_old )
+        pddev->evt_log_n_mirrored = i - n_skip;
+
+      break;
+    }
+
+    if ( mbg_rc_is_error( rc ) )
+      n = ( i > n_skip ) ? ( i - n_skip ) : 0;
+
+    if ( n < n_old )
+      appended = false;
+
+    if ( !appended )
+      pddev->evt_log_seq++;
+
+    pddev->evt_log_n_mirrored = n;
+
+    if ( mbg_rc_is_success( rc ) )
+    {
+      pddev->evt_log_first = first;
+      pddev->evt_log_n_dev = num.used;
+      pddev->evt_log_cursor_synced = gen;
+      pddev->evt_log_cursor_valid = 1;
+    }
+
+    break;
+  }
+
+  if ( n_tries >= MBG_EVT_LOG_SYNC_MAX_TRIES )
+  {
+    // The mirror may have been partially overwritten.
+    pddev->evt_log_n_mirrored = 0;
+    pddev->evt_log_seq++;
+  }
+
+out:
+  _pcps_kfree( p_iob, sizeof( *p_iob ) );
+
+  return rc;
+
+}  // mbgdrvr_evt_log_sync
+
+
+
+static /*HDR*/
+/**
+ * @brief Return a range of event log entries, see ::IOCTL_GET_EVT_LOG_ENTRIES
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  arg    The user space address of the ::MBG_EVT_LOG_BULK_REQ
+ *
+ * @return 0 on success, else a negative errno
+ */
+long mbgdrvr_get_evt_log_entries( PCPS_DDEV *pddev, unsigned long arg )
+{
+  MBG_EVT_LOG_BULK_REQ req;
+  long sys_rc = 0;
+  int rc;
+
+  if ( !_pcps_ddev_has_evt_log( pddev ) )
+    return IOCTL_RC_ERR_NOT_SUPP_BY_DEV;
+
+  if ( copy_from_user( &req, (void *) arg, sizeof( req ) ) )
+    return IOCTL_RC_ERR_COPY_FROM_USER;
+
+  if ( _mbg_mutex_acquire( &pddev->evt_log_mutex ) < 0 )
+    return -ERESTARTSYS;
+
+  rc = mbgdrvr_evt_log_sync( pddev );
+
+  if ( mbg_rc_is_error( rc ) )
+  {
+    _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "Failed to read event log of " MBG_DEV_NAME_FMT ", rc: %i",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
+
+    sys_rc = ( rc == -ERESTARTSYS ) ? -ERESTARTSYS :
+             ( rc == MBG_ERR_BUSY ) ? -EBUSY :
+             ( rc == MBG_ERR_NO_MEM ) ? IOCTL_RC_ERR_NO_MEM :
+             ( rc == MBG_ERR_IRQ_UNSAFE ) ? IOCTL_RC_ERR_BUSY_IRQ_UNSAFE :
+             IOCTL_RC_ERR_DEV_ACCESS;
+    goto out_release;
+  }
+
+  req.n_total = pddev->evt_log_n_mirrored;
+  req.log_seq = pddev->evt_log_seq;
+  req.n_entries = 0;
+
+  if ( req.first_idx < req.n_total )
+    req.n_entries = min_t( uint32_t, req.n_total - req.first_idx, req.max_entries );
+
+  if ( req.n_entries )
+    if ( copy_to_user( (void *) (uintptr_t) req.out_p, &pddev->evt_log_mirror[req.first_idx],
+                       req.n_entries * sizeof( MBG_EVT_LOG_ENTRY ) ) )
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+
+out_release:
+  _mbg_mutex_release( &pddev->evt_log_mutex );
+
+  if ( sys_rc == 0 )
+    if ( copy_to_user( (void *) arg, &req, sizeof( req ) ) )
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+
+  return sys_rc;
+
+}  // mbgdrvr_get_evt_log_entries
+
+#endif  // USE_PCPS_EVT_LOG_MIRROR
+
+
+
+#if _PCPS_USE_UCAP_RING
+
+#if !defined( MBG_UCAP_DRAIN_MAX_BATCH )
+  // The max. number of capture events read while the device mutex is held.
+  #define MBG_UCAP_DRAIN_MAX_BATCH  32
+#endif
+
+#if !defined( MBG_UCAP_DRAIN_MAX_BATCHES )
+  // The max. number of batches read in a single drain cycle.
+  #define MBG_UCAP_DRAIN_MAX_BATCHES  16
+#endif
+
+
+#if _PCPS_USE_PTP_CLOCK
+
+#if !defined( MBG_PTP_CLOCK_DFLT_DRAIN_INTV )
+  // The drain interval [ms] used if a PTP clock is registered
+  // but the ucap_drain_intv module parameter has not been set.
+  #define MBG_PTP_CLOCK_DFLT_DRAIN_INTV  10
+#endif
+
+
+static /*HDR*/
+int mbgdrvr_ptp_adjfine( struct ptp_clock_info *p_info, long scaled_ppm )
+{
+  // The PHC just represents the time of the device,
+  // which is disciplined by its own reference.
+  return -EOPNOTSUPP;
+
+}  // mbgdrvr_ptp_adjfine
+
+
+
+static /*HDR*/
+int mbgdrvr_ptp_adjtime( struct ptp_clock_info *p_info, s64 delta )
+{
+  return -EOPNOTSUPP;
+
+}  // mbgdrvr_ptp_adjtime
+
+
+
+static /*HDR*/
+int mbgdrvr_ptp_settime( struct ptp_clock_info *p_info, const struct timespec64 *ts )
+{
+  return -EOPNOTSUPP;
+
+}  // mbgdrvr_ptp_settime
+
+
+
+static /*HDR*/
+int mbgdrvr_ptp_gettime( struct ptp_clock_info *p_info, struct timespec64 *ts )
+{
+  PCPS_DDEV *pddev = container_of( p_info, PCPS_DDEV, ptp_info );
+  PCPS_TIME_STAMP tstamp;
+
+  if ( pddev->mm_tstamp_addr )
+    do_get_fast_hr_timestamp_safe( pddev, &tstamp );
+  else
+  {
+    int rc;
+
+    if ( _pcps_access_is_unsafe( pddev ) )
+      return -EBUSY;
+
+    _pcps_sem_inc( pddev );
+    rc = _pcps_read_var( pddev, PCPS_GIVE_HR_TIME, pddev->ucap_drain_iob->pcps_hr_time );
+    tstamp = pddev->ucap_drain_iob->pcps_hr_time.tstamp;
+    _pcps_sem_dec( pddev );
+
+    if ( mbg_rc_is_error( rc ) )
+      return -EIO;
+
+    _mbg_swab_pcps_time_stamp( &tstamp );
+  }
+
+  ts->tv_sec = tstamp.sec;
+  ts->tv_nsec = bin_frac_32_to_nsec( tstamp.frac );
+
+  return 0;
+
+}  // mbgdrvr_ptp_gettime
+
+
+
+static /*HDR*/
+int mbgdrvr_ptp_enable( struct ptp_clock_info *p_info, struct ptp_clock_request *rq, int on )
+{
+  PCPS_DDEV *pddev = container_of( p_info, PCPS_DDEV, ptp_info );
+
+  if ( rq->type != PTP_CLK_REQ_EXTTS )
+    return -EOPNOTSUPP;
+
+  if ( rq->extts.index >= (unsigned) p_info->n_ext_ts )
+    return -EINVAL;
+
+  #if defined( PTP_STRICT_FLAGS )
+    // The active slope of the capture inputs is determined by the hardware.
+    if ( ( rq->extts.flags & PTP_STRICT_FLAGS ) && ( rq->extts.flags & PTP_FALLING_EDGE ) )
+      return -EOPNOTSUPP;
+  #endif
+
+  if ( on )
+    set_bit( rq->extts.index, &pddev->ptp_extts_mask );
+  else
+    clear_bit( rq->extts.index, &pddev->ptp_extts_mask );
+
+  return 0;
+
+}  // mbgdrvr_ptp_enable
+
+
+
+static /*HDR*/
+/**
+ * @brief Pass a user capture event to the PTP clock, if enabled for the input
+ *
+ * The capture input number is used as extts channel index.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  p      The capture event as read from the device
+ */
+void mbgdrvr_ptp_extts_event( PCPS_DDEV *pddev, const PCPS_HR_TIME *p )
+{
+  struct ptp_clock_event ev;
+  PCPS_HR_TIME t;
+
+  if ( pddev->ptp_clock == NULL || pddev->ptp_extts_mask == 0 )
+    return;
+
+  t = *p;
+  _mbg_swab_pcps_hr_time( &t );
+
+  if ( t.signal >= pddev->ptp_info.n_ext_ts || !test_bit( t.signal, &pddev->ptp_extts_mask ) )
+    return;
+
+  memset( &ev, 0, sizeof( ev ) );
+  ev.type = PTP_CLOCK_EXTTS;
+  ev.index = t.signal;
+  ev.timestamp = (u64) t.tstamp.sec * NSEC_PER_SEC + bin_frac_32_to_nsec( t.tstamp.frac );
+
+  ptp_clock_event( pddev->ptp_clock, &ev );
+
+}  // mbgdrvr_ptp_extts_event
+
+
+
+static /*HDR*/
+void mbgdrvr_register_ptp_clock( PCPS_DDEV *pddev )
+{
+  struct ptp_clock_info *p_info = &pddev->ptp_info;
+  const RECEIVER_INFO *p_ri = _ri_addr( pddev );
+  struct ptp_clock *p;
+
+  if ( !ptp_clock || pddev->ucap_ring == NULL || p_ri->n_ucaps == 0 )
+    return;
+
+  memset( p_info, 0, sizeof( *p_info ) );
+  p_info->owner = THIS_MODULE;
+  snprintf( p_info->name, sizeof( p_info->name ), "%s", _pcps_ddev_type_name( pddev ) );
+  p_info->n_ext_ts = min_t( int, p_ri->n_ucaps, BITS_PER_LONG );
+  p_info->adjfine = mbgdrvr_ptp_adjfine;
+  p_info->adjtime = mbgdrvr_ptp_adjtime;
+  p_info->gettime64 = mbgdrvr_ptp_gettime;
+  p_info->settime64 = mbgdrvr_ptp_settime;
+  p_info->enable = mbgdrvr_ptp_enable;
+
+  #if ( LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 15, 0 ) )
+    // Since kernel 6.15 the PTP core rejects extts flags
+    // which are not explicitly declared to be supported.
+    p_info->supported_extts_flags = PTP_RISING_EDGE | PTP_STRICT_FLAGS;
+  #endif
+
+  pddev->ptp_extts_mask = 0;
+
+  p = ptp_clock_register( p_info, NULL );
+
+  if ( IS_ERR_OR_NULL( p ) )
+  {
+    mbg_kdd_msg( MBG_LOG_WARN, "Failed to register PTP clock for " MBG_DEV_NAME_FMT ", errno: %li",
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), p ? PTR_ERR( p ) : 0L );
+    return;
+  }
+
+  pddev->ptp_clock = p;
+
+  mbg_kdd_msg( MBG_LOG_INFO, "Registered " MBG_DEV_NAME_FMT " as PTP clock %i with %i extts channels",
+               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+               ptp_clock_index( p ), p_info->n_ext_ts );
+
+}  // mbgdrvr_register_ptp_clock
+
+
+
+static /*HDR*/
+void mbgdrvr_unregister_ptp_clock( PCPS_DDEV *pddev )
+{
+  if ( pddev->ptp_clock == NULL )
+    return;
+
+  ptp_clock_unregister( pddev->ptp_clock );
+  pddev->ptp_clock = NULL;
+
+}  // mbgdrvr_unregister_ptp_clock
+
+#endif  // _PCPS_USE_PTP_CLOCK
+
+
+
+static /*HDR*/
+/**
+ * @brief Append a capture event to the user capture ring buffer
+ *
+ * Only called by the drain worker, which is the only producer.
+ * If the ring buffer is full the event is dropped and counted.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  p      The capture event as read from the device
+ */
+void ucap_ring_push( PCPS_DDEV *pddev, const PCPS_HR_TIME *p )
+{
+  MBG_UCAP_RING_HDR *p_hdr = pddev->ucap_ring;
+  uint32_t head = p_hdr->head;
+  uint32_t tail = READ_ONCE( p_hdr->tail );
+
+  if ( p->status & PCPS_UCAP_BUFFER_FULL )
+    p_hdr->n_fifo_full++;
+
+  if ( head - tail > pddev->ucap_ring_mask )
+  {
+    p_hdr->n_overruns++;
+    return;
+  }
+
+  pddev->ucap_ring_entries[head & pddev->ucap_ring_mask] = *p;
+
+  // Make sure the entry is visible before head is updated.
+  smp_wmb();
+  WRITE_ONCE( p_hdr->head, head + 1 );
+
+  p_hdr->n_drained++;
+
+}  // ucap_ring_push
+
+
+
+static /*HDR*/
+/**
+ * @brief Move a batch of capture events from the on-board FIFO to the ring buffer
+ *
+ * The number of events in the FIFO is read first, so only existing
+ * events are read, and the device mutex is held for a limited time.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ *
+ * @return The number of events moved, or one of the @ref MBG_ERROR_CODES
+ */
+int ucap_drain_batch( PCPS_DDEV *pddev )
+{
+  PCPS_IO_BUFFER *p_iob = pddev->ucap_drain_iob;
+  uint32_t n;
+  uint32_t i;
+  int rc;
+
+  if ( _pcps_access_is_unsafe( pddev ) )
+    return MBG_ERR_IRQ_UNSAFE;
+
+  _pcps_sem_inc( pddev );
+
+  rc = _pcps_read_var( pddev, PCPS_GIVE_UCAP_ENTRIES, p_iob->pcps_ucap_entries );
+
+  if ( mbg_rc_is_error( rc ) )
+    goto out;
+
+  n = min_t( uint32_t, p_iob->pcps_ucap_entries.used, MBG_UCAP_DRAIN_MAX_BATCH );
+
+  for ( i = 0; i < n; i++ )
+  {
+    rc = _pcps_read_var( pddev, PCPS_GIVE_UCAP_EVENT, p_iob->pcps_hr_time );
+
+    if ( mbg_rc_is_error( rc ) )
+      break;
+
+    // A time stamp 0 indicates the FIFO is empty.
+    if ( p_iob->pcps_hr_time.tstamp.sec == 0 && p_iob->pcps_hr_time.tstamp.frac == 0 )
+      break;
+
+    ucap_ring_push( pddev, &p_iob->pcps_hr_time );
+
+    #if _PCPS_USE_PTP_CLOCK
+      mbgdrvr_ptp_extts_event( pddev, &p_iob->pcps_hr_time );
+    #endif
+  }
+
+  if ( mbg_rc_is_success( rc ) )
+    rc = i;
+
+out:
+  _pcps_sem_dec( pddev );
+
+  return rc;
+
+}  // ucap_drain_batch
+
+
+
+static /*HDR*/
+void mbgdrvr_ucap_drain_work( struct work_struct *work )
+{
+  PCPS_DDEV *pddev = container_of( work, PCPS_DDEV, ucap_drain_work.work );
+  int n_total = 0;
+  int i;
+
+  // Release the device mutex between batches, so other
+  // callers are not blocked if many events are pending.
+  for ( i = 0; i < MBG_UCAP_DRAIN_MAX_BATCHES; i++ )
+  {
+    int rc = ucap_drain_batch( pddev );
+
+    if ( rc < 0 )
+    {
+      pddev->ucap_ring->n_errors++;
+      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "Failed to drain ucap events from " MBG_DEV_NAME_FMT ", rc: %i",
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), rc );
+      break;
+    }
+
+    n_total += rc;
+
+    if ( rc < MBG_UCAP_DRAIN_MAX_BATCH )
+      break;
+  }
+
+  if ( n_total )
+    wake_up_interruptible( &pddev->wait_queue );
+
+  schedule_delayed_work( &pddev->ucap_drain_work, pddev->ucap_drain_intv );
+
+}  // mbgdrvr_ucap_drain_work
+
+
+
+static /*HDR*/
+void mbgdrvr_start_ucap_drain( PCPS_DDEV *pddev )
+{
+  MBG_UCAP_RING_HDR *p_hdr;
+  uint32_t n_entries;
+  size_t entries_offs;
+  int intv = ucap_drain_intv;
+
+  #if _PCPS_USE_PTP_CLOCK
+    // A PTP clock can only provide capture events if they are drained.
+    if ( intv <= 0 && ptp_clock )
+      intv = MBG_PTP_CLOCK_DFLT_DRAIN_INTV;
+  #endif
+
+  if ( intv <= 0 || !_pcps_ddev_has_ucap( pddev ) )
+    return;
+
+  n_entries = roundup_pow_of_two( clamp_t( int, ucap_ring_size, 2, MBG_UCAP_RING_MAX_ENTRIES ) );
+  entries_offs = L1_CACHE_ALIGN( sizeof( *p_hdr ) );
+
+  pddev->ucap_drain_iob = _pcps_kmalloc( sizeof( *pddev->ucap_drain_iob ) );
+
+  if ( pddev->ucap_drain_iob == NULL )
+    goto fail;
+
+  // The ring buffer can be mapped to user space, so it has to be
+  // zeroed, and must be allocated by vmalloc_user().
+  pddev->ucap_ring_alloc_size = PAGE_ALIGN( entries_offs + n_entries * sizeof( PCPS_HR_TIME ) );
+  p_hdr = vmalloc_user( pddev->ucap_ring_alloc_size );
+
+  if ( p_hdr == NULL )
+  {
+    _pcps_kfree( pddev->ucap_drain_iob, sizeof( *pddev->ucap_drain_iob ) );
+    pddev->ucap_drain_iob = NULL;
+    goto fail;
+  }
+
+  p_hdr->n_entries = n_entries;
+  p_hdr->entries_offs = (uint32_t) entries_offs;
+
+  pddev->ucap_ring_entries = (PCPS_HR_TIME *) ( (uint8_t *) p_hdr + entries_offs );
+  pddev->ucap_ring_mask = n_entries - 1;
+  pddev->ucap_drain_intv = msecs_to_jiffies( intv );
+
+  if ( pddev->ucap_drain_intv == 0 )
+    pddev->ucap_drain_intv = 1;
+
+  _mbg_mutex_init( &pddev->ucap_ring_mutex, "ucap_ring_mutex" );
+  INIT_DELAYED_WORK( &pddev->ucap_drain_work, mbgdrvr_ucap_drain_work );
+
+  pddev->ucap_ring = p_hdr;
+
+  #if _PCPS_USE_PTP_CLOCK
+    mbgdrvr_register_ptp_clock( pddev );
+  #endif
+
+  schedule_delayed_work( &pddev->ucap_drain_work, pddev->ucap_drain_intv );
+
+  mbg_kdd_msg( MBG_LOG_INFO, "Draining ucap events of " MBG_DEV_NAME_FMT " every %i ms, ring size %lu",
+               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+               intv, (ulong) n_entries );
+  return;
+
+fail:
+  mbg_kdd_msg( MBG_LOG_WARN, "Failed to allocate ucap ring buffer for " MBG_DEV_NAME_FMT,
+               _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+
+}  // mbgdrvr_start_ucap_drain
+
+
+
+static /*HDR*/
+void mbgdrvr_stop_ucap_drain( PCPS_DDEV *pddev )
+{
+  MBG_UCAP_RING_HDR *p_hdr = pddev->ucap_ring;
+
+  if ( p_hdr == NULL )
+    return;
+
+  // The work item re-arms itself, which is handled properly by
+  // cancel_delayed_work_sync().
+  cancel_delayed_work_sync( &pddev->ucap_drain_work );
+
+  #if _PCPS_USE_PTP_CLOCK
+    // Must be done before the I/O buffer is released, which
+    // is also used to read the time for the PTP clock.
+    mbgdrvr_unregister_ptp_clock( pddev );
+  #endif
+
+  pddev->ucap_ring = NULL;
+
+  // Pages which are still mapped to user space are
+  // only released when they have been unmapped.
+  vfree( p_hdr );
+
+  _pcps_kfree( pddev->ucap_drain_iob, sizeof( *pddev->ucap_drain_iob ) );
+  pddev->ucap_drain_iob = NULL;
+
+}  // mbgdrvr_stop_ucap_drain
+
+
+
+static /*HDR*/
+/**
+ * @brief Return user capture events from the ring buffer, see ::IOCTL_GET_UCAP_EVENTS
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  arg    The user space address of the ::MBG_UCAP_EVENTS_REQ
+ *
+ * @return 0 on success, else a negative errno
+ */
+long mbgdrvr_get_ucap_events( PCPS_DDEV *pddev, unsigned long arg )
+{
+  MBG_UCAP_EVENTS_REQ req;
+  PCPS_HR_TIME ev[8];
+  PCPS_HR_TIME __user *p_usr;
+  long sys_rc = 0;
+
+  if ( pddev->ucap_ring == NULL )
+    return IOCTL_RC_ERR_NOT_SUPP_BY_DEV;
+
+  if ( copy_from_user( &req, (void *) arg, sizeof( req ) ) )
+    return IOCTL_RC_ERR_COPY_FROM_USER;
+
+  p_usr = (PCPS_HR_TIME __user *) (uintptr_t) req.out_p;
+  req.n_entries = 0;
+
+  if ( _mbg_mutex_acquire( &pddev->ucap_ring_mutex ) < 0 )
+    return -ERESTARTSYS;
+
+  while ( req.n_entries < req.max_entries )
+  {
+    unsigned int n = min_t( uint32_t, req.max_entries - req.n_entries, ARRAY_SIZE( ev ) );
+
+    n = ucap_ring_pop( pddev, ev, n );
+
+    if ( n == 0 )
+      break;
+
+    // If this fails then the events are lost anyway.
+    if ( copy_to_user( &p_usr[req.n_entries], ev, n * sizeof( ev[0] ) ) )
+    {
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+      break;
+    }
+
+    req.n_entries += n;
+  }
+
+  req.n_overruns = READ_ONCE( pddev->ucap_ring->n_overruns );
+  req.n_fifo_full = READ_ONCE( pddev->ucap_ring->n_fifo_full );
+
+  _mbg_mutex_release( &pddev->ucap_ring_mutex );
+
+  if ( sys_rc == 0 )
+    if ( copy_to_user( (void *) arg, &req, sizeof( req ) ) )
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+
+  return sys_rc;
+
+}  // mbgdrvr_get_ucap_events
+
+#endif  // _PCPS_USE_UCAP_RING
+
+
+
+#if DEBUG_IRQ_TIMING
+
+static /*HDR*/
+void report_irq_timing( int lvl, const PCPS_DDEV *pddev,
+                        unsigned long jiffies_now,
+                        unsigned long jiffies_at_irq,
+                        long delta_jiffies )
+{
+
+}  // report_irq_timing
+
+#endif  // DEBUG_IRQ_TIMING
+
+
+
+static /*HDR*/
+unsigned int mbgclock_poll( struct file *filp, poll_table *pt )
+{
+  unsigned int poll_retval = 0;
+  PCPS_DDEV *pddev = NULL;
+  int sys_rc = mbgdrvr_get_pddev( &pddev, filp, "poll" );
+
+  if ( sys_rc < 0 )
+  {
+    poll_retval = POLLERR | POLLHUP;
+    goto out;
+  }
+
+  mbgdrvr_enable_cyclic( pddev, 0 );
+
+  poll_wait( filp, &pddev->wait_queue, pt );
+
+  if ( atomic_read( &pddev->data_avail ) )
+    poll_retval = POLLIN | POLLRDNORM;
+  else
+  {
+    unsigned long flags = 0;
+    unsigned long jiffies_now = jiffies;
+    unsigned long jiffies_at_irq;
+    long delta_jiffies;
+
+    if ( get_cyclic_lock( pddev, &flags, __func__ ) < 0 )
+      return -ERESTARTSYS;
+
+    jiffies_at_irq = pddev->jiffies_at_irq;
+
+    release_cyclic_lock( pddev, &flags, __func__ );
+
+    delta_jiffies = (long) jiffies_now - (long) jiffies_at_irq;
+
+
+    if ( delta_jiffies > CYCLIC_TIMEOUT )
+    {
+      mbg_kdd_msg( MBG_LOG_WARN, "** Cyclic timeout polling " MBG_DEV_NAME_FMT ": 0x%08lX - 0x%08lX = %li, exceeds %li",
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+                   jiffies_now, jiffies_at_irq,
+                   delta_jiffies, CYCLIC_TIMEOUT );
+
+      #if DEBUG_IRQ_TIMING
+        report_irq_timing( MBG_LOG_DEBUG, pddev, jiffies_now, jiffies_at_irq, delta_jiffies );
+      #endif
+
+      mbgdrvr_enable_cyclic( pddev, 2 );
+    }
+    else
+    {
+      #if DEBUG_IRQ_TIMING
+        mbg_kdd_msg( MBG_LOG_DEBUG, "Poll chk cyclic timeout " MBG_DEV_NAME_FMT ": 0x%08lX - 0x%08lX = %li, timeout: %li",
+                     _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ),
+                     jiffies_now, jiffies_at_irq,
+                     delta_jiffies, CYCLIC_TIMEOUT );
+      #endif
+    }
+  }
+
+  #if _PCPS_USE_ASYNC_REQ
+    if ( mbgdrvr_async_result_avail( pddev, filp ) )
+      poll_retval |= POLLPRI;
+  #endif
+
+  #if _PCPS_USE_UCAP_RING
+    if ( pddev->ucap_ring &&
+         READ_ONCE( pddev->ucap_ring->head ) != READ_ONCE( pddev->ucap_ring->tail ) )
+      poll_retval |= POLLRDBAND;
+  #endif
+
+out:
+  return poll_retval;
+
+}  // mbgclock_poll
+
+
+
+/*
+ * The function below is called whenever fcntl( .., F_SETFL, ..) is called
+ * to change the device's FASYNC flag.
+ *
+ */
+static /*HDR*/
+int mbgclock_fasync( int fd, struct file *filp, int on )
+{
+  PCPS_DDEV *pddev = NULL;
+  int sys_rc = mbgdrvr_get_pddev( &pddev, filp, "fasync" );
+
+  if ( sys_rc < 0 )
+    goto out;
+
+  // mbgdrvr_enable_cyclic( pddev, 0 );    //##++ conditionally / always enable IRQ here?
+
+  sys_rc = fasync_helper( fd, filp, on, &pddev->fasyncptr );
+
+out:
+  return sys_rc;
+
+}  // mbgclock_fasync
+
+
+
+static /*HDR*/
+#if FLUSH_WITH_LOCK_OWNER_ID
+int mbgclock_flush( struct file *filp, fl_owner_t id )
+#else
+int mbgclock_flush( struct file *filp )
+#endif
+{
+  PCPS_DDEV *pddev = NULL;
+  int sys_rc = mbgdrvr_get_pddev( &pddev, filp, "flush" );
+
+  if ( sys_rc < 0 )
+    goto out;
+
+  atomic_set( &pddev->data_avail, 0 );
+
+out:
+  return sys_rc;
+
+}  // mbgclock_flush
+
+
+
+static /*HDR*/
+int mbgclock_open( struct inode *inode, struct file *filp )
+{
+  PCPS_DDEV **ppddev;
+  PCPS_DDEV *pddev;
+  int minor = iminor( inode );
+  int retval = 0;
+  _mbg_dbg_hw_lpt_vars
+
+  _mbg_dbg_hw_lpt_set_bit( MBG_BIT_OPEN );
+
+  if ( filp == NULL )
+  {
+    mbg_kdd_msg( MBG_LOG_WARN, "Open minor %i called with file pointer NULL", minor );
+    retval = -EBADF;
+    goto out;
+  }
+
+  if ( _down_interruptible( &sem_fops, "sem_fops", __func__, filp ) < 0 )
+  {
+    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p open minor %i: interrupted wait for sem_fops",
+                 filp, minor );
+    retval = -ERESTARTSYS;
+    goto out;
+  }
+
+  ppddev = ddev_list_locate_minor( minor );
+
+  if ( ppddev == NULL )
+    goto out_enodev;
+
+  pddev = *ppddev;
+
+  if ( pddev == NULL )
+    goto out_enodev;
+
+
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p open minor %i",
+               filp, minor );
+
+  filp->private_data = ppddev;
+
+  atomic_inc( &pddev->open_count );
+
+  _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "%p open: new open count: %i, dev: %p",
+               filp, atomic_read( &pddev->open_count ), pddev );
+
+  #if _PCPS_MUST_UPDATE_USE_COUNT
+    MOD_INC_USE_COUNT;
+  #endif
+
+  goto out_up_sem_fops;
+
+
+out_enodev:
+   retval = -ENODEV;
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "%p open failed for minor %i: ENODEV",
+               filp, minor );
+
+out_up_sem_fops:
+  _up( &sem_fops, "sem_fops", "open", filp );
+
+out:
+  _mbg_dbg_hw_lpt_clr_bit( MBG_BIT_OPEN );
+
+  return retval;
+
+}  // mbgclock_open
+
+
+
+static /*HDR*/
+int mbgclock_release( struct inode *inode, struct file *filp )
+{
+  PCPS_DDEV *pddev;
+  int retval = 0;
+  _mbg_dbg_hw_lpt_vars
+
+
+  _mbg_dbg_hw_lpt_set_bit( MBG_BIT_RELEASE );
+
+  if ( _down_interruptible( &sem_fops, "sem_fops", __func__, filp ) < 0 )
+  {
+    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: interrupted wait for sem_fops",
+                 filp, minor );
+    retval = -ERESTARTSYS;
+    goto out;  // don't return directly
+  }
+
+  // sem_fops must not be released before we're through with pddev !
+
+  pddev = *( (PCPS_DDEV **) filp->private_data );
+
+  if ( pddev == NULL )
+  {
+    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "%p release %i: closing with dev NULL",
+                 filp, iminor( inode ) );
+    retval = -ENODEV;
+    goto out_up_sem_fops;
+  }
+
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: closing",
+                filp, iminor( inode ) );
+
+  #if _PCPS_USE_ASYNC_REQ
+    mbgdrvr_async_release( pddev, filp );
+  #endif
+
+  if ( atomic_dec_and_test( &pddev->open_count ) )
+  {
+    if ( get_dev_connected( pddev ) )
+    {
+      _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: closing with connected dev " MBG_DEV_NAME_FMT,
+                   filp, iminor( inode ),
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      mbgdrvr_disable_cyclic( pddev );
+    }
+    else
+    {
+      _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: closing with disconnected dev " MBG_DEV_NAME_FMT,
+                   filp, iminor( inode ),
+                   _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      mbgdrvr_delete_device( pddev );
+      pddev = NULL;
+      retval = -ENODEV;
+    }
+  }
+  else
+    _mbgddmsg_5( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i: new open count: %i, dev " MBG_DEV_NAME_FMT,
+                 filp, iminor( inode ), atomic_read( &pddev->open_count ),
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+
+  #if _PCPS_MUST_UPDATE_USE_COUNT
+    MOD_DEC_USE_COUNT;
+  #endif
+
+  if ( pddev )  // has not been deleted above
+  {
+    _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p release %i calling fasync_helper",
+                 filp, iminor( inode ));
+    fasync_helper( -1, filp, 0, &pddev->fasyncptr );
+  }
+
+
+out_up_sem_fops:
+  _up( &sem_fops, "sem_fops", "release", filp );
+
+out:
+  _mbg_dbg_hw_lpt_clr_bit( MBG_BIT_RELEASE );
+
+  return retval;
+
+}  // mbgclock_release
+
+
+
+#if DEBUG_IRQ_LATENCY
+
+static /*HDR*/
+long dt( int64_t delta_cyc )
+{
+  return (long) ( delta_cyc / cpu_khz / 1000 );
+
+}  // dt
+
+#endif
+
+
+
+static /*HDR*/
+ssize_t mbgclock_read( struct file *filp, char *buffer,
+                       size_t count, loff_t *ppos )
+{
+  PCPS_DDEV *pddev;
+  unsigned long flags = 0;
+  PCPS_TIME t;
+  char timestr[MBG_SIZE_TLG];
+  int bytes_to_copy;
+  ssize_t sys_rc = mbgdrvr_get_pddev( &pddev, filp, ( filp->f_flags & O_NONBLOCK ) ?
+                                      "read (non-blocking)" : "read (blocking)" );
+
+  if ( sys_rc < 0 )
+    goto out;
+
+  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "%p read starts", filp );
+
+  if ( atomic_read( &pddev->open_count ) == 0 )  //##++
+  {
+    _mbgddmsg_3( DEBUG, MBG_LOG_ERR, "%p read: dev " MBG_DEV_NAME_FMT " not opened",
+                 filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+    sys_rc = -EIO;
+    goto out;
+  }
+
+  #if !ESPIPE_BY_VFS
+    if ( ppos != &filp->f_pos )
+    {
+      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "%p read: dev " MBG_DEV_NAME_FMT " past end",
+                   filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      sys_rc = -ESPIPE;
+      goto out;
+    }
+  #endif
+
+  if ( buffer == NULL )
+  {
+    _mbgddmsg_1( DEBUG, MBG_LOG_ERR, "%p read: no buffer specified", filp );
+    sys_rc = -EINVAL;
+    goto out;
+  }
+
+  mbgdrvr_enable_cyclic( pddev, 0 );
+
+  if ( count < sizeof( timestr ) )
+    _mbgddmsg_3( DEBUG, MBG_LOG_WARN, "%p read: buffer size (%i) less than required (%i)",
+                 filp, (int) count, (int) sizeof( timestr ) );
+
+  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "%p read: wait for data_avail", filp );
+
+  while ( !atomic_read( &pddev->data_avail ) )
+  {
+    if ( filp->f_flags & O_NONBLOCK )
+    {
+      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "%p read non-blocking returns with no data available, dev: " MBG_DEV_NAME_FMT,
+                   filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      sys_rc = -EAGAIN;
+      goto out;
+    }
+
+    #if USE_WAIT_EVENT
+      for (;;)
+      {
+        int dev_connected = 0;
+        int this_rc = wait_event_interruptible_timeout( pddev->wait_queue,
+           atomic_read( &pddev->data_avail ) || !(dev_connected = get_dev_connected( pddev ) ), CYCLIC_TIMEOUT );
+
+        if ( this_rc < 0 )  // interrupted
+          goto out_interrupted_wait;
+
+        if ( !dev_connected )  // device has been removed
+        {
+          _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "%p read dev " MBG_DEV_NAME_FMT ": device removed while waiting",
+                       filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+          sys_rc = -ERESTARTSYS;
+          goto out;
+        }
+
+        if ( this_rc )  // data available, the normal case
+          break;
+
+        // timeout, cyclic reads may have been disabled, try to re-enable
+        _mbgddmsg_3( DEBUG, MBG_LOG_WARN, "%p read: IRQ timeout, dev " MBG_DEV_NAME_FMT,
+                     filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+
+        mbgdrvr_enable_cyclic( pddev, 2 );
+      }
+    #else
+      // There may be a race condition if data has become available
+      // after the while() check but before we go to sleep below.
+      // However, this doesn't really matter for our application.
+      interruptible_sleep_on_timeout( &pddev->wait_queue );   // used with 2.4.x and needs to be fixed
+
+      if ( signal_pending( current ) )
+        goto out_interrupted_wait;
+    #endif
+  }
+
+
+  if ( get_cyclic_lock( pddev, &flags, __func__ ) < 0 )
+    return -ERESTARTSYS;
+
+  t = pddev->t;
+  atomic_set( &pddev->data_avail, 0 );
+
+  release_cyclic_lock( pddev, &flags, __func__ );
+
+
+  pcps_time_to_time_str( &t, timestr, sizeof( timestr ) );
+
+  #if DEBUG_IRQ_LATENCY
+    if ( debug > 1 )
+    {
+      unsigned long long tsc;
+
+      rdtscll( tsc );
+
+      if ( _pcps_ddev_is_usb( pddev ) )
+        mbg_kdd_msg( MBG_LOG_INFO, "%s %Lu %lu %lu, %lu", _pcps_ddev_type_name( pddev ),
+                     tsc, dt( tsc - tsc_usb_2 ), dt( tsc_usb_2 - tsc_usb_1 ),
+                     dt( tsc_usb_1 - tsc_irq_1 ) );
+      else
+        mbg_kdd_msg( MBG_LOG_INFO, "%s %Lu %lu %lu", _pcps_ddev_type_name( pddev ),
+                     tsc, dt( tsc - tsc_irq_2 ), dt( tsc_irq_2 - tsc_irq_1 ) );
+    }
+  #endif
+
+  bytes_to_copy = _min( count, sizeof( timestr ) - 1 );
+
+  if ( copy_to_user( buffer, timestr, bytes_to_copy ) )
+  {
+    _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_ERR, "%p read: unable to copy to user space, dev " MBG_DEV_NAME_FMT,
+                  filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+    sys_rc = -EFAULT;
+    goto out;
+  }
+
+  sys_rc = bytes_to_copy;
+  _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO, "%p read dev " MBG_DEV_NAME_FMT ": \"%s\"",
+               filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ), timestr );
+  goto out;
+
+
+out_interrupted_wait:
+  _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "%p read dev " MBG_DEV_NAME_FMT ": blocking interrupted",
+               filp, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+  sys_rc = -ERESTARTSYS;
+
+out:
+  return sys_rc;
+
+}  // mbgclock_read
+
+
+
+static /*HDR*/
+ssize_t mbgclock_write( struct file *filp, const char *buffer,
+                        size_t count, loff_t *ppos )
+{
+  _mbgddmsg_1( DEBUG, MBG_LOG_WARN, "%p write: not supported", filp );
+
+  #if !ESPIPE_BY_VFS
+    if ( ppos != &filp->f_pos )
+      return -ESPIPE;
+  #endif
+
+  return -EIO;
+
+}  // mbgclock_write
+
+
+
+static /*HDR*/
+int mbgdrvr_ioctl_emu_serial( struct file *filp, unsigned int cmd, unsigned long arg )
+{
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p ioctl: emu serial cmd 0x%X", filp, cmd );
+
+  switch ( cmd )
+  {
+    case TCGETS:
+    {
+      struct termios termios = { 0 };
+
+      /*** Setzen der termios-Werte fuer die Meinberg Funkuhr
+         ueber serielle Leitung zur Abfrage. ***/
+      termios.c_iflag = IGNBRK|IGNPAR|ISTRIP;   /* input mode flags */
+      termios.c_oflag = 0;                      /* output mode flags */
+      termios.c_cflag = B9600|CS7|PARENB|CREAD|HUPCL|CLOCAL;  /* control mode flags */
+      termios.c_lflag = 0;                      /* local mode flags */
+      termios.c_line = 0;                       /* line discipline */
+
+      if ( copy_to_user( (struct termios *) arg, &termios, sizeof( termios ) ) )
+      {
+        _mbgddmsg_1( DEBUG, MBG_LOG_WARN, "%p ioctl: cmd TCGETS copy_to_user failed", filp );
+        return -EFAULT;
+      }
+
+      break;
+    }
+
+
+    case TIOCGWINSZ:
+    {
+      struct winsize winsize = { 0, 0, 0, 0 };
+
+      if ( copy_to_user( (struct winsize *) arg, &winsize, sizeof( winsize ) ) )
+      {
+        _mbgddmsg_1( DEBUG, MBG_LOG_WARN, "%p ioctl: cmd TIOCGWINSZ copy_to_user failed", filp );
+        return -EFAULT;
+      }
+
+      break;
+    }
+
+
+    case TCSETS:
+    case TCFLSH:
+      break;
+
+    default:
+      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "%p ioctl: serial IOCTL cmd 0x%X not supported",
+                   filp, cmd );
+      return -EINVAL;
+
+  }  // switch
+
+  return 0;
+
+}  // mbgdrvr_ioctl_emu_serial
+
+
+
+#if DEBUG_IOCTL
+
+static /*HDR*/
+void decode_ioctl( const char *s, ulong cmd )
+{
+  _mbgddmsg_5( DEBUG_IOCTL, MBG_LOG_INFO, "          %s 0x%08lX: type: 0x%02lX, nr: 0x%02lX, size: %lu",
+               s, cmd, (ulong) _IOC_TYPE( cmd ), (ulong) _IOC_NR( cmd ), (ulong) _IOC_SIZE( cmd ) );
+
+}  // decode_ioctl
+
+#endif
+
+
+
+#if USE_PCPS_IOCTL_BATCH
+
+static /*HDR*/
+/**
+ * @brief Execute a batch of IOCTL read requests
+ *
+ * The entries of an ::MBG_IOCTL_BATCH_REQ are executed by ::ioctl_switch
+ * in the order given, while the device mutex is held continuously.
+ * Only IOCTL codes which just return a data structure of fixed size,
+ * and which don't require more than ::MBG_REQ_PRIVL_CFG_READ are
+ * executed. The results are collected in a kernel buffer, so no user
+ * space page fault can occur while the mutex is held, and are copied
+ * to user space together with the return code of each entry after
+ * the mutex has been released.
+ *
+ * The mutex is not yielded to latency-class callers between the entries,
+ * see ::MBG_IOCTL_BATCH_REQ.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  arg    The user space address of the ::MBG_IOCTL_BATCH_REQ
+ *
+ * @return 0 if the batch has been executed, else a negative errno
+ */
+long mbgdrvr_ioctl_batch( PCPS_DDEV *pddev, unsigned long arg )
+{
+  MBG_IOCTL_BATCH_REQ req;
+  MBG_IOCTL_BATCH_ENTRY *p_entries;
+  uint8_t *p_out_buf = NULL;
+  uint8_t *p_out;
+  size_t entries_size;
+  size_t out_buf_size = 0;
+  uint32_t i;
+  long sys_rc = 0;
+
+  if ( copy_from_user( &req, (void *) arg, sizeof( req ) ) )
+    return IOCTL_RC_ERR_COPY_FROM_USER;
+
+  if ( req.n_entries == 0 || req.n_entries > MBG_IOCTL_BATCH_MAX_ENTRIES || req.flags )
+    return IOCTL_RC_ERR_INVAL_PARAM;
+
+  entries_size = req.n_entries * sizeof( *p_entries );
+  p_entries = kmalloc( entries_size, GFP_KERNEL );
+
+  if ( p_entries == NULL )
+    return IOCTL_RC_ERR_NO_MEM;
+
+  if ( copy_from_user( p_entries, (void *) (uintptr_t) req.entries_p, entries_size ) )
+  {
+    sys_rc = IOCTL_RC_ERR_COPY_FROM_USER;
+    goto out_free;
+  }
+
+  // Check all entries in advance, so we don't need to hold
+  // the device mutex while doing this.
+  for ( i = 0; i < req.n_entries; i++ )
+  {
+    MBG_IOCTL_BATCH_ENTRY *p = &p_entries[i];
+    int priv_lvl = ioctl_get_required_privilege( p->ioctl_code );
+
+    p->rc = 0;
+
+    if ( ( priv_lvl < 0 ) || ( p->ioctl_code == IOCTL_PCPS_BATCH ) )
+      p->rc = IOCTL_RC_ERR_UNSUPP_IOCTL;
+    else
+      if ( priv_lvl > MBG_REQ_PRIVL_CFG_READ )
+        p->rc = IOCTL_RC_ERR_PERM;
+      else
+        if ( ( _IOC_DIR( p->ioctl_code ) != _IOC_READ ) ||
+             ( _IOC_SIZE( p->ioctl_code ) != p->out_sz ) )
+          p->rc = IOCTL_RC_ERR_INVAL_PARAM;
+
+    // No buffer space is reserved for an entry which is not executed.
+    // The modified size is not copied back to user space.
+    if ( p->rc )
+      p->out_sz = 0;
+
+    out_buf_size += p->out_sz;
+  }
+
+  if ( out_buf_size > MBG_IOCTL_BATCH_MAX_OUT_SIZE )
+  {
+    sys_rc = IOCTL_RC_ERR_INVAL_PARAM;
+    goto out_free;
+  }
+
+  if ( out_buf_size )
+  {
+    p_out_buf = vmalloc( out_buf_size );
+
+    if ( p_out_buf == NULL )
+    {
+      sys_rc = IOCTL_RC_ERR_NO_MEM;
+      goto out_free;
+    }
+  }
+
+  if ( _mbg_mutex_acquire( &pddev->dev_mutex ) < 0 )
+  {
+    sys_rc = -ERESTARTSYS;
+    goto out_free;
+  }
+
+  pddev->batch_owner = current;
+
+  // While we are the batch owner, ::ioctl_switch writes
+  // the results to the kernel buffer.
+  for ( i = 0, p_out = p_out_buf; i < req.n_entries; i++ )
+  {
+    MBG_IOCTL_BATCH_ENTRY *p = &p_entries[i];
+
+    if ( p->rc == 0 )
+    {
+      _pcps_stats_inc( pddev, ioctl_cnt[_IOC_NR( p->ioctl_code )] );
+      p->rc = ioctl_switch( pddev, p->ioctl_code, p_out, p_out );
+    }
+
+    p_out += p->out_sz;
+  }
+
+  pddev->batch_owner = NULL;
+  _mbg_mutex_release( &pddev->dev_mutex );
+
+  _mbgddmsg_3( DEBUG, MBG_LOG_INFO, "ioctl batch with %u entries done, dev " MBG_DEV_NAME_FMT,
+               req.n_entries, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+
+  // Now copy the results of the successful entries, and
+  // the return codes of all entries back to user space.
+  for ( i = 0, p_out = p_out_buf; i < req.n_entries; i++ )
+  {
+    MBG_IOCTL_BATCH_ENTRY *p = &p_entries[i];
+    MBG_IOCTL_BATCH_ENTRY __user *p_usr = (MBG_IOCTL_BATCH_ENTRY __user *) (uintptr_t) req.entries_p + i;
+
+    if ( p->rc == MBG_SUCCESS )
+      if ( copy_to_user( (void __user *) (uintptr_t) p->out_p, p_out, p->out_sz ) )
+        p->rc = MBG_ERR_COPY_TO_USER;
+
+    p_out += p->out_sz;
+
+    if ( put_user( p->rc, &p_usr->rc ) )
+    {
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
+      break;
+    }
+  }
+
+out_free:
+  if ( p_out_buf )
+    vfree( p_out_buf );
+
+  kfree( p_entries );
+  return sys_rc;
+
+}  // mbgdrvr_ioctl_batch
+
+#endif  // USE_PCPS_IOCTL_BATCH
+
+
+
+static /*HDR*/
+/**
+ * @brief Dispatch an IOCTL call after the privilege check
+ *
+ * Used by ::mbgclock_unlocked_ioctl and ::mbgclock_uring_cmd, so the
+ * IOCTL codes which are handled by the driver rather than by
+ * ioctl_switch() are supported by both entry points, and both calls
+ * are traced and counted in the same way.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  filp   The file the call has been made for
+ * @param[in]  cmd    The IOCTL code
+ * @param[in]  arg    The IOCTL argument
+ *
+ * @return The return code of the IOCTL call
+ */
+long mbgdrvr_ioctl_dispatch( PCPS_DDEV *pddev, struct file *filp,
+                             unsigned int cmd, unsigned long arg )
+{
+  _pcps_trace_ioctl( pddev, cmd );
+  _pcps_stats_inc( pddev, ioctl_cnt[_IOC_NR( cmd )] );
+
+  #if USE_PCPS_IOCTL_BATCH
+    if ( cmd == IOCTL_PCPS_BATCH )
+      return mbgdrvr_ioctl_batch( pddev, arg );
+  #endif
+
+  #if USE_PCPS_EVT_LOG_MIRROR
+    if ( cmd == IOCTL_GET_EVT_LOG_ENTRIES )
+      return mbgdrvr_get_evt_log_entries( pddev, arg );
+  #endif
+
+  #if _PCPS_USE_UCAP_RING
+    if ( cmd == IOCTL_GET_UCAP_EVENTS )
+      return mbgdrvr_get_ucap_events( pddev, arg );
+  #endif
+
+  #if _PCPS_USE_ASYNC_REQ
+    if ( cmd == IOCTL_ASYNC_SUBMIT )
+      return mbgdrvr_async_submit( pddev, filp, arg );
+
+    if ( cmd == IOCTL_ASYNC_FETCH )
+      return mbgdrvr_async_fetch( pddev, filp, arg );
+  #endif
+
+  return ioctl_switch( pddev, cmd, (void *) arg, (void *) arg );
+
+}  // mbgdrvr_ioctl_dispatch
+
+
+
+static /*HDR*/
+// Unlike the other kernel functions which return POSIX errnos in case of
+// an error, this fuction returns one of the MBG_ERROR_CODES, except
+// for some IOCTLs for serial port emulation which are only received
+// if ntpd accesses this device via the parse driver.
+long mbgclock_unlocked_ioctl( struct file *filp, unsigned int cmd, unsigned long arg )
+{
+  PCPS_DDEV *pddev = NULL;
+  long sys_rc = mbgdrvr_get_pddev( &pddev, filp, "ioctl" );
+  int priv_lvl;
+  #if defined( DEBUG )
+    const char *ioctl_name = mbgioctl_get_name( cmd );
+  #endif
+
+  if ( sys_rc < 0 )  // usually -ENODEV, or -ERESTARTSYS
+    goto out;
+
+  // Find out which privilege level is required
+  // to execute this IOCTL command.
+  priv_lvl = ioctl_get_required_privilege( cmd );
+
+  // Check if the calling process has the required privilege.
+  switch ( priv_lvl )
+  {
+    case MBG_REQ_PRIVL_NONE:
+      _mbgddmsg_5( DEBUG, MBG_LOG_INFO, "%p %s (0x%02X): no priv lvl required, dev " MBG_DEV_NAME_FMT,
+                   filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      // Always allow.
+      break;
+
+    case MBG_REQ_PRIVL_EXT_STATUS:
+    case MBG_REQ_PRIVL_CFG_READ:
+      _mbgddmsg_5( DEBUG, MBG_LOG_INFO, "%p %s (0x%02X): no priv lvl required to read cfg, dev " MBG_DEV_NAME_FMT,
+                   filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      // This may require some privilege for the calling process.
+      // Anyway, always allow for now.
+      break;
+
+    case MBG_REQ_PRIVL_CFG_WRITE:
+    case MBG_REQ_PRIVL_SYSTEM:
+      #if !OMIT_PRIV_CHECKING   // this is the default case
+        _mbgddmsg_5( DEBUG, MBG_LOG_INFO, "%p %s (0x%02X): admin rights required, dev " MBG_DEV_NAME_FMT,
+                     filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+
+        if ( !capable( CAP_SYS_ADMIN ) )  // allow only if root privileges available.
+        {
+          _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): permission denied, dev " MBG_DEV_NAME_FMT,
+                       filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+          return IOCTL_RC_ERR_PERM;
+        }
+      #else
+        _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): admin rights would be required (checking omitted), dev " MBG_DEV_NAME_FMT,
+                     filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+      #endif
+      break;
+
+    default:
+      // maybe an unknown IOCTL code ...
+      // This is OK if it is one of those codes required
+      switch ( cmd )
+      {
+        case TCGETS:
+        case TIOCGWINSZ:
+        case TCSETS:
+        case TCFLSH:
+          sys_rc = mbgdrvr_ioctl_emu_serial( filp, cmd, arg );
+
+          if ( sys_rc == 0 )
+            goto out;  // has been handled normally
+
+          _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): invalid cmd, dev " MBG_DEV_NAME_FMT,
+                       filp, ioctl_name, cmd,
+                       _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+          #if DEBUG_IOCTL
+            decode_ioctl( "ioctl", cmd );
+          #endif
+          break;
+
+        default:
+          _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): unknown command code, dev " MBG_DEV_NAME_FMT,
+                       filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+          #if DEBUG_IOCTL
+            decode_ioctl( "ioctl", cmd );
+          #endif
+          return IOCTL_RC_ERR_UNSUPP_IOCTL;  // TODO Is this ret val appropriate?
+
+      }  // switch
+  }
+
+  sys_rc = mbgdrvr_ioctl_dispatch( pddev, filp, cmd, arg );
+
+out:
+  // If the return value is negative then this is considered as an error code.
+  // The kernel converts this to a positive value which is stored in errno, and
+  // lets the ioctl call return -1, so the calling user space code has to read
+  // errno if -1 is returned.
+
+  return sys_rc;
+
+}  // mbgclock_unlocked_ioctl
+
+
+
+#if _PCPS_USE_URING_CMD
+
+static /*HDR*/
+/**
+ * @brief Handle an IOCTL code submitted via io_uring
+ *
+ * The IOCTL code is passed in the cmd_op field of the SQE, and the
+ * IOCTL argument is passed in an ::MBG_URING_CMD structure in the
+ * cmd field of the SQE.
+ *
+ * Latency-class commands are completed inline. Other commands may have
+ * to wait until the device has completed a command, so if we are called
+ * from the submitting task they are deferred to an io_uring async worker,
+ * which shares the address space of the submitting task so data can be
+ * copied from and to user space. So a single thread can drive several
+ * devices without being blocked by a slow command.
+ *
+ * @param[in]  ioucmd       The io_uring command
+ * @param[in]  issue_flags  Flags passed by io_uring, e.g. IO_URING_F_NONBLOCK
+ *
+ * @return The result of the command, which is the same as the return code
+ *         of the equivalent ioctl() call, or -EAGAIN if the command has to be
+ *         executed from an async worker.
+ */
+int mbgclock_uring_cmd( struct io_uring_cmd *ioucmd, unsigned int issue_flags )
+{
+  const MBG_URING_CMD *p_cmd = _mbg_uring_cmd_payload( ioucmd );
+  unsigned int cmd = ioucmd->cmd_op;
+  unsigned long arg = (unsigned long) READ_ONCE( p_cmd->arg );
+  PCPS_DDEV *pddev = NULL;
+  long sys_rc;
+  int priv_lvl;
+
+  if ( READ_ONCE( p_cmd->reserved ) )
+    return IOCTL_RC_ERR_INVAL_PARAM;
+
+  // Serial port emulation is not supported via io_uring,
+  // so unknown codes are always denied.
+  priv_lvl = ioctl_get_required_privilege( cmd );
+
+  if ( priv_lvl < 0 )
+    return IOCTL_RC_ERR_UNSUPP_IOCTL;
+
+  #if !OMIT_PRIV_CHECKING
+    if ( ( priv_lvl >= MBG_REQ_PRIVL_CFG_WRITE ) && !capable( CAP_SYS_ADMIN ) )
+      return IOCTL_RC_ERR_PERM;
+  #endif
+
+  if ( ( issue_flags & IO_URING_F_NONBLOCK ) && !ioctl_is_latency_class( cmd ) )
+    return -EAGAIN;
+
+  sys_rc = mbgdrvr_get_pddev( &pddev, ioucmd->file, "uring_cmd" );
+
+  if ( sys_rc < 0 )  // usually -ENODEV, or -ERESTARTSYS
+    return sys_rc;
+
+  return mbgdrvr_ioctl_dispatch( pddev, ioucmd->file, cmd, arg );
+
+}  // mbgclock_uring_cmd
+
+#endif  // _PCPS_USE_URING_CMD
+
+
+
+#if defined( HAVE_COMPAT_IOCTL ) && defined( CONFIG_COMPAT )
+
+static /*HDR*/
+long mbgclock_compat_ioctl( struct file *filp, unsigned int cmd, unsigned long arg )
+{
+  long rc;
+
+  #if DEBUG_IOCTL
+    _mbg_kdd_msg_4( MBG_LOG_INFO, "%p compat_ioctl %s (0x%08X) calling ioctl (0x%08lX)",
+                    filp, mbgioctl_get_name( cmd ), cmd, (ulong) IOCTL_PCPS_GENERIC_READ_GPS );
+
+  #endif
+
+  rc = mbgclock_unlocked_ioctl( filp, cmd, arg );
+
+  return rc;
+
+}  // mbgclock_compat_ioctl
+
+#endif
+
+
+
+#if !defined( HAVE_UNLOCKED_IOCTL )
+
+static /*HDR*/
+int mbgclock_ioctl( struct inode *not_used, struct file *filp, unsigned int cmd, unsigned long arg )
+{
+  long rc;
+
+  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "%p unlocked_ioctl calling ioctl()", filp );
+
+  rc = mbgclock_unlocked_ioctl( filp, cmd, arg );
+
+  return (int) rc;
+
+}  // mbgclock_ioctl
+
+#endif
+
+
+
+static /*HDR*/
+int mbgclock_mmap( struct file * filp, struct vm_area_struct *vma )
+{
+  MBG_IOMEM_ADDR_RAW addr;
+  PCPS_DDEV *pddev = NULL;
+  int rc = mbgdrvr_get_pddev( &pddev, filp, "mmap" );
+
+  if ( rc < 0 )
+    goto out;
+
+  #if _PCPS_USE_UCAP_RING
+    if ( vma->vm_pgoff == ( MBG_UCAP_RING_MMAP_OFFS >> PAGE_SHIFT ) )
+    {
+      if ( pddev->ucap_ring == NULL )
+      {
+        rc = -ENODEV;
+        goto out;
+      }
+
+      // The consumer has to update the tail index in the header,
+      // which the driver can only see in a shared mapping.
+      if ( !( vma->vm_flags & VM_SHARED ) )
+      {
+        rc = -EINVAL;
+        goto out;
+      }
+
+      // This also checks that the size doesn't exceed the ring buffer.
+      rc = remap_vmalloc_range( vma, pddev->ucap_ring, 0 );
+      goto out;
+    }
+  #endif
+
+  addr = pddev->rsrc_info.mem[0].start_raw;
+
+#if VMA_HAS_VM_PGOFF
+  if ( ( ( vma->vm_end - vma->vm_start ) != PAGE_SIZE ) || vma->vm_pgoff )
+#else
+  if ( ( ( vma->vm_end - vma->vm_start ) != PAGE_SIZE ) )
+#endif
+  {
+    mbg_kdd_msg( MBG_LOG_ERR, "vm_end (0x%08lX) - vm_start (0x%08lX) doesn't match PAGE_SIZE (0x%08lX)",
+                 vma->vm_end, vma->vm_start, (unsigned long) PAGE_SIZE );
+    rc = -EINVAL;
+    goto out;
+  }
+
+  #if VMA_HAS_VM_PGOFF
+    _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO,
+                 "vm_end (0x%08lX) - vm_start (0x%08lX) == PAGE_SIZE (0x%08lX), pg_off: 0x%08lX",
+                 vma->vm_end, vma->vm_start, (unsigned long) PAGE_SIZE, vma->vm_pgoff );
+  #else
+    _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "vm_end (0x%08lX) - vm_start (0x%08lX) == PAGE_SIZE (0x%08lX)",
+                 vma->vm_end, vma->vm_start, (unsigned long) PAGE_SIZE );
+  #endif
+
+  vma->vm_flags |= VM_IO;
+
+  #if defined( pgprot_noncached )
+    vma->vm_page_prot = pgprot_noncached( vma->vm_page_prot );
+  #endif
+
+  #if _PCPS_HAS_REMAP_PFN
+    rc = io_remap_pfn_range( vma, vma->vm_start, addr >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot );
+  #else
+    rc = io_remap_page_range( vma, vma->vm_start, addr, PAGE_SIZE, vma->vm_page_prot );
+  #endif
+
+  if ( rc )
+  {
+    rc = -EAGAIN;
+    goto out;
+  }
+
+  rc = 0;
+
+out:
+  return rc;
+
+}  // mbgclock_mmap
+
+
+
+struct file_operations mbgclock_fops =
+{
+  #if NEW_FILE_OPS
+    owner: THIS_MODULE,
+  #endif
+
+  read: mbgclock_read,
+  write: mbgclock_write,
+  poll: mbgclock_poll,
+  #if defined( HAVE_UNLOCKED_IOCTL )
+    unlocked_ioctl: mbgclock_unlocked_ioctl,
+  #else
+    ioctl: mbgclock_ioctl,
+  #endif
+  #if defined( HAVE_COMPAT_IOCTL ) && defined( CONFIG_COMPAT )
+    compat_ioctl: mbgclock_compat_ioctl,  // called if a 32 bit app ioctls a 64 bit driver
+  #endif
+  open: mbgclock_open,
+  flush: mbgclock_flush,
+  release: mbgclock_release,
+  fasync: mbgclock_fasync,
+  mmap: mbgclock_mmap,
+  #if _PCPS_USE_URING_CMD
+    uring_cmd: mbgclock_uring_cmd,
+  #endif
+  llseek: NULL
+};
+
+
+
+#if _PCPS_USE_SYSFS_ATTR
+
+// The attributes below are read-only, and only report state
+// which has been cached by the driver, so reading them never
+// accesses the device.
+
+static /*HDR*/
+ssize_t type_name_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, "%s\n", _pcps_ddev_type_name( pddev ) );
+
+}  // type_name_show
+
+static DEVICE_ATTR_RO( type_name );
+
+
+
+static /*HDR*/
+ssize_t serial_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, "%s\n", _pcps_ddev_sernum( pddev ) );
+
+}  // serial_show
+
+static DEVICE_ATTR_RO( serial );
+
+
+
+static /*HDR*/
+ssize_t fw_id_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, "%s\n", _pcps_ddev_fw_id( pddev ) );
+
+}  // fw_id_show
+
+static DEVICE_ATTR_RO( fw_id );
+
+
+
+static /*HDR*/
+ssize_t asic_version_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, PCPS_ASIC_STR_FMT "\n",
+                    _pcps_asic_version_major( _pcps_ddev_asic_version( pddev ) ),
+                    _pcps_asic_version_minor( _pcps_ddev_asic_version( pddev ) ) );
+
+}  // asic_version_show
+
+static DEVICE_ATTR_RO( asic_version );
+
+
+
+static /*HDR*/
+ssize_t access_mode_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  static const char * const strs[N_PCPS_ACCESS_MODES] = PCPS_ACCESS_MODE_STRS;
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  if ( pddev->access_mode >= N_PCPS_ACCESS_MODES )
+    return scnprintf( buf, PAGE_SIZE, "unknown (%u)\n", pddev->access_mode );
+
+  return scnprintf( buf, PAGE_SIZE, "%s%s\n", strs[pddev->access_mode],
+                    pddev->access_mode_forced ? PCPS_ACCESS_MODE_STR_FRCD : "" );
+
+}  // access_mode_show
+
+static DEVICE_ATTR_RO( access_mode );
+
+
+
+static /*HDR*/
+ssize_t irq_stat_info_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, "0x%08lX\n", (ulong) pddev->irq_stat_info );
+
+}  // irq_stat_info_show
+
+static DEVICE_ATTR_RO( irq_stat_info );
+
+
+
+static /*HDR*/
+ssize_t irq_counters_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+  uint32_t cnt, err_cnt, busy_cnt;
+  unsigned long flags;
+
+  spin_lock_irqsave( &pddev->irq_lock, flags );
+  cnt = pddev->irq_cnt;
+  err_cnt = pddev->irq_err_cnt;
+  busy_cnt = pddev->irq_busy_cnt;
+  spin_unlock_irqrestore( &pddev->irq_lock, flags );
+
+  return scnprintf( buf, PAGE_SIZE, "%u %u %u\n", cnt, err_cnt, busy_cnt );
+
+}  // irq_counters_show
+
+static DEVICE_ATTR_RO( irq_counters );
+
+
+
+static /*HDR*/
+// The time status is the one read by the last cyclic IRQ,
+// so it's only available if cyclic IRQs are enabled, i.e.
+// while the device is polled or read by an application.
+ssize_t sync_state_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+  PCPS_TIME_STATUS status;
+  unsigned long flags;
+  uint32_t cnt;
+  const char *cp;
+
+  spin_lock_irqsave( &pddev->irq_lock, flags );
+  cnt = pddev->irq_cnt - pddev->irq_err_cnt - pddev->irq_busy_cnt;
+  status = pddev->t.status;
+  spin_unlock_irqrestore( &pddev->irq_lock, flags );
+
+  if ( cnt == 0 )
+    return scnprintf( buf, PAGE_SIZE, "unknown\n" );
+
+  if ( status & PCPS_INVT )
+    cp = "invalid";
+  else
+    if ( !( status & PCPS_SYNCD ) )
+      cp = "not_synced";
+    else
+      if ( status & PCPS_FREER )
+        cp = "free_running";
+      else
+        cp = "synced";
+
+  return scnprintf( buf, PAGE_SIZE, "%s 0x%02X\n", cp, status );
+
+}  // sync_state_show
+
+static DEVICE_ATTR_RO( sync_state );
+
+
+
+static /*HDR*/
+ssize_t tick_age_ms_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+  unsigned long jiffies_at_irq;
+  unsigned long flags;
+  uint32_t cnt;
+
+  spin_lock_irqsave( &pddev->irq_lock, flags );
+  cnt = pddev->irq_cnt;
+  jiffies_at_irq = pddev->jiffies_at_irq;
+  spin_unlock_irqrestore( &pddev->irq_lock, flags );
+
+  if ( cnt == 0 )
+    return scnprintf( buf, PAGE_SIZE, "-1\n" );
+
+  return scnprintf( buf, PAGE_SIZE, "%u\n", jiffies_to_msecs( jiffies - jiffies_at_irq ) );
+
+}  // tick_age_ms_show
+
+static DEVICE_ATTR_RO( tick_age_ms );
+
+
+
+static /*HDR*/
+ssize_t numa_node_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, "%i\n", pddev->numa_node );
+
+}  // numa_node_show
+
+static DEVICE_ATTR_RO( numa_node );
+
+
+
+#if _PCPS_USE_DBG_KEYS
+
+// Unlike the attributes above, this one is writable, and lets the
+// administrator enable debug code for this device at runtime.
+
+static /*HDR*/
+ssize_t dbg_flags_show( struct device *dev, struct device_attribute *attr, char *buf )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+
+  return scnprintf( buf, PAGE_SIZE, "0x%02X\n", READ_ONCE( pddev->dbg_flags ) );
+
+}  // dbg_flags_show
+
+
+
+static /*HDR*/
+ssize_t dbg_flags_store( struct device *dev, struct device_attribute *attr,
+                         const char *buf, size_t count )
+{
+  PCPS_DDEV *pddev = dev_get_drvdata( dev );
+  u32 flags;
+  int rc = kstrtou32( buf, 0, &flags );
+
+  if ( rc < 0 )
+    return rc;
+
+  pcps_set_dbg_flags( pddev, flags );
+
+  return count;
+
+}  // dbg_flags_store
+
+static DEVICE_ATTR_RW( dbg_flags );
+
+#endif  // _PCPS_USE_DBG_KEYS
+
+
+
+static struct attribute *mbgclock_attrs[] =
+{
+  &dev_attr_type_name.attr,
+  &dev_attr_serial.attr,
+  &dev_attr_fw_id.attr,
+  &dev_attr_asic_version.attr,
+  &dev_attr_access_mode.attr,
+  &dev_attr_irq_stat_info.attr,
+  &dev_attr_irq_counters.attr,
+  &dev_attr_sync_state.attr,
+  &dev_attr_tick_age_ms.attr,
+  &dev_attr_numa_node.attr,
+  #if _PCPS_USE_DBG_KEYS
+    &dev_attr_dbg_flags.attr,
+  #endif
+  NULL
+};
+
+ATTRIBUTE_GROUPS( mbgclock );
+
+#endif  // _PCPS_USE_SYSFS_ATTR
+
+
+
+#if _PCPS_USE_DEV_STATS
+
+// The statistics counters of each device can be read in OpenMetrics
+// text format from a file "metrics" in a debugfs directory of the device.
+// The counters are summed up over all CPUs, and reading them neither
+// accesses the device nor acquires a device lock, so the values
+// are only approximately consistent.
+
+static struct dentry *mbgclock_debugfs_root;
+
+
+
+static /*HDR*/
+/**
+ * @brief Sum up the per-CPU statistics counters of a device
+ *
+ * @param[in]   pddev  Pointer to the device structure
+ * @param[out]  p      Address of a buffer to take the sums, must be zeroed
+ */
+void mbgdrvr_sum_stats( const PCPS_DDEV *pddev, PCPS_DDEV_STATS *p )
+{
+  int cpu;
+
+  for_each_possible_cpu( cpu )
+  {
+    const PCPS_DDEV_STATS *p_cpu = per_cpu_ptr( pddev->stats, cpu );
+    int i;
+
+    for ( i = 0; i < PCPS_STATS_N_IOCTL_NR; i++ )
+      p->ioctl_cnt[i] += p_cpu->ioctl_cnt[i];
+
+    for ( i = 0; i < PCPS_STATS_N_LAT_BUCKETS; i++ )
+      p->cmd_lat_hist[i] += p_cpu->cmd_lat_hist[i];
+
+    p->cmd_lat_sum_ns += p_cpu->cmd_lat_sum_ns;
+    p->cmd_timeouts += p_cpu->cmd_timeouts;
+    p->cmd_errors += p_cpu->cmd_errors;
+    p->usb_xfer_errors += p_cpu->usb_xfer_errors;
+    p->snapshot_hits += p_cpu->snapshot_hits;
+    p->snapshot_misses += p_cpu->snapshot_misses;
+  }
+
+}  // mbgdrvr_sum_stats
+
+
+
+static /*HDR*/
+void mbgdrvr_show_counter( struct seq_file *s, const char *name,
+                           const char *help, unsigned long val )
+{
+  seq_printf( s, "# TYPE mbgclock_%s counter\n", name );
+  seq_printf( s, "# HELP mbgclock_%s %s.\n", name, help );
+  seq_printf( s, "mbgclock_%s_total %lu\n", name, val );
+
+}  // mbgdrvr_show_counter
+
+
+
+static /*HDR*/
+int mbgdrvr_metrics_show( struct seq_file *s, void *v )
+{
+  PCPS_DDEV *pddev = s->private;
+  PCPS_DDEV_STATS *p;
+  unsigned long cum_cnt;
+  u32 rem_ns;
+  int i;
+
+  p = kzalloc( sizeof( *p ), GFP_KERNEL );
+
+  if ( p == NULL )
+    return -ENOMEM;
+
+  mbgdrvr_sum_stats( pddev, p );
+
+  seq_puts( s, "# TYPE mbgclock_ioctl counter\n" );
+  seq_puts( s, "# HELP mbgclock_ioctl Number of IOCTL calls by IOCTL code number.\n" );
+
+  for ( i = 0; i < PCPS_STATS_N_IOCTL_NR; i++ )
+    if ( p->ioctl_cnt[i] )
+      seq_printf( s, "mbgclock_ioctl_total{nr=\"0x%02X\"} %lu\n", i, p->ioctl_cnt[i] );
+
+  // Bucket i counts commands which took less than 2^i us,
+  // except the last bucket, see PCPS_STATS_N_LAT_BUCKETS.
+  seq_puts( s, "# TYPE mbgclock_cmd_latency_seconds histogram\n" );
+  seq_puts( s, "# HELP mbgclock_cmd_latency_seconds Execution time of device commands, only measured while debug flag 0x20 is set.\n" );
+
+  for ( i = 0, cum_cnt = 0; i < PCPS_STATS_N_LAT_BUCKETS - 1; i++ )
+  {
+    ulong le_us = 1UL << i;
+
+    cum_cnt += p->cmd_lat_hist[i];
+    seq_printf( s, "mbgclock_cmd_latency_seconds_bucket{le=\"%lu.%06lu\"} %lu\n",
+                le_us / 1000000, le_us % 1000000, cum_cnt );
+  }
+
+  cum_cnt += p->cmd_lat_hist[i];
+  seq_printf( s, "mbgclock_cmd_latency_seconds_bucket{le=\"+Inf\"} %lu\n", cum_cnt );
+  seq_printf( s, "mbgclock_cmd_latency_seconds_count %lu\n", cum_cnt );
+  seq_printf( s, "mbgclock_cmd_latency_seconds_sum %llu.%09u\n",
+              (unsigned long long) div_u64_rem( p->cmd_lat_sum_ns, NSEC_PER_SEC, &rem_ns ),
+              rem_ns );
+
+  mbgdrvr_show_counter( s, "cmd_timeouts", "Device commands which timed out",
+                        p->cmd_timeouts );
+  mbgdrvr_show_counter( s, "cmd_errors", "Device commands which failed for other reasons",
+                        p->cmd_errors );
+  mbgdrvr_show_counter( s, "usb_xfer_errors", "Failed USB transfers",
+                        p->usb_xfer_errors );
+  mbgdrvr_show_counter( s, "snapshot_hits", "Status requests served from the status snapshot",
+                        p->snapshot_hits );
+  mbgdrvr_show_counter( s, "snapshot_misses", "Status requests which had to access the device",
+                        p->snapshot_misses );
+
+  // The IRQ counters are maintained by the IRQ handler without per-CPU
+  // data since there is only a single writer.
+  mbgdrvr_show_counter( s, "irqs", "Interrupts handled",
+                        pddev->irq_cnt );
+  mbgdrvr_show_counter( s, "irqs_deferred", "Interrupts not served because the device was busy",
+                        pddev->irq_busy_cnt );
+  mbgdrvr_show_counter( s, "irqs_failed", "Interrupts which failed to read the time",
+                        pddev->irq_err_cnt );
+
+  seq_puts( s, "# EOF\n" );
+
+  kfree( p );
+
+  return 0;
+
+}  // mbgdrvr_metrics_show
+
+
+
+static /*HDR*/
+int mbgdrvr_metrics_open( struct inode *inode, struct file *file )
+{
+  return single_open( file, mbgdrvr_metrics_show, inode->i_private );
+
+}  // mbgdrvr_metrics_open
+
+
+
+static struct file_operations mbgdrvr_metrics_fops =
+{
+  owner: THIS_MODULE,
+  open: mbgdrvr_metrics_open,
+  read: seq_read,
+  llseek: seq_lseek,
+  release: single_release
+};
+
+
+
+static /*HDR*/
+/**
+ * @brief Set up the statistics of a device, and the debugfs files
+ *
+ * Statistics are optional, so failures are only logged.
+ *
+ * @param[in]  pddev    Pointer to the device structure
+ * @param[in]  dev_idx  Index of the device in the device list
+ */
+void mbgdrvr_start_stats( PCPS_DDEV *pddev, int dev_idx )
+{
+  char name[32];
+
+  pddev->stats = alloc_percpu( PCPS_DDEV_STATS );
+
+  if ( pddev->stats == NULL )
+  {
+    mbg_kdd_msg( MBG_LOG_WARN, "Failed to allocate statistics for " MBG_DEV_NAME_FMT,
+                 _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+    return;
+  }
+
+  if ( IS_ERR_OR_NULL( mbgclock_debugfs_root ) )
+    return;
+
+  snprintf( name, sizeof( name ), mbg_clk_dev_node_fmt, minor + dev_idx );
+  pddev->stats_dentry = debugfs_create_dir( name, mbgclock_debugfs_root );
+
+  if ( IS_ERR_OR_NULL( pddev->stats_dentry ) )
+  {
+    pddev->stats_dentry = NULL;
+    return;
+  }
+
+  debugfs_create_file( "metrics", 0444, pddev->stats_dentry, pddev, &mbgdrvr_metrics_fops );
+
+}  // mbgdrvr_start_stats
+
+
+
+static /*HDR*/
+/**
+ * @brief Remove the debugfs files of a device
+ *
+ * Waits until the files are not read anymore.
+ * The statistics are freed by ::mbgdrvr_free_stats.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ */
+void mbgdrvr_stop_stats( PCPS_DDEV *pddev )
+{
+  debugfs_remove_recursive( pddev->stats_dentry );
+  pddev->stats_dentry = NULL;
+
+}  // mbgdrvr_stop_stats
+
+
+
+static /*HDR*/
+/**
+ * @brief Free the statistics of a device
+ *
+ * Must only be called if the device isn't accessed anymore,
+ * e.g. by the IRQ handler.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ */
+void mbgdrvr_free_stats( PCPS_DDEV *pddev )
+{
+  PCPS_DDEV_STATS __percpu *stats = pddev->stats;
+
+  pddev->stats = NULL;
+  free_percpu( stats );
+
+}  // mbgdrvr_free_stats
+
+#endif  // _PCPS_USE_DEV_STATS
+
+
+
+#if _PCPS_USE_AGG_DEV
+
+/**
+ * @brief Kinds of samples which can be read via the aggregate device
+ *
+ * A device is selected separately for each kind of sample,
+ * since not every device supports each kind.
+ */
+enum AGG_KINDS
+{
+  AGG_KIND_TIME,        ///< ::PCPS_TIME, see ::IOCTL_GET_AGG_TIME
+  AGG_KIND_HR_TIME,     ///< ::PCPS_HR_TIME, see ::IOCTL_GET_AGG_HR_TIME
+  AGG_KIND_FAST_HR_TS,  ///< ::PCPS_TIME_STAMP, see ::IOCTL_GET_AGG_FAST_HR_TIMESTAMP
+  N_AGG_KINDS
+};
+
+
+/**
+ * @brief Health ranks of a device, derived from its time status
+ *
+ * A higher rank is better.
+ */
+enum AGG_RANKS
+{
+  AGG_RANK_INVALID,     ///< ::PCPS_INVT is set, so the time is not usable
+  AGG_RANK_NOT_SYNCD,   ///< Not synchronized since power-up
+  AGG_RANK_FREER,       ///< Has been synchronized, but is freewheeling now
+  AGG_RANK_SYNCD,       ///< Synchronized
+  N_AGG_RANKS
+};
+
+
+/**
+ * @brief A sample read from a device by the aggregate device
+ */
+typedef union
+{
+  PCPS_TIME t;
+  PCPS_HR_TIME hr_t;
+  PCPS_TIME_STAMP tstamp;
+
+} AGG_SAMPLE;
+
+
+/**
+ * @brief The device selected to serve a kind of samples
+ *
+ * Protected by ::agg_mutex. A device is only selected while
+ * the aggregate device holds a reference to it, see ::agg_get_devs.
+ */
+typedef struct
+{
+  PCPS_DDEV *pddev;          ///< The selected device, or NULL
+  int rank;                  ///< Health rank of the selected device, see ::AGG_RANKS
+  int dev_lost;              ///< The previously selected device has been removed
+  int offs_valid;            ///< Indicates that switch_offs_ns is valid
+  int32_t switch_offs_ns;    ///< See ::MBG_AGG_SAMPLE_INFO::switch_offs_ns
+  uint32_t n_switches;       ///< See ::MBG_AGG_SAMPLE_INFO::n_switches
+  unsigned long next_check;  ///< Time [jiffies] when all devices have to be checked again
+
+} AGG_SEL;
+
+
+/**
+ * @brief A device which has been read successfully by ::agg_select
+ */
+typedef struct
+{
+  PCPS_DDEV *pddev;     ///< The device
+  int rank;             ///< Health rank of the device, see ::AGG_RANKS
+  PCPS_TIME_STAMP ts;   ///< Time stamp read from the device, in host byte order, zeroed if not available
+  int64_t sys_ns;       ///< System time [ns] when the device has been read
+
+} AGG_CAND;
+
+
+static AGG_SEL agg_sel[N_AGG_KINDS];
+static PCPS_DDEV **agg_devs;     // Devices referenced by the current request, protected by agg_mutex
+static AGG_CAND *agg_cands;      // max_devs + 1 entries used by agg_select, protected by agg_mutex
+static int agg_n_devs;           // Number of entries in agg_devs
+static PCPS_IO_BUFFER *agg_iob;  // DMA-capable buffer for device reads, protected by agg_mutex
+static MBG_MUTEX agg_mutex;      // Serializes the requests to the aggregate device
+static DECLARE_WAIT_QUEUE_HEAD( agg_refs_wait );  // Woken up when references to devices have been dropped
+static int agg_dev_registered;
+
+
+
+static /*HDR*/
+int agg_rank( PCPS_TIME_STATUS_X status )
+{
+  if ( status & PCPS_INVT )
+    return AGG_RANK_INVALID;
+
+  if ( !( status & PCPS_SYNCD ) )
+    return AGG_RANK_NOT_SYNCD;
+
+  if ( status & PCPS_FREER )
+    return AGG_RANK_FREER;
+
+  return AGG_RANK_SYNCD;
+
+}  // agg_rank
+
+
+
+static /*HDR*/
+int agg_dev_supports( PCPS_DDEV *pddev, int kind )
+{
+  switch ( kind )
+  {
+    case AGG_KIND_HR_TIME:
+      return _pcps_ddev_has_hr_time( pddev );
+
+    case AGG_KIND_FAST_HR_TS:
+      return _pcps_ddev_has_fast_hr_timestamp( pddev );
+
+  }  // switch
+
+  return 1;
+
+}  // agg_dev_supports
+
+
+
+static /*HDR*/
+int32_t agg_tstamp_diff_ns( const PCPS_TIME_STAMP *p_ts1, const PCPS_TIME_STAMP *p_ts2 )
+{
+  int64_t d = ( (int64_t) p_ts1->sec - (int64_t) p_ts2->sec ) * NSEC_PER_SEC
+            + (int64_t) bin_frac_32_to_nsec( p_ts1->frac )
+            - (int64_t) bin_frac_32_to_nsec( p_ts2->frac );
+
+  return (int32_t) clamp_t( int64_t, d, INT_MIN, INT_MAX );
+
+}  // agg_tstamp_diff_ns
+
+
+
+static /*HDR*/
+/**
+ * @brief Determine the offset of the time of a candidate to another one
+ *
+ * The devices have been read one after the other, so the difference
+ * of the time stamps is compensated by the system time which has
+ * elapsed between the reads.
+ */
+int64_t agg_cand_offs_ns( const AGG_CAND *p1, const AGG_CAND *p2 )
+{
+  return (int64_t) agg_tstamp_diff_ns( &p1->ts, &p2->ts ) - ( p1->sys_ns - p2->sys_ns );
+
+}  // agg_cand_offs_ns
+
+
+
+static /*HDR*/
+int agg_cand_has_time( const AGG_CAND *p )
+{
+  // The time of a device which has never been
+  // synchronized is not worth being compared.
+  return p->ts.sec && ( p->rank >= AGG_RANK_FREER );
+
+}  // agg_cand_has_time
+
+
+
+static /*HDR*/
+/**
+ * @brief Check if the time of a candidate disagrees with most of the others
+ *
+ * Only candidates with a time stamp are compared, see ::agg_cand_has_time.
+ * With only 2 such candidates it can't be decided which one is wrong,
+ * so at least 2 other candidates are required to form a majority.
+ *
+ * @param[in]  idx      Index of the candidate to check in ::agg_cands
+ * @param[in]  n_cands  Number of valid entries in ::agg_cands
+ *
+ * @return 1 if the offset of the candidate to the majority of the others
+ *         exceeds ::agg_max_offs, else 0
+ */
+int agg_cand_is_outlier( int idx, int n_cands )
+{
+  const AGG_CAND *p = &agg_cands[idx];
+  int64_t max_offs_ns = (int64_t) agg_max_offs * NSEC_PER_USEC;
+  int n_cmp = 0;
+  int n_agree = 0;
+  int i;
+
+  if ( ( agg_max_offs <= 0 ) || !agg_cand_has_time( p ) )
+    return 0;
+
+  for ( i = 0; i < n_cands; i++ )
+  {
+    int64_t offs;
+
+    if ( ( i == idx ) || !agg_cand_has_time( &agg_cands[i] ) )
+      continue;
+
+    n_cmp++;
+    offs = agg_cand_offs_ns( p, &agg_cands[i] );
+
+    if ( ( offs <= max_offs_ns ) && ( offs >= -max_offs_ns ) )
+      n_agree++;
+  }
+
+  return ( n_cmp >= 2 ) && ( 2 * n_agree < n_cmp );
+
+}  // agg_cand_is_outlier
+
+
+
+static /*HDR*/
+/**
+ * @brief Take references to all registered devices
+ *
+ * Must be called with sem_fops and ::agg_mutex held. The references
+ * keep the devices from being deleted, see ::agg_forget_device,
+ * so they can be read after sem_fops has been released.
+ */
+void agg_get_devs( void )
+{
+  int i;
+
+  agg_n_devs = 0;
+
+  for ( i = 0; i < max_devs; i++ )
+  {
+    PCPS_DDEV *pddev = ddev_list[i];
+
+    if ( pddev == NULL )
+      continue;
+
+    atomic_inc( &pddev->agg_refs );
+    agg_devs[agg_n_devs++] = pddev;
+  }
+
+}  // agg_get_devs
+
+
+
+static /*HDR*/
+/**
+ * @brief Drop the references taken by ::agg_get_devs
+ *
+ * Must be called with ::agg_mutex held, after the selections
+ * have been updated.
+ */
+void agg_put_devs( void )
+{
+  int i;
+
+  for ( i = 0; i < agg_n_devs; i++ )
+    if ( atomic_dec_and_test( &agg_devs[i]->agg_refs ) )
+      wake_up( &agg_refs_wait );
+
+  agg_n_devs = 0;
+
+}  // agg_put_devs
+
+
+
+static /*HDR*/
+/**
+ * @brief Read the time from a device, with the device mutex held
+ *
+ * @param[in]   pddev  The device to read from
+ * @param[in]   kind   ::AGG_KIND_HR_TIME or ::AGG_KIND_TIME
+ * @param[out]  p      The sample as read from the device
+ *
+ * @return ::MBG_SUCCESS or one of the @ref MBG_ERROR_CODES,
+ *         or -ERESTARTSYS if interrupted while waiting for the device mutex
+ */
+int agg_read_dev_time( PCPS_DDEV *pddev, int kind, AGG_SAMPLE *p )
+{
+  int rc;
+
+  _pcps_sem_inc( pddev );
+
+  if ( kind == AGG_KIND_HR_TIME )
+  {
+    rc = _pcps_read_var( pddev, PCPS_GIVE_HR_TIME, agg_iob->pcps_hr_time );
+    p->hr_t = agg_iob->pcps_hr_time;
+  }
+  else
+  {
+    rc = _pcps_read_var( pddev, PCPS_GIVE_TIME_NOCLEAR, agg_iob->pcps_time );
+    p->t = agg_iob->pcps_time;
+  }
+
+  _pcps_sem_dec( pddev );
+
+  return rc;
+
+}  // agg_read_dev_time
+
+
+
+static /*HDR*/
+/**
+ * @brief Read a sample of a specific kind from a device
+ *
+ * Must be called with ::agg_mutex held, which protects ::agg_iob,
+ * and with a reference to the device, see ::agg_get_devs.
+ *
+ * @param[in]   pddev   The device to read from
+ * @param[in]   kind    One of the ::AGG_KINDS
+ * @param[out]  p       The sample as read from the device
+ * @param[out]  p_rank  The health rank derived from the sample, see ::AGG_RANKS,
+ *                      or -1 if the kind of sample provides no status
+ * @param[out]  p_ts    The time stamp of the sample in host byte order,
+ *                      or zeroed if the kind of sample provides no time stamp
+ *
+ * @return ::MBG_SUCCESS or one of the @ref MBG_ERROR_CODES,
+ *         ::MBG_ERR_INTR if interrupted by a signal, which
+ *         doesn't indicate a failure of the device
+ */
+int agg_read_dev( PCPS_DDEV *pddev, int kind, AGG_SAMPLE *p, int *p_rank, PCPS_TIME_STAMP *p_ts )
+{
+  int rc;
+
+  *p_rank = -1;
+  memset( p_ts, 0, sizeof( *p_ts ) );
+
+  if ( !get_dev_connected( pddev ) )
+    return MBG_ERR_NO_DEV;
+
+  if ( kind == AGG_KIND_FAST_HR_TS )
+  {
+    do_get_fast_hr_timestamp_safe( pddev, &p->tstamp );
+    *p_ts = p->tstamp;
+    _mbg_swab_pcps_time_stamp( p_ts );
+    return MBG_SUCCESS;
+  }
+
+  if ( _pcps_access_is_unsafe( pddev ) )
+    return MBG_ERR_IRQ_UNSAFE;
+
+  rc = agg_read_dev_time( pddev, kind, p );
+
+  if ( rc == -ERESTARTSYS )
+    return MBG_ERR_INTR;
+
+  if ( mbg_rc_is_error( rc ) )
+    return rc;
+
+  if ( kind == AGG_KIND_HR_TIME )
+  {
+    // The sample is returned to user space as read from the device,
+    // so only a copy is converted to host byte order.
+    PCPS_HR_TIME t = p->hr_t;
+
+    _mbg_swab_pcps_hr_time( &t );
+    *p_ts = t.tstamp;
+    *p_rank = agg_rank( t.status );
+  }
+  else
+    *p_rank = agg_rank( p->t.status );
+
+  return MBG_SUCCESS;
+
+}  // agg_read_dev
+
+
+
+static /*HDR*/
+/**
+ * @brief Check the health of all devices, and select the best one
+ *
+ * The current device is checked first, and is only replaced
+ * if another device has a better health rank, so the serving
+ * device doesn't change needlessly between devices which are
+ * equally healthy. Must be called with ::agg_mutex held, and
+ * with references to all devices, see ::agg_get_devs.
+ *
+ * The time stamps of the devices are compared with each other,
+ * and a device whose time disagrees with the majority of the others
+ * by more than ::agg_max_offs is demoted to ::AGG_RANK_NOT_SYNCD,
+ * even if its status claims it is synchronized, see ::agg_cand_is_outlier.
+ *
+ * If interrupted by a signal, the selection is left unchanged.
+ *
+ * @param[in]   kind     One of the ::AGG_KINDS
+ * @param[out]  p_flags  ::MBG_AGG_SAMPLE_FLAG_SWITCHED is set if the device has changed
+ *
+ * @return ::MBG_SUCCESS, or ::MBG_ERR_INTR if interrupted
+ */
+int agg_select( int kind, uint32_t *p_flags )
+{
+  AGG_SEL *p_sel = &agg_sel[kind];
+  AGG_CAND *p_best = NULL;
+  AGG_CAND *p_cur = NULL;
+  PCPS_DDEV *p_best_dev;
+  int best_rank = -1;
+  int n_cands = 0;
+  int i;
+
+  // Index -1 refers to the current device, so the current
+  // device is the first candidate, if it can be read.
+  for ( i = -1; i < agg_n_devs; i++ )
+  {
+    PCPS_DDEV *pddev = ( i < 0 ) ? p_sel->pddev : agg_devs[i];
+    AGG_CAND *p_cand = &agg_cands[n_cands];
+    AGG_SAMPLE sample;
+    int64_t t0;
+    int rc;
+
+    if ( pddev == NULL )
+      continue;
 
-static /*HDR*/
-ssize_t mbgclock_write( struct file *filp, const char *buffer,
-                        size_t count, loff_t *ppos )
-{
-  _mbgddmsg_1( DEBUG, MBG_LOG_WARN, "%p write: not supported", filp );
+    if ( ( i >= 0 ) && ( pddev == p_sel->pddev ) )
+      continue;
 
-  #if !ESPIPE_BY_VFS
-    if ( ppos != &filp->f_pos )
-      return -ESPIPE;
-  #endif
+    if ( !agg_dev_supports( pddev, kind ) )
+      continue;
 
-  return -EIO;
+    t0 = ktime_to_ns( ktime_get() );
 
-}  // mbgclock_write
+    // The health can only be checked via the time status,
+    // which is not part of the fast time stamps.
+    rc = agg_read_dev( pddev, _pcps_ddev_has_hr_time( pddev ) ? AGG_KIND_HR_TIME : AGG_KIND_TIME,
+                       &sample, &p_cand->rank, &p_cand->ts );
 
+    if ( rc == MBG_ERR_INTR )
+      return rc;
 
+    if ( mbg_rc_is_error( rc ) )
+      continue;
 
-static /*HDR*/
-int mbgdrvr_ioctl_emu_serial( struct file *filp, unsigned int cmd, unsigned long arg )
-{
-  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "%p ioctl: emu serial cmd 0x%X", filp, cmd );
+    // Assume the device has latched its time in the middle of the read.
+    p_cand->sys_ns = t0 + ( ktime_to_ns( ktime_get() ) - t0 ) / 2;
+    p_cand->pddev = pddev;
+    n_cands++;
+  }
 
-  switch ( cmd )
+  for ( i = 0; i < n_cands; i++ )
   {
-    case TCGETS:
+    AGG_CAND *p_cand = &agg_cands[i];
+    int rank = p_cand->rank;
+
+    if ( agg_cand_is_outlier( i, n_cands ) && ( rank > AGG_RANK_NOT_SYNCD ) )
     {
-      struct termios termios = { 0 };
+      _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_WARN, "Aggregate device: time of " MBG_DEV_NAME_FMT
+                   " (minor %i) disagrees with the other devices",
+                   _pcps_ddev_type_name( p_cand->pddev ), _pcps_ddev_sernum( p_cand->pddev ),
+                   MINOR( p_cand->pddev->lx_dev ) );
 
-      /*** Setzen der termios-Werte fuer die Meinberg Funkuhr
-         ueber serielle Leitung zur Abfrage. ***/
-      termios.c_iflag = IGNBRK|IGNPAR|ISTRIP;   /* input mode flags */
-      termios.c_oflag = 0;                      /* output mode flags */
-      termios.c_cflag = B9600|CS7|PARENB|CREAD|HUPCL|CLOCAL;  /* control mode flags */
-      termios.c_lflag = 0;                      /* local mode flags */
-      termios.c_line = 0;                       /* line discipline */
+      // Only used if there is no better device at all.
+      rank = AGG_RANK_NOT_SYNCD;
+    }
 
-      if ( copy_to_user( (struct termios *) arg, &termios, sizeof( termios ) ) )
-      {
-        _mbgddmsg_1( DEBUG, MBG_LOG_WARN, "%p ioctl: cmd TCGETS copy_to_user failed", filp );
-        return -EFAULT;
-      }
+    if ( p_cand->pddev == p_sel->pddev )
+      p_cur = p_cand;
 
-      break;
+    if ( rank > best_rank )
+    {
+      p_best = p_cand;
+      best_rank = rank;
     }
+  }
 
+  p_best_dev = p_best ? p_best->pddev : NULL;
 
-    case TIOCGWINSZ:
+  if ( p_best_dev != p_sel->pddev )
+  {
+    if ( p_sel->pddev || p_sel->dev_lost )
     {
-      struct winsize winsize = { 0, 0, 0, 0 };
+      p_sel->n_switches++;
+      *p_flags |= MBG_AGG_SAMPLE_FLAG_SWITCHED;
 
-      if ( copy_to_user( (struct winsize *) arg, &winsize, sizeof( winsize ) ) )
-      {
-        _mbgddmsg_1( DEBUG, MBG_LOG_WARN, "%p ioctl: cmd TIOCGWINSZ copy_to_user failed", filp );
-        return -EFAULT;
-      }
+      p_sel->offs_valid = p_best && p_cur && p_cur->ts.sec && p_best->ts.sec;
 
-      break;
+      if ( p_sel->offs_valid )
+        p_sel->switch_offs_ns = (int32_t) clamp_t( int64_t, agg_cand_offs_ns( p_best, p_cur ),
+                                                   INT_MIN, INT_MAX );
     }
 
+    if ( p_best_dev )
+      mbg_kdd_msg( MBG_LOG_INFO, "Aggregate device now using " MBG_DEV_NAME_FMT " (minor %i, rank %i)",
+                   _pcps_ddev_type_name( p_best_dev ), _pcps_ddev_sernum( p_best_dev ),
+                   MINOR( p_best_dev->lx_dev ), best_rank );
+    else
+      mbg_kdd_msg( MBG_LOG_WARN, "Aggregate device: no usable device" );
 
-    case TCSETS:
-    case TCFLSH:
-      break;
-
-    default:
-      _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_WARN, "%p ioctl: serial IOCTL cmd 0x%X not supported",
-                   filp, cmd );
-      return -EINVAL;
-
-  }  // switch
+    p_sel->pddev = p_best_dev;
+    p_sel->dev_lost = 0;
+  }
 
-  return 0;
+  p_sel->rank = best_rank;
+  p_sel->next_check = jiffies + msecs_to_jiffies( agg_check_intv );
 
-}  // mbgdrvr_ioctl_emu_serial
+  return MBG_SUCCESS;
 
+}  // agg_select
 
 
-#if DEBUG_IOCTL
 
 static /*HDR*/
-void decode_ioctl( const char *s, ulong cmd )
+/**
+ * @brief Remove a device which is going to be deleted from the selections
+ *
+ * Must be called with sem_fops held, so no new references to the
+ * device can be taken, and not with the device mutex held, which
+ * the aggregate device may be waiting for. Waits until the
+ * aggregate device has dropped its references to the device.
+ * ::agg_mutex can't be acquired here since the aggregate device
+ * acquires sem_fops with ::agg_mutex held.
+ *
+ * @param[in]  pddev  The device to be removed
+ */
+void agg_forget_device( PCPS_DDEV *pddev )
 {
-  _mbgddmsg_5( DEBUG_IOCTL, MBG_LOG_INFO, "          %s 0x%08lX: type: 0x%02lX, nr: 0x%02lX, size: %lu",
-               s, cmd, (ulong) _IOC_TYPE( cmd ), (ulong) _IOC_NR( cmd ), (ulong) _IOC_SIZE( cmd ) );
+  int i;
 
-}  // decode_ioctl
+  wait_event( agg_refs_wait, atomic_read( &pddev->agg_refs ) == 0 );
 
-#endif
+  for ( i = 0; i < N_AGG_KINDS; i++ )
+  {
+    AGG_SEL *p_sel = &agg_sel[i];
 
+    if ( p_sel->pddev == pddev )
+    {
+      p_sel->pddev = NULL;
+      p_sel->dev_lost = 1;
+    }
+  }
 
+}  // agg_forget_device
 
-static /*HDR*/
-// Unlike the other kernel functions which return POSIX errnos in case of
-// an error, this fuction returns one of the MBG_ERROR_CODES, except
-// for some IOCTLs for serial port emulation which are only received
-// if ntpd accesses this device via the parse driver.
-long mbgclock_unlocked_ioctl( struct file *filp, unsigned int cmd, unsigned long arg )
-{
-  PCPS_DDEV *pddev = NULL;
-  long sys_rc = mbgdrvr_get_pddev( &pddev, filp, "ioctl" );
-  int priv_lvl;
-  #if defined( DEBUG )
-    const char *ioctl_name = mbgioctl_get_name( cmd );
-  #endif
 
-  if ( sys_rc < 0 )  // usually -ENODEV, or -ERESTARTSYS
-    goto out;
 
-  // Find out which privilege level is required
-  // to execute this IOCTL command.
-  priv_lvl = ioctl_get_required_privilege( cmd );
+static /*HDR*/
+// Like mbgclock_unlocked_ioctl(), this returns a negative errno
+// if the IOCTL code is not supported by the aggregate device.
+long mbgclock_agg_unlocked_ioctl( struct file *filp, unsigned int cmd, unsigned long arg )
+{
+  union
+  {
+    MBG_AGG_TIME t;
+    MBG_AGG_HR_TIME hr_t;
+    MBG_AGG_FAST_HR_TIMESTAMP tstamp;
+  } out;
+  MBG_AGG_SAMPLE_INFO *p_info = &out.t.info;  // same location in all structures
+  AGG_SEL *p_sel;
+  AGG_SAMPLE sample;
+  PCPS_TIME_STAMP ts;
+  uint32_t flags = 0;
+  size_t out_size;
+  long sys_rc = 0;
+  int kind;
+  int rank;
+  int rc;
 
-  // Check if the calling process has the required privilege.
-  switch ( priv_lvl )
+  switch ( cmd )
   {
-    case MBG_REQ_PRIVL_NONE:
-      _mbgddmsg_5( DEBUG, MBG_LOG_INFO, "%p %s (0x%02X): no priv lvl required, dev " MBG_DEV_NAME_FMT,
-                   filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      // Always allow.
+    case IOCTL_GET_AGG_TIME:
+      kind = AGG_KIND_TIME;
+      out_size = sizeof( out.t );
       break;
 
-    case MBG_REQ_PRIVL_EXT_STATUS:
-    case MBG_REQ_PRIVL_CFG_READ:
-      _mbgddmsg_5( DEBUG, MBG_LOG_INFO, "%p %s (0x%02X): no priv lvl required to read cfg, dev " MBG_DEV_NAME_FMT,
-                   filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      // This may require some privilege for the calling process.
-      // Anyway, always allow for now.
+    case IOCTL_GET_AGG_HR_TIME:
+      kind = AGG_KIND_HR_TIME;
+      out_size = sizeof( out.hr_t );
       break;
 
-    case MBG_REQ_PRIVL_CFG_WRITE:
-    case MBG_REQ_PRIVL_SYSTEM:
-      #if !OMIT_PRIV_CHECKING   // this is the default case
-        _mbgddmsg_5( DEBUG, MBG_LOG_INFO, "%p %s (0x%02X): admin rights required, dev " MBG_DEV_NAME_FMT,
-                     filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-
-        if ( !capable( CAP_SYS_ADMIN ) )  // allow only if root privileges available.
-        {
-          _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): permission denied, dev " MBG_DEV_NAME_FMT,
-                       filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-          return IOCTL_RC_ERR_PERM;
-        }
-      #else
-        _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): admin rights would be required (checking omitted), dev " MBG_DEV_NAME_FMT,
-                     filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-      #endif
+    case IOCTL_GET_AGG_FAST_HR_TIMESTAMP:
+      kind = AGG_KIND_FAST_HR_TS;
+      out_size = sizeof( out.tstamp );
       break;
 
     default:
-      // maybe an unknown IOCTL code ...
-      // This is OK if it is one of those codes required
-      switch ( cmd )
-      {
-        case TCGETS:
-        case TIOCGWINSZ:
-        case TCSETS:
-        case TCFLSH:
-          sys_rc = mbgdrvr_ioctl_emu_serial( filp, cmd, arg );
+      _mbgddmsg_2( DEBUG, MBG_LOG_WARN, "%p agg ioctl 0x%02X: not supported by aggregate device",
+                   filp, cmd );
+      return IOCTL_RC_ERR_UNSUPP_IOCTL;
 
-          if ( sys_rc == 0 )
-            goto out;  // has been handled normally
+  }  // switch
 
-          _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): invalid cmd, dev " MBG_DEV_NAME_FMT,
-                       filp, ioctl_name, cmd,
-                       _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-          #if DEBUG_IOCTL
-            decode_ioctl( "ioctl", cmd );
-          #endif
-          break;
+  if ( _mbg_mutex_acquire( &agg_mutex ) < 0 )
+    return -ERESTARTSYS;
 
-        default:
-          _mbgddmsg_5( DEBUG, MBG_LOG_WARN, "%p %s (0x%02X): unknown command code, dev " MBG_DEV_NAME_FMT,
-                       filp, ioctl_name, cmd, _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
-          #if DEBUG_IOCTL
-            decode_ioctl( "ioctl", cmd );
-          #endif
-          return IOCTL_RC_ERR_UNSUPP_IOCTL;  // TODO Is this ret val appropriate?
+  // sem_fops is only held while references to the devices are taken,
+  // so opening or adding devices isn't blocked while the devices are
+  // read. A device which is being removed can't be deleted until
+  // the references have been dropped, though.
+  if ( _down_interruptible( &sem_fops, "sem_fops", __func__, filp ) < 0 )
+  {
+    sys_rc = -ERESTARTSYS;
+    goto out_release_agg_mutex;
+  }
 
-      }  // switch
+  agg_get_devs();
+
+  _up( &sem_fops, "sem_fops", __func__, filp );
+
+  p_sel = &agg_sel[kind];
+  rc = MBG_SUCCESS;
+
+  if ( ( p_sel->pddev == NULL ) || time_after_eq( jiffies, p_sel->next_check ) )
+    rc = agg_select( kind, &flags );
+
+  if ( mbg_rc_is_success( rc ) )
+  {
+    rc = MBG_ERR_NO_DEV;
+
+    if ( p_sel->pddev )
+    {
+      rc = agg_read_dev( p_sel->pddev, kind, &sample, &rank, &ts );
+
+      // If the selected device has failed, or its status has degraded,
+      // check immediately if another device is healthier. An interrupted
+      // read doesn't indicate a failure of the device, though.
+      if ( ( rc != MBG_ERR_INTR ) &&
+           ( mbg_rc_is_error( rc ) || ( ( rank >= 0 ) && ( rank < p_sel->rank ) ) ) )
+      {
+        rc = agg_select( kind, &flags );
+
+        if ( mbg_rc_is_success( rc ) )
+          rc = p_sel->pddev ? agg_read_dev( p_sel->pddev, kind, &sample, &rank, &ts ) : MBG_ERR_NO_DEV;
+      }
+    }
   }
 
-  sys_rc = ioctl_switch( pddev, cmd, (void *) arg, (void *) arg );
+  if ( mbg_rc_is_error( rc ) )
+  {
+    if ( rc == MBG_ERR_INTR )
+      sys_rc = -ERESTARTSYS;
+    else
+      sys_rc = ( rc == MBG_ERR_NO_DEV ) ? -ENODEV : IOCTL_RC_ERR_DEV_ACCESS;
 
-out:
-  // If the return value is negative then this is considered as an error code.
-  // The kernel converts this to a positive value which is stored in errno, and
-  // lets the ioctl call return -1, so the calling user space code has to read
-  // errno if -1 is returned.
+    goto out_put_devs;
+  }
 
-  return sys_rc;
+  if ( rank >= 0 )
+    p_sel->rank = rank;
 
-}  // mbgclock_unlocked_ioctl
+  if ( p_sel->rank < AGG_RANK_SYNCD )
+    flags |= MBG_AGG_SAMPLE_FLAG_DEGRADED;
 
+  if ( p_sel->offs_valid )
+    flags |= MBG_AGG_SAMPLE_FLAG_OFFS_VALID;
 
+  p_info->dev_minor = MINOR( p_sel->pddev->lx_dev );
+  p_info->flags = flags;
+  p_info->n_switches = p_sel->n_switches;
+  p_info->switch_offs_ns = p_sel->switch_offs_ns;
 
-#if defined( HAVE_COMPAT_IOCTL ) && defined( CONFIG_COMPAT )
+  switch ( kind )
+  {
+    case AGG_KIND_TIME:
+      out.t.t = sample.t;
+      break;
 
-static /*HDR*/
-long mbgclock_compat_ioctl( struct file *filp, unsigned int cmd, unsigned long arg )
-{
-  long rc;
+    case AGG_KIND_HR_TIME:
+      out.hr_t.t = sample.hr_t;
+      break;
 
-  #if DEBUG_IOCTL
-    _mbg_kdd_msg_4( MBG_LOG_INFO, "%p compat_ioctl %s (0x%08X) calling ioctl (0x%08lX)",
-                    filp, mbgioctl_get_name( cmd ), cmd, (ulong) IOCTL_PCPS_GENERIC_READ_GPS );
+    case AGG_KIND_FAST_HR_TS:
+      out.tstamp.tstamp = sample.tstamp;
+      break;
 
-  #endif
+  }  // switch
 
-  rc = mbgclock_unlocked_ioctl( filp, cmd, arg );
+out_put_devs:
+  agg_put_devs();
 
-  return rc;
+out_release_agg_mutex:
+  _mbg_mutex_release( &agg_mutex );
 
-}  // mbgclock_compat_ioctl
+  if ( sys_rc == 0 )
+    if ( copy_to_user( (void *) arg, &out, out_size ) )
+      sys_rc = IOCTL_RC_ERR_COPY_TO_USER;
 
-#endif
+  return sys_rc;
+
+}  // mbgclock_agg_unlocked_ioctl
 
 
 
 #if !defined( HAVE_UNLOCKED_IOCTL )
 
 static /*HDR*/
-int mbgclock_ioctl( struct inode *not_used, struct file *filp, unsigned int cmd, unsigned long arg )
+int mbgclock_agg_ioctl( struct inode *not_used, struct file *filp, unsigned int cmd, unsigned long arg )
 {
-  long rc;
+  return (int) mbgclock_agg_unlocked_ioctl( filp, cmd, arg );
 
-  _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "%p unlocked_ioctl calling ioctl()", filp );
+}  // mbgclock_agg_ioctl
 
-  rc = mbgclock_unlocked_ioctl( filp, cmd, arg );
+#endif
 
-  return (int) rc;
 
-}  // mbgclock_ioctl
 
-#endif
+static struct file_operations mbgclock_agg_fops =
+{
+  #if NEW_FILE_OPS
+    owner: THIS_MODULE,
+  #endif
+
+  #if defined( HAVE_UNLOCKED_IOCTL )
+    unlocked_ioctl: mbgclock_agg_unlocked_ioctl,
+  #else
+    ioctl: mbgclock_agg_ioctl,
+  #endif
+  #if defined( HAVE_COMPAT_IOCTL ) && defined( CONFIG_COMPAT )
+    // The structures have the same layout for 32 and 64 bit apps.
+    compat_ioctl: mbgclock_agg_unlocked_ioctl,
+  #endif
+  llseek: NULL
+};
+
+
+static struct miscdevice mbgclock_agg_miscdev =
+{
+  minor: MISC_DYNAMIC_MINOR,
+  name: "mbgclock-agg",
+  fops: &mbgclock_agg_fops
+};
 
 
 
 static /*HDR*/
-int mbgclock_mmap( struct file * filp, struct vm_area_struct *vma )
+/**
+ * @brief Register the aggregate device, if enabled
+ *
+ * Failure is not fatal, the devices /dev/mbgclockN
+ * are still available.
+ */
+void mbgdrvr_start_agg_dev( void )
 {
-  MBG_IOMEM_ADDR_RAW addr;
-  PCPS_DDEV *pddev = NULL;
-  int rc = mbgdrvr_get_pddev( &pddev, filp, "mmap" );
+  int rc;
 
-  if ( rc < 0 )
-    goto out;
+  if ( agg_check_intv <= 0 )
+  {
+    _mbgddmsg_0( DEBUG_DRVR, MBG_LOG_INFO, "Aggregate device disabled by module parameter" );
+    return;
+  }
 
-  addr = pddev->rsrc_info.mem[0].start_raw;
+  _mbg_mutex_init( &agg_mutex, "agg_mutex" );
 
-#if VMA_HAS_VM_PGOFF
-  if ( ( ( vma->vm_end - vma->vm_start ) != PAGE_SIZE ) || vma->vm_pgoff )
-#else
-  if ( ( ( vma->vm_end - vma->vm_start ) != PAGE_SIZE ) )
-#endif
+  agg_iob = _pcps_kmalloc( sizeof( *agg_iob ) );
+  agg_devs = _pcps_kmalloc( max_devs * sizeof( *agg_devs ) );
+  agg_cands = _pcps_kmalloc( ( max_devs + 1 ) * sizeof( *agg_cands ) );
+
+  if ( ( agg_iob == NULL ) || ( agg_devs == NULL ) || ( agg_cands == NULL ) )
+  {
+    mbg_kdd_msg( MBG_LOG_WARN, "Failed to allocate buffers for aggregate device" );
+    goto out_free;
+  }
+
+  rc = misc_register( &mbgclock_agg_miscdev );
+
+  if ( rc < 0 )
   {
-    mbg_kdd_msg( MBG_LOG_ERR, "vm_end (0x%08lX) - vm_start (0x%08lX) doesn't match PAGE_SIZE (0x%08lX)",
-                 vma->vm_end, vma->vm_start, (unsigned long) PAGE_SIZE );
-    rc = -EINVAL;
-    goto out;
+    mbg_kdd_msg( MBG_LOG_WARN, "Failed to register aggregate device, rc: %i", rc );
+    goto out_free;
   }
 
-  #if VMA_HAS_VM_PGOFF
-    _mbgddmsg_4( DEBUG_DRVR, MBG_LOG_INFO,
-                 "vm_end (0x%08lX) - vm_start (0x%08lX) == PAGE_SIZE (0x%08lX), pg_off: 0x%08lX",
-                 vma->vm_end, vma->vm_start, (unsigned long) PAGE_SIZE, vma->vm_pgoff );
-  #else
-    _mbgddmsg_3( DEBUG_DRVR, MBG_LOG_INFO, "vm_end (0x%08lX) - vm_start (0x%08lX) == PAGE_SIZE (0x%08lX)",
-                 vma->vm_end, vma->vm_start, (unsigned long) PAGE_SIZE );
-  #endif
+  agg_dev_registered = 1;
 
-  vma->vm_flags |= VM_IO;
+  _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Registered aggregate device %s, check interval %i ms",
+               mbgclock_agg_miscdev.name, agg_check_intv );
 
-  #if defined( pgprot_noncached )
-    vma->vm_page_prot = pgprot_noncached( vma->vm_page_prot );
-  #endif
+  return;
 
-  #if _PCPS_HAS_REMAP_PFN
-    rc = io_remap_pfn_range( vma, vma->vm_start, addr >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot );
-  #else
-    rc = io_remap_page_range( vma, vma->vm_start, addr, PAGE_SIZE, vma->vm_page_prot );
-  #endif
 
-  if ( rc )
+out_free:
+  if ( agg_cands )
   {
-    rc = -EAGAIN;
-    goto out;
+    _pcps_kfree( agg_cands, ( max_devs + 1 ) * sizeof( *agg_cands ) );
+    agg_cands = NULL;
   }
 
-  rc = 0;
+  if ( agg_devs )
+  {
+    _pcps_kfree( agg_devs, max_devs * sizeof( *agg_devs ) );
+    agg_devs = NULL;
+  }
 
-out:
-  return rc;
+  if ( agg_iob )
+  {
+    _pcps_kfree( agg_iob, sizeof( *agg_iob ) );
+    agg_iob = NULL;
+  }
 
-}  // mbgclock_mmap
+}  // mbgdrvr_start_agg_dev
 
 
 
-struct file_operations mbgclock_fops =
+static /*HDR*/
+void mbgdrvr_stop_agg_dev( void )
 {
-  #if NEW_FILE_OPS
-    owner: THIS_MODULE,
-  #endif
+  if ( !agg_dev_registered )
+    return;
 
-  read: mbgclock_read,
-  write: mbgclock_write,
-  poll: mbgclock_poll,
-  #if defined( HAVE_UNLOCKED_IOCTL )
-    unlocked_ioctl: mbgclock_unlocked_ioctl,
-  #else
-    ioctl: mbgclock_ioctl,
-  #endif
-  #if defined( HAVE_COMPAT_IOCTL ) && defined( CONFIG_COMPAT )
-    compat_ioctl: mbgclock_compat_ioctl,  // called if a 32 bit app ioctls a 64 bit driver
-  #endif
-  open: mbgclock_open,
-  flush: mbgclock_flush,
-  release: mbgclock_release,
-  fasync: mbgclock_fasync,
-  mmap: mbgclock_mmap,
-  llseek: NULL
-};
+  misc_deregister( &mbgclock_agg_miscdev );
+  agg_dev_registered = 0;
+
+  _pcps_kfree( agg_iob, sizeof( *agg_iob ) );
+  agg_iob = NULL;
+
+  _pcps_kfree( agg_cands, ( max_devs + 1 ) * sizeof( *agg_cands ) );
+  agg_cands = NULL;
+
+  _pcps_kfree( agg_devs, max_devs * sizeof( *agg_devs ) );
+  agg_devs = NULL;
+
+  _mbgddmsg_0( DEBUG_DRVR, MBG_LOG_INFO, "Aggregate device has been unregistered" );
+
+}  // mbgdrvr_stop_agg_dev
+
+#endif  // _PCPS_USE_AGG_DEV
 
 
 
@@ -1957,6 +5453,15 @@ int __devinit mbgdrvr_create_device( PCPS_DDEV *pddev )
                _pcps_ddev_type_name( pddev ),
                _pcps_ddev_sernum( pddev ) );
 
+  #if _PCPS_USE_ASYNC_REQ
+    // Must be set up before the device can be opened.
+    mbgdrvr_init_async_req( pddev );
+  #endif
+
+  #if USE_PCPS_EVT_LOG_MIRROR
+    _mbg_mutex_init( &pddev->evt_log_mutex, "evt_log_mutex" );
+  #endif
+
   dev_idx = ddev_list_add_entry( pddev );
 
   if ( dev_idx < 0 )
@@ -1965,8 +5470,7 @@ int __devinit mbgdrvr_create_device( PCPS_DDEV *pddev )
     goto fail;
   }
 
-  dev = MKDEV( major, minor + dev_idx );
-  pddev->lx_dev = dev;
+  dev = pddev->lx_dev;
 
   cdev_init( &pddev->cdev, &mbgclock_fops );
   pddev->cdev.owner = THIS_MODULE;
@@ -2041,10 +5545,6 @@ int __devinit mbgdrvr_create_device( PCPS_DDEV *pddev )
   pddev->data_avail = ATOMIC_INIT( 0 );
 #endif
 
-  #if _PCPS_USE_USB
-    _sema_init_pddev( &pddev->sem_usb_cyclic, 1, "sem_usb_cyclic", __func__, pddev );
-  #endif
-
   if ( default_fast_hr_time_pddev == NULL )
     if ( _pcps_ddev_has_fast_hr_timestamp( pddev ) )
     {
@@ -2061,6 +5561,22 @@ int __devinit mbgdrvr_create_device( PCPS_DDEV *pddev )
                    _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
     }
 
+  #if _PCPS_USE_DEV_STATS
+    mbgdrvr_start_stats( pddev, dev_idx );
+  #endif
+
+  #if _PCPS_USE_DBG_KEYS
+    pcps_set_dbg_flags( pddev, dbg_flags );
+  #endif
+
+  #if _PCPS_USE_STATUS_SNAPSHOT
+    mbgdrvr_start_status_snapshot( pddev );
+  #endif
+
+  #if _PCPS_USE_UCAP_RING
+    mbgdrvr_start_ucap_drain( pddev );
+  #endif
+
   _mbgddmsg_fnc_exit_success();
   return 0;
 
@@ -2092,6 +5608,10 @@ void mbgdrvr_delete_device( PCPS_DDEV *pddev )
       default_fast_hr_time_pddev = NULL;
     }
 
+    #if _PCPS_USE_AGG_DEV
+      agg_forget_device( pddev );
+    #endif
+
     if ( pddev == default_ucap_pddev )
     {
       _mbgddmsg_2( DEBUG_DRVR, MBG_LOG_INFO, "Removing " MBG_DEV_NAME_FMT " as default device for ucap events",
@@ -2104,6 +5624,35 @@ void mbgdrvr_delete_device( PCPS_DDEV *pddev )
       //               S_IFCHR | S_IRUSR | S_IWUSR, driver_name );
     #endif
 
+    #if _PCPS_USE_DEV_STATS
+      mbgdrvr_stop_stats( pddev );
+    #endif
+
+    #if _PCPS_USE_STATUS_SNAPSHOT
+      mbgdrvr_stop_status_snapshot( pddev );
+    #endif
+
+    #if _PCPS_USE_UCAP_RING
+      mbgdrvr_stop_ucap_drain( pddev );
+    #endif
+
+    #if _PCPS_USE_ASYNC_REQ
+      mbgdrvr_exit_async_req( pddev );
+    #endif
+
+    #if _PCPS_USE_USB
+      if ( _pcps_ddev_is_usb( pddev ) )
+        mbgdrvr_free_usb_cyclic( pddev );
+    #endif
+
+    #if USE_PCPS_EVT_LOG_MIRROR
+      if ( pddev->evt_log_mirror )
+      {
+        vfree( pddev->evt_log_mirror );
+        pddev->evt_log_mirror = NULL;
+      }
+    #endif
+
     cdev_del( &pddev->cdev );
 
     #if _PCPS_HAVE_LINUX_CLASS
@@ -2122,10 +5671,20 @@ void mbgdrvr_delete_device( PCPS_DDEV *pddev )
       }
     #endif
 
+    ddev_list_remove_entry( pddev );
+
     pcps_cleanup_device( pddev );
-    pcps_cleanup_ddev( pddev );
 
-    ddev_list_remove_entry( pddev );
+    #if _PCPS_USE_DEV_STATS
+      mbgdrvr_free_stats( pddev );
+    #endif
+
+    #if _PCPS_USE_DBG_KEYS
+      // Release the static key if debugging was enabled for this device.
+      pcps_set_dbg_flags( pddev, 0 );
+    #endif
+
+    pcps_cleanup_ddev( pddev );
 
     if ( drvr_info.n_devs )
       drvr_info.n_devs--;
@@ -2144,7 +5703,13 @@ void mbgdrvr_delete_device( PCPS_DDEV *pddev )
 static /*HDR*/
 int __devinit mbgdrvr_add_isa_device( PCPS_DDEV *pddev )
 {
-  int rc = mbgdrvr_create_device( pddev );
+  int rc;
+
+  #if _PCPS_USE_SYSFS_ATTR
+    pddev->numa_node = NUMA_NO_NODE;
+  #endif
+
+  rc = mbgdrvr_create_device( pddev );
 
   if ( rc >= 0 )
     set_dev_connected( pddev, 1 );
@@ -2157,13 +5722,108 @@ int __devinit mbgdrvr_add_isa_device( PCPS_DDEV *pddev )
 
 
 
+static /*HDR*/
+void __devinit mbgclock_add_pci_rsrcs( PCPS_DDEV *pddev, struct pci_dev *pci_dev )
+{
+  int i;
+
+  for ( i = 0; i < 5; i++ )
+  {
+    ulong flags = pci_resource_flags( pci_dev, i );
+
+    if ( flags & IORESOURCE_IO )
+      pcps_add_rsrc_io( pddev, pci_resource_start( pci_dev, i ), pci_resource_len( pci_dev, i ) );
+    else
+      if ( flags & IORESOURCE_MEM )
+        pcps_add_rsrc_mem( pddev, pci_resource_start( pci_dev, i ), pci_resource_len( pci_dev, i ) );
+  }
+
+  pcps_add_rsrc_irq( pddev, pci_dev->irq );
+
+}  // mbgclock_add_pci_rsrcs
+
+
+
+static /*HDR*/
+int __devinit mbgclock_add_pci_device( PCPS_DDEV *pddev )
+{
+  int rc;
+
+  // Device creation has to be serialized since
+  // several devices may be probed in parallel.
+  _down( &sem_fops, "sem_fops", __func__, pddev );
+  rc = mbgdrvr_create_device( pddev );
+  _up( &sem_fops, "sem_fops", __func__, pddev );
+
+  if ( rc >= 0 )
+    set_dev_connected( pddev, 1 );
+
+  return rc;
+
+}  // mbgclock_add_pci_device
+
+
+
+#if _PCPS_USE_ASYNC_PROBE
+
+/**
+ * @brief Max. number of deferred probe attempts in 1 s intervals
+ *
+ * Slightly more than the max. boot time of a PTP270PEX card.
+ * The last attempt waits until the card is ready, if required.
+ */
+#define MAX_DEFERRED_PROBE_TRIES  30
+
+
+static /*HDR*/
+void mbgclock_deferred_probe_work( struct work_struct *work )
+{
+  PCPS_DDEV *pddev = container_of( to_delayed_work( work ), PCPS_DDEV, probe_work );
+  struct pci_dev *pci_dev = pddev->probe_pci_dev;
+  int rc;
+
+  pddev->probe_state = ( ++pddev->probe_tries < MAX_DEFERRED_PROBE_TRIES ) ?
+                       PCPS_PROBE_MAY_DEFER : PCPS_PROBE_NOW;
+
+  // The resources have been released and may have been
+  // rearranged by the previous attempt, so set them up again.
+  memset( &pddev->rsrc_info, 0, sizeof( pddev->rsrc_info ) );
+  mbgclock_add_pci_rsrcs( pddev, pci_dev );
+
+  rc = pcps_probe_device( pddev, pci_dev->bus->number, pci_dev->devfn );
+
+  if ( rc == MBG_ERR_NOT_READY )
+  {
+    pddev->probe_state = PCPS_PROBE_DEFERRED;
+    schedule_delayed_work( &pddev->probe_work, HZ );
+    return;
+  }
+
+  if ( mbg_rc_is_error( rc ) || mbgclock_add_pci_device( pddev ) < 0 )
+  {
+    mbg_kdd_msg( MBG_LOG_ERR, "Deferred probing of PCI device %04X failed after %i attempts",
+                 pci_dev->device, pddev->probe_tries );
+    pddev->probe_state = PCPS_PROBE_FAILED;
+    return;
+  }
+
+  pddev->probe_state = PCPS_PROBE_DONE;
+
+  _mbg_kdd_msg_2( MBG_LOG_INFO, "%s ready after %i deferred probe attempts",
+                  _pcps_ddev_type_name( pddev ), pddev->probe_tries );
+
+}  // mbgclock_deferred_probe_work
+
+#endif  // _PCPS_USE_ASYNC_PROBE
+
+
+
 static /*HDR*/
 int __devinit mbgclock_probe_pci_device( struct pci_dev *pci_dev,
                                          const struct pci_device_id *ent )
 {
   PCPS_DDEV *pddev = NULL;
   int rc;
-  int i;
 
   _mbgddmsg_fnc_entry();
 
@@ -2193,37 +5853,52 @@ int __devinit mbgclock_probe_pci_device( struct pci_dev *pci_dev,
     goto fail;
   }
 
-  for ( i = 0; i < 5; i++ )
-  {
-    ulong flags = pci_resource_flags( pci_dev, i );
+  #if _PCPS_USE_SYSFS_ATTR
+    pddev->numa_node = dev_to_node( &pci_dev->dev );
+  #endif
 
-    if ( flags & IORESOURCE_IO )
-      pcps_add_rsrc_io( pddev, pci_resource_start( pci_dev, i ), pci_resource_len( pci_dev, i ) );
-    else
-      if ( flags & IORESOURCE_MEM )
-        pcps_add_rsrc_mem( pddev, pci_resource_start( pci_dev, i ), pci_resource_len( pci_dev, i ) );
-  }
+  mbgclock_add_pci_rsrcs( pddev, pci_dev );
 
-  pcps_add_rsrc_irq( pddev, pci_dev->irq );
+  #if _PCPS_USE_ASYNC_PROBE
+    // Don't wait here if the device is not yet ready.
+    pddev->probe_state = PCPS_PROBE_MAY_DEFER;
+  #endif
 
   rc = pcps_probe_device( pddev, pci_dev->bus->number, pci_dev->devfn );
 
+  #if _PCPS_USE_ASYNC_PROBE
+    if ( rc == MBG_ERR_NOT_READY )
+    {
+      // The device node is created as soon as the device is ready.
+      pddev->probe_pci_dev = pci_dev;
+      pddev->probe_tries = 0;
+      pddev->probe_state = PCPS_PROBE_DEFERRED;
+      INIT_DELAYED_WORK( &pddev->probe_work, mbgclock_deferred_probe_work );
+      pci_set_drvdata( pci_dev, pddev );
+      schedule_delayed_work( &pddev->probe_work, HZ );
+
+      _mbgddmsg_fnc_exit_str( "probe deferred" );
+      return 0;
+    }
+  #endif
+
   if ( mbg_rc_is_error( rc ) )
   {
     rc = -EIO;
     goto fail;
   }
 
+  #if _PCPS_USE_ASYNC_PROBE
+    pddev->probe_state = PCPS_PROBE_DONE;
+  #endif
+
   pci_set_drvdata( pci_dev, pddev );
 
-  rc = mbgdrvr_create_device( pddev );
+  rc = mbgclock_add_pci_device( pddev );
 
   if ( rc < 0 )
     goto fail;
 
-
-  set_dev_connected( pddev, 1 );
-
   _mbgddmsg_fnc_exit_success();
 
   return 0;
@@ -2247,10 +5922,31 @@ void __devexit mbgclock_remove_pci_device( struct pci_dev *pci_dev )
   _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "Removing PCI device %04X",
                pci_dev->device );
 
+  #if _PCPS_USE_ASYNC_PROBE
+    if ( pddev->probe_state != PCPS_PROBE_DONE )
+    {
+      cancel_delayed_work_sync( &pddev->probe_work );
+
+      // If deferred probing has not succeeded then no Linux device
+      // has been created, so only the resources have to be released.
+      if ( pddev->probe_state != PCPS_PROBE_DONE )
+      {
+        pcps_cleanup_device( pddev );
+        pcps_cleanup_ddev( pddev );
+        goto out;
+      }
+    }
+  #endif
+
   set_dev_connected( pddev, 0 );
 
+  _down( &sem_fops, "sem_fops", __func__, pddev );
   mbgdrvr_delete_device( pddev );
+  _up( &sem_fops, "sem_fops", __func__, pddev );
 
+#if _PCPS_USE_ASYNC_PROBE
+out:
+#endif
   pci_set_drvdata( pci_dev, NULL );
 
 }  // mbgclock_remove_pci_device
@@ -2270,7 +5966,11 @@ static struct pci_driver mbgclock_pci_driver =
   name:      MBG_DRVR_NAME,
   id_table:  mbgclock_pci_tbl,
   probe:     mbgclock_probe_pci_device,
-  remove:    __devexit_p( mbgclock_remove_pci_device )
+  remove:    __devexit_p( mbgclock_remove_pci_device ),
+  #if _PCPS_USE_ASYNC_PROBE
+    // Several cards can be probed in parallel.
+    driver:  { probe_type: PROBE_PREFER_ASYNCHRONOUS }
+  #endif
 };
 
 #endif  // _PCPS_USE_PCI_PNP
@@ -2331,6 +6031,27 @@ int __devinit mbgclock_probe_usb_device( struct usb_interface *pintf,
 
   pddev->udev = usb_device;
 
+  #if _PCPS_USE_SYSFS_ATTR
+    pddev->numa_node = dev_to_node( &usb_device->dev );
+  #endif
+
+  if ( ppddev )  // device has been probed before
+  {
+    // The device structure still contains the information read
+    // when the device was probed before, so we only need to check
+    // if it is still valid, which is much faster than a full probe.
+    pddev->intf = pintf;
+    usb_set_intfdata( pintf, pddev );
+
+    rc = pcps_reattach_usb_device( pddev );
+
+    if ( mbg_rc_is_success( rc ) )
+      goto connected;
+
+    _mbg_kdd_msg_2( MBG_LOG_INFO, "Fast re-attach of %s failed (%s), doing full probe",
+                    _pcps_ddev_type_name( pddev ), mbg_strerror( rc ) );
+  }
+
   rc = pcps_setup_ddev( pddev, PCPS_BUS_USB, dev_id );
 
   if ( mbg_rc_is_error( rc ) )
@@ -2354,6 +6075,7 @@ int __devinit mbgclock_probe_usb_device( struct usb_interface *pintf,
     goto fail_free_up_sem_fops;
   }
 
+connected:
   set_dev_connected( pddev, 1 );
 
   if ( ppddev == NULL )  // device did not exist before
@@ -2399,8 +6121,26 @@ void  __devexit mbgclock_remove_usb_device( struct usb_interface *intf )
 
   set_dev_connected( pddev, 0 );
 
+  // The cyclic URB is bound to the USB device which has gone,
+  // and is re-submitted if the device is re-attached.
+  mbgdrvr_stop_usb_cyclic( pddev );
+
+  #if _PCPS_USE_USB_URB
+    // Wait until a transfer in progress has finished,
+    // then release the URBs bound to the USB device.
+    _down( &pddev->dev_mutex, "dev_mutex", __func__, NULL );
+    pcps_usb_free_urbs( pddev );
+    _up( &pddev->dev_mutex, "dev_mutex", __func__, NULL );
+  #endif
+
   _down( &sem_fops, "sem_fops", __func__, NULL );
 
+  #if _PCPS_USE_AGG_DEV
+    // The aggregate device may be waiting for the device mutex,
+    // so it has to drop the device before the mutex is acquired below.
+    agg_forget_device( pddev );
+  #endif
+
   if ( atomic_read( &pddev->open_count ) )
   {
     _mbgddmsg_0( DEBUG_DRVR, MBG_LOG_INFO, "USB remove: calling wake_up_interruptible" );
@@ -2467,6 +6207,10 @@ void mbgclock_cleanup_module( void )
 
   _mbgddmsg_fnc_entry();
 
+  #if _PCPS_USE_AGG_DEV
+    mbgdrvr_stop_agg_dev();
+  #endif
+
   #if _PCPS_USE_PNP
     #if _PCPS_USE_PCI_PNP
       pci_unregister_driver( &mbgclock_pci_driver );
@@ -2496,6 +6240,15 @@ void mbgclock_cleanup_module( void )
   _mbgddmsg_0( DEBUG_DRVR, MBG_LOG_INFO, "chrdev device numbers have been unregistered" );
   ddev_list_free();
 
+  #if _PCPS_USE_IOCTL_MEMPOOL
+    mbgdrvr_destroy_ioctl_buf_pools();
+  #endif
+
+  #if _PCPS_USE_DEV_STATS
+    debugfs_remove_recursive( mbgclock_debugfs_root );
+    mbgclock_debugfs_root = NULL;
+  #endif
+
   #if _PCPS_HAVE_LINUX_CLASS
     if ( !IS_ERR( mbgclock_class ) )
     {
@@ -2616,6 +6369,11 @@ int __init mbgclock_init_module( void )
     {
       _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_INFO, "Class %s created successfully",
                    mbgclock_class_name );
+
+      #if _PCPS_USE_SYSFS_ATTR
+        // Must be set up before the first device is created.
+        mbgclock_class->dev_groups = mbgclock_groups;
+      #endif
     }
     else
       mbg_kdd_msg( MBG_LOG_WARN, "Failed to create class %s, no UDEV support",
@@ -2631,6 +6389,19 @@ int __init mbgclock_init_module( void )
     goto fail_with_cleanup;
   }
 
+  #if _PCPS_USE_IOCTL_MEMPOOL
+    mbgdrvr_create_ioctl_buf_pools();
+  #endif
+
+  #if _PCPS_USE_DEV_STATS
+    // Must be set up before the first device is created.
+    mbgclock_debugfs_root = debugfs_create_dir( driver_name, NULL );
+  #endif
+
+  #if _PCPS_USE_AGG_DEV
+    mbgdrvr_start_agg_dev();
+  #endif
+
   #if _USE_LINUX_DEVFS
     #error devfs support needs cleanup!!
     devfs_mk_cdev( MKDEV( pddev->major, 0 ),
@@ -2659,12 +6430,19 @@ int __init mbgclock_init_module( void )
   #endif
 
 
-  if ( drvr_info.n_devs == 0 )
-  {
-    mbg_kdd_msg( MBG_LOG_INFO, "No supported device found." );
-    rc = -ENODEV;
-    goto fail_with_cleanup;
-  }
+  #if _PCPS_USE_ASYNC_PROBE
+    // PCI devices are probed asynchronously, so they may
+    // not yet have been set up at this point.
+    if ( drvr_info.n_devs == 0 )
+      mbg_kdd_msg( MBG_LOG_INFO, "No supported device found yet." );
+  #else
+    if ( drvr_info.n_devs == 0 )
+    {
+      mbg_kdd_msg( MBG_LOG_INFO, "No supported device found." );
+      rc = -ENODEV;
+      goto fail_with_cleanup;
+    }
+  #endif
 
   if ( pretend_sync )
     mbg_kdd_msg( MBG_LOG_INFO, "Pretending to NTP to be always sync'ed" );
@@ -2792,6 +6570,10 @@ int mbgclock_default_clr_ucap_buff( void )
   rc = _pcps_write_byte( default_ucap_pddev, PCPS_CLR_UCAP_BUFF );
   _pcps_sem_dec( default_ucap_pddev );
 
+  #if _PCPS_USE_UCAP_RING
+    ucap_ring_clear( default_ucap_pddev );
+  #endif
+
   _mbgddmsg_fnc_exit();
   return rc;
 
@@ -2830,6 +6612,15 @@ int mbgclock_default_get_ucap_entries( PCPS_UCAP_ENTRIES *p )
 
   _mbgddmsg_fnc_entry();
 
+  #if _PCPS_USE_UCAP_RING
+    if ( default_ucap_pddev->ucap_ring )
+    {
+      ucap_ring_get_entries( default_ucap_pddev, p );
+      _mbgddmsg_fnc_exit_success();
+      return MBG_SUCCESS;
+    }
+  #endif
+
   _pcps_sem_inc_safe( default_ucap_pddev );
   rc = _pcps_read_var( default_ucap_pddev, PCPS_GIVE_UCAP_ENTRIES, *p );
   _pcps_sem_dec( default_ucap_pddev );
@@ -2878,9 +6669,28 @@ int mbgclock_default_get_ucap_event( PCPS_HR_TIME *p )
 
   _mbgddmsg_fnc_entry();
 
-  _pcps_sem_inc_safe( default_ucap_pddev );
-  rc = _pcps_read_var( default_ucap_pddev, PCPS_GIVE_UCAP_EVENT, *p );
-  _pcps_sem_dec( default_ucap_pddev );
+  #if _PCPS_USE_UCAP_RING
+    // If the user capture drainer is running for the device
+    // then the on-board FIFO must not be read directly.
+    if ( default_ucap_pddev->ucap_ring )
+    {
+      rc = MBG_SUCCESS;
+
+      if ( _mbg_mutex_acquire( &default_ucap_pddev->ucap_ring_mutex ) < 0 )
+        return MBG_ERR_INTR;
+
+      if ( ucap_ring_pop( default_ucap_pddev, p, 1 ) == 0 )
+        memset( p, 0, sizeof( *p ) );
+
+      _mbg_mutex_release( &default_ucap_pddev->ucap_ring_mutex );
+    }
+    else
+  #endif
+  {
+    _pcps_sem_inc_safe( default_ucap_pddev );
+    rc = _pcps_read_var( default_ucap_pddev, PCPS_GIVE_UCAP_EVENT, *p );
+    _pcps_sem_dec( default_ucap_pddev );
+  }
 
   _mbg_swab_pcps_hr_time( p );
 
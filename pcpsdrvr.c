@@ -476,6 +476,21 @@
   #define REPORT_IO_ERRORS  DEBUG_IO
 #endif
 
+// If static keys are used then the debug code in the I/O functions
+// is always compiled in, but is only executed if it has been enabled
+// at runtime for a specific device, see ::pcps_set_dbg_flags.
+// Otherwise the DEBUG_... switches above determine at compile time
+// whether the debug code is included.
+#if _PCPS_USE_DBG_KEYS
+  #define USE_DEBUG_IO             1
+  #define USE_DEBUG_IO_TIMING      1
+  #define USE_DEBUG_ACCESS_TIMING  1
+#else
+  #define USE_DEBUG_IO             DEBUG_IO
+  #define USE_DEBUG_IO_TIMING      DEBUG_IO_TIMING
+  #define USE_DEBUG_ACCESS_TIMING  DEBUG_ACCESS_TIMING
+#endif
+
 #if !defined( DEBUG_PORTS )
   #if defined( DEBUG )
     #define DEBUG_PORTS  1
@@ -665,7 +680,7 @@ static const char str_unkn_braced[] = "(unknown)";
   static const char drvr_str_not_spc[] = "not ";
 #endif
 
-#if DEBUG_IO
+#if USE_DEBUG_IO
   static const char str_gps_spc[] = "GPS ";
 #endif
 
@@ -770,7 +785,7 @@ static const char *pcps_feature_names[N_PCPS_FEATURE_BITS] = PCPS_FEATURE_NAMES;
 
 
 
-#if ( _PCPS_USE_USB || DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING )
+#if ( _PCPS_USE_USB || USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING )
 
 static const char str_spc_cyc[] = " cyc";
 static const char str_spc_ns[] = " ns";
@@ -794,7 +809,7 @@ int64_t pc_cycles_to_ns( MBG_PC_CYCLES cyc, MBG_PC_CYCLES_FREQUENCY freq )
 
 }  // pc_cycles_to_ns
 
-#endif  // ( _PCPS_USE_USB || DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING )
+#endif  // ( _PCPS_USE_USB || USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING )
 
 
 
@@ -1018,6 +1033,39 @@ bool ptp270pex_has_flagged_ready( const PCPS_DDEV *pddev )
 
 
 
+#if _PCPS_USE_ASYNC_PROBE
+
+static /*HDR*/
+/**
+ * @brief Check without waiting if a PTP270PEX card is ready
+ *
+ * This uses the same criteria as ::wait_ptp270pex_ready, but
+ * returns immediately, so the caller can retry later.
+ *
+ * @param[in]  pddev   Pointer to the device structure
+ *
+ * @return true if the card can be accessed
+ *
+ * @see ::wait_ptp270pex_ready
+ */
+bool ptp270pex_is_ready( const PCPS_DDEV *pddev )
+{
+  MBG_SYS_UPTIME uptime;
+
+  if ( ptp270pex_can_flag_ready( pddev ) && ptp270pex_has_flagged_ready( pddev ) )
+    return true;
+
+  mbg_get_sys_uptime( &uptime );
+
+  // If uptime is not supported then just assume the card is ready.
+  return ( uptime == 0 ) || ( uptime == -1 ) || ( uptime >= MAX_BOOT_TIME_PTP270PEX );
+
+}  // ptp270pex_is_ready
+
+#endif  // _PCPS_USE_ASYNC_PROBE
+
+
+
 #if MBG_TGT_HAS_UPTIME
 
 static /*HDR*/
@@ -1236,7 +1284,7 @@ int setup_mm_addr( PCPS_DDEV *pddev )
 
 
 
-#if defined( DEBUG )
+#if defined( DEBUG ) || USE_DEBUG_IO
 
 /*HDR*/
 void pcps_dump_data( const void *buffer, size_t count, const char *info )
@@ -1279,11 +1327,11 @@ void pcps_dump_data( const void *buffer, size_t count, const char *info )
 
 }  // pcps_dump_data
 
-#endif  // defined( DEBUG )
+#endif  // defined( DEBUG ) || USE_DEBUG_IO
 
 
 
-#if DEBUG_IO
+#if USE_DEBUG_IO
 
 static /*HDR*/
 void report_io_cmd( uint8_t cmd, uint16_t count, const char *info )
@@ -1293,11 +1341,11 @@ void report_io_cmd( uint8_t cmd, uint16_t count, const char *info )
 
 }  // report_io_cmd
 
-#endif  // DEBUG_IO
+#endif  // USE_DEBUG_IO
 
 
 
-#if DEBUG_ACCESS_TIMING
+#if USE_DEBUG_ACCESS_TIMING
 
 static uint32_t debug_dummy_var;
 
@@ -1470,11 +1518,11 @@ void test_port_access( const PCPS_DDEV *pddev )
 
 #endif  // TEST_PORT_ACCESS
 
-#endif  // DEBUG_ACCESS_TIMING
+#endif  // USE_DEBUG_ACCESS_TIMING
 
 
 
-#if DEBUG_IO_TIMING
+#if USE_DEBUG_IO_TIMING
 
 static /*HDR*/
 /**
@@ -1545,7 +1593,7 @@ void report_io_timing( const PCPS_DDEV *pddev, const char *info,
 
 }  // report_io_timing
 
-#endif  // DEBUG_IO_TIMING
+#endif  // USE_DEBUG_IO_TIMING
 
 
 
@@ -1575,6 +1623,332 @@ void report_ret_val( int rc, const char *info )
 
 
 
+#if _PCPS_USE_USB_URB
+
+static /*HDR*/
+void pcps_usb_urb_out_complete( struct urb *urb )
+{
+  PCPS_DDEV *pddev = (PCPS_DDEV *) urb->context;
+
+  // Normally the waiter is woken up when the response has been
+  // received. Only if the command could not be sent there won't
+  // be a response, so the waiter has to be woken up here.
+  if ( urb->status )
+    complete( &pddev->urb_done );
+
+}  // pcps_usb_urb_out_complete
+
+
+
+static /*HDR*/
+void pcps_usb_urb_in_complete( struct urb *urb )
+{
+  PCPS_DDEV *pddev = (PCPS_DDEV *) urb->context;
+
+  complete( &pddev->urb_done );
+
+}  // pcps_usb_urb_in_complete
+
+
+
+/*HDR*/
+/**
+ * @brief Release the pre-allocated URBs of a USB device
+ *
+ * Must not be called while a transfer is in progress,
+ * i.e. the caller has to hold the device mutex.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure
+ *
+ * @see ::pcps_usb_alloc_urbs
+ */
+void pcps_usb_free_urbs( PCPS_DDEV *pddev )
+{
+  // The coherent buffers have to be released using the
+  // USB device they have been allocated for, which may
+  // differ from pddev->udev if the device is re-attached.
+  if ( pddev->urb_in )
+  {
+    usb_kill_anchored_urbs( &pddev->urb_anchor );
+
+    usb_free_coherent( pddev->urb_in->dev, MBGUSB_URB_BUF_SIZE,
+                       pddev->urb_in_buf, pddev->urb_in->transfer_dma );
+    usb_free_urb( pddev->urb_in );
+    pddev->urb_in = NULL;
+    pddev->urb_in_buf = NULL;
+  }
+
+  if ( pddev->urb_out )
+  {
+    if ( pddev->urb_out_buf )
+      usb_free_coherent( pddev->urb_out->dev, MBGUSB_URB_BUF_SIZE,
+                         pddev->urb_out_buf, pddev->urb_out->transfer_dma );
+
+    usb_free_urb( pddev->urb_out );
+    pddev->urb_out = NULL;
+    pddev->urb_out_buf = NULL;
+  }
+
+}  // pcps_usb_free_urbs
+
+
+
+static /*HDR*/
+/**
+ * @brief Set up the pre-allocated URBs of a USB device
+ *
+ * If this fails, the conventional synchronous transfers are used.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure
+ *
+ * @return ::MBG_SUCCESS on success, else ::MBG_ERR_NO_MEM
+ *
+ * @see ::pcps_usb_free_urbs
+ */
+int pcps_usb_alloc_urbs( PCPS_DDEV *pddev )
+{
+  struct usb_device *udev = pddev->udev;
+
+  // Release URBs that may have been set up for a previous
+  // instance of the device which has been re-attached.
+  pcps_usb_free_urbs( pddev );
+
+  init_usb_anchor( &pddev->urb_anchor );
+  init_completion( &pddev->urb_done );
+
+  pddev->urb_out = usb_alloc_urb( 0, GFP_KERNEL );
+
+  if ( pddev->urb_out == NULL )
+    goto fail;
+
+  pddev->urb_out_buf = usb_alloc_coherent( udev, MBGUSB_URB_BUF_SIZE, GFP_KERNEL,
+                                           &pddev->urb_out->transfer_dma );
+
+  if ( pddev->urb_out_buf == NULL )
+    goto fail;
+
+  usb_fill_bulk_urb( pddev->urb_out, udev,
+                     usb_sndbulkpipe( udev, pddev->ep[MBGUSB_EP_IDX_HOST_OUT].addr ),
+                     pddev->urb_out_buf, MBGUSB_URB_BUF_SIZE,
+                     pcps_usb_urb_out_complete, pddev );
+  pddev->urb_out->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+  pddev->urb_in = usb_alloc_urb( 0, GFP_KERNEL );
+
+  if ( pddev->urb_in == NULL )
+    goto fail;
+
+  pddev->urb_in_buf = usb_alloc_coherent( udev, MBGUSB_URB_BUF_SIZE, GFP_KERNEL,
+                                          &pddev->urb_in->transfer_dma );
+
+  if ( pddev->urb_in_buf == NULL )
+  {
+    usb_free_urb( pddev->urb_in );
+    pddev->urb_in = NULL;
+    goto fail;
+  }
+
+  usb_fill_bulk_urb( pddev->urb_in, udev,
+                     usb_rcvbulkpipe( udev, pddev->ep[MBGUSB_EP_IDX_HOST_IN].addr ),
+                     pddev->urb_in_buf, MBGUSB_URB_BUF_SIZE,
+                     pcps_usb_urb_in_complete, pddev );
+  pddev->urb_in->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+  return MBG_SUCCESS;
+
+fail:
+  _mbg_kdd_msg_0( MBG_LOG_WARN, "Failed to allocate URBs, using synchronous USB transfers" );
+  pcps_usb_free_urbs( pddev );
+
+  return MBG_ERR_NO_MEM;
+
+}  // pcps_usb_alloc_urbs
+
+
+
+// Check if a transfer can be done using the pre-allocated URBs.
+#define _pcps_usb_urb_avail( _pddev, _len ) \
+  ( ( (_pddev)->urb_in != NULL ) && ( (_len) <= MBGUSB_URB_BUF_SIZE ) )
+
+
+static /*HDR*/
+/**
+ * @brief Send a command to a USB device and read the response
+ *
+ * The URB to read the response is submitted together with the URB
+ * sending the command, so the caller only has to wait once until
+ * the response has been received, rather than waiting for
+ * each transfer to complete.
+ *
+ * @param[in]  pddev    Pointer to the device structure
+ * @param[in]  out      The command bytes to be sent
+ * @param[in]  out_len  The number of bytes to be sent, max. ::MBGUSB_URB_BUF_SIZE
+ * @param[out] in       A buffer to take the response
+ * @param[in]  in_len   The number of bytes expected, max. ::MBGUSB_URB_BUF_SIZE
+ *
+ * @return The number of bytes received on success, else one of the @ref MBG_ERROR_CODES
+ *
+ * @see ::_pcps_usb_urb_avail
+ */
+int pcps_usb_urb_transfer( PCPS_DDEV *pddev, const void *out, int out_len,
+                           void *in, int in_len )
+{
+  struct urb *urb_out = pddev->urb_out;
+  struct urb *urb_in = pddev->urb_in;
+  unsigned long tmo = msecs_to_jiffies( MBGUSB_TIMEOUT_SEND_MS + MBGUSB_TIMEOUT_RECEIVE_MS );
+  int usb_rc;
+
+  memcpy( pddev->urb_out_buf, out, out_len );
+  urb_out->transfer_buffer_length = out_len;
+  urb_in->transfer_buffer_length = in_len;
+
+  reinit_completion( &pddev->urb_done );
+
+  // The read is submitted first, so the host controller
+  // is ready to receive the response immediately.
+  usb_anchor_urb( urb_in, &pddev->urb_anchor );
+  usb_rc = usb_submit_urb( urb_in, GFP_KERNEL );
+
+  if ( usb_rc < 0 )
+  {
+    usb_unanchor_urb( urb_in );
+    goto out;
+  }
+
+  usb_anchor_urb( urb_out, &pddev->urb_anchor );
+  usb_rc = usb_submit_urb( urb_out, GFP_KERNEL );
+
+  if ( usb_rc < 0 )
+  {
+    usb_unanchor_urb( urb_out );
+    usb_kill_anchored_urbs( &pddev->urb_anchor );
+    goto out;
+  }
+
+  if ( wait_for_completion_timeout( &pddev->urb_done, tmo ) == 0 )
+  {
+    usb_kill_anchored_urbs( &pddev->urb_anchor );
+    usb_rc = -ETIMEDOUT;
+    goto out;
+  }
+
+  // The completion handler of the command URB may not have
+  // been called yet, but it must be finished before the URB
+  // can be re-used.
+  if ( !usb_wait_anchor_empty_timeout( &pddev->urb_anchor, MBGUSB_TIMEOUT_SEND_MS ) )
+    usb_kill_anchored_urbs( &pddev->urb_anchor );
+
+  usb_rc = urb_out->status;
+
+  if ( usb_rc == 0 )
+    usb_rc = urb_in->status;
+
+  if ( usb_rc == 0 )
+  {
+    memcpy( in, pddev->urb_in_buf, urb_in->actual_length );
+    return urb_in->actual_length;
+  }
+
+out:
+  _mbgddmsg_2( DEBUG_USB_IO, MBG_LOG_INFO, "%s: USB rc %i", __func__, usb_rc );
+  return mbg_posix_errno_to_mbg( -usb_rc, NULL );
+
+}  // pcps_usb_urb_transfer
+
+#endif  // _PCPS_USE_USB_URB
+
+
+
+#if _PCPS_USE_USB_LATENCY_COMP
+
+#if !defined( MBGUSB_20_LATENCY_NS )
+  // The constant latency of USB 2.0 transfers using 125 us microframes.
+  // This value has been determined experimentally on different hardware platforms.
+  #define MBGUSB_20_LATENCY_NS  50000
+#endif
+
+
+static /*HDR*/
+/**
+ * @brief Compensate the latency of a time stamp read from a USB device
+ *
+ * The device takes the time stamp when the command is received, which
+ * is in the first USB frame after the command has been submitted. So
+ * ::PCPS_DDEV::acc_cycles, which has been taken before the command
+ * was submitted, is shifted towards the start of that frame.
+ *
+ * @param[in,out]  pddev        Pointer to the device structure
+ * @param[in]      frame_num_1  The USB frame number before the command was submitted, or < 0
+ * @param[in]      frame_num_2  The USB frame number after the response was received, or < 0
+ * @param[in]      post_cycles  The cycles count after the response was received
+ */
+void pcps_usb_comp_latency( PCPS_DDEV *pddev, int frame_num_1, int frame_num_2,
+                            MBG_PC_CYCLES post_cycles )
+{
+  MBG_PC_CYCLES cycles_diff = mbg_delta_pc_cycles( &post_cycles, &pddev->acc_cycles );
+  uint64_t frame_length_cycles;
+  int64_t latency_cycles;
+  int frame_num_diff;
+
+  if ( pc_cycles_frequency == 0 || cycles_diff <= 0 )
+    return;
+
+  if ( pddev->usb_20_mode )
+  {
+    // Just add an offset to compensate the constant latency.
+    uint64_t tmp = (uint64_t) pc_cycles_frequency * ( MBGUSB_20_LATENCY_NS / 1000 );
+
+    _do_div( tmp, 1000000UL );
+    latency_cycles = tmp;
+  }
+  else
+  {
+    // USB 1.1 mode with millisecond frames.
+    frame_length_cycles = pc_cycles_frequency;
+    _do_div( frame_length_cycles, 1000 );
+
+    if ( frame_num_1 < 0 || frame_num_2 < 0 )
+    {
+      // The frame numbers are not available from the host controller.
+      latency_cycles = cycles_diff - (int64_t) frame_length_cycles;
+
+      if ( latency_cycles < 0 )
+        latency_cycles = -latency_cycles;
+    }
+    else
+    {
+      frame_num_diff = frame_num_2 - frame_num_1;
+
+      // The frame number has wrapped around, or the whole
+      // transfer has been completed in the same frame.
+      if ( frame_num_diff < 0 )
+        frame_num_diff = 2;
+      else
+        if ( frame_num_diff == 0 )
+          frame_num_diff = 1;
+
+      latency_cycles = cycles_diff - ( ( frame_num_diff - 1 ) * (int64_t) frame_length_cycles );
+    }
+  }
+
+  // The compensated time stamp must be inside the transfer interval.
+  if ( latency_cycles < 0 || latency_cycles > cycles_diff )
+  {
+    #if defined( DEBUG )
+      _mbg_kdd_msg_3( MBG_LOG_DEBUG, "USB latency %" PRIi64 " out of range 0..%" PRIi64 " cyc, frames %i",
+                      latency_cycles, (int64_t) cycles_diff, frame_num_2 - frame_num_1 );
+    #endif
+    return;
+  }
+
+  pddev->acc_cycles += latency_cycles;
+
+}  // pcps_usb_comp_latency
+
+#endif  // _PCPS_USE_USB_LATENCY_COMP
+
+
+
 #if _PCPS_USE_USB
 
 static /*HDR*/
@@ -1600,6 +1974,7 @@ int check_usb_timing( PCPS_DDEV *pddev )
 
     #define _FMT "USB access: %" PRIi64 "%s"
 
+    MBG_PC_CYCLES start_cycles;
     MBG_PC_CYCLES completion_cycles;
     int64_t delta_cycles;
 
@@ -1607,8 +1982,10 @@ int check_usb_timing( PCPS_DDEV *pddev )
       _mbg_kdd_msg_0( MBG_LOG_DEBUG, "Reading PCPS_HR_TIME as USB timing test:" );
     #endif
 
-    // Determine USB access time. The first cycles value is taken
-    // by the low level routine and saved in pddev->acc_cycles.
+    // Determine USB access time. We can't use pddev->acc_cycles
+    // as start value here since this may have been adjusted
+    // by the latency compensation.
+    mbg_get_pc_cycles( &start_cycles );
     rc = _pcps_read_var( pddev, PCPS_GIVE_HR_TIME, *p_hrt );
     mbg_get_pc_cycles( &completion_cycles );
 
@@ -1616,7 +1993,7 @@ int check_usb_timing( PCPS_DDEV *pddev )
       goto out;
 
 
-    delta_cycles = mbg_delta_pc_cycles( &completion_cycles, &pddev->acc_cycles );
+    delta_cycles = mbg_delta_pc_cycles( &completion_cycles, &start_cycles );
 
     #if defined( DEBUG )
       _mbg_kdd_msg_2( MBG_LOG_DEBUG, _FMT, delta_cycles, str_spc_cyc );
@@ -1685,11 +2062,18 @@ int pcps_read_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     LARGE_INTEGER UsbPostCount;
   #endif
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if _PCPS_USE_USB_LATENCY_COMP
+    bool lat_comp = !is_gps_data && ( cmd == PCPS_GIVE_HR_TIME );
+    int frame_num_1 = -1;
+    int frame_num_2 = -1;
+    MBG_PC_CYCLES post_cycles = 0;
+  #endif
+
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
@@ -1698,8 +2082,15 @@ int pcps_read_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     _mbgddmsg_fnc_entry();
   #endif
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   mbg_get_pc_cycles( &pddev->acc_cycles );
 
+  #if _PCPS_USE_USB_LATENCY_COMP
+    if ( lat_comp )
+      frame_num_1 = usb_get_current_frame_number( pddev->udev );
+  #endif
+
   // We write the request data to our device's private data structure,
   // so we don't have to explicitly allocate a buffer here.
   if ( is_gps_data )
@@ -1714,14 +2105,49 @@ int pcps_read_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     transfer_size = sizeof( pddev->cmd_info.cmd );
   }
 
+  #if _PCPS_USE_USB_URB
+    if ( buffer && count && _pcps_usb_urb_avail( pddev, count ) )
+    {
+      rc = pcps_usb_urb_transfer( pddev, &pddev->cmd_info, transfer_size, buffer, count );
+
+      #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+          mbg_get_pc_cycles( &t_after_cmd );
+      #endif
+
+      #if USE_DEBUG_IO_TIMING
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+          t_after_busy = t_after_cmd;
+      #endif
+
+      if ( mbg_rc_is_error( rc ) )
+      {
+        #if REPORT_IO_ERRORS
+          if ( is_gps_data )
+            _mbg_kdd_msg_2( MBG_LOG_ERR, FNC_ID_USB_READ_GEN ": URB xfer for GPS cmd 0x%02X failed, rc: %i",  // REPORT_IO_ERRORS
+                            pddev->cmd_info.gps_cmd_info.gps_cmd, rc );
+          else
+            _mbg_kdd_msg_2( MBG_LOG_ERR, FNC_ID_USB_READ_GEN ": URB xfer for cmd 0x%02X failed, rc: %i",  // REPORT_IO_ERRORS
+                            pddev->cmd_info.cmd, rc );
+        #endif
+
+        goto out;
+      }
+
+      goto chk_count;
+    }
+  #endif
+
   rc = pcps_direct_usb_write( pddev, &pddev->cmd_info, transfer_size );
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_IO_TIMING
-    t_after_busy = t_after_cmd;
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      t_after_busy = t_after_cmd;
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -1739,21 +2165,25 @@ int pcps_read_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
   }
 
 
-  #if DEBUG_IO
-    if ( is_gps_data )
-      _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": GPS write 0x%02X succeeded, %i bytes read",
-                      pddev->cmd_info.gps_cmd_info.gps_cmd, rc );
-    else
-      _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": write 0x%02X succeeded, %i bytes read",
-                      pddev->cmd_info.cmd, rc );
-  #endif  // DEBUG_IO
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+    {
+      if ( is_gps_data )
+        _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": GPS write 0x%02X succeeded, %i bytes read",
+                        pddev->cmd_info.gps_cmd_info.gps_cmd, rc );
+      else
+        _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": write 0x%02X succeeded, %i bytes read",
+                        pddev->cmd_info.cmd, rc );
+    }
+  #endif  // USE_DEBUG_IO
 
 
   if ( buffer == NULL || count == 0 )  // no data need to be read
   {
-    #if DEBUG_IO
-      _mbg_kdd_msg_0( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": no data to be read, exiting" );
-    #endif  // DEBUG_IO
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        _mbg_kdd_msg_0( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": no data to be read, exiting" );
+    #endif  // USE_DEBUG_IO
 
     goto out;
   }
@@ -1788,18 +2218,32 @@ int pcps_read_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     goto out;
   }
 
-  #if DEBUG_IO
-    if ( is_gps_data )
-      _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": rd after GPS cmd 0x%02X succeeded, bytes read: %i",
-                      pddev->cmd_info.gps_cmd_info.gps_cmd, rc );
-    else
-      _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": rd after cmd 0x%02X succeeded, bytes read: %i",
-                      pddev->cmd_info.cmd, rc );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+    {
+      if ( is_gps_data )
+        _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": rd after GPS cmd 0x%02X succeeded, bytes read: %i",
+                        pddev->cmd_info.gps_cmd_info.gps_cmd, rc );
+      else
+        _mbg_kdd_msg_2( MBG_LOG_DEBUG, FNC_ID_USB_READ_GEN ": rd after cmd 0x%02X succeeded, bytes read: %i",
+                        pddev->cmd_info.cmd, rc );
 
-    pcps_dump_data( buffer, rc, FNC_ID_USB_READ_GEN );
+      pcps_dump_data( buffer, rc, FNC_ID_USB_READ_GEN );
+    }
   #endif
 
 
+#if _PCPS_USE_USB_URB
+chk_count:
+#endif
+  #if _PCPS_USE_USB_LATENCY_COMP
+    if ( lat_comp )
+    {
+      mbg_get_pc_cycles( &post_cycles );
+      frame_num_2 = usb_get_current_frame_number( pddev->udev );
+    }
+  #endif
+
   // "rc" should now contain the number of bytes that have been read,
   // and this should match "count".
   if ( rc != count )
@@ -1874,14 +2318,25 @@ int pcps_read_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     }
   #endif  // defined( MBG_TGT_WIN32_PNP )
 
+  #if _PCPS_USE_USB_LATENCY_COMP
+    if ( lat_comp )
+      pcps_usb_comp_latency( pddev, frame_num_1, frame_num_2, post_cycles );
+  #endif
+
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, is_gps_data ? "USB GPS" : "USB", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, is_gps_data ? "USB GPS" : "USB", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "USB wr/rd", t_after_cmd, 0 );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "USB wr/rd", t_after_cmd, 0 );
   #endif
 
   #if defined( DEBUG )
@@ -1959,16 +2414,38 @@ int pcps_write_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     transfer_bytes = 1;
   }
 
-  #if DEBUG_IO
-    _mbg_kdd_msg_3( MBG_LOG_DEBUG, FNC_ID_USB_WRITE_GEN ": %scmd %02X, %u bytes",
-                    is_gps_data ? str_gps_spc : str_empty, cmd, count );
-    pcps_dump_data( buffer, count, FNC_ID_USB_WRITE_GEN );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+    {
+      _mbg_kdd_msg_3( MBG_LOG_DEBUG, FNC_ID_USB_WRITE_GEN ": %scmd %02X, %u bytes",
+                      is_gps_data ? str_gps_spc : str_empty, cmd, count );
+      pcps_dump_data( buffer, count, FNC_ID_USB_WRITE_GEN );
+    }
   #endif
 
   // Now append the data bytes.
   memcpy( pb, buffer, count );
   transfer_bytes += count;
 
+  #if _PCPS_USE_USB_URB
+    if ( _pcps_usb_urb_avail( pddev, transfer_bytes ) )
+    {
+      // Send the data and read the completion code in one go.
+      rc = pcps_usb_urb_transfer( pddev, p, transfer_bytes, p, 1 );
+
+      if ( mbg_rc_is_error( rc ) )
+      {
+        #if REPORT_IO_ERRORS
+          _mbg_kdd_msg_2( MBG_LOG_ERR, FNC_ID_USB_WRITE_GEN ": URB xfer failed: %s (rc: %i)",  // REPORT_IO_ERRORS
+                          mbg_strerror( rc ), rc );
+        #endif
+        goto out_free;
+      }
+
+      goto done;
+    }
+  #endif
+
   rc = pcps_direct_usb_write( pddev, p, transfer_bytes );
 
   if ( mbg_rc_is_error( rc ) )
@@ -1993,6 +2470,9 @@ int pcps_write_usb_generic( PCPS_DDEV *pddev, uint8_t cmd,
     goto out_free;
   }
 
+#if _PCPS_USE_USB_URB
+done:
+#endif
   rc = (int8_t) p[0];  // return the completion code read from the device
 
 out_free:
@@ -2155,37 +2635,44 @@ int pcps_read_std( PCPS_DDEV *pddev, uint8_t cmd,
   int rc;
   _pcps_irq_flags
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_ACCESS_TIMING
+  #if USE_DEBUG_ACCESS_TIMING
     MBG_PC_CYCLES t_after_reread = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, "pcps_read_amcc_std" );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, "pcps_read_amcc_std" );
   #endif
 
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   _pcps_disb_local_irq_save();
 
   // get current cycles and write the command byte
   mbg_get_pc_cycles( &pddev->acc_cycles );
   _mbg_outp8( pddev, 0, port, cmd );
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    debug_dummy_var = _pcps_ddev_read_status_port( pddev );
-    mbg_get_pc_cycles( &t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+    {
+      debug_dummy_var = _pcps_ddev_read_status_port( pddev );
+      mbg_get_pc_cycles( &t_after_reread );
+    }
   #endif
 
   _pcps_local_irq_restore();
@@ -2194,8 +2681,9 @@ int pcps_read_std( PCPS_DDEV *pddev, uint8_t cmd,
   // wait until BUSY flag goes low or timeout
   rc = pcps_wait_busy( pddev );
 
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_busy );
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_busy );
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -2208,8 +2696,9 @@ int pcps_read_std( PCPS_DDEV *pddev, uint8_t cmd,
   {
     *p = _mbg_inp8( pddev, 0, port );
 
-    #if DEBUG_IO
-      pcps_dump_data( p, sizeof( *p ), "pcps_read_std" );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        pcps_dump_data( p, sizeof( *p ), "pcps_read_std" );
     #endif
 
     p++;
@@ -2217,13 +2706,19 @@ int pcps_read_std( PCPS_DDEV *pddev, uint8_t cmd,
 
 
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, "STD", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, "STD", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "STD wr/rd", t_after_cmd, t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "STD wr/rd", t_after_cmd, t_after_reread );
   #endif
 
   #if defined( DEBUG )
@@ -2265,21 +2760,22 @@ int pcps_read_amcc_s5933( PCPS_DDEV *pddev, uint8_t cmd,
   int rc;
   _pcps_irq_flags
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_ACCESS_TIMING
+  #if USE_DEBUG_ACCESS_TIMING
     MBG_PC_CYCLES t_after_reread = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, "pcps_read_amcc_s5933" );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, "pcps_read_amcc_s5933" );
   #endif
 
 
@@ -2290,6 +2786,8 @@ int pcps_read_amcc_s5933( PCPS_DDEV *pddev, uint8_t cmd,
   _mbg_outp8( pddev, 0, port + AMCC_OP_REG_INTCSR + 3, 0x3C );
 
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   _pcps_disb_local_irq_save();
 
   mbg_get_pc_cycles( &pddev->acc_cycles );
@@ -2299,13 +2797,17 @@ int pcps_read_amcc_s5933( PCPS_DDEV *pddev, uint8_t cmd,
     udelay( 3 );
   #endif
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    debug_dummy_var = _pcps_ddev_read_status_port( pddev );
-    mbg_get_pc_cycles( &t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+    {
+      debug_dummy_var = _pcps_ddev_read_status_port( pddev );
+      mbg_get_pc_cycles( &t_after_reread );
+    }
   #endif
 
   _pcps_local_irq_restore();
@@ -2314,8 +2816,9 @@ int pcps_read_amcc_s5933( PCPS_DDEV *pddev, uint8_t cmd,
   // wait until BUSY flag goes low or timeout
   rc = pcps_wait_busy( pddev );
 
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_busy );
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_busy );
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -2327,24 +2830,34 @@ int pcps_read_amcc_s5933( PCPS_DDEV *pddev, uint8_t cmd,
   for ( i = 0; i < count; i++ )
   {
     if ( _mbg_inp16_to_cpu( pddev, 0, port + AMCC_OP_REG_MCSR ) & 0x20 )
-      return MBG_ERR_NO_DATA;
+    {
+      rc = MBG_ERR_NO_DATA;
+      goto out;
+    }
 
     p[i] = _mbg_inp8( pddev, 0, port + AMCC_OP_REG_FIFO + ( i % sizeof( uint32_t) ) );
 
-    #if DEBUG_IO
-      pcps_dump_data( &p[i], sizeof( p[i] ), "pcps_read_amcc_s5933" );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        pcps_dump_data( &p[i], sizeof( p[i] ), "pcps_read_amcc_s5933" );
     #endif
   }
 
 
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, "S5933", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, "S5933", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "S5933 wr/rd", t_after_cmd, t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "S5933 wr/rd", t_after_cmd, t_after_reread );
   #endif
 
   #if defined( DEBUG )
@@ -2390,24 +2903,27 @@ int pcps_read_amcc_s5920( PCPS_DDEV *pddev, uint8_t cmd,
   int dt_rem;
   _pcps_irq_flags
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_ACCESS_TIMING
+  #if USE_DEBUG_ACCESS_TIMING
     MBG_PC_CYCLES t_after_reread = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, "pcps_read_amcc_s5920" );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, "pcps_read_amcc_s5920" );
   #endif
 
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   _pcps_disb_local_irq_save();
 
   mbg_get_pc_cycles( &pddev->acc_cycles );
@@ -2417,13 +2933,17 @@ int pcps_read_amcc_s5920( PCPS_DDEV *pddev, uint8_t cmd,
     udelay( 3 );
   #endif
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    debug_dummy_var = _pcps_ddev_read_status_port( pddev );
-    mbg_get_pc_cycles( &t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+    {
+      debug_dummy_var = _pcps_ddev_read_status_port( pddev );
+      mbg_get_pc_cycles( &t_after_reread );
+    }
   #endif
 
   _pcps_local_irq_restore();
@@ -2436,8 +2956,9 @@ int pcps_read_amcc_s5920( PCPS_DDEV *pddev, uint8_t cmd,
   // wait until BUSY flag goes low or timeout
   rc = pcps_wait_busy( pddev );
 
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_busy );
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_busy );
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -2456,8 +2977,9 @@ int pcps_read_amcc_s5920( PCPS_DDEV *pddev, uint8_t cmd,
     for ( i = 0; i < dt_quot; i++ )
     {
       ul = _mbg_inp32_native( pddev, 1, data_port );
-      #if DEBUG_IO
-        pcps_dump_data( &ul, sizeof( ul ), "pcps_read_amcc_s5920" );
+      #if USE_DEBUG_IO
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+          pcps_dump_data( &ul, sizeof( ul ), "pcps_read_amcc_s5920" );
       #endif
       _mbg_put_unaligned( ul, (uint32_t FAR *) p );
       p += sizeof( ul );
@@ -2470,8 +2992,9 @@ int pcps_read_amcc_s5920( PCPS_DDEV *pddev, uint8_t cmd,
 
       for ( i = 0; i < dt_rem; i++ )
       {
-        #if DEBUG_IO
-          pcps_dump_data( &ul, dt_rem, "pcps_read_amcc_s5920" );
+        #if USE_DEBUG_IO
+          if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+            pcps_dump_data( &ul, dt_rem, "pcps_read_amcc_s5920" );
         #endif
 
         *p++ = BYTE_OF( ul, i );
@@ -2482,13 +3005,19 @@ int pcps_read_amcc_s5920( PCPS_DDEV *pddev, uint8_t cmd,
     (void) _mbg_inp32_native( pddev, 1, data_port );  // do a dummy read
 
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, "S5920", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, "S5920", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "S5920 wr/rd", t_after_cmd, t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "S5920 wr/rd", t_after_cmd, t_after_reread );
   #endif
 
   #if defined( DEBUG )
@@ -2537,24 +3066,27 @@ int pcps_read_asic( PCPS_DDEV *pddev, uint8_t cmd,
   int dt_rem;
   _pcps_irq_flags
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_ACCESS_TIMING
+  #if USE_DEBUG_ACCESS_TIMING
     MBG_PC_CYCLES t_after_reread = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, "pcps_read_asic" );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, "pcps_read_asic" );
   #endif
 
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   _pcps_disb_local_irq_save();
 
   // get current cycles and write the command byte
@@ -2562,14 +3094,18 @@ int pcps_read_asic( PCPS_DDEV *pddev, uint8_t cmd,
   _mbg_outp32_to_mbg( pddev, 0, _pcps_ddev_io_base_mapped( pddev, 0 )
                       + offsetof( PCI_ASIC, pci_data ), cmd );
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    debug_dummy_var = _mbg_inp32_to_cpu( pddev, 0, _pcps_ddev_io_base_mapped( pddev, 0 )
-                                         + offsetof( PCI_ASIC, addon_data ) );
-    mbg_get_pc_cycles( &t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+    {
+      debug_dummy_var = _mbg_inp32_to_cpu( pddev, 0, _pcps_ddev_io_base_mapped( pddev, 0 )
+                                           + offsetof( PCI_ASIC, addon_data ) );
+      mbg_get_pc_cycles( &t_after_reread );
+    }
   #endif
 
   _pcps_local_irq_restore();
@@ -2584,8 +3120,9 @@ int pcps_read_asic( PCPS_DDEV *pddev, uint8_t cmd,
   // wait until BUSY flag goes low or timeout
   rc = pcps_wait_busy( pddev );
 
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_busy );
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_busy );
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -2598,8 +3135,9 @@ int pcps_read_asic( PCPS_DDEV *pddev, uint8_t cmd,
   for ( i = 0; i < dt_quot; i++ )
   {
     ar.ul = _mbg_inp32_native( pddev, 0, data_port );
-    #if DEBUG_IO
-      pcps_dump_data( &ar.ul, sizeof( ar.ul ), "pcps_read_asic" );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        pcps_dump_data( &ar.ul, sizeof( ar.ul ), "pcps_read_asic" );
     #endif
     _mbg_put_unaligned( ar.ul, (uint32_t FAR *) p );
     p += sizeof( ar.ul );
@@ -2613,8 +3151,9 @@ int pcps_read_asic( PCPS_DDEV *pddev, uint8_t cmd,
 
     for ( i = 0; i < dt_rem; i++ )
     {
-      #if DEBUG_IO
-        pcps_dump_data( &ar.b[i], sizeof( ar.b[i] ), "pcps_read_asic" );
+      #if USE_DEBUG_IO
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+          pcps_dump_data( &ar.b[i], sizeof( ar.b[i] ), "pcps_read_asic" );
       #endif
 
       *p++ = ar.b[i];
@@ -2622,13 +3161,19 @@ int pcps_read_asic( PCPS_DDEV *pddev, uint8_t cmd,
   }
 
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, "ASIC", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, "ASIC", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "ASIC wr/rd", t_after_cmd, t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "ASIC wr/rd", t_after_cmd, t_after_reread );
   #endif
 
   #if defined( DEBUG )
@@ -2677,21 +3222,22 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
   int dt_rem;
   _pcps_irq_flags
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_ACCESS_TIMING
+  #if USE_DEBUG_ACCESS_TIMING
     MBG_PC_CYCLES t_after_reread = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, "pcps_read_asic_mm" );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, "pcps_read_asic_mm" );
   #endif
 
   #if defined( MBG_ARCH_SPARC )
@@ -2699,6 +3245,8 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
     return MBG_ERR_TIMEOUT;  // FIXME TODO
   #endif
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   _pcps_disb_local_irq_save();
 
   // get current cycles and write the command byte
@@ -2713,13 +3261,17 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
     _mbg_mmwr32( &pddev->mm_asic_addr->pci_data.ul, cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    debug_dummy_var = _mbg_mmrd32_native( &pddev->mm_asic_addr->pci_data.ul );
-    mbg_get_pc_cycles( &t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+    {
+      debug_dummy_var = _mbg_mmrd32_native( &pddev->mm_asic_addr->pci_data.ul );
+      mbg_get_pc_cycles( &t_after_reread );
+    }
   #endif
 
   _pcps_local_irq_restore();
@@ -2733,8 +3285,9 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
   // wait until BUSY flag goes low or timeout
   rc = pcps_wait_busy( pddev );
 
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_busy );
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_busy );
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -2747,8 +3300,9 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
   for ( i = 0; i < dt_quot; i++ )
   {
     ar.ul = _mbg_mmrd32_native( p_data_reg );
-    #if DEBUG_IO
-      pcps_dump_data( &ar.ul, sizeof( ar.ul ), "pcps_read_asic_mm" );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        pcps_dump_data( &ar.ul, sizeof( ar.ul ), "pcps_read_asic_mm" );
     #endif
     _mbg_put_unaligned( ar.ul, (uint32_t FAR *) p );
     p += sizeof( ar.ul );
@@ -2762,8 +3316,9 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
 
     for ( i = 0; i < dt_rem; i++ )
     {
-      #if DEBUG_IO
-        pcps_dump_data( &ar.b[i], sizeof( ar.b[i] ), "pcps_read_asic_mm" );
+      #if USE_DEBUG_IO
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+          pcps_dump_data( &ar.b[i], sizeof( ar.b[i] ), "pcps_read_asic_mm" );
       #endif
 
       *p++ = ar.b[i];
@@ -2771,13 +3326,19 @@ int pcps_read_asic_mm( PCPS_DDEV *pddev, uint8_t cmd,
   }
 
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, "ASIC MM", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, "ASIC MM", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "ASIC MM wr/rd", t_after_cmd, t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "ASIC MM wr/rd", t_after_cmd, t_after_reread );
   #endif
 
   #if defined( DEBUG )
@@ -2826,24 +3387,27 @@ int pcps_read_asic_mm16( PCPS_DDEV *pddev, uint8_t cmd,
   int dt_rem;
   _pcps_irq_flags
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_cmd = 0;
   #endif
 
-  #if DEBUG_ACCESS_TIMING
+  #if USE_DEBUG_ACCESS_TIMING
     MBG_PC_CYCLES t_after_reread = 0;
   #endif
 
-  #if DEBUG_IO_TIMING
+  #if USE_DEBUG_IO_TIMING
     MBG_PC_CYCLES t_after_busy = 0;
     MBG_PC_CYCLES t_done = 0;
   #endif
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, "pcps_read_asic_mm16" );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, "pcps_read_asic_mm16" );
   #endif
 
 
+  _pcps_trace_cmd_start( pddev, cmd, count );
+
   _pcps_disb_local_irq_save();
 
   // get current cycles and write the command byte
@@ -2858,13 +3422,17 @@ int pcps_read_asic_mm16( PCPS_DDEV *pddev, uint8_t cmd,
     _mbg_mmwr32_mbg( &pddev->mm_asic_addr->pci_data.ul, cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING || DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_cmd );
+  #if USE_DEBUG_ACCESS_TIMING || USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING | PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_cmd );
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    debug_dummy_var = _mbg_mmrd32_native( &pddev->mm_asic_addr->pci_data.ul );
-    mbg_get_pc_cycles( &t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+    {
+      debug_dummy_var = _mbg_mmrd32_native( &pddev->mm_asic_addr->pci_data.ul );
+      mbg_get_pc_cycles( &t_after_reread );
+    }
   #endif
 
   _pcps_local_irq_restore();
@@ -2878,8 +3446,9 @@ int pcps_read_asic_mm16( PCPS_DDEV *pddev, uint8_t cmd,
   // wait until BUSY flag goes low or timeout
   rc = pcps_wait_busy( pddev );
 
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_after_busy );
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+      mbg_get_pc_cycles( &t_after_busy );
   #endif
 
   if ( mbg_rc_is_error( rc ) )
@@ -2892,8 +3461,9 @@ int pcps_read_asic_mm16( PCPS_DDEV *pddev, uint8_t cmd,
   for ( i = 0; i < dt_quot; i++ )
   {
     ar.us[0] = _mbg_mmrd16_native( p_data_reg );
-    #if DEBUG_IO
-      pcps_dump_data( &ar.us[0], sizeof( ar.us[0] ), "pcps_read_asic_mm16" );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        pcps_dump_data( &ar.us[0], sizeof( ar.us[0] ), "pcps_read_asic_mm16" );
     #endif
     _mbg_put_unaligned( ar.us[0], (uint16_t FAR *) p );
     p += sizeof( ar.us[0] );
@@ -2907,8 +3477,9 @@ int pcps_read_asic_mm16( PCPS_DDEV *pddev, uint8_t cmd,
 
     for ( i = 0; i < dt_rem; i++ )
     {
-      #if DEBUG_IO
-        pcps_dump_data( &ar.b[i], sizeof( ar.b[i] ), "pcps_read_asic_mm16" );
+      #if USE_DEBUG_IO
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+          pcps_dump_data( &ar.b[i], sizeof( ar.b[i] ), "pcps_read_asic_mm16" );
       #endif
 
       *p++ = ar.b[i];
@@ -2916,13 +3487,19 @@ int pcps_read_asic_mm16( PCPS_DDEV *pddev, uint8_t cmd,
   }
 
 out:
-  #if DEBUG_IO_TIMING
-    mbg_get_pc_cycles( &t_done );
-    report_io_timing( pddev, "ASIC MM ww", cmd, count, t_after_cmd, t_after_busy, t_done );
+  _pcps_trace_cmd_end( pddev, cmd, count, rc );
+
+  #if USE_DEBUG_IO_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO_TIMING ) )
+    {
+      mbg_get_pc_cycles( &t_done );
+      report_io_timing( pddev, "ASIC MM ww", cmd, count, t_after_cmd, t_after_busy, t_done );
+    }
   #endif
 
-  #if DEBUG_ACCESS_TIMING
-    report_access_timing( pddev, "ASIC MM ww wr/rd", t_after_cmd, t_after_reread );
+  #if USE_DEBUG_ACCESS_TIMING
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_ACCESS_TIMING ) )
+      report_access_timing( pddev, "ASIC MM ww wr/rd", t_after_cmd, t_after_reread );
   #endif
 
   #if defined( DEBUG )
@@ -2964,8 +3541,9 @@ int pcps_read_usb( PCPS_DDEV *pddev, uint8_t cmd,
 {
   int rc;
 
-  #if DEBUG_IO
-    report_io_cmd( cmd, count, __func__ );
+  #if USE_DEBUG_IO
+    if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+      report_io_cmd( cmd, count, __func__ );
   #endif
 
   rc = pcps_read_usb_generic( pddev, cmd, buffer, count, false );
@@ -2984,10 +3562,124 @@ int pcps_read_usb( PCPS_DDEV *pddev, uint8_t cmd,
 
 
 
+#if _PCPS_USE_DBG_KEYS
+
+DEFINE_STATIC_KEY_FALSE( pcps_dbg_key );
+
+
+/*HDR*/
+/**
+ * @brief Set the debug flags of a device
+ *
+ * Enables or disables debug code for a specific device at runtime.
+ * The debug code is skipped by a patched-out branch while the
+ * flags of all devices are 0. Must be called with flags 0
+ * before a device is removed. May sleep.
+ *
+ * @param[in]  pddev  Pointer to the device structure
+ * @param[in]  flags  Bit mask of ::PCPS_DBG_FLAG_MASKS
+ */
+void pcps_set_dbg_flags( PCPS_DDEV *pddev, uint32_t flags )
+{
+  uint32_t prv_flags = xchg( &pddev->dbg_flags, flags );
+
+  // The key counts the devices with flags != 0.
+  if ( flags && !prv_flags )
+    static_branch_inc( &pcps_dbg_key );
+  else
+    if ( !flags && prv_flags )
+      static_branch_dec( &pcps_dbg_key );
+
+}  // pcps_set_dbg_flags
+
+#endif  // _PCPS_USE_DBG_KEYS
+
+
+
+#if _PCPS_USE_DEV_STATS
+
+/*HDR*/
+/**
+ * @brief Call the read function of a device, and update the statistics
+ *
+ * Used by the ::_pcps_read macro if ::_PCPS_USE_DEV_STATS is set.
+ * May also be called from interrupt context.
+ *
+ * The errors are always counted, but the latency of a command is
+ * only measured if ::PCPS_DBG_CMD_LAT has been set for the device,
+ * since this requires reading the system time twice for every command.
+ *
+ * @param[in]  pddev   Pointer to the device structure
+ * @param[in]  cmd     The command code for the board, see @ref PCPS_CMD_CODES
+ * @param[out] buffer  A buffer for the data to be read, or NULL
+ * @param[in]  count   The number of bytes to be read
+ *
+ * @return The return code of the read function, see @ref MBG_RETURN_CODES
+ */
+int pcps_read_timed( PCPS_DDEV *pddev, uint8_t cmd, void FAR *buffer, uint16_t count )
+{
+  int rc;
+
+  if ( _pcps_ddev_dbg( pddev, PCPS_DBG_CMD_LAT ) )
+  {
+    ktime_t t0 = ktime_get();
+    s64 lat_ns;
+    u32 lat_us;
+    int idx;
+
+    rc = pddev->read( pddev, cmd, buffer, count );
+    lat_ns = ktime_to_ns( ktime_sub( ktime_get(), t0 ) );
+
+    if ( pddev->stats == NULL )
+      goto out;
+
+    if ( lat_ns < 0 )
+      lat_ns = 0;
+
+    lat_us = (u32) min_t( u64, div_u64( (u64) lat_ns, 1000 ), U32_MAX );
+    idx = min_t( int, fls( lat_us ), PCPS_STATS_N_LAT_BUCKETS - 1 );
+
+    this_cpu_inc( pddev->stats->cmd_lat_hist[idx] );
+    this_cpu_add( pddev->stats->cmd_lat_sum_ns, (u64) lat_ns );
+  }
+  else
+  {
+    rc = pddev->read( pddev, cmd, buffer, count );
+
+    if ( pddev->stats == NULL )
+      goto out;
+  }
+
+  if ( mbg_rc_is_error( rc ) )
+  {
+    if ( rc == MBG_ERR_TIMEOUT )
+      this_cpu_inc( pddev->stats->cmd_timeouts );
+    else
+      this_cpu_inc( pddev->stats->cmd_errors );
+
+    #if _PCPS_USE_USB
+      if ( _pcps_ddev_is_usb( pddev ) )
+        this_cpu_inc( pddev->stats->usb_xfer_errors );
+    #endif
+  }
+
+out:
+  return rc;
+
+}  // pcps_read_timed
+
+#endif  // _PCPS_USE_DEV_STATS
+
+
+
 /*HDR*/
 /**
  * @brief Write data to a device
  *
+ * Each data byte is written with a separate command cycle. Unlike
+ * the read path, the PCI ASIC provides no documented way to write
+ * several data bytes at once, see @ref PCI_ASIC_FEATURE_MASKS.
+ *
  * @param[in]  pddev   Pointer to the device structure
  * @param[in]  cmd     The command code for the board, see @ref PCPS_CMD_CODES
  * @param[in]  buffer  A buffer with data to be written according to the cmd code
@@ -3007,6 +3699,8 @@ int pcps_write( PCPS_DDEV *pddev, uint8_t cmd,
 {
   int rc;
 
+  _pcps_trace_write_start( pddev, cmd, count );
+
 #if _PCPS_USE_USB
   if ( _pcps_ddev_is_usb( pddev ) )
     rc = pcps_write_usb_generic( pddev, cmd, buffer, count, false );
@@ -3022,9 +3716,10 @@ int pcps_write( PCPS_DDEV *pddev, uint8_t cmd,
     // the number of data bytes that must follow.
     rc = _pcps_read_var( pddev, cmd, bytes_expected );
 
-    #if DEBUG_IO
-      _mbg_kdd_msg_4( MBG_LOG_DEBUG, "pcps_write: cmd %02X, %u bytes, expects %u, rc: %i",
-                      cmd, count, bytes_expected, rc );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        _mbg_kdd_msg_4( MBG_LOG_DEBUG, "pcps_write: cmd %02X, %u bytes, expects %u, rc: %i",
+                        cmd, count, bytes_expected, rc );
     #endif
 
     if ( mbg_rc_is_error( rc ) )  // TODO REPORT ?
@@ -3049,8 +3744,9 @@ int pcps_write( PCPS_DDEV *pddev, uint8_t cmd,
 
     for ( i = 0; i < bytes_expected; i++ )
     {
-      #if DEBUG_IO
-        _mbg_kdd_msg_2( MBG_LOG_DEBUG, "pcps_write: byte %i: 0x%02X", i, *p );
+      #if USE_DEBUG_IO
+        if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+          _mbg_kdd_msg_2( MBG_LOG_DEBUG, "pcps_write: byte %i: 0x%02X", i, *p );
       #endif
 
       rc = _pcps_write_byte( pddev, *p++ );
@@ -3060,8 +3756,9 @@ int pcps_write( PCPS_DDEV *pddev, uint8_t cmd,
     }
 
     // Write the last byte and read the completion code.
-    #if DEBUG_IO
-      _mbg_kdd_msg_2( MBG_LOG_DEBUG, "pcps_write: last byte %i: 0x%02X", i, *p );
+    #if USE_DEBUG_IO
+      if ( _pcps_ddev_dbg( pddev, PCPS_DBG_IO ) )
+        _mbg_kdd_msg_2( MBG_LOG_DEBUG, "pcps_write: last byte %i: 0x%02X", i, *p );
     #endif
 
     rc = _pcps_read_var( pddev, *p++, write_rc );
@@ -3071,6 +3768,8 @@ int pcps_write( PCPS_DDEV *pddev, uint8_t cmd,
   }
 
 out:
+  _pcps_trace_write_end( pddev, cmd, count, rc );
+
   #if defined( DEBUG )
     report_ret_val( rc, "pcps_write" );
   #endif
@@ -3453,6 +4152,74 @@ out:
 
 
 
+#if USE_PCPS_PRIO_LANES
+
+static /*HDR*/
+/**
+ * @brief Let waiting latency-class callers access the device
+ *
+ * This static function is used by ::pcps_read_gps between 2 blocks
+ * of a bulk transfer. Each block is a complete transfer on its own,
+ * so other commands can be executed in between.
+ *
+ * If the caller holds the device mutex and has marked the transfer as
+ * bulk class, and a latency-class caller is waiting for the mutex,
+ * then the mutex is released and acquired again. Since the waiters
+ * are queued in FIFO order, and other bulk-class callers pass the mutex
+ * on while a latency-class caller is waiting (see ::lane_sem_inc), the
+ * latency-class caller gets the mutex first.
+ *
+ * The number of times a single transfer yields is limited to
+ * ::PCPS_LANE_MAX_YIELDS, so the delay of the bulk transfer is limited, too.
+ *
+ * If waiting for the mutex is interrupted then the caller doesn't hold
+ * the mutex anymore, and ::_pcps_sem_dec doesn't release it again.
+ *
+ * @param[in]      pddev       Pointer to the device structure
+ * @param[in,out]  p_n_yields  Number of times the current transfer has yielded so far
+ *
+ * @return 1 if the mutex has been released temporarily, so other
+ *         commands may have been sent to the device in the meantime,
+ *         0 if the mutex has not been released, or ::MBG_ERR_INTR
+ *         if waiting for the mutex has been interrupted
+ */
+int pcps_lane_yield( PCPS_DDEV *pddev, int *p_n_yields )
+{
+  ulong flags;
+
+  if ( !pddev->lane_may_yield || !_pcps_lane_is_owner( pddev ) )
+    return 0;
+
+  if ( *p_n_yields >= PCPS_LANE_MAX_YIELDS )
+    return 0;
+
+  // Check this as late as possible, just before the mutex is released.
+  if ( atomic_read( &pddev->n_lat_waiters ) == 0 )
+    return 0;
+
+  (*p_n_yields)++;
+
+  _pcps_sem_dec( pddev );
+
+  if ( _mbg_mutex_acquire( &pddev->dev_mutex ) < 0 )
+    return MBG_ERR_INTR;
+
+  _pcps_lane_set_owner( pddev );
+
+  spin_lock_irqsave( &pddev->irq_lock, flags );
+  atomic_inc( &pddev->access_in_progress );
+  spin_unlock_irqrestore( &pddev->irq_lock, flags );
+
+  pddev->lane_may_yield = 1;
+
+  return 1;
+
+}  // pcps_lane_yield
+
+#endif  // USE_PCPS_PRIO_LANES
+
+
+
 /*HDR*/
 /**
  * @brief Read a large data structure from a device
@@ -3489,6 +4256,9 @@ int pcps_read_gps( PCPS_DDEV *pddev,
   int dt_rem;
   int block_num;
   int rc;
+  #if USE_PCPS_PRIO_LANES
+    int n_yields = 0;
+  #endif
 
   #define FNC_ID_GPS_READ "GPS rd"
 
@@ -3516,6 +4286,16 @@ int pcps_read_gps( PCPS_DDEV *pddev,
   // Read dt_quot full blocks of data.
   for ( block_num = 0; block_num < dt_quot; block_num++ )
   {
+    #if USE_PCPS_PRIO_LANES
+      if ( block_num )
+      {
+        rc = pcps_lane_yield( pddev, &n_yields );
+
+        if ( mbg_rc_is_error( rc ) )
+          goto out;
+      }
+    #endif
+
     rc = pcps_read_gps_block( pddev, data_type, p, count,
                               (uint8_t) block_num, PCPS_FIFO_SIZE );
 
@@ -3529,8 +4309,20 @@ int pcps_read_gps( PCPS_DDEV *pddev,
 
   // Read dt_rem additional bytes of data.
   if ( dt_rem )
+  {
+    #if USE_PCPS_PRIO_LANES
+      if ( block_num )
+      {
+        rc = pcps_lane_yield( pddev, &n_yields );
+
+        if ( mbg_rc_is_error( rc ) )
+          goto out;
+      }
+    #endif
+
     rc = pcps_read_gps_block( pddev, data_type, p, count,
                               (uint8_t) block_num, (uint8_t) dt_rem );
+  }
 
 out:
   #if defined( DEBUG )
@@ -4451,7 +5243,6 @@ out:
 void check_receiver_info_and_features( PCPS_DDEV *pddev )
 {
   const RECEIVER_INFO *p_ri = _ri_addr( pddev );
-  int rc;
 
   #if REPORT_CFG
     _mbg_kdd_msg_3( REPORT_CFG_LOG_LVL, "%s v%03X RECEIVER_INFO features: 0x%08lX",
@@ -4503,6 +5294,54 @@ void check_receiver_info_and_features( PCPS_DDEV *pddev )
   #endif
 
 
+  // The extended features are only read when they are needed.
+  memset( _xfeat_addr( pddev ), 0, sizeof( *_xfeat_addr( pddev ) ) );
+  memset( _tlv_info_addr( pddev ), 0, sizeof( *_tlv_info_addr( pddev ) ) );
+  pddev->ext_feat_read = false;
+
+  #if !_PCPS_USE_LAZY_EXT_FEAT
+    pcps_chk_ext_features( pddev );
+  #endif
+
+}  // check_receiver_info_and_features
+
+
+
+/*HDR*/
+/**
+ * @brief Read the extended features of a device, if not yet done
+ *
+ * The ::MBG_XFEATURE_BUFFER and ::MBG_TLV_INFO of a device are only
+ * needed to check for extended features, so if ::_PCPS_USE_LAZY_EXT_FEAT
+ * is set they are not read by ::pcps_probe_device, but when they are
+ * needed for the first time. They are read at most once, even if
+ * reading fails.
+ *
+ * The caller must hold the device mutex, which isn't released
+ * temporarily while the buffers are read, see ::pcps_lane_yield.
+ *
+ * @param[in,out] pddev  Pointer to a device structure
+ *
+ * @see ::check_receiver_info_and_features
+ */
+void pcps_chk_ext_features( PCPS_DDEV *pddev )
+{
+  #if USE_PCPS_PRIO_LANES
+    int may_yield;
+  #endif
+  int rc;
+
+  if ( pddev->ext_feat_read )
+    return;
+
+  #if USE_PCPS_PRIO_LANES
+    // The device mutex must not be released while the buffers
+    // are read, otherwise another caller would find them
+    // only partially filled.
+    may_yield = pddev->lane_may_yield;
+    pddev->lane_may_yield = 0;
+  #endif
+
   // Check if the device supports extended features
 
   rc = pcps_chk_dev_feat( pddev, DEV_FEAT_TYPE_RI, GPS_FEAT_XFEATURE );
@@ -4575,7 +5414,13 @@ void check_receiver_info_and_features( PCPS_DDEV *pddev )
   }
   #endif
 
-}  // check_receiver_info_and_features
+  #if USE_PCPS_PRIO_LANES
+    pddev->lane_may_yield = may_yield;
+  #endif
+
+  pddev->ext_feat_read = true;
+
+}  // pcps_chk_ext_features
 
 
 
@@ -4960,6 +5805,73 @@ int pcps_alloc_ddev_struc( PCPS_DDEV **ppddev )
 
 
 
+#if USE_IO_BUFFER_POOL
+
+static /*HDR*/
+/**
+ * @brief Set up the pool of DMA-capable I/O buffers for a device
+ *
+ * The buffers are used by the IOCTL read functions, so the data read
+ * from the device can be copied to user space after the device mutex
+ * has been released. If not all buffers can be allocated, this is not
+ * fatal since the IOCTL code falls back to allocating temporary buffers.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure
+ *
+ * @see ::pcps_free_iob_pool
+ */
+void pcps_alloc_iob_pool( PCPS_DDEV *pddev )
+{
+  int i;
+
+  _mbg_spin_lock_init( &pddev->iob_pool_lock, MBG_DRVR_NAME "_iob_pool_lock" );
+  pddev->iob_pool_free = 0;
+
+  for ( i = 0; i < PCPS_IOB_POOL_SIZE; i++ )
+  {
+    pddev->iob_pool[i] = _pcps_kmalloc( sizeof( *pddev->iob_pool[i] ) );
+
+    if ( pddev->iob_pool[i] )
+      pddev->iob_pool_free |= 1UL << i;
+    else
+      _mbgddmsg_1( DEBUG_DRVR, MBG_LOG_WARN, "Failed to allocate I/O buffer %i for pool", i );
+  }
+
+}  // pcps_alloc_iob_pool
+
+
+
+static /*HDR*/
+/**
+ * @brief Free the pool of I/O buffers of a device
+ *
+ * Must only be called if no IOCTL call can be in progress for the device.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure
+ *
+ * @see ::pcps_alloc_iob_pool
+ */
+void pcps_free_iob_pool( PCPS_DDEV *pddev )
+{
+  int i;
+
+  for ( i = 0; i < PCPS_IOB_POOL_SIZE; i++ )
+  {
+    if ( pddev->iob_pool[i] )
+    {
+      _pcps_kfree( pddev->iob_pool[i], sizeof( *pddev->iob_pool[i] ) );
+      pddev->iob_pool[i] = NULL;
+    }
+  }
+
+  pddev->iob_pool_free = 0;
+
+}  // pcps_free_iob_pool
+
+#endif  // USE_IO_BUFFER_POOL
+
+
+
 /*HDR*/
 /**
  * @brief Allocate and initialize a device info structure
@@ -5003,6 +5915,11 @@ int pcps_init_ddev( PCPS_DDEV **ppddev )
     }
   #endif
 
+  #if USE_IO_BUFFER_POOL
+    if ( mbg_rc_is_success( rc ) )
+      pcps_alloc_iob_pool( *ppddev );
+  #endif
+
   _mbgddmsg_fnc_exit_chk_mbg_rc( rc );
 
   return rc;
@@ -5034,6 +5951,10 @@ void pcps_cleanup_ddev( PCPS_DDEV *pddev )
       _mbg_spin_lock_destroy( &pddev->irq_lock );
     #endif
 
+    #if USE_IO_BUFFER_POOL
+      pcps_free_iob_pool( pddev );
+    #endif
+
     pcps_free_ddev_struc( &pddev );
   }
 
@@ -5459,6 +6380,11 @@ int pcps_usb_init( PCPS_DDEV *pddev )
       }
 
       rc = MBG_SUCCESS;
+
+      #if _PCPS_USE_USB_URB
+        // If this fails, the conventional synchronous transfers are used.
+        pcps_usb_alloc_urbs( pddev );
+      #endif
     }
 
   #else
@@ -5563,6 +6489,82 @@ void report_device_info( const PCPS_DDEV *pddev )
 
 
 
+static /*HDR*/
+/**
+ * @brief Set up the capability bit mask of a device
+ *
+ * This is called when the device has been probed successfully,
+ * so IOCTL calls only need to look up a single bit, and all
+ * capabilities can be retrieved at once via ::IOCTL_GET_DEV_CAPS.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure
+ *
+ * @see ::MBG_DEV_CAP_BITS
+ */
+void setup_dev_caps( PCPS_DDEV *pddev )
+{
+  MBG_DEV_CAPS *p = &pddev->dev_caps;
+
+  #define _setup_dev_cap( _n, _cond ) \
+    if ( _cond )                      \
+      _mbg_dev_cap_set( p, _n )
+
+  memset( p, 0, sizeof( *p ) );
+  p->n_bits = N_MBG_DEV_CAP_BITS;
+
+  _setup_dev_cap( MBG_DEV_CAP_IS_GPS,                _pcps_ddev_is_gps( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_DCF,                _pcps_ddev_is_dcf( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_MSF,                _pcps_ddev_is_msf( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_WWVB,               _pcps_ddev_is_wwvb( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_LWR,                _pcps_ddev_is_lwr( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_GNSS,               _pcps_ddev_is_gnss( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_IRIG_RX,            _pcps_ddev_is_irig_rx( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_HR_TIME,           _pcps_ddev_has_hr_time( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_CAB_LEN,           _pcps_ddev_has_cab_len( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_TZDL,              _pcps_ddev_has_tzdl( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_PCPS_TZDL,         _pcps_ddev_has_pcps_tzdl( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_TZCODE,            _pcps_ddev_has_tzcode( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_TZ,                _pcps_ddev_has_tz( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_EVENT_TIME,        _pcps_ddev_has_event_time( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_RECEIVER_INFO,     _pcps_ddev_has_receiver_info( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_CAN_CLR_UCAP_BUFF,     _pcps_ddev_can_clr_ucap_buff( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_UCAP,              _pcps_ddev_has_ucap( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_IRIG_TX,           _pcps_ddev_has_irig_tx( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_SERIAL_HS,         _pcps_ddev_has_serial_hs( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_SIGNAL,            _pcps_ddev_has_signal( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_MOD,               _pcps_ddev_has_mod( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_IRIG,              _pcps_ddev_has_irig( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_REF_OFFS,          _pcps_ddev_has_ref_offs( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_OPT_FLAGS,         _pcps_ddev_has_opt_flags( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_GPS_DATA,          _pcps_ddev_has_gps_data( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_SYNTH,             _pcps_ddev_has_synth( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_GENERIC_IO,        _pcps_ddev_has_generic_io( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_PCI_ASIC_FEATURES, _pcps_ddev_has_asic_features( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_PCI_ASIC_VERSION,  _pcps_ddev_has_asic_version( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_FAST_HR_TIMESTAMP, _pcps_ddev_has_fast_hr_timestamp( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_GPS_TIME_SCALE,    _pcps_ddev_has_time_scale( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_GPS_UTC_PARM,      _pcps_ddev_has_utc_parm( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_IRIG_CTRL_BITS,    _pcps_ddev_has_irig_ctrl_bits( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_LAN_INTF,          _pcps_ddev_has_lan_intf( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_IS_PTP,                _pcps_ddev_is_ptp( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_PTP,               _pcps_ddev_has_ptp( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_IRIG_TIME,         _pcps_ddev_has_irig_time( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_RAW_IRIG_DATA,     _pcps_ddev_has_raw_irig_data( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_PTP_UNICAST,       _pcps_ddev_has_ptp_unicast( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_PZF,               _pcps_ddev_has_pzf( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_CORR_INFO,         _pcps_ddev_has_corr_info( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_TR_DISTANCE,       _pcps_ddev_has_tr_distance( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_DEBUG_STATUS,      _pcps_ddev_has_debug_status( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_EVT_LOG,           _pcps_ddev_has_evt_log( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_GPIO,              _pcps_ddev_has_gpio( pddev ) );
+  _setup_dev_cap( MBG_DEV_CAP_HAS_XMR,               _pcps_ddev_has_xmr( pddev ) );
+
+  #undef _setup_dev_cap
+
+}  // setup_dev_caps
+
+
+
 /*HDR*/
 /**
  * @brief Probe if a device is supported, and allocate and setup the device structure
@@ -5979,7 +6981,20 @@ chip_setup_done:
   // A PTP270PEX card must have finished booting
   // before it can be accessed.
   if ( pcps_ddev_is_ptp270pex( pddev ) )
+  {
+    #if _PCPS_USE_ASYNC_PROBE
+      // Don't block the caller if it can retry later.
+      if ( ( pddev->probe_state == PCPS_PROBE_MAY_DEFER ) && !ptp270pex_is_ready( pddev ) )
+      {
+        _mbgddmsg_1( DEBUG_DEV_INIT, MBG_LOG_INFO, "%s not yet ready, deferring probe",
+                     _pcps_ddev_type_name( pddev ) );
+        rc = MBG_ERR_NOT_READY;
+        goto fail_with_cleanup;
+      }
+    #endif
+
     wait_ptp270pex_ready( pddev );
+  }
 
 
   #if TEST_PORT_ACCESS
@@ -6350,6 +7365,7 @@ chip_setup_done:
           _mbg_kdd_msg_0( MBG_LOG_WARN, "Warning: ASIC features don't reflect memory mapped time stamp support." );
         #endif
       }
+
   }
 
   #if _PCPS_USE_USB
@@ -6396,6 +7412,8 @@ chip_setup_done:
                     (ulong) _pcps_ddev_features( pddev ) );
   #endif
 
+  setup_dev_caps( pddev );
+
   rc = MBG_SUCCESS;
   goto out;
 
@@ -6414,6 +7432,83 @@ out:
 
 
 
+#if _PCPS_USE_USB && !defined( MBG_TGT_WIN32 )
+
+/*HDR*/
+/**
+ * @brief Quickly re-attach a USB device that has been probed before
+ *
+ * If a USB device is unplugged and plugged in again, the kernel driver
+ * can find the device structure that has been set up when the device
+ * was probed before, by product ID and serial number. In this case
+ * it is sufficient to re-initialize the USB interface and read the
+ * firmware ID to check if the information determined by the previous
+ * ::pcps_probe_device call is still valid, so the time-consuming
+ * readout of ::RECEIVER_INFO, extended features, etc. can be skipped.
+ *
+ * The udev and intf fields of the device structure have to be set
+ * up for the new USB device before this function is called.
+ *
+ * @param[in,out]  pddev  Pointer to the device structure which has been recycled
+ *
+ * @return ::MBG_SUCCESS if the device could be re-attached, ::MBG_ERR_FW_ID
+ *         if the firmware ID has changed, or one of the other @ref MBG_ERROR_CODES.
+ *         In case of error ::pcps_probe_device has to be called to do a full probe.
+ *
+ * @see ::pcps_probe_device
+ */
+int pcps_reattach_usb_device( PCPS_DDEV *pddev )
+{
+  PCPS_ID_STR fw_id;
+  int rc;
+
+  set_access_mode( pddev, PCPS_ACC_MODE_USB, 0, pcps_read_usb );
+
+  rc = pcps_usb_init( pddev );
+
+  if ( mbg_rc_is_error( rc ) )
+    goto out;
+
+  if ( pddev->n_usb_ep < MBGUSB_MIN_ENDPOINTS_REQUIRED )
+  {
+    rc = MBG_ERR_GENERIC;
+    goto out_cleanup;
+  }
+
+  rc = pcps_get_fw_id( pddev, fw_id );
+
+  if ( mbg_rc_is_error( rc ) )
+    goto out_cleanup;
+
+  // If the firmware has been updated in the meantime, the
+  // supported features may have changed, too.
+  if ( _fstrncmp( fw_id, _pcps_ddev_fw_id( pddev ), sizeof( fw_id ) ) != 0 )
+  {
+    _mbg_kdd_msg_3( MBG_LOG_INFO, "%s: firmware ID changed from \"%s\" to \"%s\"",
+                    _pcps_ddev_type_name( pddev ), _pcps_ddev_fw_id( pddev ), fw_id );
+    rc = MBG_ERR_FW_ID;
+    goto out_cleanup;
+  }
+
+  _mbg_kdd_msg_2( MBG_LOG_INFO, "%s %s re-attached",
+                  _pcps_ddev_type_name( pddev ), _pcps_ddev_sernum( pddev ) );
+
+  rc = MBG_SUCCESS;
+  goto out;
+
+
+out_cleanup:
+  pcps_cleanup_device( pddev );
+
+out:
+  return rc;
+
+}  // pcps_reattach_usb_device
+
+#endif  // _PCPS_USE_USB && !defined( MBG_TGT_WIN32 )
+
+
+
 /*HDR*/
 /**
  * @brief Clean up function called by ::pcps_probe_device on error
@@ -6426,6 +7521,10 @@ void pcps_cleanup_device( PCPS_DDEV *pddev )
 {
   set_access_mode( pddev, PCPS_ACC_MODE_NULL, 0, pcps_read_null );
 
+  #if _PCPS_USE_USB_URB
+    pcps_usb_free_urbs( pddev );
+  #endif
+
   #if _PCPS_USE_RSRCMGR
     pcps_release_rsrcs( pddev );
   #endif